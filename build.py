@@ -129,6 +129,7 @@ def main():
                 # f"-drive if=none,id=disk0,format=raw,file=bin/elos.img "            # -hda
                 # f"-device ahci,id=ahci "
                 # f"-device ide-drive,drive=disk0,bus=ahci.0 "
+                # f"-device virtio-blk-pci,drive=disk0,num-queues=4,packed=on "
                 # f"-nographic "
                 "-serial file:kernel.log "
                 "-s "
@@ -199,9 +200,26 @@ def build_elos(output: str):
         "src/elos/kernel/log/print.c",
         "src/elos/kernel/driver/pata.c",
         "src/elos/kernel/driver/pci.c",
+        "src/elos/kernel/driver/ahci.c",
+        "src/elos/kernel/driver/nvme.c",
+        "src/elos/kernel/driver/virtio_blk.c",
+        "src/elos/kernel/device/device.c",
+        "src/elos/kernel/device/block.c",
+        "src/elos/kernel/device/bcache.c",
         "src/elos/kernel/common/string.c",
+        "src/elos/kernel/common/clock.c",
+        "src/elos/kernel/common/timer.c",
+        "src/elos/kernel/common/smp.c",
+        "src/elos/kernel/common/scheduler.c",
+        "src/elos/kernel/common/idle.c",
+        "src/elos/kernel/common/sync.c",
+        "src/elos/kernel/acpi/acpi.c",
         "src/elos/kernel/memory/phys_allocator.c",
         "src/elos/kernel/memory/paging.c",
+        "src/elos/kernel/memory/slab.c",
+        "src/elos/kernel/memory/demand_paging.c",
+        "src/elos/kernel/interrupt/interrupt.c",
+        "src/elos/kernel/interrupt/apic.c",
         "src/elos/kernel/debug/debug.c",
 
         "res/ascii_bitmap.c", # temporary
@@ -212,6 +230,7 @@ def build_elos(output: str):
     CFLAGS += f" -Wall -Werror -fshort-wchar -Werror=implicit-function-declaration"
     CFLAGS += f" -Wno-multichar"
     CFLAGS += f" -Wno-unused-variable -Wno-unused-function -Wno-unused-but-set-variable"
+    # CFLAGS += f" -DELOS_LOCK_STATS" # contention counters, see sync.h
 
     # TODO: Multiple threads
     for s,o in zip(sources,objects):
@@ -8,6 +8,7 @@
 #include "elos/kernel/frame/font/font.h"
 #include "elos/kernel/log/print.h"
 #include "elos/kernel/debug/debug.h"
+#include "elos/kernel/common/smp.h"
 
 extern void kernel_entry();
 
@@ -75,6 +76,31 @@ EFI_STATUS fetch_memory_map() {
 
 EFI_STATUS load_font();
 
+static bool guid_equal(EFI_GUID* a, EFI_GUID* b) {
+    u8* x = (u8*)a;
+    u8* y = (u8*)b;
+    for (int i = 0; i < sizeof(EFI_GUID); i++) {
+        if (x[i] != y[i])
+            return false;
+    }
+    return true;
+}
+
+// The kernel finds the ACPI tables through the RSDP, prefer the ACPI 2.0 one
+void find_acpi_rsdp() {
+    EFI_GUID acpi20_guid = ACPI_20_TABLE_GUID;
+    kernel__core_data->acpi_rsdp = NULL;
+    for (UINTN i = 0; i < ST->NumberOfTableEntries; i++) {
+        EFI_CONFIGURATION_TABLE* table = &ST->ConfigurationTable[i];
+        if (guid_equal(&table->VendorGuid, &acpi20_guid)) {
+            kernel__core_data->acpi_rsdp = table->VendorTable;
+            return;
+        }
+        if (guid_equal(&table->VendorGuid, &AcpiTableGuid))
+            kernel__core_data->acpi_rsdp = table->VendorTable;
+    }
+}
+
 EFI_STATUS print_memory_map() {
     #define IS_FREE_PAGE(N) ((N == EfiConventionalMemory) || (N == EfiPersistentMemory))
     // We want to keep these (N >= EfiLoaderCode && N <= EfiBootServicesData)
@@ -171,6 +197,8 @@ efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE * SystemTable) {
         return Status;
     }
 
+    find_acpi_rsdp();
+
     Status = fetch_memory_map();
     if (EFI_ERROR(Status)) {
         return Status;
@@ -198,6 +226,9 @@ efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE * SystemTable) {
         return Status;
     }
 
+    // GS points to our per-CPU data from here on, cpu_index() and every lock use it
+    init_boot_cpu();
+
     serial_printf("UEFI - Exit boot services\n");
 
     kernel__core_data->inside_uefi = false;
@@ -0,0 +1,166 @@
+#include "elos/kernel/acpi/acpi.h"
+#include "elos/kernel/common/core_data.h"
+#include "elos/kernel/memory/paging.h"
+#include "elos/kernel/debug/debug.h"
+
+#define MADT_LOCAL_APIC       0
+#define MADT_IO_APIC          1
+#define MADT_SOURCE_OVERRIDE  2
+#define MADT_LAPIC_OVERRIDE   5
+#define MADT_LOCAL_X2APIC     9
+
+#define MADT_CPU_ENABLED        0x1
+#define MADT_CPU_ONLINE_CAPABLE 0x2
+#define MADT_PCAT_COMPAT        0x1
+
+#define DEFAULT_LAPIC_ADDRESS  0xFEE00000ULL
+#define DEFAULT_IOAPIC_ADDRESS 0xFEC00000ULL
+
+#pragma pack(push, 1)
+typedef struct AcpiRsdp {
+    char signature[8];
+    u8   checksum;
+    char oem_id[6];
+    u8   revision;
+    u32  rsdt_address;
+    // revision 2 and later
+    u32  length;
+    u64  xsdt_address;
+    u8   extended_checksum;
+    u8   reserved[3];
+} AcpiRsdp;
+
+typedef struct MadtEntry {
+    u8 type;
+    u8 length;
+} MadtEntry;
+#pragma pack(pop)
+
+MadtInfo g_madt;
+
+static AcpiHeader* g_root;   // XSDT or RSDT
+static bool g_root_is_xsdt;
+
+static bool checksum_ok(void* data, u32 length) {
+    u8 sum = 0;
+    for (u32 i = 0; i < length; i++)
+        sum += ((u8*)data)[i];
+    return sum == 0;
+}
+
+static bool signature_equal(const char* a, const char* b, int length) {
+    for (int i = 0; i < length; i++) {
+        if (a[i] != b[i])
+            return false;
+    }
+    return true;
+}
+
+AcpiHeader* acpi_find_table(const char* signature) {
+    if (!g_root)
+        return NULL;
+    u32 entry_size = g_root_is_xsdt ? 8 : 4;
+    u32 count = (g_root->length - sizeof(AcpiHeader)) / entry_size;
+    u8* entries = (u8*)g_root + sizeof(AcpiHeader);
+    for (u32 i = 0; i < count; i++) {
+        u64 address = g_root_is_xsdt ? *(u64*)(entries + i * 8) : *(u32*)(entries + i * 4);
+        AcpiHeader* table = phys_to_virt(address);
+        if (signature_equal(table->signature, signature, 4) && checksum_ok(table, table->length))
+            return table;
+    }
+    return NULL;
+}
+
+static void madt_defaults() {
+    g_madt.lapic_address   = DEFAULT_LAPIC_ADDRESS;
+    g_madt.cpu_count       = 0;
+    g_madt.ioapic_address  = DEFAULT_IOAPIC_ADDRESS;
+    g_madt.ioapic_gsi_base = 0;
+    g_madt.has_pic         = true;
+    for (int i = 0; i < ISA_IRQ_COUNT; i++) {
+        g_madt.isa_gsi[i]   = i;
+        g_madt.isa_flags[i] = 0;
+    }
+}
+
+static void parse_madt(AcpiHeader* madt) {
+    u8* data = (u8*)madt + sizeof(AcpiHeader);
+    g_madt.lapic_address = *(u32*)data;
+    g_madt.has_pic = (*(u32*)(data + 4) & MADT_PCAT_COMPAT) != 0;
+    g_madt.ioapic_address = 0;
+
+    u8* at  = data + 8;
+    u8* end = (u8*)madt + madt->length;
+    while (at + sizeof(MadtEntry) <= end) {
+        MadtEntry* entry = (MadtEntry*)at;
+        if (entry->length < sizeof(MadtEntry) || at + entry->length > end)
+            break;
+
+        switch (entry->type) {
+        case MADT_LOCAL_APIC:
+        case MADT_LOCAL_X2APIC: {
+            u32 apic_id = entry->type == MADT_LOCAL_APIC ? at[3] : *(u32*)(at + 4);
+            u32 flags   = entry->type == MADT_LOCAL_APIC ? *(u32*)(at + 4) : *(u32*)(at + 8);
+            if (!(flags & (MADT_CPU_ENABLED | MADT_CPU_ONLINE_CAPABLE)))
+                break;
+            if (g_madt.cpu_count == MAX_CPUS) {
+                serial_printf("acpi: More than %d CPUs, ignoring the rest\n", MAX_CPUS);
+                break;
+            }
+            g_madt.apic_ids[g_madt.cpu_count++] = apic_id;
+            break;
+        }
+        case MADT_IO_APIC:
+            if (g_madt.ioapic_address == 0) {
+                g_madt.ioapic_address  = *(u32*)(at + 4);
+                g_madt.ioapic_gsi_base = *(u32*)(at + 8);
+            }
+            break;
+        case MADT_SOURCE_OVERRIDE: {
+            u8 bus = at[2], source = at[3];
+            if (bus == 0 && source < ISA_IRQ_COUNT) {
+                g_madt.isa_gsi[source]   = *(u32*)(at + 4);
+                g_madt.isa_flags[source] = *(u16*)(at + 8);
+            }
+            break;
+        }
+        case MADT_LAPIC_OVERRIDE:
+            g_madt.lapic_address = *(u64*)(at + 4);
+            break;
+        }
+        at += entry->length;
+    }
+}
+
+bool init_acpi() {
+    madt_defaults();
+
+    AcpiRsdp* rsdp = kernel__core_data->acpi_rsdp ? phys_to_virt((u64)kernel__core_data->acpi_rsdp) : NULL;
+    if (!rsdp || !signature_equal(rsdp->signature, "RSD PTR ", 8) || !checksum_ok(rsdp, 20)) {
+        serial_printf("acpi: No RSDP\n");
+        return false;
+    }
+
+    if (rsdp->revision >= 2 && rsdp->xsdt_address && checksum_ok(rsdp, rsdp->length)) {
+        g_root = phys_to_virt(rsdp->xsdt_address);
+        g_root_is_xsdt = true;
+    } else {
+        g_root = phys_to_virt(rsdp->rsdt_address);
+        g_root_is_xsdt = false;
+    }
+    if (!checksum_ok(g_root, g_root->length)) {
+        serial_printf("acpi: Bad root table checksum\n");
+        g_root = NULL;
+        return false;
+    }
+
+    AcpiHeader* madt = acpi_find_table("APIC");
+    if (!madt) {
+        serial_printf("acpi: No MADT\n");
+        return false;
+    }
+    parse_madt(madt);
+
+    serial_printf("acpi: %d CPUs, I/O APIC at %x\n", (int)g_madt.cpu_count, (u32)g_madt.ioapic_address);
+    return true;
+}
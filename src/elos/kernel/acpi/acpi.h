@@ -0,0 +1,51 @@
+/*
+    ACPI tables
+
+    UEFI gives us the RSDP through the configuration table (stored in core data before
+    boot services exit). Tables live in ACPI reclaim/NVS memory which the direct map covers.
+    Only the MADT is parsed for now.
+*/
+
+#pragma once
+
+#include "elos/kernel/common/types.h"
+#include "elos/kernel/common/cpu.h"
+
+#define ISA_IRQ_COUNT 16
+
+#pragma pack(push, 1)
+typedef struct AcpiHeader {
+    char signature[4];
+    u32  length;
+    u8   revision;
+    u8   checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    u32  oem_revision;
+    u32  creator_id;
+    u32  creator_revision;
+} AcpiHeader;
+#pragma pack(pop)
+
+// What we need from the MADT (signature "APIC")
+typedef struct MadtInfo {
+    u64  lapic_address;
+    u32  cpu_count;
+    u32  apic_ids[MAX_CPUS];
+    u64  ioapic_address; // 0 if there is none, only the first I/O APIC is used
+    u32  ioapic_gsi_base;
+    u32  isa_gsi[ISA_IRQ_COUNT];   // I/O APIC input of each ISA IRQ
+    u16  isa_flags[ISA_IRQ_COUNT]; // MPS INTI flags from overrides, 0 is the bus default
+    bool has_pic;
+} MadtInfo;
+
+extern MadtInfo g_madt;
+
+/*
+    Finds the tables and parses the MADT. Call after init_paging.
+    Returns false without ACPI, g_madt then lists no CPUs (only the BSP runs) and the default I/O APIC.
+*/
+bool init_acpi();
+
+// Returns NULL if there is no such table or its checksum is wrong
+AcpiHeader* acpi_find_table(const char* signature);
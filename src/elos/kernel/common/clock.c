@@ -0,0 +1,103 @@
+#include "elos/kernel/common/clock.h"
+#include "elos/kernel/common/intrinsics.h"
+#include "elos/kernel/interrupt/interrupt.h"
+#include "elos/kernel/debug/debug.h"
+
+#include <cpuid.h>
+
+#define PIT_FREQUENCY     1193182ULL
+#define PIT_CHANNEL2      0x42
+#define PIT_COMMAND       0x43
+#define PIT_GATE_PORT     0x61 // bit 0 gates channel 2, bit 1 the speaker, bit 5 is channel 2's output
+
+#define CALIBRATE_MS      10
+#define CALIBRATE_RUNS    5
+#define CALIBRATE_TIMEOUT 100 // times the expected cycles at 4 GHz, for a PIT that never counts down
+
+#define CPUID_INVARIANT_TSC (1 << 8) // leaf 0x80000007 edx
+
+Clock g_clock = {
+    .tsc_hz     = 4000000000ULL,
+    .ns_per_tsc = (NS_PER_SECOND << 32) / 4000000000ULL,
+    .tsc_per_ns = (4000000000ULL << 32) / NS_PER_SECOND,
+};
+
+// Exact frequency from the crystal ratio, 0 if the CPU doesn't report it
+static u64 cpuid_tsc_frequency() {
+    u32 eax, ebx, ecx, edx;
+    if (__get_cpuid_max(0, NULL) < 0x15)
+        return 0;
+    __cpuid(0x15, eax, ebx, ecx, edx);
+    if (eax == 0 || ebx == 0 || ecx == 0)
+        return 0;
+    return (u64)ecx * ebx / eax;
+}
+
+// TSC cycles for one countdown of PIT channel 2, in one-shot mode. 0 if it never ends.
+static u64 pit_measure(u32 pit_ticks) {
+    u8 gate = inb(PIT_GATE_PORT);
+    outb(PIT_GATE_PORT, (gate & ~0x02) | 0x01);
+    outb(PIT_COMMAND, 0xB0); // channel 2, lobyte/hibyte, mode 0
+    outb(PIT_CHANNEL2, pit_ticks & 0xFF);
+    outb(PIT_CHANNEL2, pit_ticks >> 8);
+
+    u64 start = __rdtsc();
+    u64 timeout = CALIBRATE_TIMEOUT * g_clock.tsc_hz / PIT_FREQUENCY * pit_ticks;
+    u64 cycles = 0;
+    while (1) {
+        if (inb(PIT_GATE_PORT) & 0x20) {
+            cycles = __rdtsc() - start;
+            break;
+        }
+        if (__rdtsc() - start > timeout)
+            break;
+        _mm_pause();
+    }
+
+    outb(PIT_GATE_PORT, gate);
+    return cycles;
+}
+
+static u64 pit_tsc_frequency() {
+    u32 pit_ticks = PIT_FREQUENCY * CALIBRATE_MS / 1000;
+
+    // SMIs and virtual machine exits only make a run longer, keep the shortest
+    u64 best = ~0ULL;
+    for (int i = 0; i < CALIBRATE_RUNS; i++) {
+        u64 cycles = pit_measure(pit_ticks);
+        if (cycles == 0)
+            return 0;
+        if (cycles < best)
+            best = cycles;
+    }
+    return best * PIT_FREQUENCY / pit_ticks;
+}
+
+void init_clock() {
+    u32 eax, ebx, ecx, edx;
+    bool invariant = false;
+    if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+        invariant = (edx & CPUID_INVARIANT_TSC) != 0;
+
+    bool enabled = interrupts_save_disable();
+    u64 hz = cpuid_tsc_frequency();
+    const char* source = "cpuid";
+    if (hz == 0) {
+        hz = pit_tsc_frequency();
+        source = "pit";
+    }
+    interrupts_restore(enabled);
+
+    if (hz == 0) {
+        serial_printf("clock: PIT calibration timed out, assuming 4 GHz\n");
+        return;
+    }
+
+    g_clock.tsc_hz     = hz;
+    g_clock.ns_per_tsc = (NS_PER_SECOND << 32) / hz;
+    g_clock.tsc_per_ns = (u64)(((unsigned __int128)hz << 32) / NS_PER_SECOND);
+    g_clock.invariant  = invariant;
+    g_clock.boot_tsc   = __rdtsc();
+
+    serial_printf("clock: TSC %d kHz (%s)%s\n", (int)(hz / 1000), source, invariant ? "" : ", not invariant");
+}
@@ -0,0 +1,51 @@
+/*
+    Monotonic clock based on the TSC
+
+    init_clock measures the TSC frequency (CPUID leaf 0x15 when the CPU reports it,
+    against the PIT otherwise). Cycles are converted with a 32.32 fixed point factor
+    and a 128-bit product so conversions don't overflow for any u64 count.
+
+    Without an invariant TSC the frequency changes with power states and
+    the clock is only roughly right.
+
+    Until init_clock runs the TSC is assumed to run at 4 GHz, waits are then
+    too long on slower CPUs, not too short.
+*/
+
+#pragma once
+
+#include "elos/kernel/common/types.h"
+
+#include <immintrin.h>
+
+#define NS_PER_SECOND 1000000000ULL
+
+typedef struct Clock {
+    u64 tsc_hz;
+    u64 ns_per_tsc;   // 32.32 fixed point
+    u64 tsc_per_ns;   // 32.32 fixed point
+    u64 boot_tsc;
+    bool invariant;
+} Clock;
+
+extern Clock g_clock;
+
+/*
+    Calibrates the TSC, call early with interrupts that may be enabled.
+    Takes around 50 ms when calibrating against the PIT, a PIT that
+    doesn't count gives up after about a second and keeps the 4 GHz.
+*/
+void init_clock();
+
+static inline u64 tsc_to_ns(u64 cycles) {
+    return (u64)(((unsigned __int128)cycles * g_clock.ns_per_tsc) >> 32);
+}
+
+static inline u64 ns_to_tsc(u64 ns) {
+    return (u64)(((unsigned __int128)ns * g_clock.tsc_per_ns) >> 32);
+}
+
+// Nanoseconds since init_clock
+static inline u64 now_ns() {
+    return tsc_to_ns(__rdtsc() - g_clock.boot_tsc);
+}
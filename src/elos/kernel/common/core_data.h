@@ -7,6 +7,7 @@ typedef struct kernel__CoreData {
     int inside_uefi;
     EFI_GRAPHICS_OUTPUT_PROTOCOL* graphics_output;
     EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* simple_file_system;
+    void* acpi_rsdp; // physical address, from the UEFI configuration table
 } kernel__CoreData;
 
 #define kernel__core_data ((kernel__CoreData*)0x88000)
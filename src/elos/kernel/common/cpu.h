@@ -1,67 +1,92 @@
+#pragma once
+
 
 
 #include <immintrin.h>
+#include <stddef.h>
 
 #include "elos/kernel/common/types.h"
+#include "elos/kernel/common/clock.h"
 
 #include <efi.h>
 #include <efilib.h>
 
+#define MAX_CPUS 64
+
+/*
+    Per-CPU data, GS base points to the Cpu of the CPU we run on.
+    Started by smp.c, index 0 is the bootstrap processor.
+*/
+typedef struct Cpu {
+    struct Cpu* self;
+    u32 index;
+    u32 apic_id;
+    u64 stack_top;
+    volatile bool online;
+    volatile bool call_pending; // see smp_call_others
+    u32 preempt_count;          // no thread switches while non-zero, see preempt_disable
+    volatile bool need_resched; // the scheduler wants to run, acted on when preemption is allowed
+    struct Thread* thread;      // running thread, see thread_current
+    u32 rcu_nesting;
+    volatile u64 rcu_epoch;     // epoch seen by the outermost RCU read section, 0 outside of one
+} Cpu;
+
+extern Cpu g_cpus[MAX_CPUS];
 
+static inline Cpu* this_cpu() {
+    Cpu* cpu;
+    asm volatile ("movq %%gs:%c1, %0" : "=r" (cpu) : "i" (offsetof(Cpu, self)));
+    return cpu;
+}
+
+/*
+    Index of the CPU we run on, 0 to MAX_CPUS-1.
+*/
+static inline int cpu_index() {
+#ifdef ELOS_HOST_TEST
+    return 0;
+#else
+    u32 index;
+    asm volatile ("movl %%gs:%c1, %0" : "=r" (index) : "i" (offsetof(Cpu, index)));
+    return index;
+#endif
+}
 
 
+void scheduler_preempt(); // scheduler.c
+
+/*
+    Spinlocks disable preemption so a thread holding one is never switched out,
+    interrupts still arrive. Nests. The scheduler runs when it's enabled again
+    if it asked to while disabled.
+*/
+static inline void preempt_disable() {
+#ifndef ELOS_HOST_TEST
+    asm volatile ("incl %%gs:%c0" : : "i" (offsetof(Cpu, preempt_count)) : "memory");
+#endif
+}
+
+static inline void preempt_enable() {
+#ifndef ELOS_HOST_TEST
+    bool resched;
+    asm volatile ("decl %%gs:%c1\n" "setz %0\n" : "=q" (resched) : "i" (offsetof(Cpu, preempt_count)) : "memory", "cc");
+    if (!resched)
+        return;
+    asm volatile ("movb %%gs:%c1, %0" : "=q" (resched) : "i" (offsetof(Cpu, need_resched)) : "memory");
+    if (!resched)
+        return;
+    u64 rflags;
+    asm volatile ("pushfq\n pop %0\n" : "=r" (rflags));
+    if (rflags & 0x200)
+        scheduler_preempt();
+#endif
+}
+
+// Busy waits, accurate once init_clock has calibrated the TSC
 static inline void sleep_ns(u64 ns) {
-    u64 start = _rdtsc(); // used in case EFI doesn't work
-    u64 freq = 4000000000;
-
-    // EFI_TIME start_time;
-    // EFI_TIME_CAPABILITIES cap;
-    // EFI_STATUS status = ST->RuntimeServices->GetTime(&start_time, &cap);
-    // if (EFI_ERROR(status)) {
-    //     goto fallback;
-    // }
-    
-    // while (1) {
-    //     __pause();
-        
-    //     EFI_TIME now_time;
-    //     EFI_STATUS status = ST->RuntimeServices->GetTime(&now_time, NULL);
-    //     if (EFI_ERROR(status)) {
-    //         goto fallback;
-    //     }
-        
-    //     // @NOTE: We diff nanosecond all the way up to year to avoid wrap around issue and negative numbers which
-    //     //    could cause you to wait indefinitely.
-    //     //    In terms of precision an unsigned 64-bit integer should hold for 18.8 years.
-    //     //   
-    //     //   (18.69 = 2**64/(1e9 * 60 * 60 * 24 * 31 * 365))
-        
-    //     u64 delta_ns = 
-    //     + ((u64)now_time.Year - (u64)start_time.Year) * 12LLU * 24LLU * 60LLU * 60LLU * 1000000000LLU
-    //     + ((u64)now_time.Month - (u64)start_time.Month) * 31LLU * 24LLU * 60LLU * 60LLU * 1000000000LLU
-    //     + ((u64)now_time.Day - (u64)start_time.Day) * 24LLU * 60LLU * 60LLU * 1000000000LLU
-    //     + ((u64)now_time.Hour - (u64)start_time.Hour) * 60LLU * 60LLU * 1000000000LLU
-    //     + ((u64)now_time.Minute - (u64)start_time.Minute) * 60LLU * 1000000000LLU
-    //     + ((u64)now_time.Second - (u64)start_time.Second) * 1000000000LLU
-    //     + (u64)now_time.Nanosecond - (u64)start_time.Nanosecond;
-        
-    //     if (delta_ns > ns)
-    //         break;
-    // }
-    
-    // return;
-    
-    // fallback:
-    // printf("Fallback\n");
-
-    while (1) {
-        __pause();
-
-        // Fallback, not great.
-        u64 delta = _rdtsc() - start;
-        if ((delta * 1000000000) / freq > ns)
-            break;
-    }
+    u64 end = __rdtsc() + ns_to_tsc(ns);
+    while (__rdtsc() < end)
+        _mm_pause();
 }
 
 static inline void sleep_ms(u64 ms) {
@@ -0,0 +1,89 @@
+/*
+    Chase-Lev work-stealing deque
+
+    One owner pushes and pops at the bottom, any CPU may steal from the top.
+    No locks, the only atomic read-modify-write is the CAS on top when two CPUs
+    race for the last item or thieves race each other. Memory orders follow
+    "Correct and Efficient Work-Stealing for Weak Memory Models" (Lê et al. 2013).
+
+    The buffer has a fixed power-of-two capacity, growing would need a way to
+    retire the old buffer while thieves may still read it.
+*/
+
+#pragma once
+
+#include "elos/kernel/common/types.h"
+
+typedef struct Deque {
+    volatile s64 top;
+    u8 pad0[56];         // thieves and the owner write different cache lines
+    volatile s64 bottom;
+    u8 pad1[56];
+    void** buffer;
+    u64 mask;
+} Deque;
+
+// buffer must hold capacity pointers, capacity a power of two
+static inline void deque_init(Deque* deque, void** buffer, u64 capacity) {
+    deque->top    = 0;
+    deque->bottom = 0;
+    deque->buffer = buffer;
+    deque->mask   = capacity - 1;
+}
+
+// Owner only. Returns false if the deque is full.
+static inline bool deque_push(Deque* deque, void* item) {
+    s64 b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    s64 t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    if ((u64)(b - t) > deque->mask)
+        return false;
+    __atomic_store_n(&deque->buffer[b & deque->mask], item, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+// Owner only, takes the newest item. Returns NULL if empty.
+static inline void* deque_pop(Deque* deque) {
+    s64 b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&deque->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    s64 t = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+    void* item = NULL;
+    if (t <= b) {
+        item = __atomic_load_n(&deque->buffer[b & deque->mask], __ATOMIC_RELAXED);
+        if (t == b) {
+            // last item, a thief may want it too
+            if (!__atomic_compare_exchange_n(&deque->top, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+                item = NULL;
+            __atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+        }
+    } else {
+        __atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return item;
+}
+
+/*
+    Any CPU, the owner too, takes the oldest item.
+    Returns NULL if empty or another CPU won the race for the item, the caller moves on.
+*/
+static inline void* deque_steal(Deque* deque) {
+    s64 t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    s64 b = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b)
+        return NULL;
+    void* item = __atomic_load_n(&deque->buffer[t & deque->mask], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&deque->top, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return NULL;
+    return item;
+}
+
+// A snapshot, may be stale as soon as it's read
+static inline u32 deque_size(Deque* deque) {
+    s64 b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    s64 t = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+    return b > t ? (u32)(b - t) : 0;
+}
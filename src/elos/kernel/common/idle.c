@@ -0,0 +1,126 @@
+/*
+    MWAIT is entered with interrupts disabled and the "interrupts break MWAIT" extension,
+    a pending interrupt wakes the CPU and is taken at the sti afterwards. That way
+    nothing runs between waking up and reading the clock for the stats.
+    HLT needs sti right before it, preemption is disabled so an interrupt that
+    wakes a thread can't switch away from the idle thread in the middle.
+*/
+
+#include "elos/kernel/common/idle.h"
+#include "elos/kernel/common/cpu.h"
+#include "elos/kernel/common/clock.h"
+#include "elos/kernel/common/sync.h"
+#include "elos/kernel/interrupt/interrupt.h"
+#include "elos/kernel/interrupt/apic.h"
+#include "elos/kernel/debug/debug.h"
+
+#include <cpuid.h>
+
+#define CPUID_1_ECX_MONITOR           (1 << 3)
+#define CPUID_5_ECX_EXTENSIONS        (1 << 0)
+#define CPUID_5_ECX_INTERRUPT_BREAK   (1 << 1)
+#define CPUID_6_EAX_ARAT              (1 << 2)
+#define MWAIT_BREAK_ON_INTERRUPT      1
+
+// One cache line per CPU, the monitored flag must not share it with anything another CPU writes
+typedef struct IdleState {
+    volatile u32 wake;
+    volatile u64 wake_request_tsc;
+    SeqCount stats_seq; // only the CPU itself writes its stats
+    IdleStats stats;
+} __attribute__((aligned(64))) IdleState;
+
+static IdleState g_idle[MAX_CPUS];
+static bool g_mwait;
+static u32  g_mwait_hint;
+
+void init_idle() {
+    u32 eax, ebx, ecx, edx;
+    __get_cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (!(ecx & CPUID_1_ECX_MONITOR) || __get_cpuid_max(0, NULL) < 6) {
+        serial_printf("idle: HLT\n");
+        return;
+    }
+
+    u32 substates;
+    __cpuid(5, eax, ebx, ecx, substates);
+    if (!(ecx & CPUID_5_ECX_EXTENSIONS) || !(ecx & CPUID_5_ECX_INTERRUPT_BREAK)) {
+        serial_printf("idle: HLT, MWAIT can't wake on masked interrupts\n");
+        return;
+    }
+
+    __cpuid(6, eax, ebx, ecx, edx);
+    g_mwait_hint = 0; // C1
+    if (eax & CPUID_6_EAX_ARAT) {
+        // EDX of leaf 5 has 4 bits per C-state with the number of sub-states, C0 first
+        for (u32 state = 7; state >= 2; state--) {
+            if ((substates >> (state * 4)) & 0xF) {
+                g_mwait_hint = (state - 1) << 4;
+                break;
+            }
+        }
+    }
+    g_mwait = true;
+    serial_printf("idle: MWAIT, C%d\n", (int)((g_mwait_hint >> 4) + 1));
+}
+
+bool idle_uses_mwait() {
+    return g_mwait;
+}
+
+void idle_prepare() {
+    IdleState* idle = &g_idle[cpu_index()];
+    idle->wake = 0;
+    if (g_mwait)
+        asm volatile ("monitor" : : "a" (&idle->wake), "c" (0), "d" (0) : "memory");
+    // the caller's check for work must not be done before the flag was cleared
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void idle_wait() {
+    IdleState* idle = &g_idle[cpu_index()];
+    preempt_disable();
+
+    u64 start = __rdtsc();
+    if (g_mwait) {
+        if (!idle->wake)
+            asm volatile ("mwait" : : "a" (g_mwait_hint), "c" (MWAIT_BREAK_ON_INTERRUPT) : "memory");
+    } else {
+        if (!idle->wake)
+            asm volatile ("sti\n hlt\n cli\n" ::: "memory"); // an interrupt right after sti still ends the hlt
+    }
+    u64 end = __rdtsc();
+
+    write_seqcount_begin(&idle->stats_seq);
+    idle->stats.entries++;
+    idle->stats.idle_ns += tsc_to_ns(end - start);
+    u64 request = __atomic_exchange_n(&idle->wake_request_tsc, 0, __ATOMIC_RELAXED);
+    if (request) {
+        u64 latency = end > request ? tsc_to_ns(end - request) : 0;
+        idle->stats.wakeups++;
+        idle->stats.wake_latency_ns += latency;
+        if (latency > idle->stats.max_wake_latency_ns)
+            idle->stats.max_wake_latency_ns = latency;
+    }
+    write_seqcount_end(&idle->stats_seq);
+
+    interrupts_enable();
+    preempt_enable();
+}
+
+void idle_wake(u32 cpu) {
+    IdleState* idle = &g_idle[cpu];
+    __atomic_store_n(&idle->wake_request_tsc, __rdtsc(), __ATOMIC_RELAXED);
+    __atomic_store_n(&idle->wake, 1, __ATOMIC_RELEASE);
+    if (!g_mwait)
+        lapic_send_ipi(g_cpus[cpu].apic_id, VECTOR_RESCHEDULE);
+}
+
+void idle_get_stats(u32 cpu, IdleStats* out_stats) {
+    IdleState* idle = &g_idle[cpu];
+    u32 seq;
+    do {
+        seq = read_seqcount_begin(&idle->stats_seq);
+        *out_stats = idle->stats;
+    } while (read_seqcount_retry(&idle->stats_seq, seq));
+}
@@ -0,0 +1,41 @@
+/*
+    Idle states
+
+    A CPU with nothing to run waits in MWAIT on its wake flag when the CPU has
+    MONITOR/MWAIT, otherwise in HLT. Waking an MWAIT CPU is a store to the flag,
+    no interrupt needed, HLT CPUs get an IPI. Both give the core back to the host
+    when we run in a VM (MWAIT is only exposed to guests that own their cores).
+
+    The deepest MWAIT state CPUID lists is used when the local APIC timer keeps
+    running in it (ARAT), else C1 so the timer wheel isn't stalled.
+*/
+
+#pragma once
+
+#include "elos/kernel/common/types.h"
+
+typedef struct IdleStats {
+    u64 entries;
+    u64 idle_ns;          // residency, time spent waiting
+    u64 wakeups;          // wakes requested by idle_wake, the rest were interrupts
+    u64 wake_latency_ns;  // total from idle_wake to the CPU running again
+    u64 max_wake_latency_ns;
+} IdleStats;
+
+// Checks for MONITOR/MWAIT, call once on the bootstrap processor
+void init_idle();
+
+/*
+    Call with interrupts disabled, returns with them enabled after the CPU woke up.
+    idle_prepare arms the wake flag, check for work after it and only then call
+    idle_wait so a wakeup in between isn't lost.
+*/
+void idle_prepare();
+void idle_wait();
+
+// Wakes a CPU that is in idle_wait (or about to be), any context
+void idle_wake(u32 cpu);
+
+bool idle_uses_mwait();
+
+void idle_get_stats(u32 cpu, IdleStats* out_stats);
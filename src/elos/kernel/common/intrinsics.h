@@ -51,3 +51,12 @@ static inline u32 inl(u16 port) {
     );
     return value;
 }
+
+static inline u64 read_msr(u32 msr) {
+    u32 low, high;
+    asm volatile ("rdmsr" : "=a" (low), "=d" (high) : "c" (msr));
+    return ((u64)high << 32) | low;
+}
+static inline void write_msr(u32 msr, u64 value) {
+    asm volatile ("wrmsr" : : "c" (msr), "a" ((u32)value), "d" ((u32)(value >> 32)));
+}
@@ -0,0 +1,779 @@
+/*
+    Scheduler
+
+    The run queue of a CPU is only touched by that CPU with interrupts disabled,
+    except the top of its deque which thieves take from. Rate threads are in a list
+    sorted by deadline, they are not stolen since they are usually few and short.
+
+    on_cpu stays set until the CPU a thread ran on has switched away from its stack
+    (schedule_tail). A thread only goes into a run queue once on_cpu is clear: a
+    preempted best-effort thread is pushed by schedule_tail, thread_wake waits for it.
+    Otherwise two CPUs could each pick the thread the other one is still leaving and
+    wait for each other forever.
+
+    Idle CPUs set their bit in g_idle_mask before checking for work one last time
+    and going idle. Whoever makes a best-effort thread runnable checks the mask after
+    the push and wakes one of them (idle_wake) so it can steal.
+*/
+
+#include "elos/kernel/common/scheduler.h"
+#include "elos/kernel/common/cpu.h"
+#include "elos/kernel/common/clock.h"
+#include "elos/kernel/common/deque.h"
+#include "elos/kernel/common/idle.h"
+#include "elos/kernel/common/smp.h"
+#include "elos/kernel/common/string.h"
+#include "elos/kernel/common/sync.h"
+#include "elos/kernel/interrupt/interrupt.h"
+#include "elos/kernel/memory/paging.h"
+#include "elos/kernel/memory/phys_allocator.h"
+#include "elos/kernel/memory/slab.h"
+#include "elos/kernel/debug/debug.h"
+
+#define DEQUE_PAGES ((SCHED_MAX_THREADS * sizeof(void*) + PAGE_SIZE_4K - 1) / PAGE_SIZE_4K)
+#define IDLE_ZERO_PAGES 64
+
+typedef struct RunQueue {
+    Thread* current;
+    Thread* idle;
+    Thread* prev;      // switched away from, its on_cpu is cleared in schedule_tail
+    bool prev_requeue; // schedule_tail pushes prev to the deque
+    Thread* edf_head;  // rate threads, earliest deadline first
+    u32 edf_count;
+    u32 steal_cursor;  // where the last steal succeeded
+    Deque deque;       // best-effort threads
+    Timer slice_timer;
+    SchedStats stats;
+    bool ready;
+} RunQueue;
+
+static RunQueue g_run_queues[MAX_CPUS];
+static volatile u64 g_idle_mask;
+static u32 g_thread_count;
+static KmemCache* g_thread_cache;
+
+__attribute__((ms_abi)) void sched_context_switch(u64* save_rsp, u64 new_rsp);
+extern char sched_thread_trampoline[];
+
+/*
+    Saves the callee-saved registers of the Windows x64 ABI (xmm6-xmm15 too) on the old
+    stack and restores them from the new one. A new thread's stack is set up so the
+    restore "returns" to the trampoline with the Thread in rbx and thread_start in r12.
+*/
+asm (
+    ".text\n"
+    ".globl sched_context_switch\n"
+    "sched_context_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %rdi\n"
+    "    pushq %rsi\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $160, %rsp\n"
+    "    movdqu %xmm6, 0(%rsp)\n"
+    "    movdqu %xmm7, 16(%rsp)\n"
+    "    movdqu %xmm8, 32(%rsp)\n"
+    "    movdqu %xmm9, 48(%rsp)\n"
+    "    movdqu %xmm10, 64(%rsp)\n"
+    "    movdqu %xmm11, 80(%rsp)\n"
+    "    movdqu %xmm12, 96(%rsp)\n"
+    "    movdqu %xmm13, 112(%rsp)\n"
+    "    movdqu %xmm14, 128(%rsp)\n"
+    "    movdqu %xmm15, 144(%rsp)\n"
+    "    movq %rsp, (%rcx)\n"
+    "    movq %rdx, %rsp\n"
+    "    movdqu 0(%rsp), %xmm6\n"
+    "    movdqu 16(%rsp), %xmm7\n"
+    "    movdqu 32(%rsp), %xmm8\n"
+    "    movdqu 48(%rsp), %xmm9\n"
+    "    movdqu 64(%rsp), %xmm10\n"
+    "    movdqu 80(%rsp), %xmm11\n"
+    "    movdqu 96(%rsp), %xmm12\n"
+    "    movdqu 112(%rsp), %xmm13\n"
+    "    movdqu 128(%rsp), %xmm14\n"
+    "    movdqu 144(%rsp), %xmm15\n"
+    "    addq $160, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rsi\n"
+    "    popq %rdi\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+
+    ".globl sched_thread_trampoline\n"
+    "sched_thread_trampoline:\n"
+    "    movq %rbx, %rcx\n"
+    "    subq $32, %rsp\n"    // shadow space, the stack is aligned here
+    "    call *%r12\n"
+    "    ud2\n"
+);
+
+static inline RunQueue* this_run_queue() {
+    return &g_run_queues[cpu_index()];
+}
+
+Thread* thread_current() {
+    Thread* thread;
+    asm volatile ("movq %%gs:%c1, %0" : "=r" (thread) : "i" (offsetof(Cpu, thread)));
+    return thread;
+}
+
+static void wake_timer_callback(Timer* timer, void* arg) {
+    thread_wake(arg);
+}
+
+static Thread* alloc_thread(const char* name) {
+    Thread* thread = kmem_cache_alloc(g_thread_cache);
+    if (!thread)
+        return NULL;
+    memset(thread, 0, sizeof(Thread));
+    thread->name = name;
+    timer_init(&thread->wake_timer, wake_timer_callback, thread);
+    return thread;
+}
+
+static void free_thread(Thread* thread) {
+    if (thread->stack)
+        kernel_free_phys_pages((void*)virt_to_phys(thread->stack), THREAD_STACK_PAGES);
+    kmem_cache_free(g_thread_cache, thread);
+    __atomic_sub_fetch(&g_thread_count, 1, __ATOMIC_RELAXED);
+}
+
+static void enqueue(RunQueue* rq, Thread* thread);
+static void kick_idle_cpu(u32 self);
+
+static void schedule_tail() {
+    RunQueue* rq = this_run_queue();
+    Thread* prev = rq->prev;
+    bool requeue = rq->prev_requeue;
+    rq->prev = NULL;
+    rq->prev_requeue = false;
+    if (!prev)
+        return;
+    bool dead = prev->state == THREAD_DEAD;
+    __atomic_store_n(&prev->on_cpu, false, __ATOMIC_RELEASE);
+    if (dead) {
+        free_thread(prev);
+    } else if (requeue) {
+        // only now can a thief take it
+        enqueue(rq, prev);
+        kick_idle_cpu(cpu_index());
+    }
+}
+
+__attribute__((ms_abi)) static void thread_start(Thread* thread) {
+    schedule_tail();
+    interrupts_enable();
+    thread->entry(thread->arg);
+    thread_exit();
+}
+
+// Thread with its own stack that starts in entry when first switched to, not queued anywhere
+static Thread* create_thread(const char* name, ThreadEntry entry, void* arg) {
+    Thread* thread = alloc_thread(name);
+    if (!thread)
+        return NULL;
+    void* stack = kernel_alloc_phys(THREAD_STACK_PAGES, 0);
+    if (!stack) {
+        kmem_cache_free(g_thread_cache, thread);
+        return NULL;
+    }
+    thread->stack = phys_to_virt((u64)stack);
+    thread->entry = entry;
+    thread->arg   = arg;
+    thread->state = THREAD_READY;
+
+    u64* sp = (u64*)((u8*)thread->stack + THREAD_STACK_PAGES * PAGE_SIZE_4K);
+    *--sp = (u64)sched_thread_trampoline;
+    *--sp = 0;               // rbp
+    *--sp = (u64)thread;     // rbx
+    *--sp = 0;               // rdi
+    *--sp = 0;               // rsi
+    *--sp = (u64)thread_start; // r12
+    sp -= 3;                 // r13-r15
+    sp -= 20;                // xmm6-xmm15
+    memset(sp, 0, 23 * sizeof(u64));
+    thread->rsp = (u64)sp;
+    return thread;
+}
+
+static void edf_insert(RunQueue* rq, Thread* thread) {
+    Thread** link = &rq->edf_head;
+    // after threads with the same deadline so they take turns
+    while (*link && (*link)->deadline_ns <= thread->deadline_ns)
+        link = &(*link)->edf_next;
+    thread->edf_next = *link;
+    *link = thread;
+    rq->edf_count++;
+}
+
+// Interrupts disabled
+static void enqueue(RunQueue* rq, Thread* thread) {
+    if (thread->period_ns) {
+        edf_insert(rq, thread);
+    } else if (!deque_push(&rq->deque, thread)) {
+        // can't happen, the deque holds every thread there is
+        serial_printf("sched: Run queue full\n");
+        kernel_bug();
+    }
+}
+
+static void kick_idle_cpu(u32 self) {
+    // pairs with the fetch_or in idle_thread, either we see its bit or it sees our push
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    u64 idle = __atomic_load_n(&g_idle_mask, __ATOMIC_RELAXED) & ~(1ULL << self);
+    if (!idle)
+        return;
+    u32 target = __builtin_ctzll(idle);
+    // The bit is cleared so the next push kicks someone else, the CPU sets it again before waiting
+    if (__atomic_fetch_and(&g_idle_mask, ~(1ULL << target), __ATOMIC_SEQ_CST) & (1ULL << target))
+        idle_wake(target);
+}
+
+static Thread* steal_thread(RunQueue* rq, u32 self) {
+    u32 online = cpu_online_count();
+    for (u32 i = 0; i < online; i++) {
+        u32 victim = (rq->steal_cursor + i) % online;
+        if (victim == self || !g_run_queues[victim].ready)
+            continue;
+        Deque* deque = &g_run_queues[victim].deque;
+        Thread* thread = deque_steal(deque);
+        if (thread) {
+            rq->steal_cursor = victim;
+            rq->stats.steals++;
+            // more left, get another idle CPU going
+            if (deque_size(deque) > 0)
+                kick_idle_cpu(self);
+            return thread;
+        }
+    }
+    return NULL;
+}
+
+static Thread* pick_next(RunQueue* rq, u32 self) {
+    if (rq->edf_head) {
+        Thread* thread = rq->edf_head;
+        rq->edf_head = thread->edf_next;
+        rq->edf_count--;
+        return thread;
+    }
+    // The owner takes from the top too so best-effort threads run in turns.
+    // NULL with a non-empty deque means a thief got the item, try again.
+    while (deque_size(&rq->deque) > 0) {
+        Thread* thread = deque_steal(&rq->deque);
+        if (thread)
+            return thread;
+    }
+    Thread* thread = steal_thread(rq, self);
+    return thread ? thread : rq->idle;
+}
+
+static void slice_timer_callback(Timer* timer, void* arg) {
+    this_cpu()->need_resched = true;
+}
+
+static void schedule_internal(bool preempt) {
+    bool enabled = interrupts_save_disable();
+    Cpu* cpu = this_cpu();
+    RunQueue* rq = &g_run_queues[cpu->index];
+    if (cpu->preempt_count) {
+        serial_printf("sched: schedule with preemption disabled\n");
+        kernel_bug();
+        interrupts_restore(enabled);
+        return;
+    }
+    cpu->need_resched = false;
+
+    Thread* prev = rq->current;
+    u32 state = prev->state;
+    // A thread preempted before it got to thread_block stays runnable and keeps its state
+    if (state == THREAD_BLOCKING && !preempt) {
+        if (__atomic_compare_exchange_n(&prev->state, &state, THREAD_BLOCKED, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            state = THREAD_BLOCKED;
+    }
+    // Rate threads stay in this CPU's list, best-effort ones are pushed to the deque in
+    // schedule_tail once we are off their stack
+    bool requeue = false;
+    if (prev != rq->idle && (state == THREAD_RUNNING || state == THREAD_BLOCKING)) {
+        if (state == THREAD_RUNNING)
+            prev->state = THREAD_READY;
+        if (prev->period_ns)
+            enqueue(rq, prev);
+        else
+            requeue = true;
+    }
+
+    Thread* next = pick_next(rq, cpu->index);
+    if (next == rq->idle && requeue) {
+        next = prev;
+        requeue = false;
+    }
+    u32 expected = THREAD_READY;
+    __atomic_compare_exchange_n(&next->state, &expected, THREAD_RUNNING, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+
+    if (next != rq->idle && next->period_ns == 0)
+        timer_start(&rq->slice_timer, now_ns() + SCHED_SLICE_NS, 0);
+    else
+        timer_cancel(&rq->slice_timer);
+
+    if (deque_size(&rq->deque) > 0)
+        kick_idle_cpu(cpu->index);
+
+    if (next == prev) {
+        interrupts_restore(enabled);
+        return;
+    }
+
+    // Threads are only queued once they are off their old CPU, so this never spins
+    while (__atomic_load_n(&next->on_cpu, __ATOMIC_ACQUIRE))
+        _mm_pause();
+    next->on_cpu = true;
+    next->cpu    = cpu->index;
+    rq->current  = next;
+    rq->prev     = prev;
+    rq->prev_requeue = requeue;
+    cpu->thread  = next;
+    rq->stats.switches++;
+    if (preempt && prev != rq->idle && prev->state != THREAD_BLOCKED)
+        rq->stats.preemptions++;
+
+    sched_context_switch(&prev->rsp, next->rsp);
+
+    // back in prev, maybe on another CPU
+    schedule_tail();
+    interrupts_restore(enabled);
+}
+
+void schedule() {
+    schedule_internal(false);
+}
+
+void scheduler_preempt() {
+    Cpu* cpu = this_cpu();
+    if (!cpu->need_resched || cpu->preempt_count || !g_run_queues[cpu->index].ready)
+        return;
+    schedule_internal(true);
+}
+
+static void reschedule_interrupt(InterruptFrame* frame) {
+    this_cpu()->need_resched = true;
+}
+
+static bool work_available(u32 self) {
+    RunQueue* rq = &g_run_queues[self];
+    if (rq->edf_head || deque_size(&rq->deque) > 0)
+        return true;
+    u32 online = cpu_online_count();
+    for (u32 i = 0; i < online; i++) {
+        if (g_run_queues[i].ready && deque_size(&g_run_queues[i].deque) > 0)
+            return true;
+    }
+    return false;
+}
+
+static void idle_thread(void* arg) {
+    // idle threads never move to another CPU
+    u32 self = cpu_index();
+    u64 bit = 1ULL << self;
+    while (1) {
+        rcu_poll();
+
+        // Zero free memory while there's nothing else to do so allocations don't have to.
+        // Stops once all of it is zero, after that the CPU really idles.
+        if (kernel_zero_free_pages(IDLE_ZERO_PAGES) > 0) {
+            schedule();
+            continue;
+        }
+
+        interrupts_disable();
+        idle_prepare();
+        __atomic_fetch_or(&g_idle_mask, bit, __ATOMIC_SEQ_CST);
+        if (work_available(self))
+            interrupts_enable();
+        else
+            idle_wait();
+        __atomic_fetch_and(&g_idle_mask, ~bit, __ATOMIC_SEQ_CST);
+        schedule();
+    }
+}
+
+static RunQueue* init_run_queue() {
+    Cpu* cpu = this_cpu();
+    RunQueue* rq = &g_run_queues[cpu->index];
+    void* buffer = kernel_alloc_phys(DEQUE_PAGES, 0);
+    if (!buffer)
+        return NULL;
+    deque_init(&rq->deque, phys_to_virt((u64)buffer), DEQUE_PAGES * PAGE_SIZE_4K / sizeof(void*));
+    timer_init(&rq->slice_timer, slice_timer_callback, NULL);
+    return rq;
+}
+
+void init_scheduler() {
+    Cpu* cpu = this_cpu();
+    g_thread_cache = kmem_cache_create("thread", sizeof(Thread), 0, NULL);
+    interrupt_set_handler(VECTOR_RESCHEDULE, reschedule_interrupt);
+
+    RunQueue* rq = init_run_queue();
+    Thread* main = g_thread_cache ? alloc_thread("main") : NULL;
+    Thread* idle = g_thread_cache ? create_thread("idle", idle_thread, NULL) : NULL;
+    if (!rq || !main || !idle) {
+        serial_printf("sched: Out of memory\n");
+        kernel_bug();
+        return;
+    }
+    main->state  = THREAD_RUNNING;
+    main->on_cpu = true;
+    main->cpu    = cpu->index;
+    g_thread_count = 1;
+
+    rq->idle    = idle;
+    rq->current = main;
+    cpu->thread = main;
+    __atomic_store_n(&rq->ready, true, __ATOMIC_RELEASE);
+}
+
+void scheduler_enter_idle() {
+    Cpu* cpu = this_cpu();
+    RunQueue* rq = init_run_queue();
+    Thread* idle = rq ? alloc_thread("idle") : NULL;
+    if (!idle) {
+        serial_printf("sched: Out of memory, CPU %d stays idle\n", (int)cpu->index);
+        kernel_bug();
+        while (1)
+            asm volatile ("cli\n hlt\n");
+    }
+    idle->state  = THREAD_RUNNING;
+    idle->on_cpu = true;
+    idle->cpu    = cpu->index;
+
+    rq->idle    = idle;
+    rq->current = idle;
+    cpu->thread = idle;
+    __atomic_store_n(&rq->ready, true, __ATOMIC_RELEASE);
+    idle_thread(NULL);
+}
+
+Thread* thread_create(const char* name, ThreadEntry entry, void* arg) {
+    if (__atomic_add_fetch(&g_thread_count, 1, __ATOMIC_RELAXED) > SCHED_MAX_THREADS) {
+        __atomic_sub_fetch(&g_thread_count, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    Thread* thread = create_thread(name, entry, arg);
+    if (!thread) {
+        __atomic_sub_fetch(&g_thread_count, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    bool enabled = interrupts_save_disable();
+    u32 self = cpu_index();
+    thread->cpu = self;
+    enqueue(&g_run_queues[self], thread);
+    kick_idle_cpu(self);
+    interrupts_restore(enabled);
+    return thread;
+}
+
+void thread_exit() {
+    interrupts_disable();
+    thread_current()->state = THREAD_DEAD;
+    schedule();
+    // a dead thread is never switched back to
+    while (1)
+        asm volatile ("cli\n hlt\n");
+}
+
+void thread_yield() {
+    schedule();
+}
+
+void thread_prepare_block() {
+    __atomic_store_n(&thread_current()->state, THREAD_BLOCKING, __ATOMIC_SEQ_CST);
+}
+
+void thread_block() {
+    schedule();
+}
+
+void thread_cancel_block() {
+    u32 expected = THREAD_BLOCKING;
+    __atomic_compare_exchange_n(&thread_current()->state, &expected, THREAD_RUNNING, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+bool thread_wake(Thread* thread) {
+    u32 state = __atomic_load_n(&thread->state, __ATOMIC_ACQUIRE);
+    while (1) {
+        if (state == THREAD_BLOCKING) {
+            // hasn't switched away yet, it just keeps running
+            if (__atomic_compare_exchange_n(&thread->state, &state, THREAD_RUNNING, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                return true;
+        } else if (state == THREAD_BLOCKED) {
+            if (__atomic_compare_exchange_n(&thread->state, &state, THREAD_READY, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                break;
+        } else {
+            return false;
+        }
+    }
+
+    // Its CPU may still be switching away from it. Queued, another CPU could pick it
+    // and wait for that switch while this CPU waits for one of its own.
+    while (__atomic_load_n(&thread->on_cpu, __ATOMIC_ACQUIRE))
+        _mm_pause();
+
+    bool enabled = interrupts_save_disable();
+    Cpu* cpu = this_cpu();
+    RunQueue* rq = &g_run_queues[cpu->index];
+    enqueue(rq, thread);
+
+    Thread* current = rq->current;
+    if (current == rq->idle)
+        cpu->need_resched = true;
+    else if (thread->period_ns && (current->period_ns == 0 || thread->deadline_ns < current->deadline_ns))
+        cpu->need_resched = true;
+    if (!thread->period_ns)
+        kick_idle_cpu(cpu->index);
+    interrupts_restore(enabled);
+
+    if (enabled)
+        scheduler_preempt();
+    return true;
+}
+
+void mutex_lock(Mutex* mutex) {
+    Thread* self = thread_current();
+    bool enabled = spin_lock_irqsave(&mutex->lock);
+    if (!mutex->owner) {
+        mutex->owner = self;
+        spin_unlock_irqrestore(&mutex->lock, enabled);
+        return;
+    }
+    self->wait_next = NULL;
+    if (mutex->wait_tail)
+        mutex->wait_tail->wait_next = self;
+    else
+        mutex->wait_head = self;
+    mutex->wait_tail = self;
+    spin_unlock_irqrestore(&mutex->lock, enabled);
+
+    // mutex_unlock makes us the owner before waking us
+    while (1) {
+        thread_prepare_block();
+        if (__atomic_load_n(&mutex->owner, __ATOMIC_ACQUIRE) == self)
+            break;
+        thread_block();
+    }
+    thread_cancel_block();
+}
+
+void mutex_unlock(Mutex* mutex) {
+    bool enabled = spin_lock_irqsave(&mutex->lock);
+    Thread* next = mutex->wait_head;
+    if (next) {
+        mutex->wait_head = next->wait_next;
+        if (!mutex->wait_head)
+            mutex->wait_tail = NULL;
+    }
+    __atomic_store_n(&mutex->owner, next, __ATOMIC_RELEASE);
+    spin_unlock_irqrestore(&mutex->lock, enabled);
+    if (next)
+        thread_wake(next);
+}
+
+// On the stack of the waiting thread
+struct SemaphoreWaiter {
+    Thread* thread;
+    SemaphoreWaiter* next;
+    volatile bool granted;
+};
+
+void sem_init(Semaphore* sem, u32 count) {
+    memset(sem, 0, sizeof(Semaphore));
+    sem->count = count;
+}
+
+bool sem_trydown(Semaphore* sem) {
+    bool enabled = spin_lock_irqsave(&sem->lock);
+    bool got = sem->count > 0;
+    if (got)
+        sem->count--;
+    spin_unlock_irqrestore(&sem->lock, enabled);
+    return got;
+}
+
+void sem_down(Semaphore* sem) {
+    bool enabled = spin_lock_irqsave(&sem->lock);
+    if (sem->count > 0) {
+        sem->count--;
+        spin_unlock_irqrestore(&sem->lock, enabled);
+        return;
+    }
+    SemaphoreWaiter waiter = { thread_current(), NULL, false };
+    if (sem->wait_tail)
+        sem->wait_tail->next = &waiter;
+    else
+        sem->wait_head = &waiter;
+    sem->wait_tail = &waiter;
+    spin_unlock_irqrestore(&sem->lock, enabled);
+
+    // sem_up hands the unit to us directly
+    while (1) {
+        thread_prepare_block();
+        if (__atomic_load_n(&waiter.granted, __ATOMIC_ACQUIRE))
+            break;
+        thread_block();
+    }
+    thread_cancel_block();
+}
+
+void sem_up(Semaphore* sem) {
+    bool enabled = spin_lock_irqsave(&sem->lock);
+    SemaphoreWaiter* waiter = sem->wait_head;
+    if (!waiter) {
+        sem->count++;
+        spin_unlock_irqrestore(&sem->lock, enabled);
+        return;
+    }
+    sem->wait_head = waiter->next;
+    if (!sem->wait_head)
+        sem->wait_tail = NULL;
+    // the waiter's stack frame is gone once granted is seen, read thread first
+    Thread* thread = waiter->thread;
+    __atomic_store_n(&waiter->granted, true, __ATOMIC_RELEASE);
+    spin_unlock_irqrestore(&sem->lock, enabled);
+    thread_wake(thread);
+}
+
+void completion_init(Completion* completion) {
+    completion->thread = thread_current();
+    completion->done   = false;
+    completion->ok     = false;
+}
+
+void completion_done(void* arg, bool ok) {
+    Completion* completion = arg;
+    // the waiter's stack frame may be gone once done is seen, read thread first
+    Thread* thread = completion->thread;
+    completion->ok = ok;
+    __atomic_store_n(&completion->done, true, __ATOMIC_RELEASE);
+    thread_wake(thread);
+}
+
+bool completion_wait(Completion* completion) {
+    while (1) {
+        thread_prepare_block();
+        if (__atomic_load_n(&completion->done, __ATOMIC_ACQUIRE))
+            break;
+        thread_block();
+    }
+    thread_cancel_block();
+    return completion->ok;
+}
+
+static void sleep_until(u64 wake_ns) {
+    Thread* self = thread_current();
+    while (now_ns() < wake_ns) {
+        thread_prepare_block();
+        timer_start(&self->wake_timer, wake_ns, 0);
+        thread_block();
+        thread_cancel_block();
+    }
+    timer_cancel(&self->wake_timer);
+}
+
+void thread_sleep_ns(u64 ns) {
+    sleep_until(now_ns() + ns);
+}
+
+u32 thread_set_rate(u32 rate_hz) {
+    Thread* self = thread_current();
+    if (rate_hz != 0 && rate_hz < SCHED_MIN_RATE_HZ)
+        rate_hz = SCHED_MIN_RATE_HZ;
+    if (rate_hz > SCHED_MAX_RATE_HZ)
+        rate_hz = SCHED_MAX_RATE_HZ;
+
+    bool enabled = interrupts_save_disable();
+    if (rate_hz == 0) {
+        self->period_ns = 0;
+    } else {
+        self->period_ns   = NS_PER_SECOND / rate_hz;
+        self->deadline_ns = now_ns() + self->period_ns;
+    }
+    interrupts_restore(enabled);
+    return rate_hz;
+}
+
+void thread_wait_period() {
+    Thread* self = thread_current();
+    u64 period = self->period_ns;
+    if (!period) {
+        thread_yield();
+        return;
+    }
+
+    u64 now = now_ns();
+    u64 release = self->deadline_ns;
+    if (now > release) {
+        // late, the next period starts right away
+        u64 skipped = (now - release) / period;
+        release += skipped * period;
+        self->deadline_misses += 1 + skipped;
+        __atomic_add_fetch(&this_run_queue()->stats.deadline_misses, 1 + skipped, __ATOMIC_RELAXED);
+        self->deadline_ns = release + period;
+        return;
+    }
+    self->deadline_ns = release + period;
+    sleep_until(release);
+}
+
+void sched_get_stats(u32 cpu, SchedStats* out_stats) {
+    RunQueue* rq = &g_run_queues[cpu];
+    *out_stats = rq->stats;
+    out_stats->deadline_queue_length = rq->edf_count;
+    out_stats->run_queue_length = rq->edf_count + (rq->ready ? deque_size(&rq->deque) : 0);
+}
+
+typedef struct ThroughputTest {
+    u32 iterations;
+    volatile u32 remaining;
+} ThroughputTest;
+
+static void throughput_worker(void* arg) {
+    ThroughputTest* test = arg;
+    volatile u64 sum = 0;
+    for (u32 i = 0; i < test->iterations; i++)
+        sum += (u64)i * i;
+    __atomic_sub_fetch(&test->remaining, 1, __ATOMIC_RELEASE);
+}
+
+void sched_throughput_test(u32 thread_count, u32 iterations) {
+    ThroughputTest test;
+    test.iterations = iterations;
+    test.remaining  = thread_count;
+
+    u64 steals_before = 0;
+    for (u32 cpu = 0; cpu < MAX_CPUS; cpu++)
+        steals_before += g_run_queues[cpu].stats.steals;
+
+    u64 start = now_ns();
+    for (u32 i = 0; i < thread_count; i++) {
+        if (!thread_create("throughput", throughput_worker, &test)) {
+            __atomic_sub_fetch(&test.remaining, thread_count - i, __ATOMIC_RELEASE);
+            serial_printf("sched: Could only create %d threads\n", (int)i);
+            break;
+        }
+    }
+    while (__atomic_load_n(&test.remaining, __ATOMIC_ACQUIRE))
+        thread_yield();
+    u64 elapsed = now_ns() - start;
+
+    u64 steals = 0;
+    for (u32 cpu = 0; cpu < MAX_CPUS; cpu++)
+        steals += g_run_queues[cpu].stats.steals;
+    serial_printf("sched: %d threads x %d iterations on %d CPUs took %d us, %d steals\n", (int)thread_count,
+        (int)iterations, (int)cpu_online_count(), (int)(elapsed / 1000), (int)(steals - steals_before));
+}
@@ -0,0 +1,181 @@
+/*
+    Threads and the scheduler
+
+    Every CPU has its own run queue, nothing is shared between CPUs except the
+    top of the work-stealing deques. Two classes of threads (see docs/spec/scheduling.md):
+
+    - Rate threads asked to run at some frequency with thread_set_rate. Each period
+      ends at a deadline and the earliest deadline runs first (EDF). They always go
+      ahead of best-effort threads and preempt them when they wake up.
+    - Best-effort threads take turns in time slices. They are kept in a Chase-Lev deque,
+      a CPU with nothing to run steals the oldest from another CPU's deque.
+
+    A woken thread is queued on the CPU that woke it. Threads are preempted on the way
+    out of interrupts and when preemption is enabled again, never while a spinlock is held.
+*/
+
+#pragma once
+
+#include "elos/kernel/common/types.h"
+#include "elos/kernel/common/timer.h"
+#include "elos/kernel/common/sync.h"
+
+#define THREAD_STACK_PAGES  8
+#define SCHED_MAX_THREADS   1024 // deques hold this many so a push never fails
+#define SCHED_SLICE_NS      4000000ULL
+// The rates the scheduler accepts, others are clamped to these
+#define SCHED_MIN_RATE_HZ   1
+#define SCHED_MAX_RATE_HZ   10000
+
+typedef void (*ThreadEntry)(void* arg);
+
+typedef enum ThreadState {
+    THREAD_READY,    // in a run queue
+    THREAD_RUNNING,
+    THREAD_BLOCKING, // still running but going to block, a wakeup turns it back to running
+    THREAD_BLOCKED,
+    THREAD_DEAD,
+} ThreadState;
+
+typedef struct Thread {
+    u64 rsp;                // saved by the context switch
+    volatile u32 state;     // ThreadState
+    volatile bool on_cpu;   // its stack is in use until the switch away from it finished
+    u32 cpu;                // CPU it runs or last ran on
+    const char* name;
+    ThreadEntry entry;
+    void* arg;
+    void* stack;            // NULL for threads on a stack they didn't allocate
+    u64 period_ns;          // 0 for best-effort
+    u64 deadline_ns;
+    u64 deadline_misses;
+    struct Thread* edf_next;
+    struct Thread* wait_next; // in a Mutex's wait list
+    Timer wake_timer;
+} Thread;
+
+typedef struct SchedStats {
+    u32 run_queue_length;   // runnable threads waiting, both classes
+    u32 deadline_queue_length;
+    u64 switches;
+    u64 preemptions;        // switches from a thread that could have kept running
+    u64 steals;             // threads this CPU took from others
+    u64 deadline_misses;    // periods of rate threads on this CPU that ended late
+} SchedStats;
+
+/*
+    Turns the code that calls it on the bootstrap processor into the first thread.
+    Call after init_timers and before init_smp.
+*/
+void init_scheduler();
+
+/*
+    Sets up the run queue of an application processor and turns the calling code
+    into its idle thread. Never returns.
+*/
+void scheduler_enter_idle();
+
+/*
+    Creates a best-effort thread and queues it on this CPU.
+    The Thread is freed when entry returns or it calls thread_exit.
+    Returns NULL if out of memory or at SCHED_MAX_THREADS.
+*/
+Thread* thread_create(const char* name, ThreadEntry entry, void* arg);
+
+Thread* thread_current();
+
+void thread_exit() __attribute__((noreturn));
+
+// Lets other threads of the same class run
+void thread_yield();
+
+void thread_sleep_ns(u64 ns);
+
+/*
+    Makes the current thread a rate thread, its first period starts now.
+    0 makes it best-effort again. Returns the rate that was granted.
+*/
+u32 thread_set_rate(u32 rate_hz);
+
+/*
+    Rate threads call this when the work of a period is done, it blocks until the next period.
+    Finishing after the deadline counts a miss, periods that were missed entirely are skipped.
+    Same as thread_yield for best-effort threads.
+*/
+void thread_wait_period();
+
+/*
+    Blocking without losing wakeups:
+        thread_prepare_block();
+        if (!condition)
+            thread_block();
+        thread_cancel_block();
+    Anyone setting the condition calls thread_wake afterwards.
+*/
+void thread_prepare_block();
+void thread_block();
+void thread_cancel_block();
+
+// Returns false if the thread wasn't blocked (or about to). Any context.
+bool thread_wake(Thread* thread);
+
+void schedule();
+
+/*
+    Sleeping lock for threads, for holding something across waits like device I/O.
+    Waiters get it in FIFO order, unlock hands it to the first one directly.
+    Zero initialized is unlocked. Not from interrupts or while holding a spinlock.
+*/
+typedef struct Mutex {
+    Spinlock lock; // protects the fields below
+    Thread* owner;
+    Thread* wait_head;
+    Thread* wait_tail;
+} Mutex;
+
+void mutex_lock(Mutex* mutex);
+void mutex_unlock(Mutex* mutex);
+
+/*
+    Counting semaphore, for things like free command slots of a device.
+    sem_up may be called from interrupts, the rest only from threads.
+*/
+typedef struct SemaphoreWaiter SemaphoreWaiter;
+
+typedef struct Semaphore {
+    Spinlock lock; // protects the fields below
+    u32 count;
+    SemaphoreWaiter* wait_head;
+    SemaphoreWaiter* wait_tail;
+} Semaphore;
+
+void sem_init(Semaphore* sem, u32 count);
+void sem_down(Semaphore* sem);
+bool sem_trydown(Semaphore* sem);
+void sem_up(Semaphore* sem);
+
+/*
+    One thread waiting for one thing to finish elsewhere, like a device command that
+    an interrupt completes. completion_done has the (arg, ok) shape of the drivers'
+    completion callbacks so it can be passed to them with the Completion as arg.
+*/
+typedef struct Completion {
+    Thread* thread;
+    volatile bool done;
+    bool ok;
+} Completion;
+
+// For the calling thread to wait on
+void completion_init(Completion* completion);
+// Sets the result and wakes the waiter. Any context.
+void completion_done(void* completion, bool ok);
+// Blocks until completion_done was called, returns its ok. Threads only.
+bool completion_wait(Completion* completion);
+
+void sched_get_stats(u32 cpu, SchedStats* out_stats);
+
+/*
+    Runs threads that each spin through the same amount of work and prints how long
+    it took, compare with different CPU counts to see how it scales.
+*/
+void sched_throughput_test(u32 thread_count, u32 iterations);
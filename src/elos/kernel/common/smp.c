@@ -0,0 +1,323 @@
+/*
+    Application processor startup
+
+    The trampoline is assembled into the kernel and copied to a page below 1 MiB,
+    the SIPI vector is that page number. Its code only uses addresses relative to
+    its own start (real mode CS is the page) except the far jumps and GDT pointer
+    which are patched after the copy. The other values it needs (CR3, stack, entry...)
+    are in TrampolineData at the end.
+
+    CR3 is loaded while still in 32-bit mode so the top level page table must be below 4 GiB.
+    Low memory is identity mapped by the firmware's tables which we still use.
+
+    APs are started one at a time since they share the trampoline.
+*/
+
+#include "elos/kernel/common/smp.h"
+#include "elos/kernel/common/clock.h"
+#include "elos/kernel/common/timer.h"
+#include "elos/kernel/common/scheduler.h"
+#include "elos/kernel/common/intrinsics.h"
+#include "elos/kernel/common/sync.h"
+#include "elos/kernel/common/string.h"
+#include "elos/kernel/interrupt/interrupt.h"
+#include "elos/kernel/interrupt/apic.h"
+#include "elos/kernel/acpi/acpi.h"
+#include "elos/kernel/memory/paging.h"
+#include "elos/kernel/memory/phys_allocator.h"
+#include "elos/kernel/debug/debug.h"
+
+#define MSR_GS_BASE     0xC0000101
+#define MSR_EFER        0xC0000080
+#define EFER_KEEP       0x901 // SCE, LME, NXE
+
+#define ICR_INIT        0x4500 // INIT, level assert
+#define ICR_STARTUP     0x4600
+
+#define AP_STACK_PAGES  4
+#define LOW_MEMORY      0x100000ULL
+
+#define INIT_WAIT_NS    10000000ULL
+#define SIPI_WAIT_NS    200000ULL
+#define START_WAIT_NS   1000000000ULL // TCG can be slow
+
+typedef struct TrampolineData {
+    u64 cr3;
+    u64 cr4;
+    u64 cr0;
+    u64 efer;
+    u64 stack;
+    u64 arg;
+    u64 entry;
+} TrampolineData;
+
+typedef struct SmpCall {
+    void (*fn)(void* arg);
+    void* arg;
+    volatile u32 pending;
+} SmpCall;
+
+Cpu g_cpus[MAX_CPUS];
+static u32 g_online_count = 1;
+
+static Spinlock g_call_lock = LOCK_INIT("smp call");
+static SmpCall g_call;
+
+extern void load_gdt(); // kernel.c
+
+extern char smp_trampoline_start[];
+extern char smp_trampoline_end[];
+extern char smp_trampoline_gdt[];
+extern char smp_trampoline_gdtr[];
+extern char smp_trampoline_far32[];
+extern char smp_trampoline_far64[];
+extern char smp_trampoline_32[];
+extern char smp_trampoline_64[];
+extern char smp_trampoline_data[];
+
+#define TRAMPOLINE_OFFSET(symbol) ((u64)(symbol) - (u64)smp_trampoline_start)
+
+asm (
+    ".text\n"
+    ".code16\n"
+    ".globl smp_trampoline_start\n"
+    "smp_trampoline_start:\n"
+    "    cli\n"
+    "    cld\n"
+    "    movw %cs, %ax\n"
+    "    movw %ax, %ds\n"
+    "    xorl %ebx, %ebx\n"
+    "    movw %ax, %bx\n"
+    "    shll $4, %ebx\n"  // physical address of the trampoline
+    "    lgdtl smp_trampoline_gdtr - smp_trampoline_start\n"
+    "    movl %cr0, %eax\n"
+    "    orl $1, %eax\n"
+    "    movl %eax, %cr0\n"
+    "    ljmpl *(smp_trampoline_far32 - smp_trampoline_start)\n"
+
+    ".code32\n"
+    ".globl smp_trampoline_32\n"
+    "smp_trampoline_32:\n"
+    "    movw $0x10, %ax\n"
+    "    movw %ax, %ds\n"
+    "    movw %ax, %es\n"
+    "    movw %ax, %ss\n"
+    "    movl %cr4, %eax\n"
+    "    orl $0x20, %eax\n"  // PAE
+    "    movl %eax, %cr4\n"
+    "    movl (smp_trampoline_data - smp_trampoline_start + 0)(%ebx), %eax\n"
+    "    movl %eax, %cr3\n"
+    "    movl $0xC0000080, %ecx\n"
+    "    movl (smp_trampoline_data - smp_trampoline_start + 24)(%ebx), %eax\n"
+    "    xorl %edx, %edx\n"
+    "    wrmsr\n"
+    "    movl %cr0, %eax\n"
+    "    orl $0x80000001, %eax\n"  // paging, long mode is active after this
+    "    movl %eax, %cr0\n"
+    "    ljmpl *(smp_trampoline_far64 - smp_trampoline_start)(%ebx)\n"
+
+    ".code64\n"
+    ".globl smp_trampoline_64\n"
+    "smp_trampoline_64:\n"
+    "    movl %ebx, %ebx\n"
+    "    movq (smp_trampoline_data - smp_trampoline_start + 8)(%rbx), %rax\n"
+    "    movq %rax, %cr4\n"
+    "    movq (smp_trampoline_data - smp_trampoline_start + 16)(%rbx), %rax\n"
+    "    movq %rax, %cr0\n"
+    "    movq (smp_trampoline_data - smp_trampoline_start + 32)(%rbx), %rsp\n"
+    "    movq (smp_trampoline_data - smp_trampoline_start + 40)(%rbx), %rcx\n"
+    "    movq (smp_trampoline_data - smp_trampoline_start + 48)(%rbx), %rax\n"
+    "    subq $32, %rsp\n"
+    "    call *%rax\n"
+    "1:  hlt\n"
+    "    jmp 1b\n"
+
+    ".p2align 3\n"
+    ".globl smp_trampoline_gdt\n"
+    "smp_trampoline_gdt:\n"
+    "    .quad 0\n"
+    "    .quad 0x00CF9A000000FFFF\n" // 0x08 32-bit code
+    "    .quad 0x00CF92000000FFFF\n" // 0x10 data
+    "    .quad 0x00209A0000000000\n" // 0x18 64-bit code
+    ".globl smp_trampoline_gdtr\n"
+    "smp_trampoline_gdtr:\n"
+    "    .word 31\n"
+    "    .long 0\n"
+    ".globl smp_trampoline_far32\n"
+    "smp_trampoline_far32:\n"
+    "    .long 0\n"
+    "    .word 0x08\n"
+    ".globl smp_trampoline_far64\n"
+    "smp_trampoline_far64:\n"
+    "    .long 0\n"
+    "    .word 0x18\n"
+    ".p2align 3\n"
+    ".globl smp_trampoline_data\n"
+    "smp_trampoline_data:\n"
+    "    .fill 7, 8, 0\n" // TrampolineData
+    ".globl smp_trampoline_end\n"
+    "smp_trampoline_end:\n"
+);
+
+static inline u64 read_cr0() {
+    u64 reg;
+    asm volatile ("mov %%cr0, %0\n" : "=r" (reg));
+    return reg;
+}
+static inline u64 read_cr3() {
+    u64 reg;
+    asm volatile ("mov %%cr3, %0\n" : "=r" (reg));
+    return reg;
+}
+static inline u64 read_cr4() {
+    u64 reg;
+    asm volatile ("mov %%cr4, %0\n" : "=r" (reg));
+    return reg;
+}
+
+void init_boot_cpu() {
+    Cpu* cpu = &g_cpus[0];
+    cpu->self   = cpu;
+    cpu->index  = 0;
+    cpu->online = true;
+    write_msr(MSR_GS_BASE, (u64)cpu);
+}
+
+u32 cpu_online_count() {
+    return __atomic_load_n(&g_online_count, __ATOMIC_ACQUIRE);
+}
+
+static void run_pending_call() {
+    Cpu* cpu = this_cpu();
+    if (!__atomic_exchange_n(&cpu->call_pending, false, __ATOMIC_ACQUIRE))
+        return;
+    g_call.fn(g_call.arg);
+    __atomic_sub_fetch(&g_call.pending, 1, __ATOMIC_RELEASE);
+}
+
+static void call_function_interrupt(InterruptFrame* frame) {
+    run_pending_call();
+}
+
+void smp_call_others(void (*fn)(void* arg), void* arg) {
+    u32 online = cpu_online_count();
+    if (online <= 1)
+        return;
+
+    while (!spin_trylock(&g_call_lock)) {
+        run_pending_call();
+        _mm_pause();
+    }
+
+    u32 self = cpu_index();
+    g_call.fn  = fn;
+    g_call.arg = arg;
+    __atomic_store_n(&g_call.pending, online - 1, __ATOMIC_RELEASE);
+    for (u32 i = 0; i < online; i++) {
+        if (i == self)
+            continue;
+        __atomic_store_n(&g_cpus[i].call_pending, true, __ATOMIC_RELEASE);
+        lapic_send_ipi(g_cpus[i].apic_id, VECTOR_CALL_FUNCTION);
+    }
+    while (__atomic_load_n(&g_call.pending, __ATOMIC_ACQUIRE))
+        _mm_pause();
+
+    spin_unlock(&g_call_lock);
+}
+
+__attribute__((ms_abi)) static void ap_entry(Cpu* cpu) {
+    load_gdt();
+    interrupt_load_idt();
+    write_msr(MSR_GS_BASE, (u64)cpu);
+
+    init_apic();
+    init_timers();
+
+    __atomic_store_n(&cpu->online, true, __ATOMIC_RELEASE);
+    scheduler_enter_idle();
+}
+
+static bool start_ap(Cpu* cpu, u64 trampoline, TrampolineData* data) {
+    data->stack = cpu->stack_top;
+    data->arg   = (u64)cpu;
+
+    lapic_send_ipi(cpu->apic_id, ICR_INIT);
+    sleep_ns(INIT_WAIT_NS);
+
+    // A second SIPI is ignored by a CPU that already started
+    for (int attempt = 0; attempt < 2; attempt++) {
+        lapic_send_ipi(cpu->apic_id, ICR_STARTUP | (trampoline >> 12));
+        u64 deadline = now_ns() + (attempt == 0 ? SIPI_WAIT_NS : START_WAIT_NS);
+        while (now_ns() < deadline) {
+            if (__atomic_load_n(&cpu->online, __ATOMIC_ACQUIRE))
+                return true;
+            _mm_pause();
+        }
+    }
+    return false;
+}
+
+void init_smp() {
+    Cpu* boot = &g_cpus[0];
+    boot->apic_id = lapic_id();
+
+    interrupt_set_handler(VECTOR_CALL_FUNCTION, call_function_interrupt);
+
+    if (g_madt.cpu_count <= 1)
+        return;
+
+    u64 cr3 = read_cr3() & ~0xFFFULL;
+    if (cr3 >= 0x100000000ULL) {
+        serial_printf("smp: Page tables above 4 GiB, can't start other CPUs\n");
+        return;
+    }
+
+    u64 trampoline = (u64)kernel_alloc_phys_contiguous(1, PAGE_SIZE_4K, LOW_MEMORY, 0);
+    if (!trampoline) {
+        serial_printf("smp: No memory below 1 MiB for the trampoline\n");
+        return;
+    }
+
+    u8* code = phys_to_virt(trampoline);
+    memcpy(code, smp_trampoline_start, smp_trampoline_end - smp_trampoline_start);
+    *(u32*)(code + TRAMPOLINE_OFFSET(smp_trampoline_gdtr) + 2) = trampoline + TRAMPOLINE_OFFSET(smp_trampoline_gdt);
+    *(u32*)(code + TRAMPOLINE_OFFSET(smp_trampoline_far32))   = trampoline + TRAMPOLINE_OFFSET(smp_trampoline_32);
+    *(u32*)(code + TRAMPOLINE_OFFSET(smp_trampoline_far64))   = trampoline + TRAMPOLINE_OFFSET(smp_trampoline_64);
+
+    TrampolineData* data = (TrampolineData*)(code + TRAMPOLINE_OFFSET(smp_trampoline_data));
+    data->cr3   = cr3;
+    data->cr4   = read_cr4();
+    data->cr0   = read_cr0();
+    data->efer  = read_msr(MSR_EFER) & EFER_KEEP;
+    data->entry = (u64)ap_entry;
+
+    u32 count = 1;
+    for (u32 i = 0; i < g_madt.cpu_count && count < MAX_CPUS; i++) {
+        if (g_madt.apic_ids[i] == boot->apic_id)
+            continue;
+
+        Cpu* cpu = &g_cpus[count];
+        void* stack = kernel_alloc_phys(AP_STACK_PAGES, 0);
+        if (!stack)
+            break;
+        cpu->self      = cpu;
+        cpu->index     = count;
+        cpu->apic_id   = g_madt.apic_ids[i];
+        cpu->stack_top = (u64)phys_to_virt((u64)stack) + AP_STACK_PAGES * PAGE_SIZE_4K;
+        cpu->online    = false;
+
+        if (!start_ap(cpu, trampoline, data)) {
+            // park it so it can't wake up late in a trampoline that's gone
+            lapic_send_ipi(cpu->apic_id, ICR_INIT);
+            serial_printf("smp: CPU with APIC id %d didn't start\n", (int)cpu->apic_id);
+            kernel_free_phys_pages(stack, AP_STACK_PAGES);
+            continue;
+        }
+        count++;
+        // published after the CPU is online so smp_call_others only sees running CPUs
+        __atomic_store_n(&g_online_count, count, __ATOMIC_RELEASE);
+    }
+
+    kernel_free_phys_pages((void*)trampoline, 1);
+    serial_printf("smp: %d CPUs online\n", (int)count);
+}
@@ -0,0 +1,34 @@
+/*
+    Multiprocessor startup
+
+    The application processors listed in the MADT are started with INIT-SIPI-SIPI.
+    They run a real mode trampoline copied below 1 MiB which switches to long mode
+    on the kernel's page tables, then load the GDT, IDT and GS base, enable their
+    local APIC and timer and become the idle thread of their run queue.
+*/
+
+#pragma once
+
+#include "elos/kernel/common/types.h"
+#include "elos/kernel/common/cpu.h"
+
+/*
+    Sets up the per-CPU area of the bootstrap processor.
+    Must run before anything calls cpu_index(), right after boot services exit.
+*/
+void init_boot_cpu();
+
+/*
+    Starts the other CPUs. Call after init_acpi, init_apic and init_timers.
+*/
+void init_smp();
+
+// Number of CPUs that are running, they have index 0 to count-1
+u32 cpu_online_count();
+
+/*
+    Runs fn on all other online CPUs in interrupt context and waits until all of them returned.
+    Callers spinning for their own call run the calls of others meanwhile so two CPUs calling
+    at once can't deadlock. Targets must not spin on a lock the caller holds with interrupts off.
+*/
+void smp_call_others(void (*fn)(void* arg), void* arg);
@@ -0,0 +1,118 @@
+#include "elos/kernel/common/sync.h"
+#include "elos/kernel/common/smp.h"
+#include "elos/kernel/debug/debug.h"
+
+// Callbacks of a CPU are queued in the order they were retired, so in epoch order
+typedef struct RcuQueue {
+    RcuHead*  head;
+    RcuHead** tail;
+} __attribute__((aligned(64))) RcuQueue;
+
+volatile u64 g_rcu_epoch = 1; // 0 means "not in a read section"
+static RcuQueue g_rcu_queues[MAX_CPUS];
+
+// Returns false if some CPU is still reading in an older epoch
+static bool rcu_try_advance() {
+    u64 epoch = __atomic_load_n(&g_rcu_epoch, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    u32 online = cpu_online_count();
+    for (u32 i = 0; i < online; i++) {
+        u64 seen = __atomic_load_n(&g_cpus[i].rcu_epoch, __ATOMIC_ACQUIRE);
+        if (seen && seen != epoch)
+            return false;
+    }
+    // fails if another CPU advanced it first, just as good
+    __atomic_compare_exchange_n(&g_rcu_epoch, &epoch, epoch + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+    return true;
+}
+
+void synchronize_rcu() {
+    if (this_cpu()->rcu_nesting) {
+        serial_printf("sync: synchronize_rcu in a read section\n");
+        kernel_bug();
+        return;
+    }
+    // the caller's unlinking must be visible before we read the epoch
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    u64 target = __atomic_load_n(&g_rcu_epoch, __ATOMIC_ACQUIRE) + 2;
+    while (__atomic_load_n(&g_rcu_epoch, __ATOMIC_ACQUIRE) < target) {
+        if (!rcu_try_advance())
+            _mm_pause();
+    }
+}
+
+void call_rcu(RcuHead* head, void (*callback)(RcuHead* head)) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    head->next     = NULL;
+    head->callback = callback;
+    head->epoch    = __atomic_load_n(&g_rcu_epoch, __ATOMIC_ACQUIRE);
+
+    bool enabled = interrupts_save_disable();
+    RcuQueue* queue = &g_rcu_queues[cpu_index()];
+    if (!queue->head)
+        queue->tail = &queue->head;
+    *queue->tail = head;
+    queue->tail  = &head->next;
+    interrupts_restore(enabled);
+}
+
+void rcu_poll() {
+    bool enabled = interrupts_save_disable();
+    RcuQueue* queue = &g_rcu_queues[cpu_index()];
+    if (!queue->head) {
+        interrupts_restore(enabled);
+        return;
+    }
+    rcu_try_advance();
+    u64 epoch = __atomic_load_n(&g_rcu_epoch, __ATOMIC_ACQUIRE);
+
+    // detach the callbacks that are done and run them with interrupts on
+    RcuHead* done = NULL;
+    RcuHead** done_tail = &done;
+    while (queue->head && queue->head->epoch + 2 <= epoch) {
+        RcuHead* head = queue->head;
+        queue->head = head->next;
+        *done_tail = head;
+        done_tail = &head->next;
+    }
+    *done_tail = NULL;
+    interrupts_restore(enabled);
+
+    while (done) {
+        RcuHead* next = done->next;
+        done->callback(done);
+        done = next;
+    }
+}
+
+#ifdef ELOS_LOCK_STATS
+#define MAX_LISTED_LOCKS 256
+
+static LockStats* g_listed_locks[MAX_LISTED_LOCKS];
+static u32 g_listed_count;
+
+void lock_stats_contended(LockStats* stats, u64 wait_cycles) {
+    // the caller holds the lock, only the list needs to be atomic
+    stats->contended++;
+    stats->wait_cycles += wait_cycles;
+    if (!stats->listed) {
+        stats->listed = true;
+        u32 index = __atomic_fetch_add(&g_listed_count, 1, __ATOMIC_RELAXED);
+        if (index < MAX_LISTED_LOCKS)
+            __atomic_store_n(&g_listed_locks[index], stats, __ATOMIC_RELEASE);
+    }
+}
+
+void lock_stats_print() {
+    u32 count = __atomic_load_n(&g_listed_count, __ATOMIC_ACQUIRE);
+    if (count > MAX_LISTED_LOCKS)
+        count = MAX_LISTED_LOCKS;
+    for (u32 i = 0; i < count; i++) {
+        LockStats* stats = __atomic_load_n(&g_listed_locks[i], __ATOMIC_ACQUIRE);
+        if (!stats)
+            continue;
+        serial_printf("lock: %s acquired %d, contended %d, waited %d us\n", stats->name ? stats->name : "(unnamed)",
+            (int)stats->acquired, (int)stats->contended, (int)(tsc_to_ns(stats->wait_cycles) / 1000));
+    }
+}
+#endif
@@ -0,0 +1,337 @@
+/*
+    Synchronization primitives
+
+    All locks disable preemption while held. The _irqsave variants also disable
+    interrupts, use them for data that interrupt handlers touch too.
+
+    - Spinlock: test and test-and-set, cheapest when uncontended.
+    - TicketLock: FIFO fair, for locks many CPUs queue on.
+    - McsLock: FIFO fair and every waiter spins on its own node so a hot lock
+      doesn't bounce one cache line between all the waiters.
+    - SeqLock/SeqCount: readers retry instead of locking, for read-mostly data.
+    - RCU: readers run without any writes to shared memory, writers free old
+      versions after every CPU left the read sections that could have seen them.
+
+    Build with ELOS_LOCK_STATS to count acquisitions and contention per lock,
+    lock_stats_print lists the locks that ever had to wait.
+*/
+
+#pragma once
+
+#include "elos/kernel/common/types.h"
+#include "elos/kernel/common/cpu.h"
+#include "elos/kernel/interrupt/interrupt.h"
+
+#include <immintrin.h>
+
+#ifdef ELOS_LOCK_STATS
+typedef struct LockStats {
+    const char* name;
+    u64 acquired;
+    u64 contended;   // acquisitions that had to wait
+    u64 wait_cycles; // TSC cycles spent waiting
+    bool listed;
+} LockStats;
+
+// Called by the locks with the lock held after waiting for it
+void lock_stats_contended(LockStats* stats, u64 wait_cycles);
+void lock_stats_print();
+
+// Static initializer that names the lock in the stats, works for every lock type
+#define LOCK_INIT(lock_name) { .stats = { .name = (lock_name) } }
+#else
+#define LOCK_INIT(lock_name) { 0 }
+#endif
+
+/*
+    Test and test-and-set spinlock. Zero initialized is unlocked.
+*/
+typedef struct Spinlock {
+    volatile u32 locked;
+#ifdef ELOS_LOCK_STATS
+    LockStats stats;
+#endif
+} Spinlock;
+
+static inline void spin_lock(Spinlock* lock) {
+    preempt_disable();
+    if (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE) == 0) {
+#ifdef ELOS_LOCK_STATS
+        lock->stats.acquired++;
+#endif
+        return;
+    }
+#ifdef ELOS_LOCK_STATS
+    u64 start = __rdtsc();
+#endif
+    do {
+        // wait without hammering the cache line
+        while (__atomic_load_n(&lock->locked, __ATOMIC_RELAXED))
+            _mm_pause();
+    } while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE));
+#ifdef ELOS_LOCK_STATS
+    lock->stats.acquired++;
+    lock_stats_contended(&lock->stats, __rdtsc() - start);
+#endif
+}
+
+static inline bool spin_trylock(Spinlock* lock) {
+    preempt_disable();
+    if (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE) == 0) {
+#ifdef ELOS_LOCK_STATS
+        lock->stats.acquired++;
+#endif
+        return true;
+    }
+    preempt_enable();
+    return false;
+}
+
+static inline void spin_unlock(Spinlock* lock) {
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+    preempt_enable();
+}
+
+// Returns whether interrupts were enabled, pass it to spin_unlock_irqrestore
+static inline bool spin_lock_irqsave(Spinlock* lock) {
+    bool enabled = interrupts_save_disable();
+    spin_lock(lock);
+    return enabled;
+}
+
+static inline void spin_unlock_irqrestore(Spinlock* lock, bool enabled) {
+    spin_unlock(lock);
+    interrupts_restore(enabled);
+}
+
+/*
+    Ticket lock, CPUs get the lock in the order they asked for it.
+    Zero initialized is unlocked.
+*/
+typedef struct TicketLock {
+    union {
+        volatile u32 value;
+        struct {
+            volatile u16 owner; // ticket being served
+            volatile u16 next;  // next ticket to hand out
+        };
+    };
+#ifdef ELOS_LOCK_STATS
+    LockStats stats;
+#endif
+} TicketLock;
+
+static inline void ticket_lock(TicketLock* lock) {
+    preempt_disable();
+    u32 old = __atomic_fetch_add(&lock->value, 1 << 16, __ATOMIC_ACQUIRE);
+    u16 ticket = old >> 16;
+    if ((u16)old != ticket) {
+#ifdef ELOS_LOCK_STATS
+        u64 start = __rdtsc();
+#endif
+        while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket)
+            _mm_pause();
+#ifdef ELOS_LOCK_STATS
+        lock_stats_contended(&lock->stats, __rdtsc() - start);
+#endif
+    }
+#ifdef ELOS_LOCK_STATS
+    lock->stats.acquired++;
+#endif
+}
+
+static inline bool ticket_trylock(TicketLock* lock) {
+    preempt_disable();
+    u32 old = __atomic_load_n(&lock->value, __ATOMIC_RELAXED);
+    if ((u16)old == (u16)(old >> 16) &&
+        __atomic_compare_exchange_n(&lock->value, &old, old + (1 << 16), false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+#ifdef ELOS_LOCK_STATS
+        lock->stats.acquired++;
+#endif
+        return true;
+    }
+    preempt_enable();
+    return false;
+}
+
+static inline void ticket_unlock(TicketLock* lock) {
+    // only the holder writes owner
+    __atomic_store_n(&lock->owner, (u16)(lock->owner + 1), __ATOMIC_RELEASE);
+    preempt_enable();
+}
+
+static inline bool ticket_lock_irqsave(TicketLock* lock) {
+    bool enabled = interrupts_save_disable();
+    ticket_lock(lock);
+    return enabled;
+}
+
+static inline void ticket_unlock_irqrestore(TicketLock* lock, bool enabled) {
+    ticket_unlock(lock);
+    interrupts_restore(enabled);
+}
+
+/*
+    MCS queue lock. Each CPU brings a node (usually on its stack) that must stay
+    alive until mcs_unlock with the same node. Zero initialized is unlocked.
+*/
+typedef struct McsNode {
+    struct McsNode* volatile next;
+    volatile bool locked;
+} McsNode;
+
+typedef struct McsLock {
+    McsNode* volatile tail;
+#ifdef ELOS_LOCK_STATS
+    LockStats stats;
+#endif
+} McsLock;
+
+static inline void mcs_lock(McsLock* lock, McsNode* node) {
+    preempt_disable();
+    node->next   = NULL;
+    node->locked = true;
+    McsNode* prev = __atomic_exchange_n(&lock->tail, node, __ATOMIC_ACQ_REL);
+    if (prev) {
+#ifdef ELOS_LOCK_STATS
+        u64 start = __rdtsc();
+#endif
+        __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+        while (__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE))
+            _mm_pause();
+#ifdef ELOS_LOCK_STATS
+        lock_stats_contended(&lock->stats, __rdtsc() - start);
+#endif
+    }
+#ifdef ELOS_LOCK_STATS
+    lock->stats.acquired++;
+#endif
+}
+
+static inline void mcs_unlock(McsLock* lock, McsNode* node) {
+    McsNode* next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+    if (!next) {
+        McsNode* expected = node;
+        if (__atomic_compare_exchange_n(&lock->tail, &expected, NULL, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            preempt_enable();
+            return;
+        }
+        // someone is between the exchange and linking to us
+        while (!(next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)))
+            _mm_pause();
+    }
+    __atomic_store_n(&next->locked, false, __ATOMIC_RELEASE);
+    preempt_enable();
+}
+
+/*
+    Sequence counter for data with a single writer (or writers serialized some
+    other way). Readers copy the data and retry if a write happened meanwhile:
+        u32 seq;
+        do {
+            seq = read_seqcount_begin(&counter);
+            copy = data;
+        } while (read_seqcount_retry(&counter, seq));
+*/
+typedef struct SeqCount {
+    volatile u32 sequence; // odd while a write is in progress
+} SeqCount;
+
+static inline u32 read_seqcount_begin(SeqCount* counter) {
+    u32 seq;
+    while ((seq = __atomic_load_n(&counter->sequence, __ATOMIC_ACQUIRE)) & 1)
+        _mm_pause();
+    return seq;
+}
+
+static inline bool read_seqcount_retry(SeqCount* counter, u32 seq) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&counter->sequence, __ATOMIC_RELAXED) != seq;
+}
+
+static inline void write_seqcount_begin(SeqCount* counter) {
+    __atomic_store_n(&counter->sequence, counter->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void write_seqcount_end(SeqCount* counter) {
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&counter->sequence, counter->sequence + 1, __ATOMIC_RELAXED);
+}
+
+// SeqCount with a lock between writers
+typedef struct SeqLock {
+    SeqCount count;
+    Spinlock lock;
+} SeqLock;
+
+static inline u32 read_seqbegin(SeqLock* seqlock) {
+    return read_seqcount_begin(&seqlock->count);
+}
+
+static inline bool read_seqretry(SeqLock* seqlock, u32 seq) {
+    return read_seqcount_retry(&seqlock->count, seq);
+}
+
+// Disables interrupts, a reader interrupting the writer on the same CPU would spin forever
+static inline bool write_seqlock_irqsave(SeqLock* seqlock) {
+    bool enabled = spin_lock_irqsave(&seqlock->lock);
+    write_seqcount_begin(&seqlock->count);
+    return enabled;
+}
+
+static inline void write_sequnlock_irqrestore(SeqLock* seqlock, bool enabled) {
+    write_seqcount_end(&seqlock->count);
+    spin_unlock_irqrestore(&seqlock->lock, enabled);
+}
+
+/*
+    Epoch-based RCU
+
+    A read section records the global epoch in the CPU's Cpu entry and disables
+    preemption. The epoch only moves forward once every CPU inside a read section
+    has seen the current one, so memory retired in epoch E is unreachable by any
+    reader once the epoch is E + 2.
+
+    Read sections nest and must not block. Writers publish with rcu_assign_pointer
+    and free the old version with synchronize_rcu or call_rcu.
+*/
+typedef struct RcuHead {
+    struct RcuHead* next;
+    void (*callback)(struct RcuHead* head);
+    u64 epoch;
+} RcuHead;
+
+extern volatile u64 g_rcu_epoch;
+
+static inline void rcu_read_lock() {
+    preempt_disable();
+    Cpu* cpu = this_cpu();
+    if (cpu->rcu_nesting++ == 0) {
+        __atomic_store_n(&cpu->rcu_epoch, __atomic_load_n(&g_rcu_epoch, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+        // the epoch must be visible before we read anything it protects
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+}
+
+static inline void rcu_read_unlock() {
+    Cpu* cpu = this_cpu();
+    if (--cpu->rcu_nesting == 0)
+        __atomic_store_n(&cpu->rcu_epoch, 0, __ATOMIC_RELEASE);
+    preempt_enable();
+}
+
+#define rcu_dereference(pointer)         __atomic_load_n(&(pointer), __ATOMIC_CONSUME)
+#define rcu_assign_pointer(pointer, value) __atomic_store_n(&(pointer), (value), __ATOMIC_RELEASE)
+
+// Waits until all read sections that started before the call have ended. Not in a read section.
+void synchronize_rcu();
+
+/*
+    Calls callback once all current read sections have ended, without waiting.
+    Callbacks run on the same CPU from rcu_poll which the idle loop calls.
+*/
+void call_rcu(RcuHead* head, void (*callback)(RcuHead* head));
+
+// Moves the epoch forward if it can and runs this CPU's callbacks whose grace period is over
+void rcu_poll();
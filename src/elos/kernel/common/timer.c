@@ -0,0 +1,361 @@
+/*
+    Timer wheel
+
+    WHEEL_LEVELS levels of 64 slots. A timer goes into the level whose slot width fits
+    the time left: level 0 slots are one tick, level 1 slots 64 ticks and so on.
+    When level 0 wraps around, the next slot of level 1 is cascaded, its timers are
+    put back in with the time left which lands them in level 0. Same for the levels above.
+
+    Every level has a bitmap of non-empty slots so the next tick where something
+    happens (a level 0 slot to expire or a slot to cascade) is found without
+    walking empty slots. The wheel jumps straight to that tick and the APIC timer
+    is only programmed for it, idle CPUs get no interrupts at all.
+
+    now_tick is the next tick to process. The lock protects the wheel, a timer
+    belongs to the wheel of the CPU it was started on.
+*/
+
+#include "elos/kernel/common/timer.h"
+#include "elos/kernel/common/clock.h"
+#include "elos/kernel/common/cpu.h"
+#include "elos/kernel/common/intrinsics.h"
+#include "elos/kernel/common/sync.h"
+#include "elos/kernel/interrupt/interrupt.h"
+#include "elos/kernel/interrupt/apic.h"
+#include "elos/kernel/debug/debug.h"
+
+#include <cpuid.h>
+
+#define WHEEL_BITS   6
+#define WHEEL_SLOTS  (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 6 // 2^36 ticks, about 78 hours
+#define WHEEL_RANGE  (1ULL << (WHEEL_BITS * WHEEL_LEVELS))
+
+#define NO_EVENT     (~0ULL)
+
+// Callbacks are copied out and run without the lock, this many per round
+#define EXPIRE_BATCH 32
+
+#define MSR_TSC_DEADLINE        0x6E0
+#define LVT_TIMER_ONE_SHOT      0x00000
+#define LVT_TIMER_TSC_DEADLINE  0x40000
+#define CPUID_1_ECX_TSC_DEADLINE (1 << 24)
+
+typedef struct TimerWheel {
+    Spinlock lock;
+    u64 now_tick;
+    u64 programmed_tick; // NO_EVENT when the APIC timer is stopped
+    u32 count;
+    u64 bitmap[WHEEL_LEVELS];
+    Timer* slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    TimerStats stats;
+} TimerWheel;
+
+typedef struct ExpiredTimer {
+    Timer* timer;
+    TimerCallback callback;
+    void* arg;
+    u64 expires_ns;
+} ExpiredTimer;
+
+static TimerWheel g_wheels[MAX_CPUS];
+
+static bool g_tsc_deadline;
+static u64  g_lapic_timer_hz; // one-shot mode only
+
+static inline u64 ns_to_tick_ceil(u64 ns) {
+    return (ns + TIMER_RESOLUTION_NS - 1) >> TIMER_RESOLUTION_SHIFT;
+}
+
+static void wheel_insert(TimerWheel* wheel, Timer* timer) {
+    u64 expires = timer->expires;
+    if (expires < wheel->now_tick)
+        expires = wheel->now_tick;
+    u64 delta = expires - wheel->now_tick;
+    if (delta >= WHEEL_RANGE) {
+        // cascades down once we get closer
+        delta = WHEEL_RANGE - 1;
+        expires = wheel->now_tick + delta;
+    }
+
+    int level = 0;
+    while (delta >= (1ULL << (WHEEL_BITS * (level + 1))))
+        level++;
+    int index = (expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+
+    Timer** head = &wheel->slots[level][index];
+    timer->next = *head;
+    if (*head)
+        (*head)->pprev = &timer->next;
+    *head = timer;
+    timer->pprev = head;
+    timer->slot = level * WHEEL_SLOTS + index;
+    wheel->bitmap[level] |= 1ULL << index;
+    wheel->count++;
+}
+
+static void wheel_remove(TimerWheel* wheel, Timer* timer) {
+    *timer->pprev = timer->next;
+    if (timer->next)
+        timer->next->pprev = timer->pprev;
+    int level = timer->slot / WHEEL_SLOTS;
+    int index = timer->slot % WHEEL_SLOTS;
+    if (!wheel->slots[level][index])
+        wheel->bitmap[level] &= ~(1ULL << index);
+    timer->next = NULL;
+    timer->pprev = NULL;
+    wheel->count--;
+}
+
+static void cascade(TimerWheel* wheel, int level, int index) {
+    Timer* timer = wheel->slots[level][index];
+    wheel->slots[level][index] = NULL;
+    wheel->bitmap[level] &= ~(1ULL << index);
+    while (timer) {
+        Timer* next = timer->next;
+        wheel->count--;
+        wheel_insert(wheel, timer);
+        timer = next;
+    }
+}
+
+// First tick at or after now_tick where a slot expires or cascades
+static u64 next_event_tick(TimerWheel* wheel) {
+    u64 best = NO_EVENT;
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        u64 bitmap = wheel->bitmap[level];
+        if (!bitmap)
+            continue;
+        int shift = WHEEL_BITS * level;
+        u64 base = wheel->now_tick >> shift;
+        // rotate so bit 0 is the current slot, the lowest set bit is the nearest slot
+        int current = base & WHEEL_MASK;
+        u64 rotated = (bitmap >> current) | (current ? bitmap << (WHEEL_SLOTS - current) : 0);
+        u64 distance = __builtin_ctzll(rotated);
+        if (distance == 0 && (base << shift) < wheel->now_tick) {
+            // the current slot cascaded already, what's in it now is for the next round
+            rotated &= ~1ULL;
+            distance = rotated ? __builtin_ctzll(rotated) : WHEEL_SLOTS;
+        }
+        u64 tick = (base + distance) << shift;
+        if (tick < best)
+            best = tick;
+    }
+    return best;
+}
+
+static void program_timer(TimerWheel* wheel) {
+    u64 tick = wheel->count ? next_event_tick(wheel) : NO_EVENT;
+    wheel->programmed_tick = tick;
+
+    if (g_tsc_deadline) {
+        // 0 disarms, a deadline in the past fires right away
+        u64 deadline = tick == NO_EVENT ? 0 : g_clock.boot_tsc + ns_to_tsc(tick << TIMER_RESOLUTION_SHIFT);
+        write_msr(MSR_TSC_DEADLINE, deadline);
+        return;
+    }
+
+    if (tick == NO_EVENT) {
+        lapic_write(LAPIC_TIMER_INITIAL, 0);
+        return;
+    }
+    u64 target = tick << TIMER_RESOLUTION_SHIFT;
+    u64 now = now_ns();
+    u64 delta = target > now ? target - now : 0;
+    u64 count = (u64)(((unsigned __int128)delta * g_lapic_timer_hz) / NS_PER_SECOND) + 1;
+    // longer waits take an early interrupt and program the rest
+    if (count > 0xFFFFFFFF)
+        count = 0xFFFFFFFF;
+    lapic_write(LAPIC_TIMER_INITIAL, (u32)count);
+}
+
+// Moves the wheel up to now and copies out what expired, returns how many
+static int collect_expired(TimerWheel* wheel, u64 target_tick, ExpiredTimer* batch) {
+    int count = 0;
+    while (wheel->count) {
+        u64 tick = next_event_tick(wheel);
+        if (tick > target_tick)
+            break;
+        wheel->now_tick = tick;
+
+        for (int level = 1; level < WHEEL_LEVELS; level++) {
+            int shift = WHEEL_BITS * level;
+            if (tick & ((1ULL << shift) - 1))
+                break;
+            cascade(wheel, level, (tick >> shift) & WHEEL_MASK);
+        }
+
+        Timer** head = &wheel->slots[0][tick & WHEEL_MASK];
+        while (*head && count < EXPIRE_BATCH) {
+            Timer* timer = *head;
+            wheel_remove(wheel, timer);
+            batch[count].timer      = timer;
+            batch[count].callback   = timer->callback;
+            batch[count].arg        = timer->arg;
+            batch[count].expires_ns = timer->expires_ns;
+            count++;
+
+            if (timer->period_ns) {
+                u64 now = target_tick << TIMER_RESOLUTION_SHIFT;
+                u64 next = timer->expires_ns + timer->period_ns;
+                if (next <= now)
+                    next += ((now - next) / timer->period_ns + 1) * timer->period_ns;
+                timer->expires_ns = next;
+                timer->expires = ns_to_tick_ceil(next);
+                wheel_insert(wheel, timer);
+            }
+        }
+        if (*head)
+            return count; // batch is full, the slot is finished next round
+
+        wheel->now_tick = tick + 1;
+    }
+    if (wheel->now_tick <= target_tick)
+        wheel->now_tick = target_tick + 1;
+    return count;
+}
+
+static void run_timers(TimerWheel* wheel) {
+    ExpiredTimer batch[EXPIRE_BATCH];
+    bool any = false;
+
+    spin_lock(&wheel->lock);
+    wheel->stats.interrupts++;
+    while (1) {
+        u64 now = now_ns();
+        int count = collect_expired(wheel, now >> TIMER_RESOLUTION_SHIFT, batch);
+        if (count == 0)
+            break;
+        any = true;
+        wheel->stats.fired += count;
+        spin_unlock(&wheel->lock);
+
+        for (int i = 0; i < count; i++) {
+            u64 late = now_ns() - batch[i].expires_ns;
+            if ((s64)late > 0 && late > wheel->stats.max_late_ns)
+                wheel->stats.max_late_ns = late;
+            batch[i].callback(batch[i].timer, batch[i].arg);
+        }
+
+        spin_lock(&wheel->lock);
+    }
+    if (!any)
+        wheel->stats.empty_interrupts++;
+    program_timer(wheel);
+    spin_unlock(&wheel->lock);
+}
+
+static void timer_interrupt(InterruptFrame* frame) {
+    run_timers(&g_wheels[cpu_index()]);
+}
+
+// LAPIC timer ticks per second, measured against the TSC
+static u64 calibrate_lapic_timer() {
+    lapic_write(LAPIC_TIMER_DIVIDE, 0xB); // divide by 1
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_TIMER_INITIAL, 0xFFFFFFFF);
+    u64 start = now_ns();
+    sleep_ns(1000000);
+    u32 remaining = lapic_read(LAPIC_TIMER_CURRENT);
+    u64 elapsed = now_ns() - start;
+    lapic_write(LAPIC_TIMER_INITIAL, 0);
+    return (u64)(0xFFFFFFFF - remaining) * NS_PER_SECOND / elapsed;
+}
+
+void init_timers() {
+    u32 eax, ebx, ecx, edx;
+    __get_cpuid(1, &eax, &ebx, &ecx, &edx);
+
+    TimerWheel* wheel = &g_wheels[cpu_index()];
+    wheel->now_tick = now_ns() >> TIMER_RESOLUTION_SHIFT;
+    wheel->programmed_tick = NO_EVENT;
+
+    interrupt_set_handler(VECTOR_TIMER, timer_interrupt);
+
+    g_tsc_deadline = (ecx & CPUID_1_ECX_TSC_DEADLINE) != 0;
+    if (g_tsc_deadline) {
+        lapic_write(LAPIC_LVT_TIMER, LVT_TIMER_TSC_DEADLINE | VECTOR_TIMER);
+        serial_printf("timer: TSC-deadline mode\n");
+    } else {
+        if (!g_lapic_timer_hz)
+            g_lapic_timer_hz = calibrate_lapic_timer();
+        lapic_write(LAPIC_LVT_TIMER, LVT_TIMER_ONE_SHOT | VECTOR_TIMER);
+        serial_printf("timer: One-shot mode, %d kHz\n", (int)(g_lapic_timer_hz / 1000));
+    }
+}
+
+void timer_init(Timer* timer, TimerCallback callback, void* arg) {
+    timer->next       = NULL;
+    timer->pprev      = NULL;
+    timer->expires    = 0;
+    timer->expires_ns = 0;
+    timer->period_ns  = 0;
+    timer->callback   = callback;
+    timer->arg        = arg;
+    timer->cpu        = 0;
+    timer->slot       = 0;
+}
+
+void timer_start(Timer* timer, u64 expires_ns, u64 period_ns) {
+    bool enabled = interrupts_save_disable();
+    timer_cancel(timer);
+
+    TimerWheel* wheel = &g_wheels[cpu_index()];
+    spin_lock(&wheel->lock);
+
+    // An empty wheel may not have moved in a long time
+    if (wheel->count == 0) {
+        u64 now_tick = now_ns() >> TIMER_RESOLUTION_SHIFT;
+        if (now_tick > wheel->now_tick)
+            wheel->now_tick = now_tick;
+    }
+
+    timer->expires_ns = expires_ns;
+    timer->period_ns  = period_ns;
+    timer->expires    = ns_to_tick_ceil(expires_ns);
+    timer->cpu        = cpu_index();
+    wheel_insert(wheel, timer);
+
+    // Only reprogram when the new timer comes first
+    if (wheel->programmed_tick == NO_EVENT || timer->expires < wheel->programmed_tick)
+        program_timer(wheel);
+
+    spin_unlock(&wheel->lock);
+    interrupts_restore(enabled);
+}
+
+bool timer_cancel(Timer* timer) {
+    bool enabled = interrupts_save_disable();
+    bool was_pending = false;
+    // The timer can move to another wheel while we wait for the lock, check again
+    while (timer->pprev) {
+        TimerWheel* wheel = &g_wheels[timer->cpu];
+        spin_lock(&wheel->lock);
+        if (timer->pprev && &g_wheels[timer->cpu] == wheel) {
+            // the APIC timer stays programmed, an interrupt with nothing to run is cheaper than reprogramming
+            wheel_remove(wheel, timer);
+            was_pending = true;
+        }
+        spin_unlock(&wheel->lock);
+        if (was_pending)
+            break;
+    }
+    interrupts_restore(enabled);
+    return was_pending;
+}
+
+void timer_get_stats(TimerStats* out_stats) {
+    out_stats->fired = 0;
+    out_stats->interrupts = 0;
+    out_stats->empty_interrupts = 0;
+    out_stats->max_late_ns = 0;
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        TimerStats* stats = &g_wheels[cpu].stats;
+        out_stats->fired            += stats->fired;
+        out_stats->interrupts       += stats->interrupts;
+        out_stats->empty_interrupts += stats->empty_interrupts;
+        if (stats->max_late_ns > out_stats->max_late_ns)
+            out_stats->max_late_ns = stats->max_late_ns;
+    }
+}
@@ -0,0 +1,67 @@
+/*
+    One-shot and periodic timers
+
+    Each CPU has a hierarchical timer wheel and the local APIC timer is programmed
+    for the next slot that has something in it, there is no periodic tick. Starting
+    and cancelling a timer is O(1). A timer may fire up to TIMER_RESOLUTION_NS late
+    plus interrupt latency, never early.
+
+    Callbacks run in the timer interrupt with interrupts disabled. They may start
+    and cancel timers, including their own.
+*/
+
+#pragma once
+
+#include "elos/kernel/common/types.h"
+
+#define TIMER_RESOLUTION_SHIFT 12 // ns per wheel tick, about 4 us
+#define TIMER_RESOLUTION_NS    (1ULL << TIMER_RESOLUTION_SHIFT)
+
+typedef struct Timer Timer;
+typedef void (*TimerCallback)(Timer* timer, void* arg);
+
+// Zero initialize and set callback (or use timer_init), the rest is private
+struct Timer {
+    Timer*  next;
+    Timer** pprev;       // NULL when not pending
+    u64     expires;     // wheel tick
+    u64     expires_ns;
+    u64     period_ns;   // 0 for one-shot
+    TimerCallback callback;
+    void*   arg;
+    u16     cpu;
+    u16     slot;
+};
+
+typedef struct TimerStats {
+    u64 fired;
+    u64 interrupts;
+    u64 empty_interrupts; // interrupts that had nothing to run
+    u64 max_late_ns;      // worst delay from expires_ns to the callback
+} TimerStats;
+
+/*
+    Sets up the local APIC timer of this CPU, TSC-deadline mode when the CPU has it.
+    Call after init_apic and init_clock.
+*/
+void init_timers();
+
+void timer_init(Timer* timer, TimerCallback callback, void* arg);
+
+/*
+    Starts or restarts a timer on this CPU.
+    @param expires_ns  now_ns() time to fire at, times in the past fire right away
+    @param period_ns   fire every period after that, 0 for once. Missed periods are
+                       skipped, the period stays aligned to expires_ns.
+*/
+void timer_start(Timer* timer, u64 expires_ns, u64 period_ns);
+
+// Returns false if the timer wasn't pending. A callback may already be running on another CPU.
+bool timer_cancel(Timer* timer);
+
+static inline bool timer_pending(Timer* timer) {
+    return timer->pprev != NULL;
+}
+
+// Stats of all CPUs added together
+void timer_get_stats(TimerStats* out_stats);
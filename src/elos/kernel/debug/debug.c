@@ -2,11 +2,17 @@
 #include "elos/kernel/debug/debug.h"
 #include "elos/kernel/common/intrinsics.h"
 #include "elos/kernel/common/string.h"
+#include "elos/kernel/common/sync.h"
+
+#include <immintrin.h>
 
 static bool _serial_initialized;
+// Ticket lock so a CPU printing a lot can't starve the others, interrupt handlers print too
+static TicketLock _serial_lock = LOCK_INIT("serial");
 
 void serial_write(const cstring text) {
     const u16 COM1 = 0x3F8;
+    bool enabled = ticket_lock_irqsave(&_serial_lock);
     if(!_serial_initialized) {
         _serial_initialized = true;
         outb(COM1 + 1, 0x00); // Disable interrupts
@@ -23,9 +29,11 @@ void serial_write(const cstring text) {
             u8 status = inb(COM1 + 5);
             if ((status & 0x20) != 0)
                 break;
+            _mm_pause();
         }
         outb(COM1, text.ptr[i] & 0x7F);
     }
+    ticket_unlock_irqrestore(&_serial_lock, enabled);
 }
 
 void serial_printf(const char* format, ...) {
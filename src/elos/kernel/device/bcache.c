@@ -0,0 +1,421 @@
+/*
+    A buffer's identity, hash link, pin count and CLOCK bit are protected by
+    g_bcache_lock, its data and state by its own mutex. Threads pin a buffer before
+    taking its mutex and hold at most one buffer mutex at a time, except the
+    writeback which takes a batch in address order while the buffers are pinned.
+
+    Only unpinned buffers are evicted so nobody holds the mutex of one. A dirty
+    victim is written back first and the lookup starts over. If the write fails the
+    block stays dirty and gets a second chance like a recently used one, so the
+    next lookup picks another victim.
+*/
+
+#include "elos/kernel/device/bcache.h"
+#include "elos/kernel/device/block.h"
+#include "elos/kernel/log/print.h"
+#include "elos/kernel/common/clock.h"
+#include "elos/kernel/common/scheduler.h"
+#include "elos/kernel/common/string.h"
+#include "elos/kernel/common/sync.h"
+#include "elos/kernel/memory/paging.h"
+#include "elos/kernel/memory/phys_allocator.h"
+#include "elos/kernel/debug/debug.h"
+
+#define BCACHE_BUCKETS       2048
+#define BCACHE_SECTORS       (BCACHE_BLOCK_SIZE / 512)
+#define BCACHE_ALLOC_PAGES   64   // blocks are allocated in chunks, 4 MiB at once may not be free
+#define BCACHE_SYNC_BATCH    32
+#define BCACHE_EVICT_FAILURES 4   // failed writebacks of victims before a lookup gives up
+
+typedef struct BcacheBuffer {
+    // protected by g_bcache_lock
+    elos__DeviceID device; // 0 for a buffer that was never used
+    u64 block;
+    struct BcacheBuffer* hash_next;
+    u32 refs;
+    bool referenced;
+
+    Mutex io; // protects the fields below and the data
+    bool valid;
+    bool dirty;
+    u32 sectors; // the last block of a device can be short
+    u64 dirty_since_ns;
+    u8* data;
+} BcacheBuffer;
+
+static Spinlock g_bcache_lock = LOCK_INIT("bcache");
+static BcacheBuffer g_buffers[BCACHE_BLOCKS];
+static u32 g_buffer_count;
+static BcacheBuffer* g_buckets[BCACHE_BUCKETS];
+static u32 g_clock_hand;
+static BcacheStats g_stats;
+
+static u32 bcache_hash(elos__DeviceID device, u64 block) {
+    u64 key = block * 0x9E3779B97F4A7C15ULL ^ (u64)device * 0xC2B2AE3D27D4EB4FULL;
+    return (key >> 32) & (BCACHE_BUCKETS - 1);
+}
+
+// Lock held
+static BcacheBuffer* bcache_lookup(elos__DeviceID device, u64 block) {
+    for (BcacheBuffer* buffer = g_buckets[bcache_hash(device, block)]; buffer; buffer = buffer->hash_next) {
+        if (buffer->device == device && buffer->block == block)
+            return buffer;
+    }
+    return NULL;
+}
+
+// Lock held
+static void bcache_unhash(BcacheBuffer* buffer) {
+    BcacheBuffer** link = &g_buckets[bcache_hash(buffer->device, buffer->block)];
+    while (*link != buffer)
+        link = &(*link)->hash_next;
+    *link = buffer->hash_next;
+    buffer->hash_next = NULL;
+}
+
+static void bcache_put(BcacheBuffer* buffer) {
+    spin_lock(&g_bcache_lock);
+    buffer->refs--;
+    spin_unlock(&g_bcache_lock);
+}
+
+static bool bcache_io(BcacheBuffer* buffer, bool write) {
+    BlockRequest request = { 0 };
+    request.device  = buffer->device;
+    request.lba     = buffer->block * BCACHE_SECTORS;
+    request.sectors = buffer->sectors;
+    request.write   = write;
+    request.buffer  = buffer->data;
+    if (!block_submit(&request))
+        return false;
+    return block_wait(&request);
+}
+
+static void bcache_clean(BcacheBuffer* buffer) {
+    buffer->dirty = false;
+    __atomic_sub_fetch(&g_stats.dirty, 1, __ATOMIC_RELAXED);
+}
+
+// Mutex held. The buffer stays dirty if the write fails.
+static bool bcache_writeback(BcacheBuffer* buffer) {
+    if (!buffer->dirty)
+        return true;
+    if (!bcache_io(buffer, true))
+        return false;
+    __atomic_add_fetch(&g_stats.writebacks, 1, __ATOMIC_RELAXED);
+    bcache_clean(buffer);
+    return true;
+}
+
+// Returns the buffer pinned, its data is only valid if valid is set
+static BcacheBuffer* bcache_get(elos__DeviceID device, u64 block, u32 sectors) {
+    u32 failures = 0;
+    while (1) {
+        spin_lock(&g_bcache_lock);
+        BcacheBuffer* buffer = bcache_lookup(device, block);
+        if (buffer) {
+            buffer->refs++;
+            buffer->referenced = true;
+            g_stats.hits++;
+            spin_unlock(&g_bcache_lock);
+            return buffer;
+        }
+
+        BcacheBuffer* victim = NULL;
+        for (u32 i = 0; i < 2 * g_buffer_count; i++) {
+            BcacheBuffer* candidate = &g_buffers[g_clock_hand];
+            g_clock_hand = (g_clock_hand + 1) % g_buffer_count;
+            if (candidate->refs)
+                continue;
+            if (candidate->referenced) {
+                candidate->referenced = false;
+                continue;
+            }
+            victim = candidate;
+            break;
+        }
+        if (!victim) {
+            // every buffer is pinned
+            spin_unlock(&g_bcache_lock);
+            if (g_buffer_count == 0)
+                return NULL;
+            thread_yield();
+            continue;
+        }
+        // nobody holds the mutex of an unpinned buffer
+        if (victim->dirty) {
+            victim->refs++;
+            spin_unlock(&g_bcache_lock);
+            mutex_lock(&victim->io);
+            bool written = bcache_writeback(victim);
+            mutex_unlock(&victim->io);
+
+            spin_lock(&g_bcache_lock);
+            victim->refs--;
+            if (!written)
+                victim->referenced = true;
+            spin_unlock(&g_bcache_lock);
+            if (!written && ++failures == BCACHE_EVICT_FAILURES) {
+                printf("bcache: Can't write back blocks to make room\n");
+                return NULL;
+            }
+            continue;
+        }
+        if (victim->device) {
+            bcache_unhash(victim);
+            g_stats.evictions++;
+        }
+        victim->device     = device;
+        victim->block      = block;
+        victim->refs       = 1;
+        victim->referenced = true;
+        victim->valid      = false;
+        victim->sectors    = sectors;
+        u32 bucket = bcache_hash(device, block);
+        victim->hash_next = g_buckets[bucket];
+        g_buckets[bucket] = victim;
+        g_stats.misses++;
+        spin_unlock(&g_bcache_lock);
+        return victim;
+    }
+}
+
+// Pins the buffer if the block is cached
+static BcacheBuffer* bcache_find(elos__DeviceID device, u64 block) {
+    spin_lock(&g_bcache_lock);
+    BcacheBuffer* buffer = bcache_lookup(device, block);
+    if (buffer)
+        buffer->refs++;
+    spin_unlock(&g_bcache_lock);
+    return buffer;
+}
+
+// Copies between the buffer and the valid cached blocks it overlaps, into the cache for writes, out of it for reads
+static void bcache_overlay(elos__DeviceID device, u64 offset, u64 size, u8* buffer, bool write) {
+    for (u64 block = offset / BCACHE_BLOCK_SIZE; block * BCACHE_BLOCK_SIZE < offset + size; block++) {
+        BcacheBuffer* cached = bcache_find(device, block);
+        if (!cached)
+            continue;
+        u64 start = block * BCACHE_BLOCK_SIZE;
+        u64 end = start + BCACHE_BLOCK_SIZE;
+        if (start < offset)
+            start = offset;
+        if (end > offset + size)
+            end = offset + size;
+        u8* data = cached->data + start % BCACHE_BLOCK_SIZE;
+        mutex_lock(&cached->io);
+        if (cached->valid) {
+            if (write)
+                memcpy(data, buffer + (start - offset), end - start);
+            else
+                memcpy(buffer + (start - offset), data, end - start);
+        }
+        mutex_unlock(&cached->io);
+        bcache_put(cached);
+    }
+}
+
+/*
+    Transfers of at least BCACHE_BYPASS_BYTES, sector aligned on the disk and in
+    memory. Writes update the cached blocks they overlap before going to the disk,
+    so a writeback of one of those carries the new data too, and again afterwards
+    for blocks that were read in the meantime. Reads take every valid cached block
+    over what the disk returned. A clean block isn't always what the disk returned:
+    a write to it may have been cached and written back while the read was in flight.
+*/
+static bool bcache_bypass(elos__DeviceID device, u64 offset, u64 size, u8* buffer, bool write) {
+    __atomic_add_fetch(&g_stats.bypassed, 1, __ATOMIC_RELAXED);
+    if (write) {
+        bcache_overlay(device, offset, size, buffer, true);
+        if (!block_transfer(device, offset / 512, size / 512, buffer, true))
+            return false;
+        bcache_overlay(device, offset, size, buffer, true);
+        return true;
+    }
+    if (!block_transfer(device, offset / 512, size / 512, buffer, false))
+        return false;
+    bcache_overlay(device, offset, size, buffer, false);
+    return true;
+}
+
+static bool bcache_transfer(elos__DeviceID device, u64 offset, u64 size, u8* buffer, bool write) {
+    u64 device_sectors = block_device_sectors(device);
+    if (!device_sectors || !buffer || size == 0)
+        return false;
+    if (offset + size < offset || offset + size > device_sectors * 512)
+        return false;
+    // the drivers take only aligned buffers for DMA, the cache copies anything else
+    if (size >= BCACHE_BYPASS_BYTES && offset % 512 == 0 && size % 512 == 0 && (u64)buffer % 512 == 0)
+        return bcache_bypass(device, offset, size, buffer, write);
+
+    while (size > 0) {
+        u64 block = offset / BCACHE_BLOCK_SIZE;
+        u32 in_block = offset % BCACHE_BLOCK_SIZE;
+        u32 len = BCACHE_BLOCK_SIZE - in_block;
+        if (len > size)
+            len = size;
+        u64 sectors = device_sectors - block * BCACHE_SECTORS;
+        if (sectors > BCACHE_SECTORS)
+            sectors = BCACHE_SECTORS;
+
+        BcacheBuffer* cached = bcache_get(device, block, sectors);
+        if (!cached)
+            return false;
+        mutex_lock(&cached->io);
+        // a write of the whole block doesn't need what's on the disk
+        bool whole = in_block == 0 && len == sectors * 512;
+        if (!cached->valid && !(write && whole))
+            cached->valid = bcache_io(cached, false);
+        bool ok = cached->valid || (write && whole);
+        if (ok) {
+            if (write) {
+                memcpy(cached->data + in_block, buffer, len);
+                cached->valid = true;
+                if (!cached->dirty) {
+                    cached->dirty = true;
+                    cached->dirty_since_ns = now_ns();
+                    __atomic_add_fetch(&g_stats.dirty, 1, __ATOMIC_RELAXED);
+                }
+            } else {
+                memcpy(buffer, cached->data + in_block, len);
+            }
+        }
+        mutex_unlock(&cached->io);
+        bcache_put(cached);
+        if (!ok)
+            return false;
+
+        buffer += len;
+        offset += len;
+        size -= len;
+    }
+    return true;
+}
+
+bool bcache_read(elos__DeviceID device, u64 offset, u64 size, void* buffer) {
+    return bcache_transfer(device, offset, size, buffer, false);
+}
+
+bool bcache_write(elos__DeviceID device, u64 offset, u64 size, const void* buffer) {
+    return bcache_transfer(device, offset, size, (u8*)buffer, true);
+}
+
+static bool buffer_before(BcacheBuffer* a, BcacheBuffer* b) {
+    return a->device < b->device || (a->device == b->device && a->block < b->block);
+}
+
+/*
+    Writes the dirty blocks of a device (0 for all) that were dirty at older_than_ns,
+    a batch at a time through one plug so blocks next to each other in memory
+    become one command.
+*/
+static bool bcache_writeback_dirty(elos__DeviceID device, u64 older_than_ns) {
+    bool ok = true;
+    u32 next = 0;
+    while (next < g_buffer_count) {
+        BcacheBuffer* batch[BCACHE_SYNC_BATCH];
+        u32 count = 0;
+        spin_lock(&g_bcache_lock);
+        for (; next < g_buffer_count && count < BCACHE_SYNC_BATCH; next++) {
+            BcacheBuffer* buffer = &g_buffers[next];
+            // a hint, checked again with the mutex
+            if (!__atomic_load_n(&buffer->dirty, __ATOMIC_RELAXED))
+                continue;
+            if (device && buffer->device != device)
+                continue;
+            buffer->refs++;
+            batch[count++] = buffer;
+        }
+        spin_unlock(&g_bcache_lock);
+        if (count == 0)
+            continue;
+
+        // disk order, and the mutexes are taken in the same order by everyone holding several
+        for (u32 i = 1; i < count; i++) {
+            BcacheBuffer* buffer = batch[i];
+            u32 j = i;
+            for (; j > 0 && buffer_before(buffer, batch[j - 1]); j--)
+                batch[j] = batch[j - 1];
+            batch[j] = buffer;
+        }
+
+        BlockRequest requests[BCACHE_SYNC_BATCH];
+        bool submitted[BCACHE_SYNC_BATCH];
+        BlockPlug plug;
+        block_plug_init(&plug);
+        for (u32 i = 0; i < count; i++) {
+            BcacheBuffer* buffer = batch[i];
+            mutex_lock(&buffer->io);
+            submitted[i] = false;
+            if (!buffer->dirty || buffer->dirty_since_ns > older_than_ns)
+                continue;
+            BlockRequest* request = &requests[i];
+            memset(request, 0, sizeof(BlockRequest));
+            request->device  = buffer->device;
+            request->lba     = buffer->block * BCACHE_SECTORS;
+            request->sectors = buffer->sectors;
+            request->write   = true;
+            request->buffer  = buffer->data;
+            submitted[i] = block_plug_submit(&plug, request);
+            if (!submitted[i])
+                ok = false;
+        }
+        block_unplug(&plug);
+
+        for (u32 i = 0; i < count; i++) {
+            BcacheBuffer* buffer = batch[i];
+            if (submitted[i]) {
+                if (block_wait(&requests[i])) {
+                    bcache_clean(buffer);
+                    __atomic_add_fetch(&g_stats.writebacks, 1, __ATOMIC_RELAXED);
+                } else {
+                    // stays dirty and is tried again
+                    ok = false;
+                }
+            }
+            mutex_unlock(&buffer->io);
+            bcache_put(buffer);
+        }
+    }
+    return ok;
+}
+
+bool bcache_sync(elos__DeviceID device) {
+    bool ok = bcache_writeback_dirty(device, (u64)-1);
+    if (device)
+        return block_flush(device) && ok;
+    for (elos__DeviceID id = 1; id <= DEVICE_MAX_DEVICES; id++) {
+        if (block_device_sectors(id) && !block_flush(id))
+            ok = false;
+    }
+    return ok;
+}
+
+static void bcache_writeback_thread(void* arg) {
+    while (1) {
+        thread_sleep_ns(BCACHE_WRITEBACK_NS / 2);
+        if (__atomic_load_n(&g_stats.dirty, __ATOMIC_RELAXED))
+            bcache_writeback_dirty(0, now_ns() - BCACHE_WRITEBACK_NS);
+    }
+}
+
+void init_bcache() {
+    for (u32 i = 0; i < BCACHE_BLOCKS; i += BCACHE_ALLOC_PAGES) {
+        void* pages = kernel_alloc_phys(BCACHE_ALLOC_PAGES, 0);
+        if (!pages)
+            break;
+        u8* data = phys_to_virt((u64)pages);
+        for (u32 j = 0; j < BCACHE_ALLOC_PAGES; j++)
+            g_buffers[i + j].data = data + j * BCACHE_BLOCK_SIZE;
+        g_buffer_count = i + BCACHE_ALLOC_PAGES;
+    }
+    if (!thread_create("bcache writeback", bcache_writeback_thread, NULL))
+        printf("bcache: No writeback thread, dirty blocks are only written by bcache_sync\n");
+    serial_printf("bcache: %d KiB\n", (int)(g_buffer_count * BCACHE_BLOCK_SIZE / 1024));
+}
+
+void bcache_get_stats(BcacheStats* out_stats) {
+    spin_lock(&g_bcache_lock);
+    *out_stats = g_stats;
+    spin_unlock(&g_bcache_lock);
+}
@@ -0,0 +1,47 @@
+/*
+    Buffer cache
+
+    Keeps recently used 4 KiB blocks of storage devices in memory, looked up by
+    device and block number in a hash table. elos__read_bytes and elos__write_bytes
+    go through it so small or unaligned accesses copy from and to memory instead of
+    reading whole sectors every time.
+
+    Writes only mark blocks dirty. A writeback thread writes dirty blocks that have
+    been dirty for BCACHE_WRITEBACK_NS, so repeated writes to a block reach the disk
+    once. Blocks to evict are picked with CLOCK, recently used ones get a second chance.
+
+    Large transfers aligned to sectors, both on the disk and in memory, skip the cache
+    and go to the block layer directly, the cached blocks they overlap are kept
+    consistent with them.
+*/
+
+#pragma once
+
+#include "elos/kernel/common/types.h"
+#include "elos/kernel/device/device.h"
+
+#define BCACHE_BLOCK_SIZE    4096
+#define BCACHE_BLOCKS        1024             // 4 MiB
+#define BCACHE_BYPASS_BYTES  (64 * 1024)      // sector aligned transfers this big skip the cache
+#define BCACHE_WRITEBACK_NS  1000000000ULL
+
+typedef struct BcacheStats {
+    u64 hits;
+    u64 misses;
+    u64 evictions;
+    u64 writebacks;  // blocks written to the disk
+    u64 bypassed;    // transfers that skipped the cache
+    u32 dirty;
+} BcacheStats;
+
+// Allocates the blocks and starts the writeback thread. Call after init_scheduler.
+void init_bcache();
+
+// Returns false if the device or range is invalid or the disk failed
+bool bcache_read(elos__DeviceID device, u64 offset, u64 size, void* buffer);
+bool bcache_write(elos__DeviceID device, u64 offset, u64 size, const void* buffer);
+
+// Writes every dirty block of the device (all devices for 0) and flushes the disks. Threads only.
+bool bcache_sync(elos__DeviceID device);
+
+void bcache_get_stats(BcacheStats* out_stats);
@@ -0,0 +1,343 @@
+/*
+    A command is a list of requests linked by merged_next, in disk order with their
+    buffers back to back, the first request stands for the whole command.
+
+    The dispatcher takes commands from the front of the queue while the device has
+    room and calls the driver's submit, completions dispatch the next ones. Devices
+    without submit have a thread that takes one command at a time and blocks in the
+    driver.
+
+    A driver's submit can fail because the queue of the CPU we are on is full even
+    though the device has room (NVMe and virtio have a queue per CPU), the command
+    then waits for the next completion. With nothing in flight the failure is the
+    request's fault and it fails.
+*/
+
+#include "elos/kernel/device/block.h"
+#include "elos/kernel/device/block_list.h"
+#include "elos/kernel/common/scheduler.h"
+#include "elos/kernel/common/sync.h"
+#include "elos/kernel/debug/debug.h"
+
+typedef struct BlockQueue {
+    Spinlock lock; // protects the fields below
+    BlockRequest* pending_head;
+    BlockRequest* pending_tail;
+    BlockStats stats;
+
+    bool ready;
+    const StorageDriver* driver;
+    u32 unit;
+    u64 sectors;
+    Thread* worker;
+} BlockQueue;
+
+static BlockQueue g_block_queues[DEVICE_MAX_DEVICES];
+
+static BlockQueue* block_queue(elos__DeviceID device) {
+    if (device == 0 || device > DEVICE_MAX_DEVICES)
+        return NULL;
+    BlockQueue* queue = &g_block_queues[device - 1];
+    if (!__atomic_load_n(&queue->ready, __ATOMIC_ACQUIRE))
+        return NULL;
+    return queue;
+}
+
+static void block_complete(BlockQueue* queue, BlockRequest* command, bool ok) {
+    BlockRequest* request = command;
+    while (request) {
+        // the request may be gone once it's done
+        BlockRequest* next = request->merged_next;
+        BlockCallback callback = request->callback;
+        Thread* waiter = request->waiter;
+        request->ok = ok;
+        __atomic_store_n(&request->done, true, __ATOMIC_RELEASE);
+        if (callback)
+            callback(request);
+        else
+            thread_wake(waiter);
+        request = next;
+    }
+}
+
+static void block_command_done(void* arg, bool ok);
+
+static void block_dispatch(BlockQueue* queue) {
+    if (queue->worker) {
+        thread_wake(queue->worker);
+        return;
+    }
+    bool retried = false;
+    while (1) {
+        bool enabled = spin_lock_irqsave(&queue->lock);
+        BlockRequest* command = queue->pending_head;
+        if (!command || queue->stats.in_flight >= queue->stats.queue_depth) {
+            spin_unlock_irqrestore(&queue->lock, enabled);
+            return;
+        }
+        queue->pending_head = command->next;
+        if (!queue->pending_head)
+            queue->pending_tail = NULL;
+        queue->stats.in_flight++;
+        if (queue->stats.in_flight > queue->stats.max_in_flight)
+            queue->stats.max_in_flight = queue->stats.in_flight;
+        queue->stats.commands++;
+        spin_unlock_irqrestore(&queue->lock, enabled);
+
+        if (queue->driver->submit(queue->unit, command->lba, command->command_sectors, command->buffer,
+                command->write, block_command_done, command))
+            continue;
+
+        enabled = spin_lock_irqsave(&queue->lock);
+        queue->stats.in_flight--;
+        queue->stats.commands--;
+        // a completion that raced with us may have freed the driver's queue, try once more
+        if (queue->stats.in_flight > 0 || !retried) {
+            command->next = queue->pending_head;
+            queue->pending_head = command;
+            if (!queue->pending_tail)
+                queue->pending_tail = command;
+            bool in_flight = queue->stats.in_flight > 0;
+            spin_unlock_irqrestore(&queue->lock, enabled);
+            if (in_flight)
+                return;
+            retried = true;
+            continue;
+        }
+        queue->stats.errors++;
+        spin_unlock_irqrestore(&queue->lock, enabled);
+        block_complete(queue, command, false);
+    }
+}
+
+static void block_command_done(void* arg, bool ok) {
+    BlockRequest* command = arg;
+    BlockQueue* queue = &g_block_queues[command->device - 1];
+    spin_lock(&queue->lock);
+    queue->stats.in_flight--;
+    if (!ok)
+        queue->stats.errors++;
+    spin_unlock(&queue->lock);
+
+    block_complete(queue, command, ok);
+    block_dispatch(queue);
+}
+
+// For drivers without submit
+static void block_worker(void* arg) {
+    BlockQueue* queue = arg;
+    while (1) {
+        thread_prepare_block();
+        bool enabled = spin_lock_irqsave(&queue->lock);
+        BlockRequest* command = queue->pending_head;
+        if (!command) {
+            spin_unlock_irqrestore(&queue->lock, enabled);
+            thread_block();
+            thread_cancel_block();
+            continue;
+        }
+        queue->pending_head = command->next;
+        if (!queue->pending_head)
+            queue->pending_tail = NULL;
+        queue->stats.in_flight = 1;
+        queue->stats.max_in_flight = 1;
+        queue->stats.commands++;
+        spin_unlock_irqrestore(&queue->lock, enabled);
+        thread_cancel_block();
+
+        int res;
+        if (command->write)
+            res = queue->driver->write_sectors(queue->unit, command->buffer, command->lba, command->command_sectors);
+        else
+            res = queue->driver->read_sectors(queue->unit, command->buffer, command->lba, command->command_sectors);
+
+        enabled = spin_lock_irqsave(&queue->lock);
+        queue->stats.in_flight = 0;
+        if (res)
+            queue->stats.errors++;
+        spin_unlock_irqrestore(&queue->lock, enabled);
+        block_complete(queue, command, res == 0);
+    }
+}
+
+void block_register_device(elos__DeviceID device, const StorageDriver* driver, u32 unit, u64 sectors) {
+    if (device == 0 || device > DEVICE_MAX_DEVICES)
+        return;
+    BlockQueue* queue = &g_block_queues[device - 1];
+    queue->driver  = driver;
+    queue->unit    = unit;
+    queue->sectors = sectors;
+#ifdef ELOS_LOCK_STATS
+    queue->lock.stats.name = "block queue";
+#endif
+    if (driver->submit) {
+        queue->stats.max_sectors = driver->max_sectors(unit);
+        queue->stats.queue_depth = driver->queue_depth(unit);
+        if (queue->stats.queue_depth == 0)
+            queue->stats.queue_depth = 1;
+    } else {
+        queue->stats.max_sectors = BLOCK_MAX_SECTORS;
+        queue->stats.queue_depth = 1;
+        queue->worker = thread_create(driver->name, block_worker, queue);
+        if (!queue->worker)
+            return;
+    }
+    __atomic_store_n(&queue->ready, true, __ATOMIC_RELEASE);
+}
+
+static BlockQueue* block_prepare(BlockRequest* request) {
+    BlockQueue* queue = block_queue(request->device);
+    if (!queue || !request->buffer)
+        return NULL;
+    if (request->sectors == 0 || request->sectors > queue->stats.max_sectors)
+        return NULL;
+    if (request->lba + request->sectors < request->lba || request->lba + request->sectors > queue->sectors)
+        return NULL;
+    request->done            = false;
+    request->ok              = false;
+    request->waiter          = request->callback ? NULL : thread_current();
+    request->next            = NULL;
+    request->merged_next     = NULL;
+    request->merged_tail     = request;
+    request->command_sectors = request->sectors;
+    return queue;
+}
+
+// Puts a command into the device queue and starts what fits
+static void block_enqueue(BlockQueue* queue, BlockRequest* command, u32 requests) {
+    bool enabled = spin_lock_irqsave(&queue->lock);
+    queue->stats.requests += requests;
+    if (block_insert(&queue->pending_head, &queue->pending_tail, command, queue->stats.max_sectors))
+        queue->stats.merged++;
+    spin_unlock_irqrestore(&queue->lock, enabled);
+    block_dispatch(queue);
+}
+
+bool block_submit(BlockRequest* request) {
+    BlockQueue* queue = block_prepare(request);
+    if (!queue)
+        return false;
+    block_enqueue(queue, request, 1);
+    return true;
+}
+
+bool block_wait(BlockRequest* request) {
+    while (1) {
+        thread_prepare_block();
+        if (__atomic_load_n(&request->done, __ATOMIC_ACQUIRE))
+            break;
+        thread_block();
+    }
+    thread_cancel_block();
+    return request->ok;
+}
+
+void block_plug_init(BlockPlug* plug) {
+    plug->head  = NULL;
+    plug->tail  = NULL;
+    plug->count = 0;
+}
+
+bool block_plug_submit(BlockPlug* plug, BlockRequest* request) {
+    BlockQueue* queue = block_prepare(request);
+    if (!queue)
+        return false;
+    if (block_insert(&plug->head, &plug->tail, request, queue->stats.max_sectors)) {
+        bool enabled = spin_lock_irqsave(&queue->lock);
+        queue->stats.merged++;
+        spin_unlock_irqrestore(&queue->lock, enabled);
+        return true;
+    }
+    plug->count++;
+    if (plug->count >= BLOCK_PLUG_MAX)
+        block_unplug(plug);
+    return true;
+}
+
+void block_unplug(BlockPlug* plug) {
+    BlockRequest* command = plug->head;
+    plug->head  = NULL;
+    plug->tail  = NULL;
+    plug->count = 0;
+    while (command) {
+        BlockRequest* next = command->next;
+        u32 requests = 0;
+        for (BlockRequest* request = command; request; request = request->merged_next)
+            requests++;
+        block_enqueue(&g_block_queues[command->device - 1], command, requests);
+        command = next;
+    }
+}
+
+u32 block_max_sectors(elos__DeviceID device) {
+    BlockQueue* queue = block_queue(device);
+    return queue ? queue->stats.max_sectors : 0;
+}
+
+u64 block_device_sectors(elos__DeviceID device) {
+    BlockQueue* queue = block_queue(device);
+    return queue ? queue->sectors : 0;
+}
+
+#define BLOCK_TRANSFER_BATCH 16
+
+bool block_transfer(elos__DeviceID device, u64 lba, u64 sectors, void* buffer, bool write) {
+    BlockQueue* queue = block_queue(device);
+    if (!queue)
+        return false;
+    u32 max = queue->stats.max_sectors;
+    u8* next_buffer = buffer;
+    bool ok = true;
+    while (ok && sectors > 0) {
+        BlockRequest requests[BLOCK_TRANSFER_BATCH];
+        BlockPlug plug;
+        block_plug_init(&plug);
+        u32 count = 0;
+        while (count < BLOCK_TRANSFER_BATCH && sectors > 0) {
+            BlockRequest* request = &requests[count];
+            request->device   = device;
+            request->lba      = lba;
+            request->sectors  = sectors < max ? sectors : max;
+            request->write    = write;
+            request->buffer   = next_buffer;
+            request->callback = NULL;
+            request->arg      = NULL;
+            if (!block_plug_submit(&plug, request)) {
+                ok = false;
+                break;
+            }
+            count++;
+            lba += request->sectors;
+            next_buffer += (u64)request->sectors * 512;
+            sectors -= request->sectors;
+        }
+        block_unplug(&plug);
+        // every request has to finish before the array goes away
+        for (u32 i = 0; i < count; i++) {
+            if (!block_wait(&requests[i]))
+                ok = false;
+        }
+    }
+    if (ok && write)
+        ok = block_flush(device);
+    return ok;
+}
+
+bool block_flush(elos__DeviceID device) {
+    BlockQueue* queue = block_queue(device);
+    if (!queue)
+        return false;
+    if (!queue->driver->flush)
+        return true;
+    return queue->driver->flush(queue->unit) == 0;
+}
+
+bool block_get_stats(elos__DeviceID device, BlockStats* out_stats) {
+    BlockQueue* queue = block_queue(device);
+    if (!queue)
+        return false;
+    bool enabled = spin_lock_irqsave(&queue->lock);
+    *out_stats = queue->stats;
+    spin_unlock_irqrestore(&queue->lock, enabled);
+    return true;
+}
@@ -0,0 +1,102 @@
+/*
+    Block request layer
+
+    Requests are queued per device and handed to the driver as long as the device has
+    fewer commands in flight than its queue depth. Requests waiting in the queue are
+    merged with the ones next to them on disk when their buffers are next to each other
+    in memory too, so a device that is busy collects small sequential requests into
+    large commands by itself.
+
+    Submitting through a BlockPlug holds requests back until block_unplug, use it
+    when submitting a batch so the whole batch can merge before the device sees it.
+
+    The caller owns the BlockRequest, it is the completion token. It must stay alive
+    until done is set or the callback ran.
+*/
+
+#pragma once
+
+#include "elos/kernel/common/types.h"
+#include "elos/kernel/device/device.h"
+
+// Most sectors one command gets from merging for drivers without a limit of their own
+#define BLOCK_MAX_SECTORS  2048
+// A plug passes its requests on when it holds this many commands
+#define BLOCK_PLUG_MAX     32
+
+typedef struct BlockRequest BlockRequest;
+
+// Called when the request finished, from an interrupt or the device's thread. May free the request.
+typedef void (*BlockCallback)(BlockRequest* request);
+
+struct BlockRequest {
+    // filled in by the caller
+    elos__DeviceID device;
+    u64 lba;
+    u32 sectors;
+    bool write;
+    void* buffer;            // mapped, the alignment the driver wants
+    BlockCallback callback;  // NULL to wait with block_wait instead
+    void* arg;
+
+    // the result, ok is valid once done is set
+    volatile bool done;
+    bool ok;
+
+    // owned by the block layer
+    struct Thread* waiter;
+    BlockRequest* next;         // next command in a queue or plug
+    BlockRequest* merged_next;  // requests merged behind the first one of a command
+    BlockRequest* merged_tail;
+    u32 command_sectors;        // sectors of the whole command when this is its first request
+};
+
+typedef struct BlockPlug {
+    BlockRequest* head;
+    BlockRequest* tail;
+    u32 count;
+} BlockPlug;
+
+typedef struct BlockStats {
+    u64 requests;
+    u64 merged;       // requests that joined another one's command
+    u64 commands;     // commands sent to the driver
+    u64 errors;
+    u32 in_flight;
+    u32 max_in_flight;
+    u32 queue_depth;
+    u32 max_sectors;
+} BlockStats;
+
+// Called by device_register_storage
+void block_register_device(elos__DeviceID device, const StorageDriver* driver, u32 unit, u64 sectors);
+
+/*
+    Queues the request. Returns false without queueing it if the device or range is
+    invalid. Any context if the request has a callback, threads only otherwise.
+*/
+bool block_submit(BlockRequest* request);
+
+// Waits for a request submitted without a callback, returns request->ok. Threads only.
+bool block_wait(BlockRequest* request);
+
+void block_plug_init(BlockPlug* plug);
+// Like block_submit but the request stays in the plug until block_unplug
+bool block_plug_submit(BlockPlug* plug, BlockRequest* request);
+void block_unplug(BlockPlug* plug);
+
+/*
+    Blocking transfer of any size, split into commands that are all in flight at once.
+    Writes are flushed. Returns false on failure.
+*/
+bool block_transfer(elos__DeviceID device, u64 lba, u64 sectors, void* buffer, bool write);
+
+// Asks the disk to make completed writes durable, drivers without a flush write through. Threads only.
+bool block_flush(elos__DeviceID device);
+
+// Most sectors one command takes on the device, 0 if there's no such device
+u32 block_max_sectors(elos__DeviceID device);
+// Size of the device, 0 if there's no such device
+u64 block_device_sectors(elos__DeviceID device);
+
+bool block_get_stats(elos__DeviceID device, BlockStats* out_stats);
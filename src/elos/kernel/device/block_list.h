@@ -0,0 +1,55 @@
+/*
+    Command lists of the block layer
+
+    The merging of requests into commands, on a list of commands that nobody else
+    sees yet or that the caller holds the lock of. Kept apart from block.c so the
+    host tests can run it without the rest of the kernel.
+*/
+
+#pragma once
+
+#include "elos/kernel/device/block.h"
+
+static inline u8* block_command_end(BlockRequest* command) {
+    return (u8*)command->buffer + (u64)command->command_sectors * 512;
+}
+
+/*
+    Merges the command into one of the list that it continues or that continues it,
+    otherwise appends it. Returns true if it merged. The list isn't in flight yet.
+*/
+static inline bool block_insert(BlockRequest** head, BlockRequest** tail, BlockRequest* command, u32 max_sectors) {
+    BlockRequest* previous = NULL;
+    for (BlockRequest* other = *head; other; previous = other, other = other->next) {
+        if (other->write != command->write || other->device != command->device)
+            continue;
+        if (other->command_sectors + command->command_sectors > max_sectors)
+            continue;
+        if (other->lba + other->command_sectors == command->lba && block_command_end(other) == command->buffer) {
+            other->merged_tail->merged_next = command;
+            other->merged_tail = command->merged_tail;
+            other->command_sectors += command->command_sectors;
+            return true;
+        }
+        if (command->lba + command->command_sectors == other->lba && block_command_end(command) == other->buffer) {
+            command->merged_tail->merged_next = other;
+            command->merged_tail = other->merged_tail;
+            command->command_sectors += other->command_sectors;
+            command->next = other->next;
+            if (previous)
+                previous->next = command;
+            else
+                *head = command;
+            if (*tail == other)
+                *tail = command;
+            return true;
+        }
+    }
+    command->next = NULL;
+    if (*tail)
+        (*tail)->next = command;
+    else
+        *head = command;
+    *tail = command;
+    return false;
+}
@@ -1,7 +1,10 @@
 
 #include "elos/kernel/device/device.h"
+#include "elos/kernel/device/block.h"
+#include "elos/kernel/device/bcache.h"
 
-#include "elos/kernel/driver/pata.h"
+#include "elos/kernel/common/string.h"
+#include "elos/kernel/common/sync.h"
 
 
 // stub for now
@@ -22,15 +25,48 @@ static inline cstring temp_user_string(const char* text) {
 
 
 
+#define SECTOR_SIZE 512
+
+typedef struct DeviceEntry {
+    elos__Device info;
+    const StorageDriver* driver;
+    u32 unit;
+} DeviceEntry;
+
+// Devices are only added. An entry is filled in before the length that covers it
+// is published so readers don't need the lock.
+static Spinlock g_devices_lock = LOCK_INIT("devices");
 static int g_devices_len;
-static elos__Device g_devices[100];
+static DeviceEntry g_devices[DEVICE_MAX_DEVICES];
+
 
 
+elos__DeviceID device_register_storage(const StorageDriver* driver, u32 unit, u64 sectors) {
+    spin_lock(&g_devices_lock);
+    if (g_devices_len == DEVICE_MAX_DEVICES) {
+        spin_unlock(&g_devices_lock);
+        return 0;
+    }
+    DeviceEntry* entry = &g_devices[g_devices_len];
+    memset(entry, 0, sizeof(DeviceEntry));
+    entry->info.type = elos__DEVICE_TYPE_STORAGE;
+    entry->info.id = g_devices_len + 1; // 0 is no device
+    entry->info.storage.max_bytes = sectors * SECTOR_SIZE;
+    entry->driver = driver;
+    entry->unit = unit;
+    __atomic_store_n(&g_devices_len, g_devices_len + 1, __ATOMIC_RELEASE);
+    spin_unlock(&g_devices_lock);
+
+    // reads and writes fail until the block queue is ready
+    block_register_device(entry->info.id, driver, unit, sectors);
+    return entry->info.id;
+}
 
-static elos__Device* find_device_by_id(elos__DeviceID id) {
-    for (int i=0;i<g_devices_len;i++) {
-        elos__Device* dev = &g_devices[i];
-        if (dev->id == id && dev->type != elos__DEVICE_TYPE_NONE) {
+static DeviceEntry* find_device_by_id(elos__DeviceID id) {
+    int len = __atomic_load_n(&g_devices_len, __ATOMIC_ACQUIRE);
+    for (int i=0;i<len;i++) {
+        DeviceEntry* dev = &g_devices[i];
+        if (dev->info.id == id && dev->info.type != elos__DEVICE_TYPE_NONE) {
             return dev;
         }
     }
@@ -52,7 +88,7 @@ bool elos__list_devices(elos__DeviceType types, elos__Device* out_devices, u32*
         return false;
     }
 
-    res = valid_user_pointer(in_out_devices_len, 4);
+    res = valid_user_address(in_out_devices_len, 4);
     if(!res) {
         if(out_error) {
             out_error->type = elos__DEVICE_CODE_BAD_PARAMETER;
@@ -61,7 +97,7 @@ bool elos__list_devices(elos__DeviceType types, elos__Device* out_devices, u32*
         return false;
     }
 
-    res = valid_user_pointer(out_devices, sizeof(*out_devices) * *in_out_devices_len);
+    res = valid_user_address(out_devices, sizeof(*out_devices) * *in_out_devices_len);
     if(!res) {
         if(out_error) {
             out_error->type = elos__DEVICE_CODE_BAD_PARAMETER;
@@ -73,16 +109,20 @@ bool elos__list_devices(elos__DeviceType types, elos__Device* out_devices, u32*
 
 
 
-    if (!out_devices) {
-        // TODO: Return number of devices
-        *in_out_devices_len = 0;
-    } else {
-        if(*in_out_devices_len == 0)
-            return true;
-
-        // TODO: Fill array with devices
-        *in_out_devices_len = 0;
+    u32 max = *in_out_devices_len;
+    u32 count = 0;
+    int len = __atomic_load_n(&g_devices_len, __ATOMIC_ACQUIRE);
+    for (int i=0;i<len;i++) {
+        if (!(g_devices[i].info.type & types))
+            continue;
+        if (out_devices) {
+            if (count == max)
+                break;
+            out_devices[count] = g_devices[i].info;
+        }
+        count++;
     }
+    *in_out_devices_len = count;
 
     return true;
 }
@@ -99,21 +139,22 @@ bool elos__get_storage_information(elos__DeviceID id, u64* max_bytes) {
     if (!res)
         return false;
 
-    elos__Device* dev = find_device_by_id(id);
+    DeviceEntry* dev = find_device_by_id(id);
     if(!dev)
         return false;
 
-    if (dev->type != elos__DEVICE_TYPE_STORAGE)
+    if (dev->info.type != elos__DEVICE_TYPE_STORAGE)
         return false;
 
-    *max_bytes = dev->storage.max_bytes;
+    *max_bytes = dev->info.storage.max_bytes;
     
     return true;
 }
 
 
 
-bool elos__read_bytes(elos__DeviceID id, u64 offset, u64 size, u8* buffer) {
+// Goes through the buffer cache, which reads and writes whole blocks
+static bool transfer_bytes(elos__DeviceID id, u64 offset, u64 size, u8* buffer, bool write) {
     int res;
 
     if (!buffer || size == 0)
@@ -123,52 +164,41 @@ bool elos__read_bytes(elos__DeviceID id, u64 offset, u64 size, u8* buffer) {
     if (!res)
         return false;
 
-    elos__Device* dev = find_device_by_id(id);
+    DeviceEntry* dev = find_device_by_id(id);
     if(!dev)
         return false;
 
-    if (dev->type != elos__DEVICE_TYPE_STORAGE)
+    if (dev->info.type != elos__DEVICE_TYPE_STORAGE)
         return false;
 
-    // TODO: Check integer overflow
-    if (offset + size > dev->storage.max_bytes)
+    if (offset + size < offset || offset + size > dev->info.storage.max_bytes)
         return false;
-    
-    u8 temp_sector[512];
-    u64 next_size = size;
-    u64 next_offset = offset;
-    while (next_size > 0) {
-
-        if (next_offset % 512 == 0 && next_size >= 512) {
-            ata_read_sectors(buffer, next_offset / 512, next_size / 512);
-            next_offset += 512;
-            next_size -= 512;
-            continue;
-        }
-        int partSize = 512 - next_offset % 512;
-        if (next_size < partSize)
-            partSize = next_size;
-        
-        ata_read_sectors(temp_sector, next_offset / 512, 1);
-        memcpy(buffer, temp_sector + next_offset % 512, partSize);
-        next_offset += partSize;
-        next_size -= partSize;
-    }
 
-    return true;
+    if (write)
+        return bcache_write(id, offset, size, buffer);
+    return bcache_read(id, offset, size, buffer);
 }
 
+bool elos__read_bytes(elos__DeviceID id, u64 offset, u64 size, u8* buffer) {
+    return transfer_bytes(id, offset, size, buffer, false);
+}
 
+bool elos__write_bytes(elos__DeviceID id, u64 offset, u64 size, u8* buffer) {
+    return transfer_bytes(id, offset, size, buffer, true);
+}
 
-bool elos__write_sector(elos__DeviceID id, u64 offset, int size, u8* buffer) {
-    elos__Device* dev = find_device_by_id(id);
-
-    return false;
+bool elos__sync(elos__DeviceID id) {
+    if (id != 0) {
+        DeviceEntry* dev = find_device_by_id(id);
+        if (!dev || dev->info.type != elos__DEVICE_TYPE_STORAGE)
+            return false;
+    }
+    return bcache_sync(id);
 }
 
 
 
 bool elos__scan_system() {
-
-    return false;
+    // Drivers register their devices from init_pci and init_pata
+    return true;
 }
@@ -74,9 +74,47 @@ bool elos__read_bytes(elos__DeviceID id, u64 offset, u64 size, u8* buffer);
 
 bool elos__write_bytes(elos__DeviceID id, u64 offset, u64 size, u8* buffer);
 
+// Writes are cached, this makes the ones done so far durable on the disk. id 0 syncs every storage device.
+bool elos__sync(elos__DeviceID id);
+
 // Scan system for devices and update device list
 bool elos__scan_system();
 
+
+// ############################
+//     DRIVER INTERFACE
+// ############################
+
+#define DEVICE_MAX_DEVICES 100
+
+// Called from interrupts with ok false if the command failed
+typedef void (*StorageCallback)(void* arg, bool ok);
+
+/*
+    Implemented by storage drivers. Sectors are 512 bytes, functions return 0 on
+    success and may block. unit is what the driver passed to device_register_storage.
+
+    Drivers that can have commands in flight without a thread waiting on each also fill
+    in submit, max_sectors and queue_depth and the block layer (block.h) uses those.
+    The others get a block layer thread that calls the blocking functions.
+*/
+typedef struct StorageDriver {
+    const char* name;
+    int (*read_sectors)(u32 unit, void* buffer, u64 lba, u64 sectors);
+    int (*write_sectors)(u32 unit, void* buffer, u64 lba, u64 sectors);
+
+    // Starts one command of at most max_sectors. Returns false if the buffer can't be used or the queue is full. Any context.
+    bool (*submit)(u32 unit, u64 lba, u32 sectors, void* buffer, bool write, StorageCallback callback, void* arg);
+    u32 (*max_sectors)(u32 unit);
+    // Commands the unit takes at once, over all of its queues
+    u32 (*queue_depth)(u32 unit);
+    // Makes completed writes durable. Returns 0 on success, may block. Only optional if writes are durable when they complete.
+    int (*flush)(u32 unit);
+} StorageDriver;
+
+// Adds a storage device, returns its id or 0 if the device table is full
+elos__DeviceID device_register_storage(const StorageDriver* driver, u32 unit, u64 sectors);
+
 /*
     Thoughts on interface (good and dumb)
 
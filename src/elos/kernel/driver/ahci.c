@@ -0,0 +1,723 @@
+/*
+    Every drive has a command list of 32 slots and one command table per slot. The
+    slots a drive may use are tracked in free_slots, a semaphore counts them so blocking
+    submitters can sleep until one frees up.
+
+    With NCQ a command's bit is set in SACT before CI and the drive clears it in SACT
+    when the command completed, in any order. Without NCQ only one command is in
+    flight and CI clears when it's done.
+
+    Errors complete everything in flight as failed. The interrupt handler only marks
+    the port, a thread restarts it since that waits on the hardware. Commands issued
+    meanwhile are held back until the restart. NCQ would let us find the failed tag
+    in the NCQ error log, not worth it yet.
+*/
+
+#include "elos/kernel/driver/ahci.h"
+#include "elos/kernel/log/print.h"
+#include "elos/kernel/common/cpu.h"
+#include "elos/kernel/common/clock.h"
+#include "elos/kernel/common/scheduler.h"
+#include "elos/kernel/common/string.h"
+#include "elos/kernel/common/sync.h"
+#include "elos/kernel/interrupt/interrupt.h"
+#include "elos/kernel/interrupt/apic.h"
+#include "elos/kernel/memory/paging.h"
+#include "elos/kernel/memory/phys_allocator.h"
+#include "elos/kernel/debug/debug.h"
+#include "elos/kernel/device/device.h"
+
+#define AHCI_MAX_CONTROLLERS 4
+#define AHCI_MAX_DRIVES      32
+#define AHCI_SLOTS           32
+#define AHCI_PRDT_ENTRIES    248 // command table fills a page
+#define AHCI_PRD_MAX_BYTES   0x400000
+
+#define AHCI_CAP_S64A        (1u << 31)
+#define AHCI_CAP_SNCQ        (1u << 30)
+#define AHCI_CAP2_BOH        (1u << 0)
+#define AHCI_BOHC_BOS        (1u << 0)
+#define AHCI_BOHC_OOS        (1u << 1)
+#define AHCI_GHC_HR          (1u << 0)
+#define AHCI_GHC_IE          (1u << 1)
+#define AHCI_GHC_AE          (1u << 31)
+
+#define AHCI_PORT_CMD_ST     (1u << 0)
+#define AHCI_PORT_CMD_SUD    (1u << 1)
+#define AHCI_PORT_CMD_POD    (1u << 2)
+#define AHCI_PORT_CMD_FRE    (1u << 4)
+#define AHCI_PORT_CMD_FR     (1u << 14)
+#define AHCI_PORT_CMD_CR     (1u << 15)
+
+#define AHCI_PORT_IS_DHRS    (1u << 0)  // D2H register FIS, non-NCQ completion
+#define AHCI_PORT_IS_SDBS    (1u << 3)  // set device bits FIS, NCQ completion
+#define AHCI_PORT_IS_DPS     (1u << 5)
+#define AHCI_PORT_IS_ERRORS  0x7D000000 // TFES, HBFS, HBDS, IFS, INFS, OFS
+
+#define AHCI_SSTS_DET_PRESENT 3
+#define AHCI_SIG_ATA          0x00000101
+
+#define ATA_STATUS_ERR       0x01
+#define ATA_STATUS_DRQ       0x08
+#define ATA_STATUS_BSY       0x80
+
+#define ATA_CMD_READ_DMA_EXT       0x25
+#define ATA_CMD_WRITE_DMA_EXT      0x35
+#define ATA_CMD_READ_FPDMA_QUEUED  0x60
+#define ATA_CMD_WRITE_FPDMA_QUEUED 0x61
+#define ATA_CMD_FLUSH_CACHE_EXT    0xEA
+#define ATA_CMD_IDENTIFY           0xEC
+
+#define FIS_TYPE_REG_H2D     0x27
+
+#define AHCI_TIMEOUT_NS      (1000000000ull)
+
+typedef volatile struct AhciPortRegs {
+    u32 clb, clbu, fb, fbu;
+    u32 is, ie, cmd, _reserved0;
+    u32 tfd, sig, ssts, sctl, serr, sact, ci, sntf, fbs, devslp;
+    u32 _reserved1[10];
+    u32 vendor[4];
+} AhciPortRegs;
+
+typedef volatile struct AhciHbaRegs {
+    u32 cap, ghc, is, pi, vs, ccc_ctl, ccc_ports, em_loc, em_ctl, cap2, bohc;
+    u8  _reserved[0xA0 - 0x2C];
+    u8  vendor[0x100 - 0xA0];
+    AhciPortRegs ports[32];
+} AhciHbaRegs;
+
+typedef struct AhciCommandHeader {
+    u16 flags;    // FIS length in dwords, bit 6 write
+    u16 prdtl;    // PRD entries
+    volatile u32 prdbc;
+    u32 ctba;
+    u32 ctbau;
+    u32 _reserved[4];
+} AhciCommandHeader;
+
+#define AHCI_HEADER_WRITE 0x40
+
+typedef struct AhciPrd {
+    u32 dba;
+    u32 dbau;
+    u32 _reserved;
+    u32 dbc; // bytes - 1, bit 31 interrupt on completion
+} AhciPrd;
+
+typedef struct FisRegH2D {
+    u8 type;
+    u8 flags;  // bit 7: command
+    u8 command;
+    u8 feature_low;
+    u8 lba0, lba1, lba2;
+    u8 device;
+    u8 lba3, lba4, lba5;
+    u8 feature_high;
+    u8 count_low, count_high;
+    u8 icc;
+    u8 control;
+    u8 _reserved[4];
+} FisRegH2D;
+
+typedef struct AhciCommandTable {
+    u8 cfis[64];
+    u8 acmd[16];
+    u8 _reserved[48];
+    AhciPrd prdt[AHCI_PRDT_ENTRIES];
+} AhciCommandTable;
+
+typedef struct AhciSlot {
+    AhciCallback callback;
+    void* arg;
+    bool queued;  // NCQ command, goes into SACT too
+} AhciSlot;
+
+typedef struct AhciDrive {
+    AhciPortRegs* regs;
+    u32 port;
+    u64 address_limit;  // PHYS_LIMIT_4G if the HBA is 32-bit
+    AhciCommandHeader* command_list;
+    AhciCommandTable* tables;
+    u64 tables_phys;
+    u64 sectors;
+    bool ncq;
+    u32 depth;
+
+    Spinlock lock;      // protects the fields below
+    u32 free_slots;
+    u32 issued;
+    AhciSlot slots[AHCI_SLOTS];
+    bool recovering;    // the port stopped at an error, the recovery thread restarts it
+    u32 held;           // slots of the failed commands, free again after the restart
+    u32 deferred;       // commands issued while recovering, started after the restart
+
+    Semaphore slot_count;
+    Mutex flush_lock;   // one flush at a time drains the slots
+    u64 completed;
+    u64 errors;
+} AhciDrive;
+
+typedef struct AhciController {
+    AhciHbaRegs* hba;
+    AhciDrive* port_drives[32];
+} AhciController;
+
+static AhciController g_ahci_controllers[AHCI_MAX_CONTROLLERS];
+static u32 g_ahci_controller_count;
+static AhciDrive g_ahci_drives[AHCI_MAX_DRIVES];
+static u32 g_ahci_drive_count;
+static u8 g_ahci_vector;
+static Semaphore g_ahci_recovery; // one unit per port that needs a restart
+static bool g_ahci_recovery_started;
+
+// Spins until (*reg & mask) == value, false on timeout
+static bool ahci_wait(volatile u32* reg, u32 mask, u32 value, u64 timeout_ns) {
+    u64 deadline = __rdtsc() + ns_to_tsc(timeout_ns);
+    while ((*reg & mask) != value) {
+        if (__rdtsc() > deadline)
+            return false;
+        _mm_pause();
+    }
+    return true;
+}
+
+static bool ahci_port_stop(AhciPortRegs* regs) {
+    regs->cmd &= ~AHCI_PORT_CMD_ST;
+    if (!ahci_wait(&regs->cmd, AHCI_PORT_CMD_CR, 0, 500000000))
+        return false;
+    regs->cmd &= ~AHCI_PORT_CMD_FRE;
+    return ahci_wait(&regs->cmd, AHCI_PORT_CMD_FR, 0, 500000000);
+}
+
+static void ahci_port_start(AhciPortRegs* regs) {
+    regs->serr = 0xFFFFFFFF;
+    regs->is   = 0xFFFFFFFF;
+    regs->cmd |= AHCI_PORT_CMD_FRE;
+    ahci_wait(&regs->tfd, ATA_STATUS_BSY | ATA_STATUS_DRQ, 0, AHCI_TIMEOUT_NS);
+    regs->cmd |= AHCI_PORT_CMD_ST;
+}
+
+/*
+    Fills the slot's PRD table, physically contiguous parts are merged.
+    Returns the entries used, 0 if the buffer can't be used.
+*/
+static u32 ahci_build_prdt(AhciDrive* drive, AhciCommandTable* table, u8* buffer, u64 bytes) {
+    if ((u64)buffer & 1)
+        return 0;
+    u32 count = 0;
+    u64 total = 0;
+    while (total < bytes) {
+        void* physical;
+        u64 page_size;
+        if (!lookup_page(buffer + total, &physical, &page_size))
+            return 0;
+        u64 phys = (u64)physical;
+        u64 len = page_size - (phys & (page_size - 1));
+        if (len > bytes - total)
+            len = bytes - total;
+        if (len > AHCI_PRD_MAX_BYTES)
+            len = AHCI_PRD_MAX_BYTES;
+        if (drive->address_limit && phys + len > drive->address_limit)
+            return 0;
+
+        AhciPrd* last = count ? &table->prdt[count - 1] : NULL;
+        u64 last_bytes = last ? (last->dbc & 0x3FFFFF) + 1 : 0;
+        u64 last_end = last ? ((u64)last->dbau << 32 | last->dba) + last_bytes : 0;
+        if (last && last_end == phys && last_bytes + len <= AHCI_PRD_MAX_BYTES) {
+            last->dbc = last_bytes + len - 1;
+        } else {
+            if (count == AHCI_PRDT_ENTRIES)
+                return 0;
+            table->prdt[count].dba  = (u32)phys;
+            table->prdt[count].dbau = (u32)(phys >> 32);
+            table->prdt[count]._reserved = 0;
+            table->prdt[count].dbc  = len - 1;
+            count++;
+        }
+        total += len;
+    }
+    return count;
+}
+
+static void ahci_fill_fis(FisRegH2D* fis, u8 command, u64 lba, u32 sectors) {
+    memset(fis, 0, sizeof(FisRegH2D));
+    fis->type    = FIS_TYPE_REG_H2D;
+    fis->flags   = 0x80;
+    fis->command = command;
+    fis->device  = 0x40; // LBA
+    fis->lba0 = lba;
+    fis->lba1 = lba >> 8;
+    fis->lba2 = lba >> 16;
+    fis->lba3 = lba >> 24;
+    fis->lba4 = lba >> 32;
+    fis->lba5 = lba >> 40;
+    fis->count_low  = sectors;
+    fis->count_high = sectors >> 8;
+}
+
+// Hands filled in slots to the port, caller holds drive->lock
+static void ahci_start_slots(AhciDrive* drive, u32 slots) {
+    u32 queued = 0;
+    for (u32 bits = slots; bits; bits &= bits - 1) {
+        u32 slot = __builtin_ctz(bits);
+        if (drive->slots[slot].queued)
+            queued |= 1u << slot;
+    }
+    drive->issued |= slots;
+    // writes of 0 bits are ignored, SACT must be set before CI
+    if (queued)
+        drive->regs->sact = queued;
+    drive->regs->ci = slots;
+}
+
+// Caller took a unit of slot_count
+static bool ahci_issue(AhciDrive* drive, u8 command, u64 lba, u32 sectors, void* buffer, u64 bytes, bool write, AhciCallback callback, void* arg) {
+    bool enabled = spin_lock_irqsave(&drive->lock);
+    u32 slot = __builtin_ctz(drive->free_slots);
+    drive->free_slots &= ~(1u << slot);
+    spin_unlock_irqrestore(&drive->lock, enabled);
+
+    AhciCommandTable* table = &drive->tables[slot];
+    u32 entries = bytes ? ahci_build_prdt(drive, table, buffer, bytes) : 0;
+    if (bytes && !entries) {
+        enabled = spin_lock_irqsave(&drive->lock);
+        drive->free_slots |= 1u << slot;
+        spin_unlock_irqrestore(&drive->lock, enabled);
+        sem_up(&drive->slot_count);
+        return false;
+    }
+
+    FisRegH2D* fis = (FisRegH2D*)table->cfis;
+    bool queued = drive->ncq && (command == ATA_CMD_READ_FPDMA_QUEUED || command == ATA_CMD_WRITE_FPDMA_QUEUED);
+    ahci_fill_fis(fis, command, lba, sectors);
+    if (queued) {
+        // FPDMA has the count in the feature registers and the tag in the count register
+        fis->feature_low  = sectors;
+        fis->feature_high = sectors >> 8;
+        fis->count_low    = slot << 3;
+        fis->count_high   = 0;
+    }
+    if (command == ATA_CMD_IDENTIFY)
+        fis->device = 0;
+
+    AhciCommandHeader* header = &drive->command_list[slot];
+    header->flags = (sizeof(FisRegH2D) / 4) | (write ? AHCI_HEADER_WRITE : 0);
+    header->prdtl = entries;
+    header->prdbc = 0;
+
+    drive->slots[slot].callback = callback;
+    drive->slots[slot].arg      = arg;
+    drive->slots[slot].queued   = queued;
+
+    enabled = spin_lock_irqsave(&drive->lock);
+    if (drive->recovering)
+        drive->deferred |= 1u << slot;
+    else
+        ahci_start_slots(drive, 1u << slot);
+    spin_unlock_irqrestore(&drive->lock, enabled);
+    return true;
+}
+
+static void ahci_port_interrupt(AhciDrive* drive) {
+    AhciPortRegs* regs = drive->regs;
+    u32 status = regs->is;
+    regs->is = status;
+
+    spin_lock(&drive->lock);
+    u32 failed = 0;
+    bool recover = false;
+    if (status & AHCI_PORT_IS_ERRORS) {
+        serial_printf("ahci: port %d error, is %x, tfd %x, serr %x\n", (int)drive->port, status, regs->tfd, regs->serr);
+        // The port halted and its commands are lost. Restarting it waits on the
+        // hardware for up to a second, that's done by ahci_recovery_thread.
+        failed = drive->issued;
+        recover = !drive->recovering;
+        drive->recovering = true;
+    }
+    u32 active = drive->ncq ? regs->sact | regs->ci : regs->ci;
+    u32 done = failed | (drive->issued & ~active);
+    drive->issued &= ~done;
+    drive->free_slots |= done & ~failed;
+    drive->held |= failed;
+    drive->completed += __builtin_popcount(done);
+    drive->errors += __builtin_popcount(failed);
+    AhciSlot slots[AHCI_SLOTS];
+    for (u32 bits = done; bits; bits &= bits - 1) {
+        u32 slot = __builtin_ctz(bits);
+        slots[slot] = drive->slots[slot];
+    }
+    spin_unlock(&drive->lock);
+
+    if (recover)
+        sem_up(&g_ahci_recovery);
+    for (u32 bits = done; bits; bits &= bits - 1) {
+        u32 slot = __builtin_ctz(bits);
+        bool ok = !(failed & (1u << slot));
+        if (ok)
+            sem_up(&drive->slot_count);
+        if (slots[slot].callback)
+            slots[slot].callback(slots[slot].arg, ok);
+    }
+}
+
+// Restarts ports that stopped at an error. Clearing ST drops everything the port had.
+static void ahci_recovery_thread(void* arg) {
+    while (1) {
+        sem_down(&g_ahci_recovery);
+        u32 count = __atomic_load_n(&g_ahci_drive_count, __ATOMIC_ACQUIRE);
+        for (u32 i = 0; i < count; i++) {
+            AhciDrive* drive = &g_ahci_drives[i];
+            if (!__atomic_load_n(&drive->recovering, __ATOMIC_ACQUIRE))
+                continue;
+            if (!ahci_port_stop(drive->regs))
+                serial_printf("ahci: port %d doesn't stop\n", (int)drive->port);
+            ahci_port_start(drive->regs);
+
+            bool enabled = spin_lock_irqsave(&drive->lock);
+            u32 held = drive->held;
+            drive->free_slots |= held;
+            drive->held = 0;
+            drive->recovering = false;
+            if (drive->deferred)
+                ahci_start_slots(drive, drive->deferred);
+            drive->deferred = 0;
+            spin_unlock_irqrestore(&drive->lock, enabled);
+
+            for (u32 n = __builtin_popcount(held); n; n--)
+                sem_up(&drive->slot_count);
+        }
+    }
+}
+
+static void ahci_irq_handler(InterruptFrame* frame) {
+    for (u32 i = 0; i < g_ahci_controller_count; i++) {
+        AhciController* controller = &g_ahci_controllers[i];
+        u32 pending = controller->hba->is;
+        if (!pending)
+            continue;
+        for (u32 bits = pending; bits; bits &= bits - 1) {
+            u32 port = __builtin_ctz(bits);
+            if (controller->port_drives[port])
+                ahci_port_interrupt(controller->port_drives[port]);
+            else
+                controller->hba->ports[port].is = 0xFFFFFFFF;
+        }
+        // ports first, the HBA bit would be set again otherwise
+        controller->hba->is = pending;
+    }
+}
+
+// Sleeps until the command completed
+static bool ahci_command_sync(AhciDrive* drive, u8 command, u64 lba, u32 sectors, void* buffer, u64 bytes, bool write) {
+    Completion completion;
+    completion_init(&completion);
+    sem_down(&drive->slot_count);
+    if (!ahci_issue(drive, command, lba, sectors, buffer, bytes, write, completion_done, &completion))
+        return false;
+    return completion_wait(&completion);
+}
+
+static void ahci_identify(AhciController* controller, AhciDrive* drive) {
+    void* page = kernel_alloc_phys_contiguous(1, 0, drive->address_limit, ALLOC_ZERO);
+    if (!page)
+        return;
+    u16* identify = phys_to_virt((u64)page);
+    if (!ahci_command_sync(drive, ATA_CMD_IDENTIFY, 0, 0, identify, 512, false)) {
+        serial_printf("ahci: port %d IDENTIFY failed\n", (int)drive->port);
+        kernel_free_phys_pages(page, 1);
+        return;
+    }
+    drive->sectors = *(u64*)&identify[100];
+    if (!drive->sectors)
+        drive->sectors = *(u32*)&identify[60];
+
+    // word 76 bit 8: NCQ, word 75: queue depth - 1
+    u32 hba_slots = ((controller->hba->cap >> 8) & 0x1F) + 1;
+    bool hba_ncq  = (controller->hba->cap & AHCI_CAP_SNCQ) != 0;
+    if (hba_ncq && (identify[76] & (1 << 8))) {
+        u32 depth = (identify[75] & 0x1F) + 1;
+        drive->depth = depth < hba_slots ? depth : hba_slots;
+        drive->ncq = true;
+    }
+    kernel_free_phys_pages(page, 1);
+
+    // nothing is in flight, the single slot used for IDENTIFY is free again
+    drive->free_slots = drive->depth == 32 ? 0xFFFFFFFF : (1u << drive->depth) - 1;
+    sem_init(&drive->slot_count, drive->depth);
+}
+
+static u32 ahci_storage_max_sectors(u32 drive) {
+    return AHCI_MAX_SECTORS;
+}
+
+static const StorageDriver g_ahci_storage = {
+    .name          = "ahci",
+    .read_sectors  = ahci_read_sectors,
+    .write_sectors = ahci_write_sectors,
+    .submit        = ahci_submit,
+    .max_sectors   = ahci_storage_max_sectors,
+    .queue_depth   = ahci_queue_depth,
+    .flush         = ahci_flush,
+};
+
+static void ahci_init_port(AhciController* controller, u32 port, u64 address_limit) {
+    AhciPortRegs* regs = &controller->hba->ports[port];
+    if ((regs->ssts & 0xF) != AHCI_SSTS_DET_PRESENT || regs->sig != AHCI_SIG_ATA)
+        return;
+    if (g_ahci_drive_count == AHCI_MAX_DRIVES)
+        return;
+    if (!ahci_port_stop(regs)) {
+        serial_printf("ahci: port %d doesn't stop\n", (int)port);
+        return;
+    }
+
+    // command list (1 KiB) and received FIS (256 bytes) share a page, a table per slot
+    void* list = kernel_alloc_phys_contiguous(1, 0, address_limit, ALLOC_ZERO);
+    void* tables = kernel_alloc_phys_contiguous(AHCI_SLOTS, 0, address_limit, ALLOC_ZERO);
+    if (!list || !tables) {
+        serial_printf("ahci: out of memory for port %d\n", (int)port);
+        if (list)
+            kernel_free_phys_pages(list, 1);
+        if (tables)
+            kernel_free_phys_pages(tables, AHCI_SLOTS);
+        return;
+    }
+
+    AhciDrive* drive = &g_ahci_drives[g_ahci_drive_count];
+    memset(drive, 0, sizeof(AhciDrive));
+    drive->regs          = regs;
+    drive->port          = port;
+    drive->address_limit = address_limit;
+    drive->command_list  = phys_to_virt((u64)list);
+    drive->tables        = phys_to_virt((u64)tables);
+    drive->tables_phys   = (u64)tables;
+    drive->depth         = 1;
+    drive->free_slots    = 1;
+    sem_init(&drive->slot_count, 1);
+#ifdef ELOS_LOCK_STATS
+    drive->lock.stats.name = "ahci port";
+#endif
+
+    for (u32 slot = 0; slot < AHCI_SLOTS; slot++) {
+        u64 table = drive->tables_phys + slot * sizeof(AhciCommandTable);
+        drive->command_list[slot].ctba  = (u32)table;
+        drive->command_list[slot].ctbau = (u32)(table >> 32);
+    }
+    u64 fis = (u64)list + 1024;
+    regs->clb  = (u32)(u64)list;
+    regs->clbu = (u32)((u64)list >> 32);
+    regs->fb   = (u32)fis;
+    regs->fbu  = (u32)(fis >> 32);
+    regs->cmd |= AHCI_PORT_CMD_SUD | AHCI_PORT_CMD_POD;
+
+    controller->port_drives[port] = drive;
+    ahci_port_start(regs);
+    regs->ie = AHCI_PORT_IS_DHRS | AHCI_PORT_IS_SDBS | AHCI_PORT_IS_DPS | AHCI_PORT_IS_ERRORS;
+    __atomic_store_n(&g_ahci_drive_count, g_ahci_drive_count + 1, __ATOMIC_RELEASE);
+
+    ahci_identify(controller, drive);
+    printf("ahci: port %d, %d MiB, NCQ %d, depth %d\n", (int)port, (int)(drive->sectors / 2048), (int)drive->ncq, (int)drive->depth);
+    if (drive->sectors)
+        device_register_storage(&g_ahci_storage, g_ahci_drive_count - 1, drive->sectors);
+}
+
+void ahci_attach_controller(u8 bus, u8 slot, u8 function, PCI_ConfigSpace* config) {
+    if (g_ahci_controller_count == AHCI_MAX_CONTROLLERS)
+        return;
+    u64 abar = config->header0.bar5 & ~0xFULL;
+    if (!abar || (config->header0.bar5 & 1)) {
+        printf("ahci: ABAR isn't memory\n");
+        return;
+    }
+    AhciHbaRegs* hba = map_mmio(abar, sizeof(AhciHbaRegs));
+    if (!hba) {
+        printf("ahci: Can't map ABAR\n");
+        return;
+    }
+    pci_enable_command(bus, slot, function, PCI_COMMAND_MEMORY_SPACE | PCI_COMMAND_BUS_MASTER);
+
+    if (!g_ahci_vector)
+        g_ahci_vector = interrupt_alloc_vector(ahci_irq_handler);
+    if (!g_ahci_vector || !pci_enable_msi(bus, slot, function, g_ahci_vector, lapic_id())) {
+        printf("ahci: No MSI, controller not used\n");
+        return;
+    }
+    if (!g_ahci_recovery_started) {
+        sem_init(&g_ahci_recovery, 0);
+        if (!thread_create("ahci recovery", ahci_recovery_thread, NULL)) {
+            printf("ahci: Can't start the recovery thread\n");
+            return;
+        }
+        g_ahci_recovery_started = true;
+    }
+
+    // take the HBA from the firmware
+    if (hba->cap2 & AHCI_CAP2_BOH) {
+        hba->bohc |= AHCI_BOHC_OOS;
+        ahci_wait(&hba->bohc, AHCI_BOHC_BOS, 0, AHCI_TIMEOUT_NS);
+    }
+    hba->ghc |= AHCI_GHC_AE;
+    hba->ghc |= AHCI_GHC_HR;
+    if (!ahci_wait(&hba->ghc, AHCI_GHC_HR, 0, AHCI_TIMEOUT_NS)) {
+        printf("ahci: HBA reset timed out\n");
+        return;
+    }
+    hba->ghc |= AHCI_GHC_AE;
+
+    u64 address_limit = (hba->cap & AHCI_CAP_S64A) ? 0 : PHYS_LIMIT_4G;
+    AhciController* controller = &g_ahci_controllers[g_ahci_controller_count];
+    memset(controller, 0, sizeof(AhciController));
+    controller->hba = hba;
+
+    // the interrupt handler must see the controller before ports start raising them
+    __atomic_store_n(&g_ahci_controller_count, g_ahci_controller_count + 1, __ATOMIC_RELEASE);
+    hba->is = 0xFFFFFFFF;
+    hba->ghc |= AHCI_GHC_IE;
+
+    u32 implemented = hba->pi;
+    for (u32 port = 0; port < 32; port++) {
+        if (implemented & (1u << port))
+            ahci_init_port(controller, port, address_limit);
+    }
+}
+
+u32 ahci_drive_count() {
+    return g_ahci_drive_count;
+}
+
+u64 ahci_drive_sectors(u32 drive) {
+    return drive < g_ahci_drive_count ? g_ahci_drives[drive].sectors : 0;
+}
+
+u32 ahci_queue_depth(u32 drive) {
+    return drive < g_ahci_drive_count ? g_ahci_drives[drive].depth : 0;
+}
+
+static u8 ahci_transfer_command(AhciDrive* drive, bool write) {
+    if (drive->ncq)
+        return write ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_READ_FPDMA_QUEUED;
+    return write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+}
+
+bool ahci_submit(u32 drive_index, u64 lba, u32 sectors, void* buffer, bool write, AhciCallback callback, void* arg) {
+    if (drive_index >= g_ahci_drive_count || sectors == 0 || sectors > AHCI_MAX_SECTORS)
+        return false;
+    AhciDrive* drive = &g_ahci_drives[drive_index];
+    if (lba + sectors > drive->sectors)
+        return false;
+    if (!sem_trydown(&drive->slot_count))
+        return false;
+    return ahci_issue(drive, ahci_transfer_command(drive, write), lba, sectors, buffer, (u64)sectors * 512, write, callback, arg);
+}
+
+static int ahci_transfer(u32 drive_index, u8* buffer, u64 lba, u64 sectors, bool write) {
+    if (drive_index >= g_ahci_drive_count)
+        return -1;
+    AhciDrive* drive = &g_ahci_drives[drive_index];
+    if (lba + sectors < lba || lba + sectors > drive->sectors)
+        return -1;
+    while (sectors > 0) {
+        u32 count = sectors < AHCI_MAX_SECTORS ? sectors : AHCI_MAX_SECTORS;
+        if (!ahci_command_sync(drive, ahci_transfer_command(drive, write), lba, count, buffer, (u64)count * 512, write))
+            return -1;
+        buffer += (u64)count * 512;
+        lba += count;
+        sectors -= count;
+    }
+    return 0;
+}
+
+int ahci_read_sectors(u32 drive, void* buffer, u64 lba, u64 sectors) {
+    return ahci_transfer(drive, buffer, lba, sectors, false);
+}
+
+int ahci_write_sectors(u32 drive, void* buffer, u64 lba, u64 sectors) {
+    return ahci_transfer(drive, buffer, lba, sectors, true);
+}
+
+/*
+    FLUSH CACHE EXT isn't queued, a drive aborts it while NCQ commands are in flight.
+    Taking every slot waits for those and keeps new ones out until it completed.
+*/
+int ahci_flush(u32 drive_index) {
+    if (drive_index >= g_ahci_drive_count)
+        return -1;
+    AhciDrive* drive = &g_ahci_drives[drive_index];
+    mutex_lock(&drive->flush_lock);
+    for (u32 i = 0; i < drive->depth; i++)
+        sem_down(&drive->slot_count);
+
+    Completion completion;
+    completion_init(&completion);
+    // the completion returns the flush's unit
+    bool ok = ahci_issue(drive, ATA_CMD_FLUSH_CACHE_EXT, 0, 0, NULL, 0, false, completion_done, &completion);
+    ok = ok && completion_wait(&completion);
+
+    for (u32 i = 1; i < drive->depth; i++)
+        sem_up(&drive->slot_count);
+    mutex_unlock(&drive->flush_lock);
+    return ok ? 0 : -1;
+}
+
+typedef struct AhciBenchWorker {
+    u32 drive;
+    u32 reads;
+    u32 seed;
+    bool failed;
+    Semaphore* finished;
+} AhciBenchWorker;
+
+static void ahci_bench_worker(void* arg) {
+    AhciBenchWorker* worker = arg;
+    void* page = kernel_alloc_phys_contiguous(1, 0, PHYS_LIMIT_4G, 0);
+    if (!page) {
+        worker->failed = true;
+        sem_up(worker->finished);
+        return;
+    }
+    u8* buffer = phys_to_virt((u64)page);
+    u64 blocks = g_ahci_drives[worker->drive].sectors / 8;
+    u32 rng = worker->seed;
+    for (u32 i = 0; i < worker->reads && blocks; i++) {
+        rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5;
+        if (ahci_read_sectors(worker->drive, buffer, (rng % blocks) * 8, 8)) {
+            worker->failed = true;
+            break;
+        }
+    }
+    kernel_free_phys_pages(page, 1);
+    sem_up(worker->finished);
+}
+
+void ahci_benchmark(u32 drive, u32 max_queue_depth, u32 reads_per_depth) {
+    if (drive >= g_ahci_drive_count) {
+        printf("ahci_benchmark: No drive %d\n", (int)drive);
+        return;
+    }
+    if (max_queue_depth > AHCI_SLOTS)
+        max_queue_depth = AHCI_SLOTS;
+
+    static AhciBenchWorker workers[AHCI_SLOTS];
+    Semaphore finished;
+    for (u32 depth = 1; depth <= max_queue_depth; depth *= 2) {
+        sem_init(&finished, 0);
+        u32 started = 0;
+        u64 start = now_ns();
+        for (u32 i = 0; i < depth; i++) {
+            workers[i] = (AhciBenchWorker){ drive, reads_per_depth / depth, 2463534242u + i * 7919, false, &finished };
+            if (thread_create("ahci bench", ahci_bench_worker, &workers[i]))
+                started++;
+        }
+        for (u32 i = 0; i < started; i++)
+            sem_down(&finished);
+        u64 elapsed = now_ns() - start;
+
+        u64 reads = (u64)(reads_per_depth / depth) * started;
+        bool failed = false;
+        for (u32 i = 0; i < started; i++)
+            failed |= workers[i].failed;
+        u64 iops = elapsed ? reads * 1000000000ull / elapsed : 0;
+        printf("ahci: QD %d, %d IOPS%s\n", (int)depth, (int)iops, failed ? " (errors)" : "");
+    }
+}
@@ -0,0 +1,49 @@
+/*
+    AHCI SATA driver
+
+    The PCI scan hands AHCI controllers to ahci_attach_controller which resets the
+    HBA, starts every port with a SATA disk behind it and identifies the disks.
+    Disks with Native Command Queuing get as many commands in flight as both the
+    HBA and the disk allow (up to 32) with READ/WRITE FPDMA QUEUED, others get one.
+    Completions arrive by MSI.
+
+    Drives are numbered from 0 in the order they were found.
+*/
+
+#pragma once
+
+#include "elos/kernel/common/types.h"
+#include "elos/kernel/driver/pci.h"
+
+// Most sectors one command transfers, the PRD table fits any buffer this big
+#define AHCI_MAX_SECTORS 1024
+
+// Called from interrupts with ok false if the command failed
+typedef void (*AhciCallback)(void* arg, bool ok);
+
+// Called by the PCI scan for SATA controllers with the AHCI programming interface
+void ahci_attach_controller(u8 bus, u8 slot, u8 function, PCI_ConfigSpace* config);
+
+u32 ahci_drive_count();
+u64 ahci_drive_sectors(u32 drive);
+// Commands the drive takes at once
+u32 ahci_queue_depth(u32 drive);
+
+/*
+    Starts one command of at most AHCI_MAX_SECTORS without waiting, callback runs when it completed.
+    The buffer must be word aligned and mapped (below 4 GiB if the HBA can't address more).
+    Returns false if the buffer can't be used or every slot is busy. Any context.
+*/
+bool ahci_submit(u32 drive, u64 lba, u32 sectors, void* buffer, bool write, AhciCallback callback, void* arg);
+
+// Blocking transfers of any size, wait for a free slot when the queue is full. Return 0 on success.
+int ahci_read_sectors(u32 drive, void* buffer, u64 lba, u64 sectors);
+int ahci_write_sectors(u32 drive, void* buffer, u64 lba, u64 sectors);
+// Makes completed writes durable, returns 0 on success
+int ahci_flush(u32 drive);
+
+/*
+    Random 4 KiB reads with 1, 2, 4... threads up to max_queue_depth, each thread keeps one
+    read in flight. Prints IOPS per queue depth.
+*/
+void ahci_benchmark(u32 drive, u32 max_queue_depth, u32 reads_per_depth);
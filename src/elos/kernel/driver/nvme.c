@@ -0,0 +1,589 @@
+/*
+    A queue's lock is only taken by the CPU the queue belongs to, for submitting and
+    in its completion interrupt, unless a thread moved to another CPU between picking
+    the queue and submitting. Completion entries are found by their phase bit which
+    the controller flips on every pass through the queue.
+
+    Command ids are slots, each slot has a page for its PRP list. One submission entry
+    always stays empty so a full queue never looks empty.
+
+    Admin commands are only sent while attaching and are polled.
+*/
+
+#include "elos/kernel/driver/nvme.h"
+#include "elos/kernel/log/print.h"
+#include "elos/kernel/common/cpu.h"
+#include "elos/kernel/common/clock.h"
+#include "elos/kernel/common/scheduler.h"
+#include "elos/kernel/common/smp.h"
+#include "elos/kernel/common/string.h"
+#include "elos/kernel/common/sync.h"
+#include "elos/kernel/interrupt/interrupt.h"
+#include "elos/kernel/memory/paging.h"
+#include "elos/kernel/memory/phys_allocator.h"
+#include "elos/kernel/memory/slab.h"
+#include "elos/kernel/debug/debug.h"
+#include "elos/kernel/device/device.h"
+
+#define NVME_MAX_CONTROLLERS 4
+#define NVME_MAX_NAMESPACES  NVME_MAX_CONTROLLERS
+#define NVME_ADMIN_DEPTH     16
+#define NVME_IO_DEPTH        64
+#define NVME_PRP_ENTRIES     (PAGE_SIZE_4K / sizeof(u64))
+#define NVME_MAX_BYTES       (256 * PAGE_SIZE_4K) // a PRP list page covers more, keeps the lists short
+
+#define NVME_REG_CAP         0x00
+#define NVME_REG_CC          0x14
+#define NVME_REG_CSTS        0x1C
+#define NVME_REG_AQA         0x24
+#define NVME_REG_ASQ         0x28
+#define NVME_REG_ACQ         0x30
+#define NVME_REG_DOORBELLS   0x1000
+
+#define NVME_CC_ENABLE       (1u << 0)
+#define NVME_CC_IOSQES       (6u << 16) // 64 byte submission entries
+#define NVME_CC_IOCQES       (4u << 20) // 16 byte completion entries
+#define NVME_CSTS_READY      (1u << 0)
+#define NVME_CSTS_FATAL      (1u << 1)
+
+#define NVME_ADMIN_CREATE_SQ     0x01
+#define NVME_ADMIN_CREATE_CQ     0x05
+#define NVME_ADMIN_IDENTIFY      0x06
+#define NVME_ADMIN_SET_FEATURES  0x09
+#define NVME_FEATURE_QUEUES      0x07
+#define NVME_IO_FLUSH            0x00
+#define NVME_IO_WRITE            0x01
+#define NVME_IO_READ             0x02
+
+#define NVME_ADMIN_TIMEOUT_NS    (1000000000ull)
+
+typedef struct NvmeCommand {
+    u32 cdw0; // opcode, command id in the high half
+    u32 nsid;
+    u64 _reserved;
+    u64 mptr;
+    u64 prp1;
+    u64 prp2;
+    u32 cdw10, cdw11, cdw12, cdw13, cdw14, cdw15;
+} NvmeCommand;
+
+typedef struct NvmeCompletion {
+    u32 result;
+    u32 _reserved;
+    u16 sq_head;
+    u16 sq_id;
+    u16 cid;
+    u16 status; // bit 0 phase
+} NvmeCompletion;
+
+typedef struct NvmeRequest {
+    NvmeCallback callback;
+    void* arg;
+} NvmeRequest;
+
+typedef struct NvmeQueue {
+    u16 id;
+    u16 depth;
+    NvmeCommand* sq;
+    volatile NvmeCompletion* cq;
+    volatile u32* sq_doorbell;
+    volatile u32* cq_doorbell;
+    u64* prp_lists;     // a page per slot
+    u64  prp_lists_phys;
+
+    Spinlock lock;      // protects the fields below
+    u16 sq_tail;
+    u16 cq_head;
+    u16 cq_phase;
+    u64 free_slots;
+    NvmeRequest requests[NVME_IO_DEPTH];
+
+    Semaphore slot_count;
+    u64 completed;
+    u64 errors;
+} NvmeQueue;
+
+typedef struct NvmeController {
+    volatile u8* regs;
+    u32 doorbell_stride;
+    u32 max_sectors;
+    PciMsix msix;
+    NvmeQueue admin;
+    NvmeQueue* io_queues[MAX_CPUS];
+    u32 queue_count;
+    NvmeQueue* cpu_queues[MAX_CPUS];
+} NvmeController;
+
+typedef struct NvmeNamespace {
+    NvmeController* controller;
+    u32 nsid;
+    u64 sectors;
+} NvmeNamespace;
+
+static NvmeController g_nvme_controllers[NVME_MAX_CONTROLLERS];
+static u32 g_nvme_controller_count;
+static NvmeNamespace g_nvme_namespaces[NVME_MAX_NAMESPACES];
+static u32 g_nvme_namespace_count;
+static NvmeQueue* g_nvme_vector_queues[256];
+
+static inline u32 nvme_read32(NvmeController* controller, u32 reg) {
+    return *(volatile u32*)(controller->regs + reg);
+}
+static inline void nvme_write32(NvmeController* controller, u32 reg, u32 value) {
+    *(volatile u32*)(controller->regs + reg) = value;
+}
+static inline u64 nvme_read64(NvmeController* controller, u32 reg) {
+    return nvme_read32(controller, reg) | ((u64)nvme_read32(controller, reg + 4) << 32);
+}
+static inline void nvme_write64(NvmeController* controller, u32 reg, u64 value) {
+    nvme_write32(controller, reg, (u32)value);
+    nvme_write32(controller, reg + 4, (u32)(value >> 32));
+}
+
+static bool nvme_wait_ready(NvmeController* controller, bool ready, u64 timeout_ns) {
+    u64 deadline = __rdtsc() + ns_to_tsc(timeout_ns);
+    while (((nvme_read32(controller, NVME_REG_CSTS) & NVME_CSTS_READY) != 0) != ready) {
+        if (nvme_read32(controller, NVME_REG_CSTS) & NVME_CSTS_FATAL)
+            return false;
+        if (__rdtsc() > deadline)
+            return false;
+        _mm_pause();
+    }
+    return true;
+}
+
+// Allocates the rings, the queue is created on the controller by the caller
+static bool nvme_queue_init(NvmeController* controller, NvmeQueue* queue, u16 id, u16 depth, bool prp_lists) {
+    memset(queue, 0, sizeof(NvmeQueue));
+    void* sq = kernel_alloc_phys_contiguous((depth * sizeof(NvmeCommand) + PAGE_SIZE_4K - 1) / PAGE_SIZE_4K, 0, 0, ALLOC_ZERO);
+    void* cq = kernel_alloc_phys_contiguous((depth * sizeof(NvmeCompletion) + PAGE_SIZE_4K - 1) / PAGE_SIZE_4K, 0, 0, ALLOC_ZERO);
+    void* lists = prp_lists ? kernel_alloc_phys_contiguous(depth, 0, 0, 0) : NULL;
+    if (!sq || !cq || (prp_lists && !lists)) {
+        // not freed, the controller is given up on without its queues
+        return false;
+    }
+    queue->id     = id;
+    queue->depth  = depth;
+    queue->sq     = phys_to_virt((u64)sq);
+    queue->cq     = phys_to_virt((u64)cq);
+    queue->sq_doorbell = (volatile u32*)(controller->regs + NVME_REG_DOORBELLS + (2 * id) * controller->doorbell_stride);
+    queue->cq_doorbell = (volatile u32*)(controller->regs + NVME_REG_DOORBELLS + (2 * id + 1) * controller->doorbell_stride);
+    if (lists) {
+        queue->prp_lists      = phys_to_virt((u64)lists);
+        queue->prp_lists_phys = (u64)lists;
+    }
+    queue->cq_phase   = 1;
+    queue->free_slots = (1ull << (depth - 1)) - 1;
+    sem_init(&queue->slot_count, depth - 1);
+#ifdef ELOS_LOCK_STATS
+    queue->lock.stats.name = "nvme queue";
+#endif
+    return true;
+}
+
+static u64 nvme_sq_phys(NvmeQueue* queue) {
+    return virt_to_phys(queue->sq);
+}
+static u64 nvme_cq_phys(NvmeQueue* queue) {
+    return virt_to_phys((void*)queue->cq);
+}
+
+// Polls for the completion, only while attaching
+static bool nvme_admin(NvmeController* controller, NvmeCommand* command, u32* out_result) {
+    NvmeQueue* queue = &controller->admin;
+    command->cdw0 |= (u32)queue->sq_tail << 16;
+    queue->sq[queue->sq_tail] = *command;
+    queue->sq_tail = (queue->sq_tail + 1) % queue->depth;
+    *queue->sq_doorbell = queue->sq_tail;
+
+    u64 deadline = __rdtsc() + ns_to_tsc(NVME_ADMIN_TIMEOUT_NS);
+    volatile NvmeCompletion* cqe = &queue->cq[queue->cq_head];
+    while ((cqe->status & 1) != queue->cq_phase) {
+        if (__rdtsc() > deadline) {
+            printf("nvme: admin command %d timed out\n", (int)(command->cdw0 & 0xFF));
+            return false;
+        }
+        _mm_pause();
+    }
+    u16 status = cqe->status >> 1;
+    if (out_result)
+        *out_result = cqe->result;
+    queue->cq_head++;
+    if (queue->cq_head == queue->depth) {
+        queue->cq_head = 0;
+        queue->cq_phase ^= 1;
+    }
+    *queue->cq_doorbell = queue->cq_head;
+    if (status) {
+        printf("nvme: admin command %d failed, status %x\n", (int)(command->cdw0 & 0xFF), (u32)status);
+        return false;
+    }
+    return true;
+}
+
+static void nvme_process_completions(NvmeQueue* queue) {
+    NvmeRequest done[NVME_IO_DEPTH];
+    bool ok[NVME_IO_DEPTH];
+    u32 count = 0;
+
+    spin_lock(&queue->lock);
+    while (1) {
+        volatile NvmeCompletion* cqe = &queue->cq[queue->cq_head];
+        u16 status = cqe->status;
+        if ((status & 1) != queue->cq_phase)
+            break;
+        u16 cid = cqe->cid;
+        done[count] = queue->requests[cid];
+        ok[count] = (status >> 1) == 0;
+        count++;
+        queue->free_slots |= 1ull << cid;
+        queue->cq_head++;
+        if (queue->cq_head == queue->depth) {
+            queue->cq_head = 0;
+            queue->cq_phase ^= 1;
+        }
+    }
+    if (count)
+        *queue->cq_doorbell = queue->cq_head;
+    queue->completed += count;
+    for (u32 i = 0; i < count; i++)
+        queue->errors += !ok[i];
+    spin_unlock(&queue->lock);
+
+    for (u32 i = 0; i < count; i++) {
+        sem_up(&queue->slot_count);
+        if (done[i].callback)
+            done[i].callback(done[i].arg, ok[i]);
+    }
+}
+
+static void nvme_irq_handler(InterruptFrame* frame) {
+    NvmeQueue* queue = g_nvme_vector_queues[frame->vector & 0xFF];
+    if (queue)
+        nvme_process_completions(queue);
+}
+
+/*
+    PRP1 points at the first byte, PRP2 at the second page or at a list of the
+    remaining pages. Every page after the first starts page aligned.
+*/
+static bool nvme_build_prps(NvmeQueue* queue, u32 cid, u8* buffer, u64 bytes, u64* out_prp1, u64* out_prp2) {
+    if ((u64)buffer & 3)
+        return false;
+    void* physical;
+    if (!lookup_page(buffer, &physical, NULL))
+        return false;
+    *out_prp1 = (u64)physical;
+    *out_prp2 = 0;
+
+    u64 first = PAGE_SIZE_4K - ((u64)buffer & (PAGE_SIZE_4K - 1));
+    if (bytes <= first)
+        return true;
+    u64 rest = bytes - first;
+    u8* next = buffer + first;
+    if (rest <= PAGE_SIZE_4K) {
+        if (!lookup_page(next, &physical, NULL))
+            return false;
+        *out_prp2 = (u64)physical;
+        return true;
+    }
+
+    u64* list = queue->prp_lists + cid * NVME_PRP_ENTRIES;
+    u32 entries = 0;
+    while (rest > 0) {
+        if (entries == NVME_PRP_ENTRIES || !lookup_page(next, &physical, NULL))
+            return false;
+        list[entries++] = (u64)physical;
+        u64 len = rest < PAGE_SIZE_4K ? rest : PAGE_SIZE_4K;
+        next += len;
+        rest -= len;
+    }
+    *out_prp2 = queue->prp_lists_phys + cid * PAGE_SIZE_4K;
+    return true;
+}
+
+// Caller took a unit of slot_count. Commands without sectors have no data.
+static bool nvme_issue(NvmeQueue* queue, NvmeNamespace* ns, u8 opcode, u64 lba, u32 sectors, void* buffer, NvmeCallback callback, void* arg) {
+    bool enabled = spin_lock_irqsave(&queue->lock);
+    u32 cid = __builtin_ctzll(queue->free_slots);
+    queue->free_slots &= ~(1ull << cid);
+    spin_unlock_irqrestore(&queue->lock, enabled);
+
+    NvmeCommand command = { 0 };
+    if (sectors && !nvme_build_prps(queue, cid, buffer, (u64)sectors * 512, &command.prp1, &command.prp2)) {
+        enabled = spin_lock_irqsave(&queue->lock);
+        queue->free_slots |= 1ull << cid;
+        spin_unlock_irqrestore(&queue->lock, enabled);
+        sem_up(&queue->slot_count);
+        return false;
+    }
+    command.cdw0 = opcode | (cid << 16);
+    command.nsid = ns->nsid;
+    if (sectors) {
+        command.cdw10 = (u32)lba;
+        command.cdw11 = (u32)(lba >> 32);
+        command.cdw12 = sectors - 1;
+    }
+
+    queue->requests[cid].callback = callback;
+    queue->requests[cid].arg      = arg;
+
+    enabled = spin_lock_irqsave(&queue->lock);
+    queue->sq[queue->sq_tail] = command;
+    queue->sq_tail = (queue->sq_tail + 1) % queue->depth;
+    *queue->sq_doorbell = queue->sq_tail;
+    spin_unlock_irqrestore(&queue->lock, enabled);
+    return true;
+}
+
+static NvmeQueue* nvme_this_cpu_queue(NvmeController* controller) {
+    return controller->cpu_queues[cpu_index()];
+}
+
+static bool nvme_create_io_queue(NvmeController* controller, u32 index, u32 depth) {
+    NvmeQueue* queue = kmalloc(sizeof(NvmeQueue));
+    if (!queue || !nvme_queue_init(controller, queue, index + 1, depth, true))
+        return false;
+
+    u8 vector = interrupt_alloc_vector(nvme_irq_handler);
+    if (!vector)
+        return false;
+    g_nvme_vector_queues[vector] = queue;
+    // the queue's completions interrupt the CPU that submits on it
+    pci_msix_set(&controller->msix, index + 1, vector, g_cpus[index].apic_id);
+
+    NvmeCommand command = { 0 };
+    command.cdw0  = NVME_ADMIN_CREATE_CQ;
+    command.prp1  = nvme_cq_phys(queue);
+    command.cdw10 = ((depth - 1) << 16) | queue->id;
+    command.cdw11 = ((index + 1) << 16) | 0x3; // vector, interrupts enabled, physically contiguous
+    if (!nvme_admin(controller, &command, NULL))
+        return false;
+
+    memset(&command, 0, sizeof(command));
+    command.cdw0  = NVME_ADMIN_CREATE_SQ;
+    command.prp1  = nvme_sq_phys(queue);
+    command.cdw10 = ((depth - 1) << 16) | queue->id;
+    command.cdw11 = ((u32)queue->id << 16) | 0x1; // completion queue, physically contiguous
+    if (!nvme_admin(controller, &command, NULL))
+        return false;
+
+    controller->io_queues[index] = queue;
+    return true;
+}
+
+static u32 nvme_storage_queue_depth(u32 ns);
+
+static const StorageDriver g_nvme_storage = {
+    .name          = "nvme",
+    .read_sectors  = nvme_read_sectors,
+    .write_sectors = nvme_write_sectors,
+    .submit        = nvme_submit,
+    .max_sectors   = nvme_max_sectors,
+    .queue_depth   = nvme_storage_queue_depth,
+    .flush         = nvme_flush,
+};
+
+void nvme_attach_controller(u8 bus, u8 slot, u8 function, PCI_ConfigSpace* config) {
+    if (g_nvme_controller_count == NVME_MAX_CONTROLLERS)
+        return;
+    NvmeController* controller = &g_nvme_controllers[g_nvme_controller_count];
+    memset(controller, 0, sizeof(NvmeController));
+
+    u64 bar = pci_bar_address(bus, slot, function, 0);
+    if (!bar) {
+        printf("nvme: BAR0 isn't memory\n");
+        return;
+    }
+    controller->regs = map_mmio(bar, NVME_REG_DOORBELLS);
+    if (!controller->regs)
+        return;
+    pci_enable_command(bus, slot, function, PCI_COMMAND_MEMORY_SPACE | PCI_COMMAND_BUS_MASTER);
+
+    u64 cap = nvme_read64(controller, NVME_REG_CAP);
+    u32 max_depth = (cap & 0xFFFF) + 1;
+    u64 timeout_ns = ((cap >> 24) & 0xFF) * 500000000ull;
+    controller->doorbell_stride = 4 << ((cap >> 32) & 0xF);
+    // doorbells of the admin queue and one pair per CPU
+    if (!map_mmio(bar, NVME_REG_DOORBELLS + 2 * (MAX_CPUS + 1) * controller->doorbell_stride))
+        return;
+
+    nvme_write32(controller, NVME_REG_CC, nvme_read32(controller, NVME_REG_CC) & ~NVME_CC_ENABLE);
+    if (!nvme_wait_ready(controller, false, timeout_ns)) {
+        printf("nvme: Controller doesn't disable\n");
+        return;
+    }
+    if (!nvme_queue_init(controller, &controller->admin, 0, NVME_ADMIN_DEPTH, false)) {
+        printf("nvme: Out of memory\n");
+        return;
+    }
+    nvme_write32(controller, NVME_REG_AQA, ((NVME_ADMIN_DEPTH - 1) << 16) | (NVME_ADMIN_DEPTH - 1));
+    nvme_write64(controller, NVME_REG_ASQ, nvme_sq_phys(&controller->admin));
+    nvme_write64(controller, NVME_REG_ACQ, nvme_cq_phys(&controller->admin));
+    nvme_write32(controller, NVME_REG_CC, NVME_CC_ENABLE | NVME_CC_IOSQES | NVME_CC_IOCQES);
+    if (!nvme_wait_ready(controller, true, timeout_ns)) {
+        printf("nvme: Controller doesn't enable\n");
+        return;
+    }
+
+    void* page = kernel_alloc_phys_contiguous(1, 0, 0, ALLOC_ZERO);
+    if (!page)
+        return;
+    u8* identify = phys_to_virt((u64)page);
+
+    NvmeCommand command = { 0 };
+    command.cdw0  = NVME_ADMIN_IDENTIFY;
+    command.prp1  = (u64)page;
+    command.cdw10 = 1; // controller
+    if (!nvme_admin(controller, &command, NULL)) {
+        kernel_free_phys_pages(page, 1);
+        return;
+    }
+    u32 mdts = identify[77];
+    u64 max_bytes = NVME_MAX_BYTES;
+    u64 min_page = PAGE_SIZE_4K << ((cap >> 48) & 0xF);
+    if (mdts && (min_page << mdts) < max_bytes)
+        max_bytes = min_page << mdts;
+    controller->max_sectors = max_bytes / 512;
+
+    memset(&command, 0, sizeof(command));
+    command.cdw0  = NVME_ADMIN_IDENTIFY;
+    command.nsid  = 1;
+    command.prp1  = (u64)page;
+    command.cdw10 = 0; // namespace
+    if (!nvme_admin(controller, &command, NULL)) {
+        kernel_free_phys_pages(page, 1);
+        return;
+    }
+    u64 sectors = *(u64*)&identify[0];
+    u32 format = identify[26] & 0xF;
+    u32 block_shift = (*(u32*)&identify[128 + format * 4] >> 16) & 0xFF;
+    kernel_free_phys_pages(page, 1);
+    if (block_shift != 9) {
+        printf("nvme: Namespace 1 has %d byte blocks, only 512 is supported\n", 1 << block_shift);
+        return;
+    }
+
+    if (!pci_msix_init(bus, slot, function, &controller->msix) || controller->msix.count < 2) {
+        printf("nvme: No MSI-X\n");
+        return;
+    }
+
+    u32 wanted = cpu_online_count();
+    if (wanted > controller->msix.count - 1)
+        wanted = controller->msix.count - 1;
+    u32 granted = 0;
+    memset(&command, 0, sizeof(command));
+    command.cdw0  = NVME_ADMIN_SET_FEATURES;
+    command.cdw10 = NVME_FEATURE_QUEUES;
+    command.cdw11 = ((wanted - 1) << 16) | (wanted - 1);
+    if (!nvme_admin(controller, &command, &granted))
+        return;
+    u32 queues = wanted;
+    if ((granted & 0xFFFF) + 1 < queues)
+        queues = (granted & 0xFFFF) + 1;
+    if ((granted >> 16) + 1 < queues)
+        queues = (granted >> 16) + 1;
+
+    u32 depth = max_depth < NVME_IO_DEPTH ? max_depth : NVME_IO_DEPTH;
+    for (u32 i = 0; i < queues; i++) {
+        if (!nvme_create_io_queue(controller, i, depth))
+            break;
+        controller->queue_count++;
+    }
+    if (controller->queue_count == 0) {
+        printf("nvme: No I/O queues\n");
+        return;
+    }
+    for (u32 cpu = 0; cpu < MAX_CPUS; cpu++)
+        controller->cpu_queues[cpu] = controller->io_queues[cpu % controller->queue_count];
+    g_nvme_controller_count++;
+
+    if (g_nvme_namespace_count == NVME_MAX_NAMESPACES)
+        return;
+    NvmeNamespace* ns = &g_nvme_namespaces[g_nvme_namespace_count];
+    ns->controller = controller;
+    ns->nsid       = 1;
+    ns->sectors    = sectors;
+    g_nvme_namespace_count++;
+
+    printf("nvme: %d MiB, %d queues of %d\n", (int)(sectors / 2048), (int)controller->queue_count, (int)depth);
+    device_register_storage(&g_nvme_storage, g_nvme_namespace_count - 1, sectors);
+}
+
+u32 nvme_namespace_count() {
+    return g_nvme_namespace_count;
+}
+
+u64 nvme_namespace_sectors(u32 ns) {
+    return ns < g_nvme_namespace_count ? g_nvme_namespaces[ns].sectors : 0;
+}
+
+// Every I/O queue takes depth - 1 commands, a full ring would look empty
+static u32 nvme_storage_queue_depth(u32 ns) {
+    if (ns >= g_nvme_namespace_count)
+        return 0;
+    NvmeController* controller = g_nvme_namespaces[ns].controller;
+    return (controller->io_queues[0]->depth - 1) * controller->queue_count;
+}
+
+u32 nvme_max_sectors(u32 ns) {
+    return ns < g_nvme_namespace_count ? g_nvme_namespaces[ns].controller->max_sectors : 0;
+}
+
+bool nvme_submit(u32 ns_index, u64 lba, u32 sectors, void* buffer, bool write, NvmeCallback callback, void* arg) {
+    if (ns_index >= g_nvme_namespace_count)
+        return false;
+    NvmeNamespace* ns = &g_nvme_namespaces[ns_index];
+    if (sectors == 0 || sectors > ns->controller->max_sectors || lba + sectors > ns->sectors)
+        return false;
+    NvmeQueue* queue = nvme_this_cpu_queue(ns->controller);
+    if (!sem_trydown(&queue->slot_count))
+        return false;
+    return nvme_issue(queue, ns, write ? NVME_IO_WRITE : NVME_IO_READ, lba, sectors, buffer, callback, arg);
+}
+
+// Sleeps until the command completed
+static bool nvme_command_sync(NvmeNamespace* ns, u8 opcode, u64 lba, u32 sectors, void* buffer) {
+    // the queue of the CPU we were on, completing may wake us on another one
+    Completion completion;
+    completion_init(&completion);
+    NvmeQueue* queue = nvme_this_cpu_queue(ns->controller);
+    sem_down(&queue->slot_count);
+    if (!nvme_issue(queue, ns, opcode, lba, sectors, buffer, completion_done, &completion))
+        return false;
+    return completion_wait(&completion);
+}
+
+static int nvme_transfer(u32 ns_index, u8* buffer, u64 lba, u64 sectors, bool write) {
+    if (ns_index >= g_nvme_namespace_count)
+        return -1;
+    NvmeNamespace* ns = &g_nvme_namespaces[ns_index];
+    if (lba + sectors < lba || lba + sectors > ns->sectors)
+        return -1;
+    u32 max = ns->controller->max_sectors;
+    while (sectors > 0) {
+        u32 count = sectors < max ? sectors : max;
+        if (!nvme_command_sync(ns, write ? NVME_IO_WRITE : NVME_IO_READ, lba, count, buffer))
+            return -1;
+        buffer += (u64)count * 512;
+        lba += count;
+        sectors -= count;
+    }
+    return 0;
+}
+
+// Covers the writes that completed before it, on every queue
+int nvme_flush(u32 ns_index) {
+    if (ns_index >= g_nvme_namespace_count)
+        return -1;
+    return nvme_command_sync(&g_nvme_namespaces[ns_index], NVME_IO_FLUSH, 0, 0, NULL) ? 0 : -1;
+}
+
+int nvme_read_sectors(u32 ns, void* buffer, u64 lba, u64 sectors) {
+    return nvme_transfer(ns, buffer, lba, sectors, false);
+}
+
+int nvme_write_sectors(u32 ns, void* buffer, u64 lba, u64 sectors) {
+    return nvme_transfer(ns, buffer, lba, sectors, true);
+}
@@ -0,0 +1,39 @@
+/*
+    NVMe driver
+
+    Every CPU gets its own I/O submission/completion queue pair with an MSI-X vector
+    routed to that CPU, so submitting and completing I/O stays on one core and cores
+    never wait on each other. When the controller grants fewer queues than there are
+    CPUs, CPUs share them round-robin.
+
+    Only namespace 1 with 512 byte blocks is used, it registers as a storage device.
+*/
+
+#pragma once
+
+#include "elos/kernel/common/types.h"
+#include "elos/kernel/driver/pci.h"
+
+// Called from interrupts with ok false if the command failed
+typedef void (*NvmeCallback)(void* arg, bool ok);
+
+// Called by the PCI scan for NVM Express controllers
+void nvme_attach_controller(u8 bus, u8 slot, u8 function, PCI_ConfigSpace* config);
+
+u32 nvme_namespace_count();
+u64 nvme_namespace_sectors(u32 ns);
+// Most sectors one command transfers
+u32 nvme_max_sectors(u32 ns);
+
+/*
+    Starts one command of at most nvme_max_sectors on the queue of the CPU we run on,
+    callback runs on completion. The buffer must be dword aligned and mapped.
+    Returns false if the buffer can't be used or the queue is full. Any context.
+*/
+bool nvme_submit(u32 ns, u64 lba, u32 sectors, void* buffer, bool write, NvmeCallback callback, void* arg);
+
+// Blocking transfers of any size, return 0 on success
+int nvme_read_sectors(u32 ns, void* buffer, u64 lba, u64 sectors);
+int nvme_write_sectors(u32 ns, void* buffer, u64 lba, u64 sectors);
+// Makes completed writes durable, returns 0 on success
+int nvme_flush(u32 ns);
@@ -3,6 +3,18 @@
 
 #include "elos/kernel/log/print.h"
 #include "elos/kernel/common/cpu.h"
+#include "elos/kernel/common/clock.h"
+#include "elos/kernel/common/idle.h"
+#include "elos/kernel/common/scheduler.h"
+#include "elos/kernel/common/smp.h"
+#include "elos/kernel/common/string.h"
+#include "elos/kernel/interrupt/interrupt.h"
+#include "elos/kernel/interrupt/apic.h"
+#include "elos/kernel/memory/paging.h"
+#include "elos/kernel/memory/phys_allocator.h"
+#include "elos/kernel/memory/demand_paging.h"
+#include "elos/kernel/debug/debug.h"
+#include "elos/kernel/device/device.h"
 
 #include "elos/kernel/common/intrinsics.h"
 
@@ -18,42 +30,354 @@ const int IO_PRIMARY_BASE = 0x1F0;
 const int IO_PRIMARY_CONTROL = 0x3F6;
 const int device0 = 0xA0;
 
+#define ATA_STATUS_ERR  0x01
+#define ATA_STATUS_DRQ  0x08
+#define ATA_STATUS_BSY  0x80
+
+#define ATA_CMD_READ_SECTORS        0x20
+#define ATA_CMD_READ_SECTORS_EXT    0x24
+#define ATA_CMD_READ_MULTIPLE_EXT   0x29
+#define ATA_CMD_WRITE_SECTORS       0x30
+#define ATA_CMD_WRITE_SECTORS_EXT   0x34
+#define ATA_CMD_WRITE_MULTIPLE_EXT  0x39
+#define ATA_CMD_READ_DMA_EXT        0x25
+#define ATA_CMD_WRITE_DMA_EXT       0x35
+#define ATA_CMD_READ_DMA            0xC8
+#define ATA_CMD_WRITE_DMA           0xCA
+#define ATA_CMD_READ_MULTIPLE       0xC4
+#define ATA_CMD_WRITE_MULTIPLE      0xC5
+#define ATA_CMD_SET_MULTIPLE        0xC6
+#define ATA_CMD_FLUSH_CACHE         0xE7
+#define ATA_CMD_FLUSH_CACHE_EXT     0xEA
+#define ATA_CMD_IDENTIFY            0xEC
+
+#define ATA_TIMEOUT_NS  (1000000000ull) // spin-up can take a while
+#define ATA_IRQ         14 // primary channel in compatibility mode
+
+// Bus master IDE registers of the primary channel, I/O ports at BAR4
+#define BM_COMMAND              0x0
+#define BM_STATUS               0x2
+#define BM_PRDT                 0x4
+#define BM_COMMAND_START        0x1
+#define BM_COMMAND_TO_MEMORY    0x8 // direction of a device read
+#define BM_STATUS_ACTIVE        0x1
+#define BM_STATUS_ERROR         0x2 // write 1 to clear
+#define BM_STATUS_IRQ           0x4 // write 1 to clear
+
+// Physical region descriptor, a region may not cross a 64 KiB boundary
+typedef struct PrdEntry {
+    u32 address;
+    u16 bytes;  // 0 means 64 KiB
+    u16 flags;
+} PrdEntry;
+
+#define PRD_END_OF_TABLE  0x8000
+#define PRD_MAX_ENTRIES   (PAGE_SIZE_4K / sizeof(PrdEntry))
+
+// Filled in by init_pata from IDENTIFY
+static bool g_lba48;
+static u64  g_max_lba;
+static u32  g_multiple = 1; // sectors per DRQ block, 1 without SET MULTIPLE
+
+// One command on the bus at a time, held while a DMA command sleeps
+static Mutex g_ata_mutex;
+
+static struct {
+    bool found;          // the PCI scan found a bus master IDE controller
+    bool enabled;        // and the drive does DMA, transfers use it when the buffer allows
+    u16  bm_base;
+    PrdEntry* prdt;      // one page below 4 GiB
+    u64  prdt_phys;
+    u8   vector;
+    Timer timeout;
+    Thread* volatile waiter;
+    volatile bool done;
+    volatile bool timed_out;
+    volatile u8 bm_status; // at the interrupt
+} g_dma;
+
 // Returns non-zero if we didn't get non-bsy
 int ata_wait_bsy() {
+    u64 deadline = __rdtsc() + ns_to_tsc(ATA_TIMEOUT_NS);
     int status;
     while (1) {
         status = inb(IO_PRIMARY_BASE + 7);
-        if ((status & 0x80) == 0) {
+        if ((status & ATA_STATUS_BSY) == 0) {
             return 0;
         }
+        if (__rdtsc() > deadline) {
+            printf("ata_wait_bsy: Timed out, status: %d\n", (int) status);
+            return status;
+        }
+        _mm_pause();
     }
-    return status;
 }
 int ata_wait_drq() {
-    int attempts = 5000;
+    u64 deadline = __rdtsc() + ns_to_tsc(ATA_TIMEOUT_NS);
     int status;
     while (1) {
         status = inb(IO_PRIMARY_BASE + 7);
-        if ((status & 0x1) != 0) {
-            status = inb(IO_PRIMARY_BASE + 1);
-            printf("ata_wait_drq: ERR bit in status set, ERR register = %d\n", (int) status);
-            break;
+        if ((status & ATA_STATUS_BSY) == 0) {
+            if ((status & ATA_STATUS_ERR) != 0) {
+                status = inb(IO_PRIMARY_BASE + 1);
+                printf("ata_wait_drq: ERR bit in status set, ERR register = %d\n", (int) status);
+                return status ? status : -1;
+            }
+            if ((status & ATA_STATUS_DRQ) != 0) {
+                // printf("DRQ: Ready to read data, status: %d\n", (int) status);
+                return 0;
+            }
         }
-        if ((status & 0x8) != 0) {
-            // printf("DRQ: Ready to read data, status: %d\n", (int) status);
+
+        if (__rdtsc() > deadline) {
+            printf("ata_wait_drq: Timed out, status: %d\n", (int) status);
+            return -1;
+        }
+        _mm_pause();
+    }
+}
+
+// The status register is valid 400 ns after a command or a data block, reading
+// the alternate status four times takes that long and doesn't ack anything
+static inline void ata_delay_400ns() {
+    for (int i=0;i<4;i++)
+        inb(IO_PRIMARY_CONTROL);
+}
+
+static inline void ata_read_words(void* buffer, u64 count) {
+    asm volatile (
+        "rep insw\n"
+        : "+D" (buffer), "+c" (count)
+        : "d" ((u16)IO_PRIMARY_BASE)
+        : "memory"
+    );
+}
+
+static inline void ata_write_words(const void* buffer, u64 count) {
+    asm volatile (
+        "rep outsw\n"
+        : "+S" (buffer), "+c" (count)
+        : "d" ((u16)IO_PRIMARY_BASE)
+        : "memory"
+    );
+}
+
+/*
+    Writes the task file for a command on count sectors starting at lba.
+    count is at most 65536 with LBA48 and 256 without, the register holds 0 for the maximum.
+*/
+static void ata_issue(u8 command, u64 lba, u32 count) {
+    if (g_lba48) {
+        outb(IO_PRIMARY_BASE + 6, 0x40); // drive 0, LBA
+        // high bytes first, the registers are two deep FIFOs
+        outb(IO_PRIMARY_BASE + 2, (count >> 8) & 0xFF);
+        outb(IO_PRIMARY_BASE + 3, (lba >> 24) & 0xFF);
+        outb(IO_PRIMARY_BASE + 4, (lba >> 32) & 0xFF);
+        outb(IO_PRIMARY_BASE + 5, (lba >> 40) & 0xFF);
+    } else {
+        outb(IO_PRIMARY_BASE + 6, 0xE0 | ((lba >> 24) & 0x0F)); // drive + LBA bits 24–27
+    }
+    outb(IO_PRIMARY_BASE + 1, 0);
+    outb(IO_PRIMARY_BASE + 2, count & 0xFF);
+    outb(IO_PRIMARY_BASE + 3, lba & 0xFF);
+    outb(IO_PRIMARY_BASE + 4, (lba >> 8) & 0xFF);
+    outb(IO_PRIMARY_BASE + 5, (lba >> 16) & 0xFF);
+    outb(IO_PRIMARY_BASE + 7, command);
+    ata_delay_400ns();
+}
+
+static void ata_irq_handler(InterruptFrame* frame) {
+    u8 bm_status = inb(g_dma.bm_base + BM_STATUS);
+    // reading the status register acknowledges the drive's interrupt, PIO commands raise it too
+    inb(IO_PRIMARY_BASE + 7);
+    Thread* waiter = g_dma.waiter;
+    if (!waiter || !(bm_status & BM_STATUS_IRQ))
+        return;
+    outb(g_dma.bm_base + BM_STATUS, BM_STATUS_IRQ | BM_STATUS_ERROR);
+    g_dma.bm_status = bm_status;
+    __atomic_store_n(&g_dma.done, true, __ATOMIC_RELEASE);
+    thread_wake(waiter);
+}
+
+static void ata_dma_timeout(Timer* timer, void* arg) {
+    Thread* waiter = g_dma.waiter;
+    g_dma.timed_out = true;
+    if (waiter)
+        thread_wake(waiter);
+}
+
+void pata_attach_controller(u8 bus, u8 slot, u8 function, PCI_ConfigSpace* config) {
+    // Native mode has the task file in BAR0-3 and a PCI interrupt, we only drive the legacy ports
+    if (config->progIF & 0x1) {
+        printf("pata: Primary channel in native mode, no DMA\n");
+        return;
+    }
+    if (!(config->progIF & 0x80) || !(config->header0.bar4 & 1)) {
+        printf("pata: Controller can't bus master\n");
+        return;
+    }
+    pci_enable_command(bus, slot, function, PCI_COMMAND_IO_SPACE | PCI_COMMAND_BUS_MASTER);
+
+    g_dma.bm_base = config->header0.bar4 & 0xFFFC;
+    g_dma.found = true;
+}
+
+static void ata_init_dma() {
+    void* prdt = kernel_alloc_phys_contiguous(1, 0, PHYS_LIMIT_4G, ALLOC_ZERO);
+    if (!prdt) {
+        printf("pata: No memory for the PRD table\n");
+        return;
+    }
+    g_dma.prdt_phys = (u64)prdt;
+    g_dma.prdt = phys_to_virt(g_dma.prdt_phys);
+
+    g_dma.vector = interrupt_alloc_vector(ata_irq_handler);
+    if (!g_dma.vector || !ioapic_route_irq(ATA_IRQ, g_dma.vector, lapic_id(), 0)) {
+        printf("pata: Can't route IRQ %d\n", ATA_IRQ);
+        if (g_dma.vector)
+            interrupt_free_vector(g_dma.vector);
+        kernel_free_phys_pages(prdt, 1);
+        return;
+    }
+    timer_init(&g_dma.timeout, ata_dma_timeout, NULL);
+    outb(IO_PRIMARY_CONTROL, 0); // nIEN clear, the drive raises its interrupt
+    g_dma.enabled = true;
+}
+
+/*
+    Fills the PRD table for up to max_bytes of buffer, physically contiguous parts are
+    merged. Returns the bytes it covers, a multiple of 512, the rest needs another command.
+    Returns 0 if the buffer can't be used for DMA: not word aligned, not mapped or above 4 GiB.
+*/
+static u64 ata_build_prdt(u8* buffer, u64 max_bytes) {
+    if ((u64)buffer & 1)
+        return 0;
+    PrdEntry* prdt = g_dma.prdt;
+    u32 count = 0;
+    u64 total = 0;
+    while (total < max_bytes) {
+        void* physical;
+        u64 page_size;
+        if (!lookup_page(buffer + total, &physical, &page_size))
             return 0;
+        u64 phys = (u64)physical;
+        u64 len = page_size - (phys & (page_size - 1));
+        if (len > max_bytes - total)
+            len = max_bytes - total;
+        if (len > 0x10000 - (phys & 0xFFFF))
+            len = 0x10000 - (phys & 0xFFFF);
+        if (phys + len > PHYS_LIMIT_4G)
+            return 0;
+
+        PrdEntry* last = count ? &prdt[count - 1] : NULL;
+        u32 last_bytes = last ? (last->bytes ? last->bytes : 0x10000) : 0;
+        if (last && last->address + last_bytes == phys && (phys & 0xFFFF) != 0) {
+            // same 64 KiB window, can't exceed it
+            last->bytes = (u16)(last_bytes + len);
+        } else {
+            if (count == PRD_MAX_ENTRIES)
+                break;
+            prdt[count].address = phys;
+            prdt[count].bytes   = (u16)len;
+            prdt[count].flags   = 0;
+            count++;
         }
+        total += len;
+    }
 
-        if (attempts <= 0) {
-            printf("ata_wait_drq: To many attempts, status: %d\n", (int) status);
-            return -1;
+    // commands move whole sectors
+    u64 excess = total % 512;
+    total -= excess;
+    while (excess > 0) {
+        u32 bytes = prdt[count - 1].bytes ? prdt[count - 1].bytes : 0x10000;
+        if (bytes <= excess) {
+            count--;
+            excess -= bytes;
+        } else {
+            prdt[count - 1].bytes = (u16)(bytes - excess);
+            excess = 0;
         }
+    }
+    if (count == 0)
+        return 0;
+    prdt[count - 1].flags = PRD_END_OF_TABLE;
+    return total;
+}
 
-        attempts--;
+/*
+    One DMA command, the mutex is held. Sets out_sectors to what was transferred,
+    0 with a return of 0 means the buffer needs PIO.
+*/
+static int ata_dma_command(u8* buffer, u64 lba, u32 count, bool write, u32* out_sectors) {
+    *out_sectors = 0;
+    u64 bytes = ata_build_prdt(buffer, (u64)count * 512);
+    if (!bytes)
+        return 0;
+    u32 sectors = bytes / 512;
+
+    int status = ata_wait_bsy();
+    if (status)
+        return status;
+
+    u16 bm = g_dma.bm_base;
+    u8 direction = write ? 0 : BM_COMMAND_TO_MEMORY;
+    outb(bm + BM_COMMAND, direction);
+    outl(bm + BM_PRDT, (u32)g_dma.prdt_phys);
+    outb(bm + BM_STATUS, BM_STATUS_IRQ | BM_STATUS_ERROR);
+
+    g_dma.done      = false;
+    g_dma.timed_out = false;
+    g_dma.waiter    = thread_current();
+    timer_start(&g_dma.timeout, now_ns() + ATA_TIMEOUT_NS, 0);
+
+    u8 command;
+    if (write)
+        command = g_lba48 ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_WRITE_DMA;
+    else
+        command = g_lba48 ? ATA_CMD_READ_DMA_EXT : ATA_CMD_READ_DMA;
+    ata_issue(command, lba, sectors);
+    outb(bm + BM_COMMAND, direction | BM_COMMAND_START);
+
+    // other threads get the CPU until the drive interrupts
+    while (1) {
+        thread_prepare_block();
+        if (__atomic_load_n(&g_dma.done, __ATOMIC_ACQUIRE) || g_dma.timed_out)
+            break;
+        thread_block();
+    }
+    thread_cancel_block();
+    timer_cancel(&g_dma.timeout);
+    g_dma.waiter = NULL;
+    outb(bm + BM_COMMAND, direction);
+
+    if (!g_dma.done) {
+        printf("ata_dma_command: Timed out, bus master status: %d\n", (int)inb(bm + BM_STATUS));
+        return -1;
+    }
+    u8 ata_status = inb(IO_PRIMARY_BASE + 7);
+    if ((g_dma.bm_status & BM_STATUS_ERROR) || (ata_status & ATA_STATUS_ERR)) {
+        printf("ata_dma_command: Error, bus master status: %d, status: %d\n", (int)g_dma.bm_status, (int)ata_status);
+        return -1;
     }
-    return status;
+    *out_sectors = sectors;
+    return 0;
 }
 
+static int pata_storage_read(u32 unit, void* buffer, u64 lba, u64 sectors) {
+    return ata_read_sectors(buffer, lba, sectors);
+}
+
+static int pata_storage_write(u32 unit, void* buffer, u64 lba, u64 sectors) {
+    return ata_write_sectors(buffer, lba, sectors);
+}
+
+// Blocks for every command, the block layer gives it a thread
+static const StorageDriver g_pata_storage = {
+    .name          = "pata",
+    .read_sectors  = pata_storage_read,
+    .write_sectors = pata_storage_write,
+};
+
 void ata_soft_reset() {
     outb(IO_PRIMARY_CONTROL, 0x4); // SRST
     sleep_ns(5000); // 5 us
@@ -99,7 +423,7 @@ void init_pata() {
     outb(IO_PRIMARY_BASE + 3, 0); // LBA low
     outb(IO_PRIMARY_BASE + 4, 0); // LBA mid
     outb(IO_PRIMARY_BASE + 5, 0); // LBA high
-    outb(IO_PRIMARY_BASE + 7, 0xEC); // identify command
+    outb(IO_PRIMARY_BASE + 7, ATA_CMD_IDENTIFY);
     
     u8 status = inb(IO_PRIMARY_BASE + 7);
     
@@ -116,6 +440,7 @@ void init_pata() {
             // Done
             break;
         }
+        _mm_pause();
     }
     printf("BSY done, status: %d\n", (int)status);
 
@@ -137,116 +462,255 @@ void init_pata() {
             printf("DRQ: Ready to read data, status: %d\n", (int) status);
             break;
         }
+        _mm_pause();
     }
 
-    u16* ptr = (u16*)identify_data;
-    int count = 256;
-    asm (
-        "mov $0, %%eax\n"
-        "mov %%eax, %%es\n"
-        "rep insw\n"
-        : "+D" (ptr), "+c" (count)
-        : "d" (IO_PRIMARY_BASE)
-        : "memory", "eax"
-    );
+    ata_read_words(identify_data, 256);
 
-    printf("48bit mode: %d\n", (int) (identify_data[83] >> 10) & 1);
+    g_lba48   = (identify_data[83] >> 10) & 1;
+    g_max_lba = g_lba48 ? *(u64*)&identify_data[100] : *(u32*)&identify_data[60];
+    printf("48bit mode: %d\n", (int) g_lba48);
     printf("28bit max lba: %d\n", (int) *(u32*)&identify_data[60]);
     printf("48bit max lba: %d\n", (int) *(u64*)&identify_data[100]);
-}
 
+    // Word 47 is the most sectors the drive moves per DRQ block in READ/WRITE MULTIPLE.
+    // Larger blocks mean fewer interrupts/status polls per command.
+    u32 max_multiple = identify_data[47] & 0xFF;
+    if (max_multiple > 1) {
+        ata_wait_bsy();
+        outb(IO_PRIMARY_BASE + 6, g_lba48 ? 0x40 : 0xE0);
+        outb(IO_PRIMARY_BASE + 2, max_multiple);
+        outb(IO_PRIMARY_BASE + 7, ATA_CMD_SET_MULTIPLE);
+        ata_delay_400ns();
+        if (ata_wait_bsy() == 0 && (inb(IO_PRIMARY_BASE + 7) & ATA_STATUS_ERR) == 0)
+            g_multiple = max_multiple;
+    }
+    printf("Sectors per block: %d\n", (int) g_multiple);
 
-int ata_read_sectors(void* buffer, u64 lba, u64 sectors) {
-    // Assumes device is ready to be read
+    // word 49 bit 8: DMA supported
+    if (g_dma.found && (identify_data[49] & (1 << 8)))
+        ata_init_dma();
+    printf("DMA: %d\n", (int) g_dma.enabled);
 
-    int attempts = 0;
+    device_register_storage(&g_pata_storage, 0, g_max_lba);
+}
 
-start:
+static u32 ata_max_sectors_per_command() {
+    return g_lba48 ? 65536 : 256;
+}
 
-    if (attempts > 10) {
-        printf("ata_read_sector: Failed %d times\n", (int)attempts);
-        return -1;
+// One read command, the lock is held
+static int ata_read_command(u8* buffer, u64 lba, u32 count) {
+    u8 command;
+    if (g_multiple > 1)
+        command = g_lba48 ? ATA_CMD_READ_MULTIPLE_EXT : ATA_CMD_READ_MULTIPLE;
+    else
+        command = g_lba48 ? ATA_CMD_READ_SECTORS_EXT : ATA_CMD_READ_SECTORS;
+
+    int status = ata_wait_bsy();
+    if (status)
+        return status;
+    ata_issue(command, lba, count);
+
+    // The drive raises DRQ once per block of g_multiple sectors, the last one may be shorter
+    u32 left = count;
+    while (left > 0) {
+        status = ata_wait_drq();
+        if (status)
+            return status;
+        u32 block = left < g_multiple ? left : g_multiple;
+        ata_read_words(buffer, block * 256);
+        buffer += block * 512;
+        left -= block;
+        ata_delay_400ns();
     }
+    return 0;
+}
+
+// One write command, the lock is held
+static int ata_write_command(const u8* buffer, u64 lba, u32 count) {
+    u8 command;
+    if (g_multiple > 1)
+        command = g_lba48 ? ATA_CMD_WRITE_MULTIPLE_EXT : ATA_CMD_WRITE_MULTIPLE;
+    else
+        command = g_lba48 ? ATA_CMD_WRITE_SECTORS_EXT : ATA_CMD_WRITE_SECTORS;
 
     int status = ata_wait_bsy();
-    if (status) {
-        printf("ata_read_sector: Error while BUSY?, status: %d\n", (int)status);
-        return -1;
+    if (status)
+        return status;
+    ata_issue(command, lba, count);
+
+    u32 left = count;
+    while (left > 0) {
+        status = ata_wait_drq();
+        if (status)
+            return status;
+        u32 block = left < g_multiple ? left : g_multiple;
+        ata_write_words(buffer, block * 256);
+        buffer += block * 512;
+        left -= block;
+        ata_delay_400ns();
     }
-    
-    outb(IO_PRIMARY_BASE + 6, 0xE0 | ((lba >> 24) & 0x0F)); // drive + LBA bits 24–27
-    outb(IO_PRIMARY_BASE + 1, 0);
-    outb(IO_PRIMARY_BASE + 2, 1); // sector count
-    outb(IO_PRIMARY_BASE + 3, lba & 0xFF);
-    outb(IO_PRIMARY_BASE + 4, (lba >> 8) & 0xFF);
-    outb(IO_PRIMARY_BASE + 5, (lba >> 16) & 0xFF);
-    outb(IO_PRIMARY_BASE + 7, 0x20); // READ SECTORS command
-    
+    return ata_wait_bsy();
+}
+
+static int ata_flush() {
+    int status = ata_wait_bsy();
+    if (status)
+        return status;
+    outb(IO_PRIMARY_BASE + 6, g_lba48 ? 0x40 : 0xE0);
+    outb(IO_PRIMARY_BASE + 7, g_lba48 ? ATA_CMD_FLUSH_CACHE_EXT : ATA_CMD_FLUSH_CACHE);
+    ata_delay_400ns();
     status = ata_wait_bsy();
-    if (status) {
-        ata_soft_reset();
-        attempts++;
-        printf("ata_read_sector: Error while BUSY?, status: %d\n", (int)status);
-        goto start;
+    if (status)
+        return status;
+    if (inb(IO_PRIMARY_BASE + 7) & ATA_STATUS_ERR)
         return -1;
+    return 0;
+}
+
+static bool ata_check_range(const char* func, u64 lba, u64 sectors) {
+    if (lba + sectors < lba || (g_max_lba && lba + sectors > g_max_lba)) {
+        printf("%s: Sectors out of range\n", func);
+        return false;
     }
-    status = ata_wait_drq();
-    if (status) {
-        ata_soft_reset();
-        attempts++;
-        goto start;
-        return -1;
+    if (!g_lba48 && lba + sectors > (1 << 28)) {
+        printf("%s: Sectors above LBA28 without 48bit mode\n", func);
+        return false;
     }
+    return true;
+}
 
-    u16* ptr = (u16*)buffer;
-    int count = 256;
-    asm (
-        "mov $0, %%eax\n"
-        "mov %%eax, %%es\n"
-        "rep insw\n"
-        : "+D" (ptr), "+c" (count)
-        : "d" (IO_PRIMARY_BASE)
-        : "memory", "eax"
-    );
-    // for (int i = 0; i < count; i++) {
-    //     ptr[i] = inw(IO_PRIMARY_BASE); // 256 words = 512 bytes
-    // }
+// DMA is used when dma is set and the buffer allows it
+static int ata_read(void* buffer, u64 lba, u64 sectors, bool dma) {
+    // Assumes device is ready to be read
+    if (!ata_check_range("ata_read_sectors", lba, sectors))
+        return -1;
 
+    u8* ptr = buffer;
+    u32 max_count = ata_max_sectors_per_command();
+    int attempts = 0;
+    while (sectors > 0) {
+        u32 count = sectors < max_count ? sectors : max_count;
+
+        mutex_lock(&g_ata_mutex);
+        u32 done = 0;
+        int status = 0;
+        if (dma)
+            status = ata_dma_command(ptr, lba, count, false, &done);
+        if (!status && !done) {
+            status = ata_read_command(ptr, lba, count);
+            done = count;
+        }
+        if (status)
+            ata_soft_reset();
+        mutex_unlock(&g_ata_mutex);
+
+        if (status) {
+            attempts++;
+            printf("ata_read_sectors: Error, status: %d\n", (int)status);
+            if (attempts > 10) {
+                printf("ata_read_sectors: Failed %d times\n", (int)attempts);
+                return -1;
+            }
+            continue;
+        }
+        ptr += (u64)done * 512;
+        lba += done;
+        sectors -= done;
+    }
     return 0;
 }
 
-int ata_write_sectors(void* buffer, u64 lba, u64 sectors) {
-    // Assumes device is ready to be read
+int ata_read_sectors(void* buffer, u64 lba, u64 sectors) {
+    return ata_read(buffer, lba, sectors, g_dma.enabled);
+}
 
-    int status = ata_wait_bsy();
-    if (status) {
-        printf("ata_read_sector: Error while BUSY?, status: %d\n", (int)status);
+int ata_write_sectors(void* buffer, u64 lba, u64 sectors) {
+    // Assumes device is ready to be written
+    if (!ata_check_range("ata_write_sectors", lba, sectors))
         return -1;
+
+    u8* ptr = buffer;
+    u32 max_count = ata_max_sectors_per_command();
+    while (sectors > 0) {
+        u32 count = sectors < max_count ? sectors : max_count;
+
+        mutex_lock(&g_ata_mutex);
+        u32 done = 0;
+        int status = 0;
+        if (g_dma.enabled)
+            status = ata_dma_command(ptr, lba, count, true, &done);
+        if (!status && !done) {
+            status = ata_write_command(ptr, lba, count);
+            done = count;
+        }
+        mutex_unlock(&g_ata_mutex);
+        if (status) {
+            printf("ata_write_sectors: Error, status: %d\n", (int)status);
+            return -1;
+        }
+        ptr += (u64)done * 512;
+        lba += done;
+        sectors -= done;
     }
-    
-    outb(IO_PRIMARY_BASE + 6, 0xE0 | ((lba >> 24) & 0x0F)); // drive + LBA bits 24–27
-    outb(IO_PRIMARY_BASE + 2, 1); // sector count
-    outb(IO_PRIMARY_BASE + 3, (u8)lba & 0xFF);
-    outb(IO_PRIMARY_BASE + 4, (u8)(lba >> 8) & 0xFF);
-    outb(IO_PRIMARY_BASE + 5, (u8)(lba >> 16) & 0xFF);
-    outb(IO_PRIMARY_BASE + 7, 0x30); // write SECTORS command
-    
-    status = ata_wait_bsy();
+
+    // once per call instead of per sector
+    mutex_lock(&g_ata_mutex);
+    int status = ata_flush();
+    mutex_unlock(&g_ata_mutex);
     if (status) {
-        printf("ata_read_sector: Error while BUSY?, status: %d\n", (int)status);
+        printf("ata_write_sectors: Flush failed, status: %d\n", (int)status);
         return -1;
     }
-    status = ata_wait_drq();
-    if (status)
-        return -1;
+    return 0;
+}
 
-    u16* ptr = (u16*)buffer;
-    for (int i = 0; i < 256; i++) {
-        outw(IO_PRIMARY_BASE, ptr[i]); // 256 words = 512 bytes
-        sleep_ns(1000);
+// Busy time of all CPUs, what idle_wait didn't spend waiting
+static u64 cpu_busy_ns(u64 wall_ns, u64 idle_before_ns, u64* out_idle_ns) {
+    u64 idle_ns = 0;
+    u32 online = cpu_online_count();
+    for (u32 i = 0; i < online; i++) {
+        IdleStats stats;
+        idle_get_stats(i, &stats);
+        idle_ns += stats.idle_ns;
     }
+    if (out_idle_ns)
+        *out_idle_ns = idle_ns;
+    u64 idle_delta = idle_ns - idle_before_ns;
+    u64 total = wall_ns * online;
+    return total > idle_delta ? total - idle_delta : 0;
+}
 
-    outb(IO_PRIMARY_BASE + 7, 0xE7); // flush command
-
-    return 0;
+void pata_benchmark(u64 lba, u64 sectors, u32 rounds, bool dma) {
+    if (dma && !g_dma.enabled) {
+        printf("pata_benchmark: No DMA\n");
+        return;
+    }
+    u64 bytes = sectors * 512;
+    u8* buffer = kernel_reserve(bytes, PAGE_WRITE | PAGE_NO_EXECUTE);
+    if (!buffer) {
+        printf("pata_benchmark: Out of memory\n");
+        return;
+    }
+    // fault the pages in, they end up scattered so DMA gets a real scatter-gather list
+    memset(buffer, 0, bytes);
+
+    u64 idle_before;
+    cpu_busy_ns(0, 0, &idle_before);
+    u64 start = now_ns();
+    for (u32 i = 0; i < rounds; i++) {
+        if (ata_read(buffer, lba, sectors, dma)) {
+            printf("pata_benchmark: Read failed\n");
+            break;
+        }
+    }
+    u64 wall_ns = now_ns() - start;
+    u64 busy_ns = cpu_busy_ns(wall_ns, idle_before, NULL);
+
+    u64 total_kib = bytes * rounds / 1024;
+    u64 kib_per_s = wall_ns ? total_kib * 1000000000ull / wall_ns : 0;
+    u64 cycles_per_mib = total_kib ? ns_to_tsc(busy_ns) * 1024 / total_kib : 0;
+    printf("pata: %s %d KiB/s, %d CPU cycles/MiB\n", dma ? "DMA" : "PIO", (int)kib_per_s, (int)cycles_per_mib);
+    kernel_unreserve(buffer);
 }
@@ -3,15 +3,31 @@
 #pragma once
 
 #include "elos/kernel/common/types.h"
+#include "elos/kernel/driver/pci.h"
 
 
 
 
 
+/*
+    Finds the drive on the primary channel. When the PCI scan attached a bus master
+    controller before this, transfers use DMA and sleep until the drive's interrupt,
+    buffers DMA can't reach (above 4 GiB, not mapped) fall back to PIO.
+*/
 void init_pata();
 
+// Called by the PCI scan for IDE controllers, call init_pci before init_pata
+void pata_attach_controller(u8 bus, u8 slot, u8 function, PCI_ConfigSpace* config);
 
+
+/*
+    PIO transfers of any number of 512 byte sectors, split into commands of at most
+    65536 sectors (256 without 48-bit LBA). Returns 0 on success.
+    Writes flush the drive's cache before returning.
+*/
 int ata_read_sectors(void* buffer, u64 lba, u64 sectors);
 
 int ata_write_sectors(void* buffer, u64 lba, u64 sectors);
 
+// Reads the same sectors rounds times with DMA or PIO, prints throughput and CPU cycles per MiB
+void pata_benchmark(u64 lba, u64 sectors, u32 rounds, bool dma);
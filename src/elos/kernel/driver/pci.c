@@ -4,278 +4,18 @@
 #include "elos/kernel/log/print.h"
 #include "elos/kernel/common/intrinsics.h"
 #include "elos/kernel/debug/debug.h"
+#include "elos/kernel/common/sync.h"
+#include "elos/kernel/memory/paging.h"
 
 #include "elos/kernel/driver/pata.h"
+#include "elos/kernel/driver/ahci.h"
+#include "elos/kernel/driver/nvme.h"
+#include "elos/kernel/driver/virtio_blk.h"
 
-typedef enum PCI_ClassCode {
-    PCI_CLASSCODE__UNCLASSIFIED = 0x0,
-    PCI_CLASSCODE__MASS_STORAGE_CONTROLLER = 0x1,
-    PCI_CLASSCODE__NETWORK_CONTROLLER = 0x2,
-    PCI_CLASSCODE__DISPLAY_CONTROLLER = 0x3,
-    PCI_CLASSCODE__MULTIMEDIA_CONTROLLER = 0x4,
-    PCI_CLASSCODE__MEMORY_CONTROLLER = 0x5,
-    PCI_CLASSCODE__BRIDGE_CONTROLLER = 0x6,
-    PCI_CLASSCODE__SIMPLE_COMMUNICATION_CONTROLLER = 0x7,
-    PCI_CLASSCODE__BASE_SYSTEM_PERIPHERAL = 0x8,
-    PCI_CLASSCODE__INPUT_DEVICE_CONTROLLER = 0x9,
-    PCI_CLASSCODE__DOCKING_STATION = 0xA,
-    PCI_CLASSCODE__PROCESSOR = 0xB,
-    PCI_CLASSCODE__SERIAL_BUS_CONTROLLER = 0xC,
-    PCI_CLASSCODE__WIRELESS_CONTROLLER = 0xD,
-    PCI_CLASSCODE__INTELLIGENT_CONTROLLER = 0xE,
-    PCI_CLASSCODE__SATELLITE_COMMUNICATION_CONTROLLER = 0xF,
-    PCI_CLASSCODE__ENCRYPTION_CONTROLLER = 0x10,
-    PCI_CLASSCODE__SIGNAL_PROCESSING_CONTROLLER = 0x11,
-    PCI_CLASSCODE__PROCESSING_ACCELERATOR = 0x12,
-    PCI_CLASSCODE__NON_ESSENTIAL_INSTRUMENTATION = 0x13,
-    // reserved 0x14 - 0x3f
-    PCI_CLASSCODE__CO_PROCESSOR = 0x40,
-    // reserved 0x41 - 0xFE
-    PCI_CLASSCODE__UNASSIGNED_CLASS = 0xFF, // vendor specific
-} PCI_ClassCode;
-
-
-typedef enum PCI_Subclass {
-    PCI_SUBCLASS__OTHER = 0x80,
-
-    // PCI_CLASSCODE__UNCLASSIFIED
-    PCI_SUBCLASS__NON_VGA_COMPATIBLE_UNCLASSIFIED_DEVICE = 0x0,
-    PCI_SUBCLASS__VGA_COMPATIBLE_UNCLASSIFIED_DEVICE = 0x1,
-    
-    // PCI_CLASSCODE__MASS_STORAGE_CONTROLLER
-    PCI_SUBCLASS__SCSI_BUS_CONTROLLER = 0x0,
-    PCI_SUBCLASS__IDE_CONTROLLER = 0x1,
-    PCI_SUBCLASS__FLOPPY_DISK_CONTROLLER = 0x2,
-    PCI_SUBCLASS__IPI_BUS_CONTROLLER = 0x3,
-    PCI_SUBCLASS__RAID_CONTROLLER = 0x4,
-    PCI_SUBCLASS__ATA_CONTROLLER = 0x5,
-    PCI_SUBCLASS__SERIAL_ATA_CONTROLLER = 0x6,
-    PCI_SUBCLASS__SERIAL_ATTACHED_SCSI_CONTROLLER = 0x7,
-    PCI_SUBCLASS__NON_VOLATILE_MEMORY_CONTROLLER = 0x8,
-
-    // PCI_CLASSCODE__NETWORK_CONTROLLER
-    PCI_SUBCLASS__ETHERNET_CONTROLLER = 0x0,
-    PCI_SUBCLASS__TOKEN_RING_CONTROLLER = 0x1,
-    PCI_SUBCLASS__FDDI_CONTROLLER = 0x2,
-    PCI_SUBCLASS__ATM_CONTROLLER = 0x3,
-    PCI_SUBCLASS__ISDN_CONTROLLER = 0x4,
-    PCI_SUBCLASS__WORLD_FIP_CONTROLLER = 0x5,
-    PCI_SUBCLASS__PICMG_CONTROLLER = 0x6,
-    PCI_SUBCLASS__NETWORK_INFINIBAND_CONTROLLER = 0x7,
-    PCI_SUBCLASS__FABRIC_CONTROLLER = 0x8,
-
-    // PCI_CLASSCODE__DISPLAY_CONTROLLER
-    PCI_SUBCLASS__VGA_CONTROLLER = 0x0,
-    PCI_SUBCLASS__XGA_CONTROLLER = 0x1,
-    PCI_SUBCLASS__3D_CONTROLLER = 0x2,
-
-    // PCI_CLASSCODE__MULTIMEDIA_CONTROLLER
-    PCI_SUBCLASS__VIDEO_CONTROLLER = 0x0,
-    PCI_SUBCLASS__AUDIO_CONTROLLER = 0x1,
-    PCI_SUBCLASS__TELEPHONY_DEVICE = 0x2,
-    PCI_SUBCLASS__AUDIO_DEVICE     = 0x3,
-
-    // PCI_CLASSCODE__MEMORY_CONTROLLER
-    PCI_SUBCLASS__RAM_CONTROLLER = 0x0,
-    PCI_SUBCLASS__FLASH_CONTROLLER = 0x1,
-
-    // PCI_CLASSCODE__BRIDGE_CONTROLLER
-    PCI_SUBCLASS__HOST_BRIDGE = 0x0,
-    PCI_SUBCLASS__ISA_BRIDGE = 0x1,
-    PCI_SUBCLASS__EISA_BRIDGE = 0x2,
-    PCI_SUBCLASS__MCA_BRIDGE = 0x3,
-    PCI_SUBCLASS__PCI_TO_PCI_BRIDGE = 0x4,
-    PCI_SUBCLASS__PCMCIA_BRIDGE = 0x5,
-    PCI_SUBCLASS__NUBUS_BRIDGE = 0x6,
-    PCI_SUBCLASS__CARDBUS_BRIDGE = 0x7,
-    PCI_SUBCLASS__RACEWAY_BRIDGE = 0x8,
-    PCI_SUBCLASS__PCI_TO_PCI_SEMI_TRANSPARENT_BRIDGE = 0x9,
-    PCI_SUBCLASS__INFINIBAND_TO_PCI_BRIDGE = 0xA,
-
-    // PCI_CLASSCODE__SIMPLE_COMMUNICATION_CONTROLLER
-    PCI_SUBCLASS__SERIAL_CONTROLLER = 0x0,
-    PCI_SUBCLASS__PARALLEL_CONTROLLER = 0x1,
-    PCI_SUBCLASS__MULTIPORT_SERIAL_CONTROLLER = 0x2,
-    PCI_SUBCLASS__MODEM = 0x3,
-    PCI_SUBCLASS__IEEE_488_GPIB_CONTROLLER = 0x4,
-    PCI_SUBCLASS__SMART_CARD_CONTROLLER = 0x5,
-
-    // PCI_CLASSCODE__BASE_SYSTEM_PERIPHERAL
-    PCI_SUBCLASS__PIC = 0x0,
-    PCI_SUBCLASS__DMA_CONTROLLER = 0x1,
-    PCI_SUBCLASS__TIMER = 0x2,
-    PCI_SUBCLASS__RTC_CONTROLLER = 0x3,
-    PCI_SUBCLASS__PCI_HOT_PLUG_CONTROLLER = 0x4,
-    PCI_SUBCLASS__SD_HOST_CONTROLLER = 0x5,
-    PCI_SUBCLASS__IOMMU = 0x6,
-
-    // PCI_CLASSCODE__INPUT_DEVICE_CONTROLLER
-    PCI_SUBCLASS__KEYBOARD_CONTROLLER = 0x0,
-    PCI_SUBCLASS__PEN_CONTROLLER = 0x1,
-    PCI_SUBCLASS__MOUSE_CONTROLLER = 0x2,
-    PCI_SUBCLASS__SCANNER_CONTROLLER = 0x3,
-    PCI_SUBCLASS__GAMEPORT_CONTROLLER = 0x4,
-
-    // PCI_CLASSCODE__DOCKING_STATION
-    PCI_SUBCLASS__GENERIC_DOCKING_STATION = 0x0,
-
-    // PCI_CLASSCODE__PROCESSOR
-    PCI_SUBCLASS__386 = 0x0,
-    PCI_SUBCLASS__486 = 0x1,
-    PCI_SUBCLASS__PENTIUM = 0x2,
-    PCI_SUBCLASS__PENTIUM_PRO = 0x3,
-    PCI_SUBCLASS__ALPHA = 0x10,
-    PCI_SUBCLASS__POWERPC = 0x20,
-    PCI_SUBCLASS__MIPS = 0x30,
-    PCI_SUBCLASS__CO_PROCESSOR = 0x40,
-
-    // PCI_CLASSCODE__SERIAL_BUS_CONTROLLER
-    PCI_SUBCLASS__FIREWIRE_CONTROLLER = 0x0,
-    PCI_SUBCLASS__ACCESS_BUS_CONTROLLER = 0x1,
-    PCI_SUBCLASS__SSA = 0x2,
-    PCI_SUBCLASS__USB_CONTROLLER = 0x3,
-    PCI_SUBCLASS__FIBRE_CHANNEL = 0x4,
-    PCI_SUBCLASS__SMBUS_CONTROLLER = 0x5,
-    PCI_SUBCLASS__SERIAL_BUS_INFINIBAND_CONTROLLER = 0x6,
-    PCI_SUBCLASS__IPMI_INTERFACE = 0x7,
-    PCI_SUBCLASS__SERCOS_INTERFACE = 0x8,
-    PCI_SUBCLASS__CANBUS_CONTROLLER = 0x9,
-
-    // PCI_CLASSCODE__WIRELESS_CONTROLLER
-    PCI_SUBCLASS__IRDA_CONTROLLER = 0x0,
-    PCI_SUBCLASS__CONSUMER_IR_CONTROLLER = 0x1,
-    PCI_SUBCLASS__RF_CONTROLLER = 0x10,
-    PCI_SUBCLASS__BLUETOOTH_CONTROLLER = 0x11,
-    PCI_SUBCLASS__BROADBAND_CONTROLLER = 0x12,
-    PCI_SUBCLASS__ETHERNET_CONTROLLER_802_1A = 0x20,
-    PCI_SUBCLASS__ETHERNET_CONTROLLER_802_1B = 0x21,
-
-    // PCI_CLASSCODE__INTELLIGENT_CONTROLLER
-    PCI_SUBCLASS__I2O = 0x0,
-
-    // PCI_CLASSCODE__SATELLITE_COMMUNICATION_CONTROLLER
-    PCI_SUBCLASS__SATELLITE_TV_CONTROLLER = 0x0,
-    PCI_SUBCLASS__SATELLITE_AUDIO_CONTROLLER = 0x1,
-    PCI_SUBCLASS__SATELLITE_VOICE_CONTROLLER = 0x2,
-    PCI_SUBCLASS__SATELLITE_DATA_CONTROLLER = 0x3,
-
-    // PCI_CLASSCODE__ENCRYPTION_CONTROLLER
-    PCI_SUBCLASS__NETWORK_AND_COMPUTING_ENCRYPTION = 0x0,
-    PCI_SUBCLASS__ENTERTAINMENT_ENCRYPTION = 0x10,
-
-    // PCI_CLASSCODE__SIGNAL_PROCESSING_CONTROLLER
-    PCI_SUBCLASS__DPIO_MODULES = 0x0,
-    PCI_SUBCLASS__PERFORMANCE_COUNTERS = 0x1,
-    PCI_SUBCLASS__COMMUNICATION_SYNCHRONIZER = 0x10,
-    PCI_SUBCLASS__SIGNAL_PROCESSING_MANAGEMENT = 0x20,
-} PCI_Subclass;
-
-// TODO: prog IF
-
-typedef struct PCI_ConfigSpace {
-    u16 vendorID;
-    u16 deviceID;
-    struct {
-        u16  io_space                           : 1;
-        u16  memory_space                       : 1;
-        u16  bus_master                         : 1;
-        u16  special_cycles                     : 1;
-        u16  memory_write_and_invalidate_enable : 1;
-        u16  vga_palette_snoop                  : 1;
-        u16  parity_error_response              : 1;
-        u16  _reserved0                         : 1;
-        u16  serr_enable                        : 1;
-        u16  fast_back_to_back_enable           : 1;
-        u16  interupt_disable                   : 1;
-    } command;
-    struct {
-        u16 _reserved0                : 1;
-        u16 interrupt_status          : 1;
-        u16 capabilities_list         : 1;
-        u16 mhz66_capable             : 1;
-        u16 _reserved1                : 1;
-        u16 fast_back_to_back_capable : 1;
-        u16 master_data_parity_error  : 1;
-        u16 devsel_timing             : 1;
-        u16 signaled_target_abort     : 1;
-        u16 received_target_abort     : 1;
-        u16 received_master_abort     : 1;
-        u16 signaled_system_error     : 1;
-        u16 detected_parity_error     : 1;
-    } status;
-    u8  revisionID;
-    u8  progIF;
-    u8  subclass;
-    u8  classCode;
-    u8  cacheLineSize;
-    u8  latencyTimer;
-    u8  headerType;
-    struct {
-        u8 completion_code : 4;
-        u8 _reserved0      : 2;
-        u8 start_bist      : 1;
-        u8 bist_capable    : 1;
-    } bist;
-
-    // Header type specific
-    union {
-
-        // Header Type 0x0
-        struct {
-            u32 bar0;
-            u32 bar1;
-            u32 bar2;
-            u32 bar3;
-            u32 bar4;
-            u32 bar5;
-            u32 cardbus_cis_pointer;
-            u16 subsystem_vendor_id;
-            u16 subsystem_id;
-            u32 expansion_rom_base_address;
-            u8  capabilities_pointer;
-            u8  _reserved0[3];
-            u32 _reserved1;
-            u8  interrupt_line;
-            u8  interrupt_pin;
-            u8  min_grant;
-            u8  max_latency;
-        } header0;
-        
-        // Header Type 0x1 (PCI-to-PCI bridge)
-        struct {
-            u32 bar0;
-            u32 bar1;
-            u8  primary_bus_number;
-            u8  secondary_bus_number;
-            u8  subordinate_bus_number;
-            u8  secondary_latency_timer;
-            u8  io_base;
-            u8  io_limit;
-            u16 secondary_status;
-            u16 memory_base;
-            u16 memory_limit;
-            u16 prefetchable_memory_base;
-            u16 prefetchable_memory_limit;
-            u32 prefetchable_base_upper_32_bits;
-            u32 prefetchable_limit_upper_32_bits;
-            u16 io_base_upper_16_bits;
-            u16 io_limit_upper_16_bits;
-            u8  capabilities_pointer;
-            u8  _reserved0[3];
-            u32 expansion_rom_base_address;
-            u16 bridge_control;
-            u8  interrupt_pin;
-            u8  interrupt_line;
-        } header1;
-
-          // Header Type 0x2 (PCI-to-CardBus bridge)
-        //   struct {
-        //     u32 cardbus_socket_exca_base_address;
-        // } header2;
-    };
-} PCI_ConfigSpace;
-
-static u16 pciConfig_readw(u8 bus, u8 slot, u8 func, u8 offset) {
+// CONFIG_ADDRESS and CONFIG_DATA are one access as a pair, drivers may read config space from interrupts
+static Spinlock g_pci_config_lock = LOCK_INIT("pci config");
+
+u16 pciConfig_readw(u8 bus, u8 slot, u8 func, u8 offset) {
     // TODO: Handle errors?
     if (slot >= 1<<6)
         kernel_bug();
@@ -289,16 +29,18 @@ static u16 pciConfig_readw(u8 bus, u8 slot, u8 func, u8 offset) {
         | ((u32) func << 8)
         | ((u32) offset & 0xFC); // low 2 bits should be zero for DWORD alignment
 
+    bool enabled = spin_lock_irqsave(&g_pci_config_lock);
     // CONFIG_ADDRESS
     outl(0xCF8, address);
 
     // CONFIG_DATA
     u32 value = inl(0xCFC);
+    spin_unlock_irqrestore(&g_pci_config_lock, enabled);
 
     return (value >> ((offset&2) * 8)) & 0xFFFF;
 }
 
-static u32 pciConfig_readl(u8 bus, u8 slot, u8 func, u8 offset) {
+u32 pciConfig_readl(u8 bus, u8 slot, u8 func, u8 offset) {
     // TODO: Handle errors?
     if (slot >= (1<<5))
         kernel_bug();
@@ -312,14 +54,134 @@ static u32 pciConfig_readl(u8 bus, u8 slot, u8 func, u8 offset) {
         | ((u32) func << 8)
         | ((u32) offset & 0xFC); // low 2 bits should be zero for DWORD alignment
 
+    bool enabled = spin_lock_irqsave(&g_pci_config_lock);
     // CONFIG_ADDRESS
     outl(0xCF8, address);
 
     // CONFIG_DATA
     u32 value = inl(0xCFC);
+    spin_unlock_irqrestore(&g_pci_config_lock, enabled);
     return value;
 }
 
+void pciConfig_writel(u8 bus, u8 slot, u8 func, u8 offset, u32 value) {
+    if (slot >= (1<<5))
+        kernel_bug();
+    if (func >= (1<<3))
+        kernel_bug();
+    if ((offset & 3) != 0)
+        kernel_bug();
+    u32 address = (1 << 31) // enable bit
+        | ((u32) bus << 16)
+        | ((u32) slot << 11)
+        | ((u32) func << 8)
+        | ((u32) offset & 0xFC);
+
+    bool enabled = spin_lock_irqsave(&g_pci_config_lock);
+    outl(0xCF8, address);
+    outl(0xCFC, value);
+    spin_unlock_irqrestore(&g_pci_config_lock, enabled);
+}
+
+void pci_enable_command(u8 bus, u8 slot, u8 function, u16 bits) {
+    u32 command = pciConfig_readl(bus, slot, function, 4) & 0xFFFF; // status bits are write 1 to clear
+    pciConfig_writel(bus, slot, function, 4, command | bits);
+}
+
+u8 pci_find_capability(u8 bus, u8 slot, u8 function, u8 id) {
+    return pci_next_capability(bus, slot, function, 0, id);
+}
+
+u8 pci_next_capability(u8 bus, u8 slot, u8 function, u8 previous, u8 id) {
+    u8 offset;
+    if (previous) {
+        offset = (pciConfig_readl(bus, slot, function, previous) >> 8) & 0xFC;
+    } else {
+        u16 status = pciConfig_readl(bus, slot, function, 4) >> 16;
+        if (!(status & 0x10)) // capabilities list
+            return 0;
+        offset = pciConfig_readl(bus, slot, function, 0x34) & 0xFC;
+    }
+    // bounded in case the list loops
+    for (int i = 0; offset && i < 48; i++) {
+        u32 header = pciConfig_readl(bus, slot, function, offset);
+        if ((header & 0xFF) == id)
+            return offset;
+        offset = (header >> 8) & 0xFC;
+    }
+    return 0;
+}
+
+bool pci_enable_msi(u8 bus, u8 slot, u8 function, u8 vector, u32 apic_id) {
+    u8 msi = pci_find_capability(bus, slot, function, PCI_CAPABILITY_MSI);
+    if (!msi)
+        return false;
+    u32 header = pciConfig_readl(bus, slot, function, msi);
+    u16 control = header >> 16;
+    bool is_64bit = control & 0x80;
+
+    // fixed delivery, edge, physical destination
+    pciConfig_writel(bus, slot, function, msi + 4, 0xFEE00000 | ((apic_id & 0xFF) << 12));
+    if (is_64bit) {
+        pciConfig_writel(bus, slot, function, msi + 8, 0);
+        pciConfig_writel(bus, slot, function, msi + 12, vector);
+    } else {
+        pciConfig_writel(bus, slot, function, msi + 8, vector);
+    }
+    control &= ~0x70; // one vector
+    control |= 0x1;   // enable
+    pciConfig_writel(bus, slot, function, msi, (header & 0xFFFF) | ((u32)control << 16));
+    pci_enable_command(bus, slot, function, PCI_COMMAND_INTX_DISABLE);
+    return true;
+}
+
+u64 pci_bar_address(u8 bus, u8 slot, u8 function, u32 bar) {
+    u32 low = pciConfig_readl(bus, slot, function, 0x10 + bar * 4);
+    if (low & 1)
+        return 0;
+    u64 address = low & ~0xFULL;
+    if (((low >> 1) & 3) == 2 && bar < 5)
+        address |= (u64)pciConfig_readl(bus, slot, function, 0x10 + (bar + 1) * 4) << 32;
+    return address;
+}
+
+bool pci_msix_init(u8 bus, u8 slot, u8 function, PciMsix* out_msix) {
+    u8 msix = pci_find_capability(bus, slot, function, PCI_CAPABILITY_MSIX);
+    if (!msix)
+        return false;
+    u32 header = pciConfig_readl(bus, slot, function, msix);
+    u16 control = header >> 16;
+    u32 table = pciConfig_readl(bus, slot, function, msix + 4);
+    u32 count = (control & 0x7FF) + 1;
+
+    u64 bar = pci_bar_address(bus, slot, function, table & 7);
+    if (!bar)
+        return false;
+    volatile u32* entries = map_mmio(bar + (table & ~7u), count * 16);
+    if (!entries)
+        return false;
+    for (u32 i = 0; i < count; i++)
+        entries[i * 4 + 3] = 1; // masked
+
+    control |= 0x8000; // enable
+    control &= ~0x4000; // function mask
+    pciConfig_writel(bus, slot, function, msix, (header & 0xFFFF) | ((u32)control << 16));
+    pci_enable_command(bus, slot, function, PCI_COMMAND_INTX_DISABLE);
+
+    out_msix->table = entries;
+    out_msix->count = count;
+    return true;
+}
+
+void pci_msix_set(PciMsix* msix, u32 entry, u8 vector, u32 apic_id) {
+    volatile u32* e = &msix->table[entry * 4];
+    e[3] = 1;
+    e[0] = 0xFEE00000 | ((apic_id & 0xFF) << 12);
+    e[1] = 0;
+    e[2] = vector;
+    e[3] = 0;
+}
+
 void pci_read_config_space(PCI_ConfigSpace* config, u8 bus, u8 slot, u8 function) {
     u32* dwords = (u32*)config;
 
@@ -354,11 +216,19 @@ void pci_scan_function(int bus, int device, int function) {
     } else {
         switch (config.classCode) {
             case PCI_CLASSCODE__MASS_STORAGE_CONTROLLER: {
-                if (config.subclass == PCI_SUBCLASS__IDE_CONTROLLER) {
+                if (config.vendorID == VIRTIO_PCI_VENDOR && (config.deviceID == VIRTIO_PCI_DEVICE_BLOCK || config.deviceID == VIRTIO_PCI_DEVICE_BLOCK_TRANSITIONAL)) {
+                    virtio_blk_attach_controller(bus, device, function, &config);
+                } else if (config.subclass == PCI_SUBCLASS__IDE_CONTROLLER) {
+                    pata_attach_controller(bus, device, function, &config);
+
                     // for each drive and bus we create a device if we can communicate with it
 
                     // If we did a scan previously then we want to update the devices we already made instead of
                     // overwriting or creating new ones.
+                } else if (config.subclass == PCI_SUBCLASS__SERIAL_ATA_CONTROLLER && config.progIF == 0x01) {
+                    ahci_attach_controller(bus, device, function, &config);
+                } else if (config.subclass == PCI_SUBCLASS__NON_VOLATILE_MEMORY_CONTROLLER && config.progIF == 0x02) {
+                    nvme_attach_controller(bus, device, function, &config);
                 }
             } break;
             default: {
@@ -399,6 +269,10 @@ void pci_scan_bus(int bus) {
     }
 }
 
+void init_pci() {
+    pci_scan_buses();
+}
+
 void pci_scan_buses() {
 
     int header = pci_readHeaderType(0, 0, 0);
@@ -0,0 +1,796 @@
+/*
+    Every slot of a queue has its own DMA memory with the request header, the status
+    byte and the indirect descriptor table. With indirect descriptors slot n owns ring
+    entry n (split) or is the buffer id (packed), without them (split only) slot n owns
+    a fixed chain of VIRTIO_BLK_MAX_DESCRIPTORS ring descriptors. Nothing has to
+    allocate descriptors at submit time either way.
+
+    Packed rings are only used together with indirect descriptors so every request
+    is one ring entry and completions advance the used position by one.
+
+    Notifications and interrupts compare the other side's event index with how far
+    the ring moved (vring_need_event in the spec).
+*/
+
+#include "elos/kernel/driver/virtio_blk.h"
+#include "elos/kernel/log/print.h"
+#include "elos/kernel/common/cpu.h"
+#include "elos/kernel/common/clock.h"
+#include "elos/kernel/common/scheduler.h"
+#include "elos/kernel/common/smp.h"
+#include "elos/kernel/common/string.h"
+#include "elos/kernel/common/sync.h"
+#include "elos/kernel/interrupt/interrupt.h"
+#include "elos/kernel/memory/paging.h"
+#include "elos/kernel/memory/phys_allocator.h"
+#include "elos/kernel/memory/slab.h"
+#include "elos/kernel/debug/debug.h"
+#include "elos/kernel/device/device.h"
+
+#define VIRTIO_BLK_MAX_DISKS        4
+#define VIRTIO_BLK_MAX_SLOTS        64
+#define VIRTIO_QUEUE_MAX_SIZE       128
+// header, a page per 8 sectors plus one for an unaligned buffer, status
+#define VIRTIO_BLK_MAX_DESCRIPTORS  (VIRTIO_BLK_MAX_SECTORS / 8 + 3)
+#define VIRTIO_RESET_TIMEOUT_NS     (1000000000ull)
+
+#define VIRTIO_PCI_CAP_COMMON       1
+#define VIRTIO_PCI_CAP_NOTIFY       2
+#define VIRTIO_PCI_CAP_DEVICE       4
+
+// common configuration
+#define VIRTIO_COMMON_DEVICE_FEATURE_SELECT  0x00
+#define VIRTIO_COMMON_DEVICE_FEATURE         0x04
+#define VIRTIO_COMMON_DRIVER_FEATURE_SELECT  0x08
+#define VIRTIO_COMMON_DRIVER_FEATURE         0x0C
+#define VIRTIO_COMMON_CONFIG_MSIX_VECTOR     0x10
+#define VIRTIO_COMMON_NUM_QUEUES             0x12
+#define VIRTIO_COMMON_DEVICE_STATUS          0x14
+#define VIRTIO_COMMON_CONFIG_GENERATION      0x15
+#define VIRTIO_COMMON_QUEUE_SELECT           0x16
+#define VIRTIO_COMMON_QUEUE_SIZE             0x18
+#define VIRTIO_COMMON_QUEUE_MSIX_VECTOR      0x1A
+#define VIRTIO_COMMON_QUEUE_ENABLE           0x1C
+#define VIRTIO_COMMON_QUEUE_NOTIFY_OFF       0x1E
+#define VIRTIO_COMMON_QUEUE_DESC             0x20
+#define VIRTIO_COMMON_QUEUE_DRIVER           0x28
+#define VIRTIO_COMMON_QUEUE_DEVICE           0x30
+#define VIRTIO_NO_VECTOR                     0xFFFF
+
+#define VIRTIO_STATUS_ACKNOWLEDGE   0x01
+#define VIRTIO_STATUS_DRIVER        0x02
+#define VIRTIO_STATUS_DRIVER_OK     0x04
+#define VIRTIO_STATUS_FEATURES_OK   0x08
+#define VIRTIO_STATUS_FAILED        0x80
+
+#define VIRTIO_BLK_F_SIZE_MAX       (1ull << 1)
+#define VIRTIO_BLK_F_SEG_MAX        (1ull << 2)
+#define VIRTIO_BLK_F_RO             (1ull << 5)
+#define VIRTIO_BLK_F_FLUSH          (1ull << 9)
+#define VIRTIO_BLK_F_MQ             (1ull << 12)
+#define VIRTIO_F_INDIRECT_DESC      (1ull << 28)
+#define VIRTIO_F_EVENT_IDX          (1ull << 29)
+#define VIRTIO_F_VERSION_1          (1ull << 32)
+#define VIRTIO_F_RING_PACKED        (1ull << 34)
+
+// device configuration
+#define VIRTIO_BLK_CONFIG_CAPACITY    0x00
+#define VIRTIO_BLK_CONFIG_SIZE_MAX    0x08
+#define VIRTIO_BLK_CONFIG_SEG_MAX     0x0C
+#define VIRTIO_BLK_CONFIG_NUM_QUEUES  0x22
+
+#define VIRTIO_BLK_T_IN     0
+#define VIRTIO_BLK_T_OUT    1
+#define VIRTIO_BLK_T_FLUSH  4
+#define VIRTIO_BLK_S_OK     0
+
+#define VIRTQ_DESC_F_NEXT       0x1
+#define VIRTQ_DESC_F_WRITE      0x2
+#define VIRTQ_DESC_F_INDIRECT   0x4
+#define VIRTQ_DESC_F_AVAIL      (1 << 7)
+#define VIRTQ_DESC_F_USED       (1 << 15)
+#define VIRTQ_AVAIL_F_NO_INTERRUPT  0x1
+#define VIRTQ_USED_F_NO_NOTIFY      0x1
+#define VIRTQ_EVENT_ENABLE      0x0
+#define VIRTQ_EVENT_DISABLE     0x1
+#define VIRTQ_EVENT_DESC        0x2
+
+typedef struct VirtqDesc {
+    u64 addr;
+    u32 len;
+    u16 flags;
+    u16 next;
+} VirtqDesc;
+
+typedef struct VirtqPackedDesc {
+    u64 addr;
+    u32 len;
+    u16 id;
+    u16 flags;
+} VirtqPackedDesc;
+
+typedef struct VirtqAvail {
+    u16 flags;
+    u16 idx;
+    u16 ring[]; // used_event after the last entry
+} VirtqAvail;
+
+typedef struct VirtqUsedElem {
+    u32 id;
+    u32 len;
+} VirtqUsedElem;
+
+typedef struct VirtqUsed {
+    u16 flags;
+    u16 idx;
+    VirtqUsedElem ring[]; // avail_event after the last entry
+} VirtqUsed;
+
+typedef struct VirtqEvent {
+    u16 off_wrap;
+    u16 flags;
+} VirtqEvent;
+
+typedef struct VirtioBlkHeader {
+    u32 type;
+    u32 _reserved;
+    u64 sector;
+} VirtioBlkHeader;
+
+// Device visible part of a slot
+typedef struct VirtioBlkSlot {
+    VirtqDesc table[VIRTIO_BLK_MAX_DESCRIPTORS]; // indirect table, packed queues store VirtqPackedDesc
+    VirtioBlkHeader header;
+    volatile u8 status;
+} VirtioBlkSlot;
+
+typedef struct VirtioBlkRequest {
+    VirtioBlkCallback callback;
+    void* arg;
+} VirtioBlkRequest;
+
+typedef struct VirtioQueue {
+    u16 index;
+    u16 size;
+    bool packed;
+    bool indirect;
+    bool event_idx;
+    volatile u16* notify;
+
+    // split
+    volatile VirtqDesc*  desc;
+    volatile VirtqAvail* avail;
+    volatile VirtqUsed*  used;
+    volatile u16* used_event;
+    volatile u16* avail_event;
+    // packed
+    volatile VirtqPackedDesc* ring;
+    volatile VirtqEvent* driver_event;
+    volatile VirtqEvent* device_event;
+
+    VirtioBlkSlot* slots;
+    u64 slots_phys;
+    u32 slot_count_total;
+
+    Spinlock lock;      // protects the fields below
+    u16 avail_idx;      // split: free running index, packed: next ring entry
+    u16 used_idx;       // split: free running index, packed: next ring entry
+    bool avail_wrap;
+    bool used_wrap;
+    u64 free_slots;
+    VirtioBlkRequest requests[VIRTIO_BLK_MAX_SLOTS];
+
+    Semaphore slot_count;
+    u64 completed;
+    u64 errors;
+    u64 notifications;
+    u64 suppressed;     // submissions that didn't have to notify
+} VirtioQueue;
+
+typedef struct VirtioBlkDisk {
+    volatile u8* common;
+    volatile u8* notify_base;
+    u32 notify_multiplier;
+    volatile u8* device_config;
+    PciMsix msix;
+
+    u64 features;
+    u64 sectors;
+    u32 max_sectors;
+
+    VirtioQueue* queues[MAX_CPUS];
+    u32 queue_count;
+    VirtioQueue* cpu_queues[MAX_CPUS];
+} VirtioBlkDisk;
+
+static VirtioBlkDisk g_virtio_disks[VIRTIO_BLK_MAX_DISKS];
+static u32 g_virtio_disk_count;
+static VirtioQueue* g_virtio_vector_queues[256];
+
+static inline u8 common_read8(VirtioBlkDisk* disk, u32 reg) {
+    return *(volatile u8*)(disk->common + reg);
+}
+static inline u16 common_read16(VirtioBlkDisk* disk, u32 reg) {
+    return *(volatile u16*)(disk->common + reg);
+}
+static inline u32 common_read32(VirtioBlkDisk* disk, u32 reg) {
+    return *(volatile u32*)(disk->common + reg);
+}
+static inline void common_write8(VirtioBlkDisk* disk, u32 reg, u8 value) {
+    *(volatile u8*)(disk->common + reg) = value;
+}
+static inline void common_write16(VirtioBlkDisk* disk, u32 reg, u16 value) {
+    *(volatile u16*)(disk->common + reg) = value;
+}
+static inline void common_write32(VirtioBlkDisk* disk, u32 reg, u32 value) {
+    *(volatile u32*)(disk->common + reg) = value;
+}
+static inline void common_write64(VirtioBlkDisk* disk, u32 reg, u64 value) {
+    common_write32(disk, reg, (u32)value);
+    common_write32(disk, reg + 4, (u32)(value >> 32));
+}
+
+// True if moving from old to new passed event, from the virtio spec
+static inline bool vring_need_event(u16 event, u16 new, u16 old) {
+    return (u16)(new - event - 1) < (u16)(new - old);
+}
+
+static bool virtio_reset(VirtioBlkDisk* disk) {
+    common_write8(disk, VIRTIO_COMMON_DEVICE_STATUS, 0);
+    u64 deadline = __rdtsc() + ns_to_tsc(VIRTIO_RESET_TIMEOUT_NS);
+    while (common_read8(disk, VIRTIO_COMMON_DEVICE_STATUS) != 0) {
+        if (__rdtsc() > deadline)
+            return false;
+        _mm_pause();
+    }
+    return true;
+}
+
+static u64 virtio_device_features(VirtioBlkDisk* disk) {
+    common_write32(disk, VIRTIO_COMMON_DEVICE_FEATURE_SELECT, 0);
+    u64 low = common_read32(disk, VIRTIO_COMMON_DEVICE_FEATURE);
+    common_write32(disk, VIRTIO_COMMON_DEVICE_FEATURE_SELECT, 1);
+    u64 high = common_read32(disk, VIRTIO_COMMON_DEVICE_FEATURE);
+    return low | (high << 32);
+}
+
+static void virtio_driver_features(VirtioBlkDisk* disk, u64 features) {
+    common_write32(disk, VIRTIO_COMMON_DRIVER_FEATURE_SELECT, 0);
+    common_write32(disk, VIRTIO_COMMON_DRIVER_FEATURE, (u32)features);
+    common_write32(disk, VIRTIO_COMMON_DRIVER_FEATURE_SELECT, 1);
+    common_write32(disk, VIRTIO_COMMON_DRIVER_FEATURE, (u32)(features >> 32));
+}
+
+// The device may change its configuration while we read it, the generation tells
+static u64 virtio_blk_read_capacity(VirtioBlkDisk* disk) {
+    u8 generation;
+    u64 capacity;
+    do {
+        generation = common_read8(disk, VIRTIO_COMMON_CONFIG_GENERATION);
+        u64 low  = *(volatile u32*)(disk->device_config + VIRTIO_BLK_CONFIG_CAPACITY);
+        u64 high = *(volatile u32*)(disk->device_config + VIRTIO_BLK_CONFIG_CAPACITY + 4);
+        capacity = low | (high << 32);
+    } while (generation != common_read8(disk, VIRTIO_COMMON_CONFIG_GENERATION));
+    return capacity;
+}
+
+static u64 slot_phys(VirtioQueue* queue, u32 slot) {
+    return queue->slots_phys + slot * sizeof(VirtioBlkSlot);
+}
+
+// Writes descriptor i of a chain, into an indirect table or the split ring
+static void virtio_set_desc(VirtioQueue* queue, void* table, u32 base, u32 i, u64 addr, u32 len, u16 flags, bool last) {
+    if (queue->packed) {
+        // indirect tables of packed queues are in order, NEXT is ignored
+        volatile VirtqPackedDesc* desc = (volatile VirtqPackedDesc*)table + i;
+        desc->addr  = addr;
+        desc->len   = len;
+        desc->id    = 0;
+        desc->flags = flags;
+    } else {
+        volatile VirtqDesc* desc = (volatile VirtqDesc*)table + i;
+        desc->addr  = addr;
+        desc->len   = len;
+        desc->flags = flags | (last ? 0 : VIRTQ_DESC_F_NEXT);
+        desc->next  = last ? 0 : base + i + 1;
+    }
+}
+
+/*
+    Fills the slot's descriptors: header, a descriptor per page of the buffer, status.
+    Returns the number of descriptors or 0 if the buffer isn't mapped.
+*/
+static u32 virtio_blk_build(VirtioQueue* queue, u32 slot, u32 type, u64 lba, u8* buffer, u64 bytes) {
+    VirtioBlkSlot* dma = &queue->slots[slot];
+    void* table;
+    u32 base = 0;
+    if (queue->indirect) {
+        table = dma->table;
+    } else {
+        base = slot * VIRTIO_BLK_MAX_DESCRIPTORS;
+        table = (void*)&queue->desc[base];
+    }
+
+    dma->header.type      = type;
+    dma->header._reserved = 0;
+    dma->header.sector    = lba;
+    dma->status           = 0xFF;
+    u64 phys = slot_phys(queue, slot);
+
+    u32 count = 0;
+    virtio_set_desc(queue, table, base, count++, phys + offsetof(VirtioBlkSlot, header), sizeof(VirtioBlkHeader), 0, false);
+    u16 data_flags = type == VIRTIO_BLK_T_IN ? VIRTQ_DESC_F_WRITE : 0;
+    while (bytes > 0) {
+        void* physical;
+        if (!lookup_page(buffer, &physical, NULL))
+            return 0;
+        u64 len = PAGE_SIZE_4K - ((u64)buffer & (PAGE_SIZE_4K - 1));
+        if (len > bytes)
+            len = bytes;
+        if (count == VIRTIO_BLK_MAX_DESCRIPTORS - 1)
+            return 0;
+        virtio_set_desc(queue, table, base, count++, (u64)physical, len, data_flags, false);
+        buffer += len;
+        bytes -= len;
+    }
+    virtio_set_desc(queue, table, base, count++, phys + offsetof(VirtioBlkSlot, status), 1, VIRTQ_DESC_F_WRITE, true);
+    return count;
+}
+
+// Makes the slot's chain available, returns whether the device wants to be notified. Lock held.
+static bool virtio_queue_push(VirtioQueue* queue, u32 slot, u32 count) {
+    if (queue->packed) {
+        volatile VirtqPackedDesc* desc = &queue->ring[queue->avail_idx];
+        desc->addr = slot_phys(queue, slot);
+        desc->len  = count * sizeof(VirtqPackedDesc);
+        desc->id   = slot;
+        u16 flags = VIRTQ_DESC_F_INDIRECT | (queue->avail_wrap ? VIRTQ_DESC_F_AVAIL : VIRTQ_DESC_F_USED);
+        // the device may look at the descriptor as soon as the flags say it's available
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        desc->flags = flags;
+        queue->avail_idx++;
+        if (queue->avail_idx == queue->size) {
+            queue->avail_idx = 0;
+            queue->avail_wrap = !queue->avail_wrap;
+        }
+        // the device's event must be read after it can see the descriptor
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        u16 event_flags = queue->device_event->flags;
+        if (event_flags == VIRTQ_EVENT_DISABLE)
+            return false;
+        if (event_flags != VIRTQ_EVENT_DESC)
+            return true;
+        u16 off_wrap = queue->device_event->off_wrap;
+        u16 event = off_wrap & 0x7FFF;
+        if ((off_wrap >> 15) != queue->avail_wrap)
+            event -= queue->size;
+        return vring_need_event(event, queue->avail_idx, queue->avail_idx - 1);
+    }
+
+    u16 head = queue->indirect ? slot : slot * VIRTIO_BLK_MAX_DESCRIPTORS;
+    if (queue->indirect) {
+        volatile VirtqDesc* desc = &queue->desc[head];
+        desc->addr  = slot_phys(queue, slot);
+        desc->len   = count * sizeof(VirtqDesc);
+        desc->flags = VIRTQ_DESC_F_INDIRECT;
+        desc->next  = 0;
+    }
+    u16 old = queue->avail_idx;
+    queue->avail->ring[old % queue->size] = head;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    queue->avail_idx++;
+    queue->avail->idx = queue->avail_idx;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (queue->event_idx)
+        return vring_need_event(*queue->avail_event, queue->avail_idx, old);
+    return !(queue->used->flags & VIRTQ_USED_F_NO_NOTIFY);
+}
+
+static void virtio_queue_complete(VirtioQueue* queue) {
+    VirtioBlkRequest done[VIRTIO_BLK_MAX_SLOTS];
+    bool ok[VIRTIO_BLK_MAX_SLOTS];
+    u32 count = 0;
+
+    spin_lock(&queue->lock);
+    while (1) {
+        if (queue->packed) {
+            while (1) {
+                volatile VirtqPackedDesc* desc = &queue->ring[queue->used_idx];
+                u16 flags = __atomic_load_n(&desc->flags, __ATOMIC_ACQUIRE);
+                bool avail = (flags & VIRTQ_DESC_F_AVAIL) != 0;
+                bool used  = (flags & VIRTQ_DESC_F_USED) != 0;
+                if (avail != used || used != queue->used_wrap)
+                    break;
+                u32 slot = desc->id;
+                done[count] = queue->requests[slot];
+                ok[count] = queue->slots[slot].status == VIRTIO_BLK_S_OK;
+                count++;
+                queue->free_slots |= 1ull << slot;
+                queue->used_idx++;
+                if (queue->used_idx == queue->size) {
+                    queue->used_idx = 0;
+                    queue->used_wrap = !queue->used_wrap;
+                }
+            }
+            if (!queue->event_idx)
+                break;
+            // interrupt again when the next entry is used
+            queue->driver_event->off_wrap = queue->used_idx | ((u16)queue->used_wrap << 15);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            volatile VirtqPackedDesc* desc = &queue->ring[queue->used_idx];
+            u16 flags = desc->flags;
+            if (((flags & VIRTQ_DESC_F_USED) != 0) != queue->used_wrap || ((flags & VIRTQ_DESC_F_AVAIL) != 0) != queue->used_wrap)
+                break;
+        } else {
+            while (queue->used_idx != __atomic_load_n(&queue->used->idx, __ATOMIC_ACQUIRE)) {
+                u32 id = queue->used->ring[queue->used_idx % queue->size].id;
+                u32 slot = queue->indirect ? id : id / VIRTIO_BLK_MAX_DESCRIPTORS;
+                done[count] = queue->requests[slot];
+                ok[count] = queue->slots[slot].status == VIRTIO_BLK_S_OK;
+                count++;
+                queue->free_slots |= 1ull << slot;
+                queue->used_idx++;
+            }
+            if (!queue->event_idx)
+                break;
+            *queue->used_event = queue->used_idx;
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (queue->used_idx == queue->used->idx)
+                break;
+        }
+    }
+    queue->completed += count;
+    for (u32 i = 0; i < count; i++)
+        queue->errors += !ok[i];
+    spin_unlock(&queue->lock);
+
+    for (u32 i = 0; i < count; i++) {
+        sem_up(&queue->slot_count);
+        if (done[i].callback)
+            done[i].callback(done[i].arg, ok[i]);
+    }
+}
+
+static void virtio_blk_irq_handler(InterruptFrame* frame) {
+    VirtioQueue* queue = g_virtio_vector_queues[frame->vector & 0xFF];
+    if (queue)
+        virtio_queue_complete(queue);
+}
+
+// Caller took a unit of slot_count
+static bool virtio_blk_issue(VirtioQueue* queue, u32 type, u64 lba, u32 sectors, void* buffer, VirtioBlkCallback callback, void* arg) {
+    bool enabled = spin_lock_irqsave(&queue->lock);
+    u32 slot = __builtin_ctzll(queue->free_slots);
+    queue->free_slots &= ~(1ull << slot);
+    spin_unlock_irqrestore(&queue->lock, enabled);
+
+    u32 count = virtio_blk_build(queue, slot, type, lba, buffer, (u64)sectors * 512);
+    if (count == 0) {
+        enabled = spin_lock_irqsave(&queue->lock);
+        queue->free_slots |= 1ull << slot;
+        spin_unlock_irqrestore(&queue->lock, enabled);
+        sem_up(&queue->slot_count);
+        return false;
+    }
+    queue->requests[slot].callback = callback;
+    queue->requests[slot].arg      = arg;
+
+    enabled = spin_lock_irqsave(&queue->lock);
+    bool notify = virtio_queue_push(queue, slot, count);
+    if (notify) {
+        *queue->notify = queue->index;
+        queue->notifications++;
+    } else {
+        queue->suppressed++;
+    }
+    spin_unlock_irqrestore(&queue->lock, enabled);
+    return true;
+}
+
+static bool virtio_queue_init(VirtioBlkDisk* disk, u16 index, u32 msix_entry) {
+    common_write16(disk, VIRTIO_COMMON_QUEUE_SELECT, index);
+    u16 max_size = common_read16(disk, VIRTIO_COMMON_QUEUE_SIZE);
+    if (max_size == 0)
+        return false;
+    u16 size = max_size < VIRTIO_QUEUE_MAX_SIZE ? max_size : VIRTIO_QUEUE_MAX_SIZE;
+
+    VirtioQueue* queue = kmalloc(sizeof(VirtioQueue));
+    if (!queue)
+        return false;
+    memset(queue, 0, sizeof(VirtioQueue));
+    queue->index     = index;
+    queue->size      = size;
+    queue->packed    = (disk->features & VIRTIO_F_RING_PACKED) != 0;
+    queue->indirect  = (disk->features & VIRTIO_F_INDIRECT_DESC) != 0;
+    queue->event_idx = (disk->features & VIRTIO_F_EVENT_IDX) != 0;
+
+    u32 slots = queue->indirect ? size : size / VIRTIO_BLK_MAX_DESCRIPTORS;
+    if (slots > VIRTIO_BLK_MAX_SLOTS)
+        slots = VIRTIO_BLK_MAX_SLOTS;
+    if (slots == 0)
+        return false;
+    queue->slot_count_total = slots;
+
+    u64 ring_bytes, driver_offset, device_offset;
+    if (queue->packed) {
+        ring_bytes    = size * sizeof(VirtqPackedDesc);
+        driver_offset = ring_bytes;
+        device_offset = ring_bytes + sizeof(VirtqEvent);
+        ring_bytes   += 2 * sizeof(VirtqEvent);
+    } else {
+        driver_offset = size * sizeof(VirtqDesc);
+        device_offset = (driver_offset + 6 + 2 * size + 3) & ~3ull;
+        ring_bytes    = device_offset + 6 + sizeof(VirtqUsedElem) * size;
+    }
+    u64 ring_pages = (ring_bytes + PAGE_SIZE_4K - 1) / PAGE_SIZE_4K;
+    u64 slot_pages = (slots * sizeof(VirtioBlkSlot) + PAGE_SIZE_4K - 1) / PAGE_SIZE_4K;
+    void* ring = kernel_alloc_phys_contiguous(ring_pages, 0, 0, ALLOC_ZERO);
+    void* slot_memory = kernel_alloc_phys_contiguous(slot_pages, 0, 0, ALLOC_ZERO);
+    if (!ring || !slot_memory) {
+        // the disk is skipped, an allocation that worked stays allocated
+        return false;
+    }
+    u8* virt = phys_to_virt((u64)ring);
+    if (queue->packed) {
+        queue->ring         = (volatile VirtqPackedDesc*)virt;
+        queue->driver_event = (volatile VirtqEvent*)(virt + driver_offset);
+        queue->device_event = (volatile VirtqEvent*)(virt + device_offset);
+        queue->avail_wrap   = true;
+        queue->used_wrap    = true;
+        if (queue->event_idx) {
+            queue->driver_event->off_wrap = 1 << 15; // entry 0 of the first pass
+            queue->driver_event->flags    = VIRTQ_EVENT_DESC;
+        }
+    } else {
+        queue->desc        = (volatile VirtqDesc*)virt;
+        queue->avail       = (volatile VirtqAvail*)(virt + driver_offset);
+        queue->used        = (volatile VirtqUsed*)(virt + device_offset);
+        queue->used_event  = &queue->avail->ring[size];
+        queue->avail_event = (volatile u16*)&queue->used->ring[size];
+    }
+    queue->slots      = phys_to_virt((u64)slot_memory);
+    queue->slots_phys = (u64)slot_memory;
+    queue->free_slots = slots == 64 ? ~0ull : (1ull << slots) - 1;
+    sem_init(&queue->slot_count, slots);
+#ifdef ELOS_LOCK_STATS
+    queue->lock.stats.name = "virtio queue";
+#endif
+
+    u8 vector = interrupt_alloc_vector(virtio_blk_irq_handler);
+    if (!vector)
+        return false;
+    g_virtio_vector_queues[vector] = queue;
+    // used buffers of this queue are signalled to the CPU it belongs to
+    pci_msix_set(&disk->msix, msix_entry, vector, g_cpus[index].apic_id);
+
+    common_write16(disk, VIRTIO_COMMON_QUEUE_SIZE, size);
+    common_write64(disk, VIRTIO_COMMON_QUEUE_DESC, (u64)ring);
+    common_write64(disk, VIRTIO_COMMON_QUEUE_DRIVER, (u64)ring + driver_offset);
+    common_write64(disk, VIRTIO_COMMON_QUEUE_DEVICE, (u64)ring + device_offset);
+    common_write16(disk, VIRTIO_COMMON_QUEUE_MSIX_VECTOR, msix_entry);
+    if (common_read16(disk, VIRTIO_COMMON_QUEUE_MSIX_VECTOR) != msix_entry)
+        return false;
+    u16 notify_off = common_read16(disk, VIRTIO_COMMON_QUEUE_NOTIFY_OFF);
+    queue->notify = (volatile u16*)(disk->notify_base + notify_off * disk->notify_multiplier);
+    common_write16(disk, VIRTIO_COMMON_QUEUE_ENABLE, 1);
+
+    disk->queues[index] = queue;
+    return true;
+}
+
+// Maps the structure a virtio vendor capability points at
+static volatile u8* virtio_map_capability(u8 bus, u8 slot, u8 function, u8 cap) {
+    u8 bar = pciConfig_readl(bus, slot, function, cap + 4) & 0xFF;
+    u32 offset = pciConfig_readl(bus, slot, function, cap + 8);
+    u32 length = pciConfig_readl(bus, slot, function, cap + 12);
+    if (bar > 5)
+        return NULL;
+    u64 base = pci_bar_address(bus, slot, function, bar);
+    if (!base)
+        return NULL;
+    return map_mmio(base + offset, length);
+}
+
+static u32 virtio_blk_max_sectors(u32 disk);
+static u32 virtio_blk_queue_depth(u32 disk);
+
+static const StorageDriver g_virtio_blk_storage = {
+    .name          = "virtio-blk",
+    .read_sectors  = virtio_blk_read_sectors,
+    .write_sectors = virtio_blk_write_sectors,
+    .submit        = virtio_blk_submit,
+    .max_sectors   = virtio_blk_max_sectors,
+    .queue_depth   = virtio_blk_queue_depth,
+    .flush         = virtio_blk_flush,
+};
+
+void virtio_blk_attach_controller(u8 bus, u8 slot, u8 function, PCI_ConfigSpace* config) {
+    if (g_virtio_disk_count == VIRTIO_BLK_MAX_DISKS)
+        return;
+    VirtioBlkDisk* disk = &g_virtio_disks[g_virtio_disk_count];
+    memset(disk, 0, sizeof(VirtioBlkDisk));
+
+    pci_enable_command(bus, slot, function, PCI_COMMAND_MEMORY_SPACE | PCI_COMMAND_BUS_MASTER);
+    for (u8 cap = pci_find_capability(bus, slot, function, PCI_CAPABILITY_VENDOR); cap;
+            cap = pci_next_capability(bus, slot, function, cap, PCI_CAPABILITY_VENDOR)) {
+        u8 type = pciConfig_readl(bus, slot, function, cap) >> 24;
+        // the first capability of a type is the preferred one
+        if (type == VIRTIO_PCI_CAP_COMMON && !disk->common) {
+            disk->common = virtio_map_capability(bus, slot, function, cap);
+        } else if (type == VIRTIO_PCI_CAP_NOTIFY && !disk->notify_base) {
+            disk->notify_base = virtio_map_capability(bus, slot, function, cap);
+            disk->notify_multiplier = pciConfig_readl(bus, slot, function, cap + 16);
+        } else if (type == VIRTIO_PCI_CAP_DEVICE && !disk->device_config) {
+            disk->device_config = virtio_map_capability(bus, slot, function, cap);
+        }
+    }
+    if (!disk->common || !disk->notify_base || !disk->device_config) {
+        printf("virtio-blk: No modern virtio-pci interface\n");
+        return;
+    }
+
+    if (!virtio_reset(disk)) {
+        printf("virtio-blk: Device doesn't reset\n");
+        return;
+    }
+    common_write8(disk, VIRTIO_COMMON_DEVICE_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+    common_write8(disk, VIRTIO_COMMON_DEVICE_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+    u8 status = VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER;
+
+    u64 offered = virtio_device_features(disk);
+    if (!(offered & VIRTIO_F_VERSION_1)) {
+        printf("virtio-blk: Device is legacy only\n");
+        common_write8(disk, VIRTIO_COMMON_DEVICE_STATUS, status | VIRTIO_STATUS_FAILED);
+        return;
+    }
+    u64 wanted = VIRTIO_F_VERSION_1 | VIRTIO_F_INDIRECT_DESC | VIRTIO_F_EVENT_IDX | VIRTIO_BLK_F_SIZE_MAX
+        | VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_RO | VIRTIO_BLK_F_FLUSH | VIRTIO_BLK_F_MQ;
+    if (offered & VIRTIO_F_INDIRECT_DESC)
+        wanted |= VIRTIO_F_RING_PACKED;
+    disk->features = offered & wanted;
+    virtio_driver_features(disk, disk->features);
+    status |= VIRTIO_STATUS_FEATURES_OK;
+    common_write8(disk, VIRTIO_COMMON_DEVICE_STATUS, status);
+    if (!(common_read8(disk, VIRTIO_COMMON_DEVICE_STATUS) & VIRTIO_STATUS_FEATURES_OK)) {
+        printf("virtio-blk: Device refused the features\n");
+        common_write8(disk, VIRTIO_COMMON_DEVICE_STATUS, status | VIRTIO_STATUS_FAILED);
+        return;
+    }
+
+    disk->sectors = virtio_blk_read_capacity(disk);
+    disk->max_sectors = VIRTIO_BLK_MAX_SECTORS;
+    if (disk->features & VIRTIO_BLK_F_SIZE_MAX) {
+        u32 size_max = *(volatile u32*)(disk->device_config + VIRTIO_BLK_CONFIG_SIZE_MAX);
+        if (size_max < PAGE_SIZE_4K) {
+            printf("virtio-blk: Segments of %d bytes aren't supported\n", (int)size_max);
+            common_write8(disk, VIRTIO_COMMON_DEVICE_STATUS, status | VIRTIO_STATUS_FAILED);
+            return;
+        }
+    }
+    if (disk->features & VIRTIO_BLK_F_SEG_MAX) {
+        u32 seg_max = *(volatile u32*)(disk->device_config + VIRTIO_BLK_CONFIG_SEG_MAX);
+        // an unaligned buffer takes a page more
+        u32 max = seg_max >= 2 ? (seg_max - 1) * 8 : 1;
+        if (max < disk->max_sectors)
+            disk->max_sectors = max;
+    }
+
+    if (!pci_msix_init(bus, slot, function, &disk->msix)) {
+        printf("virtio-blk: No MSI-X\n");
+        common_write8(disk, VIRTIO_COMMON_DEVICE_STATUS, status | VIRTIO_STATUS_FAILED);
+        return;
+    }
+    common_write16(disk, VIRTIO_COMMON_CONFIG_MSIX_VECTOR, VIRTIO_NO_VECTOR);
+
+    u32 queues = 1;
+    if (disk->features & VIRTIO_BLK_F_MQ)
+        queues = *(volatile u16*)(disk->device_config + VIRTIO_BLK_CONFIG_NUM_QUEUES);
+    if (queues > common_read16(disk, VIRTIO_COMMON_NUM_QUEUES))
+        queues = common_read16(disk, VIRTIO_COMMON_NUM_QUEUES);
+    if (queues > cpu_online_count())
+        queues = cpu_online_count();
+    if (queues > disk->msix.count)
+        queues = disk->msix.count;
+    for (u32 i = 0; i < queues; i++) {
+        if (!virtio_queue_init(disk, i, i))
+            break;
+        disk->queue_count++;
+    }
+    if (disk->queue_count == 0) {
+        printf("virtio-blk: No queues\n");
+        common_write8(disk, VIRTIO_COMMON_DEVICE_STATUS, status | VIRTIO_STATUS_FAILED);
+        return;
+    }
+    for (u32 cpu = 0; cpu < MAX_CPUS; cpu++)
+        disk->cpu_queues[cpu] = disk->queues[cpu % disk->queue_count];
+
+    common_write8(disk, VIRTIO_COMMON_DEVICE_STATUS, status | VIRTIO_STATUS_DRIVER_OK);
+    g_virtio_disk_count++;
+
+    printf("virtio-blk: %d MiB, %d %s queues of %d%s%s\n", (int)(disk->sectors / 2048), (int)disk->queue_count,
+        (disk->features & VIRTIO_F_RING_PACKED) ? "packed" : "split", (int)disk->queues[0]->slot_count_total,
+        (disk->features & VIRTIO_F_INDIRECT_DESC) ? ", indirect" : "", (disk->features & VIRTIO_F_EVENT_IDX) ? ", event-idx" : "");
+    device_register_storage(&g_virtio_blk_storage, g_virtio_disk_count - 1, disk->sectors);
+}
+
+u32 virtio_blk_disk_count() {
+    return g_virtio_disk_count;
+}
+
+u64 virtio_blk_disk_sectors(u32 disk) {
+    return disk < g_virtio_disk_count ? g_virtio_disks[disk].sectors : 0;
+}
+
+static u32 virtio_blk_max_sectors(u32 disk) {
+    return disk < g_virtio_disk_count ? g_virtio_disks[disk].max_sectors : 0;
+}
+
+// All virtqueues have the same number of request slots
+static u32 virtio_blk_queue_depth(u32 disk_index) {
+    if (disk_index >= g_virtio_disk_count)
+        return 0;
+    VirtioBlkDisk* disk = &g_virtio_disks[disk_index];
+    return disk->queues[0]->slot_count_total * disk->queue_count;
+}
+
+bool virtio_blk_submit(u32 disk_index, u64 lba, u32 sectors, void* buffer, bool write, VirtioBlkCallback callback, void* arg) {
+    if (disk_index >= g_virtio_disk_count)
+        return false;
+    VirtioBlkDisk* disk = &g_virtio_disks[disk_index];
+    if (sectors == 0 || sectors > disk->max_sectors || lba + sectors < lba || lba + sectors > disk->sectors)
+        return false;
+    if (write && (disk->features & VIRTIO_BLK_F_RO))
+        return false;
+    VirtioQueue* queue = disk->cpu_queues[cpu_index()];
+    if (!sem_trydown(&queue->slot_count))
+        return false;
+    return virtio_blk_issue(queue, write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN, lba, sectors, buffer, callback, arg);
+}
+
+static bool virtio_blk_request(VirtioBlkDisk* disk, u32 type, u64 lba, u32 sectors, void* buffer) {
+    Completion completion;
+    completion_init(&completion);
+    VirtioQueue* queue = disk->cpu_queues[cpu_index()];
+    sem_down(&queue->slot_count);
+    if (!virtio_blk_issue(queue, type, lba, sectors, buffer, completion_done, &completion))
+        return false;
+    return completion_wait(&completion);
+}
+
+static int virtio_blk_transfer(u32 disk_index, u8* buffer, u64 lba, u64 sectors, bool write) {
+    if (disk_index >= g_virtio_disk_count)
+        return -1;
+    VirtioBlkDisk* disk = &g_virtio_disks[disk_index];
+    if (lba + sectors < lba || lba + sectors > disk->sectors)
+        return -1;
+    if (write && (disk->features & VIRTIO_BLK_F_RO))
+        return -1;
+    while (sectors > 0) {
+        u32 count = sectors < disk->max_sectors ? sectors : disk->max_sectors;
+        if (!virtio_blk_request(disk, write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN, lba, count, buffer))
+            return -1;
+        buffer += (u64)count * 512;
+        lba += count;
+        sectors -= count;
+    }
+    if (write)
+        return virtio_blk_flush(disk_index);
+    return 0;
+}
+
+int virtio_blk_flush(u32 disk_index) {
+    if (disk_index >= g_virtio_disk_count)
+        return -1;
+    VirtioBlkDisk* disk = &g_virtio_disks[disk_index];
+    if (!(disk->features & VIRTIO_BLK_F_FLUSH))
+        return 0;
+    return virtio_blk_request(disk, VIRTIO_BLK_T_FLUSH, 0, 0, NULL) ? 0 : -1;
+}
+
+int virtio_blk_read_sectors(u32 disk, void* buffer, u64 lba, u64 sectors) {
+    return virtio_blk_transfer(disk, buffer, lba, sectors, false);
+}
+
+int virtio_blk_write_sectors(u32 disk, void* buffer, u64 lba, u64 sectors) {
+    return virtio_blk_transfer(disk, buffer, lba, sectors, true);
+}
@@ -0,0 +1,49 @@
+/*
+    virtio-blk driver
+
+    Uses the modern virtio-pci interface (VIRTIO_F_VERSION_1) found through the vendor
+    capabilities in config space. Every CPU gets its own virtqueue when the device has
+    multi-queue, with an MSI-X vector routed to that CPU like the NVMe driver.
+
+    A request's descriptors (header, data, status) sit in an indirect table so it takes
+    one ring entry, queues use the packed layout when the device offers it and the
+    split layout otherwise. With event-index the device tells us how far it has read
+    and we only notify it when it has caught up, which saves a VM exit per request
+    while it is busy. The same goes the other way for interrupts.
+
+    Disks register as storage devices.
+*/
+
+#pragma once
+
+#include "elos/kernel/common/types.h"
+#include "elos/kernel/driver/pci.h"
+
+#define VIRTIO_PCI_VENDOR                     0x1AF4
+#define VIRTIO_PCI_DEVICE_BLOCK_TRANSITIONAL  0x1001
+#define VIRTIO_PCI_DEVICE_BLOCK               0x1042
+
+// Most sectors one request transfers
+#define VIRTIO_BLK_MAX_SECTORS 256
+
+// Called from interrupts with ok false if the request failed
+typedef void (*VirtioBlkCallback)(void* arg, bool ok);
+
+// Called by the PCI scan for virtio block devices
+void virtio_blk_attach_controller(u8 bus, u8 slot, u8 function, PCI_ConfigSpace* config);
+
+u32 virtio_blk_disk_count();
+u64 virtio_blk_disk_sectors(u32 disk);
+
+/*
+    Starts one request of at most VIRTIO_BLK_MAX_SECTORS on the queue of the CPU we run on,
+    callback runs on completion. The buffer must be mapped.
+    Returns false if the buffer can't be used or the queue is full. Any context.
+*/
+bool virtio_blk_submit(u32 disk, u64 lba, u32 sectors, void* buffer, bool write, VirtioBlkCallback callback, void* arg);
+
+// Blocking transfers of any size, writes are flushed if the device caches them. Return 0 on success.
+int virtio_blk_read_sectors(u32 disk, void* buffer, u64 lba, u64 sectors);
+int virtio_blk_write_sectors(u32 disk, void* buffer, u64 lba, u64 sectors);
+// Makes completed writes durable if the device caches them, returns 0 on success
+int virtio_blk_flush(u32 disk);
@@ -0,0 +1,217 @@
+/*
+    Local APIC and I/O APIC
+
+    Every CPU calls init_apic, the local APIC registers are per-CPU at the same address.
+*/
+
+#include "elos/kernel/interrupt/apic.h"
+#include "elos/kernel/interrupt/interrupt.h"
+#include "elos/kernel/memory/paging.h"
+#include "elos/kernel/acpi/acpi.h"
+#include "elos/kernel/common/cpu.h"
+#include "elos/kernel/common/intrinsics.h"
+#include "elos/kernel/common/sync.h"
+#include "elos/kernel/debug/debug.h"
+
+#include <cpuid.h>
+
+#define MSR_APIC_BASE        0x1B
+#define APIC_BASE_ENABLE     0x800
+#define APIC_BASE_X2APIC     0x400
+#define APIC_BASE_ADDRESS    0xFFFFFFFFFF000ULL
+#define MSR_X2APIC_BASE      0x800
+
+#define CPUID_1_EDX_APIC     (1 << 9)
+#define CPUID_1_ECX_X2APIC   (1 << 21)
+
+#define SVR_ENABLE           0x100
+#define ICR_DELIVERY_PENDING 0x1000
+#define LVT_NMI              0x400
+
+#define PIC1_COMMAND 0x20
+#define PIC1_DATA    0x21
+#define PIC2_COMMAND 0xA0
+#define PIC2_DATA    0xA1
+
+#define IOAPIC_VERSION       0x01
+#define IOAPIC_REDIRECTION   0x10
+#define IOAPIC_MASKED        0x10000
+
+static bool g_x2apic;
+static volatile u32* g_lapic; // xAPIC registers
+
+static volatile u32* g_ioapic;
+static u32 g_ioapic_inputs;
+static u32 g_ioapic_gsi_base;
+static Spinlock g_ioapic_lock = LOCK_INIT("ioapic");
+
+u32 lapic_read(u32 reg) {
+    if (g_x2apic)
+        return (u32)read_msr(MSR_X2APIC_BASE + (reg >> 4));
+    return g_lapic[reg / 4];
+}
+
+void lapic_write(u32 reg, u32 value) {
+    if (g_x2apic)
+        write_msr(MSR_X2APIC_BASE + (reg >> 4), value);
+    else
+        g_lapic[reg / 4] = value;
+}
+
+u32 lapic_id() {
+    u32 id = lapic_read(LAPIC_ID);
+    return g_x2apic ? id : id >> 24;
+}
+
+void lapic_eoi() {
+    lapic_write(LAPIC_EOI, 0);
+}
+
+bool lapic_is_x2apic() {
+    return g_x2apic;
+}
+
+void lapic_send_ipi(u32 apic_id, u32 icr) {
+    if (g_x2apic) {
+        // one MSR write, no delivery status to wait for
+        write_msr(MSR_X2APIC_BASE + (LAPIC_ICR_LOW >> 4), ((u64)apic_id << 32) | icr);
+        return;
+    }
+    bool enabled = interrupts_save_disable();
+    lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, icr);
+    while (lapic_read(LAPIC_ICR_LOW) & ICR_DELIVERY_PENDING)
+        _mm_pause();
+    interrupts_restore(enabled);
+}
+
+static void apic_error_handler(InterruptFrame* frame) {
+    // ESR is latched by a write
+    lapic_write(LAPIC_ESR, 0);
+    serial_printf("apic: Error %x on cpu %d\n", lapic_read(LAPIC_ESR), (int)lapic_id());
+}
+
+static void mask_pic() {
+    // Remap so spurious PIC interrupts don't land on exception vectors, then mask everything
+    outb(PIC1_COMMAND, 0x11);
+    outb(PIC2_COMMAND, 0x11);
+    outb(PIC1_DATA, VECTOR_PIC_BASE);
+    outb(PIC2_DATA, VECTOR_PIC_BASE + 8);
+    outb(PIC1_DATA, 4); // slave on IRQ 2
+    outb(PIC2_DATA, 2);
+    outb(PIC1_DATA, 0x01); // 8086 mode
+    outb(PIC2_DATA, 0x01);
+    outb(PIC1_DATA, 0xFF);
+    outb(PIC2_DATA, 0xFF);
+}
+
+static u32 ioapic_read(u32 reg) {
+    g_ioapic[0] = reg;
+    return g_ioapic[4];
+}
+
+static void ioapic_write(u32 reg, u32 value) {
+    g_ioapic[0] = reg;
+    g_ioapic[4] = value;
+}
+
+static void init_ioapic(u64 physical_address, u32 gsi_base) {
+    g_ioapic_gsi_base = gsi_base;
+    g_ioapic = map_mmio(physical_address, 0x20);
+    if (!g_ioapic) {
+        serial_printf("apic: Can't map the I/O APIC\n");
+        return;
+    }
+    g_ioapic_inputs = ((ioapic_read(IOAPIC_VERSION) >> 16) & 0xFF) + 1;
+    for (u32 i = 0; i < g_ioapic_inputs; i++)
+        ioapic_write(IOAPIC_REDIRECTION + i * 2, IOAPIC_MASKED);
+}
+
+// I/O APIC input of an IRQ or -1 if it's not on our I/O APIC
+static int ioapic_input(u8 irq, u32* flags) {
+    u32 gsi = irq;
+    if (irq < ISA_IRQ_COUNT) {
+        gsi = g_madt.isa_gsi[irq];
+        u16 inti = g_madt.isa_flags[irq];
+        if ((inti & 0x3) == 0x3) // polarity
+            *flags |= IOAPIC_ACTIVE_LOW;
+        else if ((inti & 0x3) == 0x1)
+            *flags &= ~IOAPIC_ACTIVE_LOW;
+        if ((inti & 0xC) == 0xC) // trigger mode
+            *flags |= IOAPIC_LEVEL;
+        else if ((inti & 0xC) == 0x4)
+            *flags &= ~IOAPIC_LEVEL;
+    }
+    if (!g_ioapic || gsi < g_ioapic_gsi_base || gsi - g_ioapic_gsi_base >= g_ioapic_inputs)
+        return -1;
+    return gsi - g_ioapic_gsi_base;
+}
+
+bool ioapic_route_irq(u8 irq, u8 vector, u32 apic_id, u32 flags) {
+    int input = ioapic_input(irq, &flags);
+    if (input < 0 || apic_id > 0xFF)
+        return false;
+    bool enabled = interrupts_save_disable();
+    spin_lock(&g_ioapic_lock);
+    ioapic_write(IOAPIC_REDIRECTION + input * 2 + 1, apic_id << 24);
+    ioapic_write(IOAPIC_REDIRECTION + input * 2, vector | (flags & (IOAPIC_LEVEL | IOAPIC_ACTIVE_LOW)));
+    spin_unlock(&g_ioapic_lock);
+    interrupts_restore(enabled);
+    return true;
+}
+
+void ioapic_mask_irq(u8 irq) {
+    u32 flags = 0;
+    int input = ioapic_input(irq, &flags);
+    if (input < 0)
+        return;
+    bool enabled = interrupts_save_disable();
+    spin_lock(&g_ioapic_lock);
+    ioapic_write(IOAPIC_REDIRECTION + input * 2, IOAPIC_MASKED);
+    spin_unlock(&g_ioapic_lock);
+    interrupts_restore(enabled);
+}
+
+void init_apic() {
+    u32 eax, ebx, ecx, edx;
+    __get_cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (!(edx & CPUID_1_EDX_APIC)) {
+        serial_printf("apic: No local APIC\n");
+        return;
+    }
+
+    if (cpu_index() == 0)
+        mask_pic();
+
+    // Enabling x2APIC must go through enabled xAPIC mode
+    u64 base = read_msr(MSR_APIC_BASE);
+    base |= APIC_BASE_ENABLE;
+    write_msr(MSR_APIC_BASE, base);
+    if (ecx & CPUID_1_ECX_X2APIC) {
+        base |= APIC_BASE_X2APIC;
+        write_msr(MSR_APIC_BASE, base);
+        g_x2apic = true;
+    } else if (!g_lapic) {
+        g_lapic = map_mmio(base & APIC_BASE_ADDRESS, PAGE_SIZE_4K);
+        if (!g_lapic) {
+            serial_printf("apic: Can't map the local APIC\n");
+            return;
+        }
+    }
+
+    interrupt_set_handler(VECTOR_APIC_ERROR, apic_error_handler);
+
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_LVT_LINT0, LAPIC_LVT_MASKED); // ExtINT from the PIC
+    lapic_write(LAPIC_LVT_LINT1, LVT_NMI);
+    lapic_write(LAPIC_LVT_ERROR, VECTOR_APIC_ERROR);
+    lapic_write(LAPIC_ESR, 0);
+    lapic_write(LAPIC_SVR, SVR_ENABLE | VECTOR_APIC_SPURIOUS);
+    lapic_eoi(); // in case something was left in service
+
+    if (cpu_index() == 0 && !g_ioapic && g_madt.ioapic_address)
+        init_ioapic(g_madt.ioapic_address, g_madt.ioapic_gsi_base);
+
+    serial_printf("apic: Local APIC %d enabled (%s)\n", (int)lapic_id(), g_x2apic ? "x2APIC" : "xAPIC");
+}
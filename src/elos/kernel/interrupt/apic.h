@@ -0,0 +1,61 @@
+/*
+    Local APIC and I/O APIC
+
+    The legacy PIC is remapped and masked, interrupts are delivered by the local APIC.
+    x2APIC mode (registers as MSRs) is used when the CPU has it, xAPIC (MMIO) otherwise.
+    Device IRQs are routed to a vector through the I/O APIC.
+*/
+
+#pragma once
+
+#include "elos/kernel/common/types.h"
+
+// Local APIC register offsets (xAPIC MMIO offset, x2APIC MSR is 0x800 + offset / 16)
+#define LAPIC_ID            0x020
+#define LAPIC_VERSION       0x030
+#define LAPIC_TPR           0x080
+#define LAPIC_EOI           0x0B0
+#define LAPIC_SVR           0x0F0
+#define LAPIC_ESR           0x280
+#define LAPIC_ICR_LOW       0x300
+#define LAPIC_ICR_HIGH      0x310
+#define LAPIC_LVT_TIMER     0x320
+#define LAPIC_LVT_LINT0     0x350
+#define LAPIC_LVT_LINT1     0x360
+#define LAPIC_LVT_ERROR     0x370
+#define LAPIC_TIMER_INITIAL 0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE  0x3E0
+
+#define LAPIC_LVT_MASKED    0x10000
+
+/*
+    Enables the local APIC of this CPU, the bootstrap processor also masks the PIC
+    and sets up the I/O APIC. Call after init_interrupts and init_acpi.
+*/
+void init_apic();
+
+// Local APIC of the CPU we run on
+u32 lapic_read(u32 reg);
+void lapic_write(u32 reg, u32 value);
+u32 lapic_id();
+void lapic_eoi();
+bool lapic_is_x2apic();
+
+/*
+    Sends an interrupt to another CPU.
+    @param icr  Delivery mode and vector bits of the low ICR register
+*/
+void lapic_send_ipi(u32 apic_id, u32 icr);
+
+// Flags for ioapic_route_irq, default is edge triggered and active high like ISA IRQs
+#define IOAPIC_LEVEL       0x8000
+#define IOAPIC_ACTIVE_LOW  0x2000
+
+/*
+    Routes an interrupt to a vector on a CPU. IRQs below 16 are ISA IRQs, they go through
+    the MADT's source overrides which may also replace the flags. Others are I/O APIC inputs.
+    Only the first I/O APIC in the MADT is used.
+*/
+bool ioapic_route_irq(u8 irq, u8 vector, u32 apic_id, u32 flags);
+void ioapic_mask_irq(u8 irq);
@@ -0,0 +1,250 @@
+/*
+    Interrupt stubs
+
+    Each of the 256 stubs is 16 bytes so the IDT can be filled without a table of addresses.
+    A stub pushes a dummy error code if the CPU didn't push one, then the vector number,
+    and jumps to interrupt_common.
+
+    interrupt_common saves the general purpose registers and xmm0-xmm5 and calls
+    interrupt_dispatch with the InterruptFrame. The kernel is built for the Windows x64 ABI
+    where xmm0-xmm5 are the volatile vector registers, xmm6-xmm15 are saved by the callee.
+    interrupt_dispatch is marked ms_abi so this holds whatever compiler builds it.
+
+    The stack is 16-byte aligned on entry (the CPU aligns it) and the stub pushes 22 qwords
+    plus 96 bytes of xmm registers so it is still aligned when we reserve the 32 bytes
+    of shadow space and call.
+
+    TODO: No TSS yet so there is no separate stack for double faults.
+*/
+
+#include "elos/kernel/interrupt/interrupt.h"
+#include "elos/kernel/interrupt/apic.h"
+#include "elos/kernel/common/cpu.h"
+#include "elos/kernel/debug/debug.h"
+
+#define IDT_ENTRIES   256
+#define KERNEL_CS     0x08
+#define GATE_INTERRUPT 0x8E // present, ring 0, 64-bit interrupt gate
+#define RFLAGS_IF      0x200
+
+#pragma pack(push, 1)
+typedef struct IdtGate {
+    u16 offset_low;
+    u16 selector;
+    u8  ist;
+    u8  type_attr;
+    u16 offset_mid;
+    u32 offset_high;
+    u32 reserved;
+} IdtGate;
+
+typedef struct IdtRegister {
+    u16 size;
+    u64 addr;
+} IdtRegister;
+#pragma pack(pop)
+
+static IdtGate          g_idt[IDT_ENTRIES] __attribute__((aligned(16)));
+static IdtRegister      g_idt_register;
+static InterruptHandler g_handlers[IDT_ENTRIES];
+// Per-CPU so counting doesn't bounce a cache line between CPUs
+static u64              g_vector_counts[MAX_CPUS][IDT_ENTRIES];
+
+static const char* g_exception_names[VECTOR_EXCEPTION_COUNT] = {
+    "Divide error", "Debug", "NMI", "Breakpoint", "Overflow", "Bound range", "Invalid opcode", "Device not available",
+    "Double fault", "Coprocessor overrun", "Invalid TSS", "Segment not present", "Stack fault", "General protection", "Page fault", "Reserved",
+    "x87 error", "Alignment check", "Machine check", "SIMD error", "Virtualization", "Control protection", "Reserved", "Reserved",
+    "Reserved", "Reserved", "Reserved", "Reserved", "Hypervisor injection", "VMM communication", "Security", "Reserved",
+};
+
+extern char interrupt_stubs[];
+
+__attribute__((ms_abi)) void interrupt_dispatch(InterruptFrame* frame);
+
+asm (
+    ".text\n"
+    // vectors where the CPU pushes an error code
+    ".macro interrupt_stub vector\n"
+    "    .p2align 4\n"
+    "    .if (\\vector == 8) || (\\vector >= 10 && \\vector <= 14) || (\\vector == 17) || (\\vector == 21) || (\\vector == 29) || (\\vector == 30)\n"
+    "    .else\n"
+    "    pushq $0\n"
+    "    .endif\n"
+    "    pushq $\\vector\n"
+    "    jmp interrupt_common\n"
+    ".endm\n"
+    ".altmacro\n"
+    ".macro interrupt_stub_n n\n"
+    "    interrupt_stub %n\n"
+    ".endm\n"
+
+    ".p2align 4\n"
+    ".globl interrupt_stubs\n"
+    "interrupt_stubs:\n"
+    ".set stub_vector, 0\n"
+    ".rept 256\n"
+    "    interrupt_stub_n %stub_vector\n"
+    "    .set stub_vector, stub_vector + 1\n"
+    ".endr\n"
+    ".noaltmacro\n"
+
+    "interrupt_common:\n"
+    "    pushq %rax\n"
+    "    pushq %rbx\n"
+    "    pushq %rcx\n"
+    "    pushq %rdx\n"
+    "    pushq %rsi\n"
+    "    pushq %rdi\n"
+    "    pushq %rbp\n"
+    "    pushq %r8\n"
+    "    pushq %r9\n"
+    "    pushq %r10\n"
+    "    pushq %r11\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq %rsp, %rcx\n"   // InterruptFrame*
+    "    subq $96, %rsp\n"
+    "    movdqu %xmm0, 0(%rsp)\n"
+    "    movdqu %xmm1, 16(%rsp)\n"
+    "    movdqu %xmm2, 32(%rsp)\n"
+    "    movdqu %xmm3, 48(%rsp)\n"
+    "    movdqu %xmm4, 64(%rsp)\n"
+    "    movdqu %xmm5, 80(%rsp)\n"
+    "    cld\n"
+    "    subq $32, %rsp\n"    // shadow space
+    "    call interrupt_dispatch\n"
+    "    addq $32, %rsp\n"
+    "    movdqu 0(%rsp), %xmm0\n"
+    "    movdqu 16(%rsp), %xmm1\n"
+    "    movdqu 32(%rsp), %xmm2\n"
+    "    movdqu 48(%rsp), %xmm3\n"
+    "    movdqu 64(%rsp), %xmm4\n"
+    "    movdqu 80(%rsp), %xmm5\n"
+    "    addq $96, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %r11\n"
+    "    popq %r10\n"
+    "    popq %r9\n"
+    "    popq %r8\n"
+    "    popq %rbp\n"
+    "    popq %rdi\n"
+    "    popq %rsi\n"
+    "    popq %rdx\n"
+    "    popq %rcx\n"
+    "    popq %rbx\n"
+    "    popq %rax\n"
+    "    addq $16, %rsp\n"    // vector and error code
+    "    iretq\n"
+);
+
+static inline u64 read_cr2() {
+    u64 reg;
+    asm volatile ("mov %%cr2, %0\n" : "=r" (reg));
+    return reg;
+}
+
+// %x is 32-bit
+static void print_u64(const char* name, u64 value) {
+    serial_printf("  %s %x%8x\n", name, (u32)(value >> 32), (u32)value);
+}
+
+void interrupt_panic(InterruptFrame* frame) {
+    const char* name = frame->vector < VECTOR_EXCEPTION_COUNT ? g_exception_names[frame->vector] : "interrupt";
+    serial_printf("interrupt: Unhandled exception %d (%s), error code %x\n", (int)frame->vector,
+        name, (u32)frame->error_code);
+    print_u64("rip", frame->rip);
+    print_u64("rsp", frame->rsp);
+    print_u64("rflags", frame->rflags);
+    if (frame->vector == VECTOR_PAGE_FAULT)
+        print_u64("cr2", read_cr2());
+    print_u64("rax", frame->rax);
+    print_u64("rbx", frame->rbx);
+    print_u64("rcx", frame->rcx);
+    print_u64("rdx", frame->rdx);
+    print_u64("rsi", frame->rsi);
+    print_u64("rdi", frame->rdi);
+    print_u64("rbp", frame->rbp);
+
+    while (1)
+        asm volatile ("cli\n hlt\n");
+}
+
+__attribute__((ms_abi)) void interrupt_dispatch(InterruptFrame* frame) {
+    u64 vector = frame->vector;
+    g_vector_counts[cpu_index()][vector]++;
+
+    InterruptHandler handler = g_handlers[vector];
+    if (handler) {
+        handler(frame);
+    } else if (vector < VECTOR_EXCEPTION_COUNT) {
+        interrupt_panic(frame);
+        return;
+    } else if (vector >= VECTOR_DEVICE_BASE && vector != VECTOR_APIC_SPURIOUS) {
+        serial_printf("interrupt: Unexpected vector %d\n", (int)vector);
+    }
+
+    // PIC vectors only arrive as spurious IRQs and the APIC's spurious vector
+    // must not be acknowledged, everything else came through the local APIC.
+    if (vector >= VECTOR_DEVICE_BASE && vector != VECTOR_APIC_SPURIOUS)
+        lapic_eoi();
+
+    // Switch threads if a handler asked for it, unless the interrupted code had interrupts off
+    if (frame->rflags & RFLAGS_IF)
+        scheduler_preempt();
+}
+
+void init_interrupts() {
+    for (int i = 0; i < IDT_ENTRIES; i++) {
+        u64 stub = (u64)interrupt_stubs + i * 16;
+        IdtGate* gate = &g_idt[i];
+        gate->offset_low  = stub & 0xFFFF;
+        gate->selector    = KERNEL_CS;
+        gate->ist         = 0;
+        gate->type_attr   = GATE_INTERRUPT;
+        gate->offset_mid  = (stub >> 16) & 0xFFFF;
+        gate->offset_high = stub >> 32;
+        gate->reserved    = 0;
+    }
+
+    g_idt_register.size = sizeof(g_idt) - 1;
+    g_idt_register.addr = (u64)g_idt;
+    interrupt_load_idt();
+}
+
+void interrupt_load_idt() {
+    asm volatile ("lidt %0\n" : : "m" (g_idt_register));
+}
+
+void interrupt_set_handler(u8 vector, InterruptHandler handler) {
+    g_handlers[vector] = handler;
+}
+
+u8 interrupt_alloc_vector(InterruptHandler handler) {
+    for (int vector = VECTOR_DEVICE_BASE; vector < VECTOR_DEVICE_END; vector++) {
+        InterruptHandler expected = NULL;
+        if (__atomic_compare_exchange_n(&g_handlers[vector], &expected, handler, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            return vector;
+    }
+    serial_printf("interrupt: Out of device vectors\n");
+    return 0;
+}
+
+void interrupt_free_vector(u8 vector) {
+    if (vector < VECTOR_DEVICE_BASE || vector >= VECTOR_DEVICE_END) {
+        kernel_bug();
+        return;
+    }
+    __atomic_store_n(&g_handlers[vector], NULL, __ATOMIC_RELEASE);
+}
+
+u64 interrupt_count(u8 vector) {
+    u64 count = 0;
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++)
+        count += g_vector_counts[cpu][vector];
+    return count;
+}
@@ -0,0 +1,101 @@
+/*
+    Interrupt descriptor table and interrupt dispatch
+
+    Every vector has a small assembly stub which saves the registers and calls the
+    handler registered for the vector. Exceptions without a handler print the frame
+    to serial and stop the CPU.
+*/
+
+#pragma once
+
+#include "elos/kernel/common/types.h"
+
+#define VECTOR_DIVIDE_ERROR        0
+#define VECTOR_DEBUG               1
+#define VECTOR_NMI                 2
+#define VECTOR_BREAKPOINT          3
+#define VECTOR_INVALID_OPCODE      6
+#define VECTOR_DOUBLE_FAULT        8
+#define VECTOR_GENERAL_PROTECTION  13
+#define VECTOR_PAGE_FAULT          14
+
+#define VECTOR_EXCEPTION_COUNT     32
+
+// The legacy PIC is remapped here and masked, only its spurious IRQs 7 and 15 show up
+#define VECTOR_PIC_BASE            0x20
+// Vectors handed out by interrupt_alloc_vector
+#define VECTOR_DEVICE_BASE         0x30
+#define VECTOR_DEVICE_END          0xF0
+// 0xF0-0xFF are fixed system vectors
+#define VECTOR_TIMER               0xF0
+#define VECTOR_CALL_FUNCTION       0xF1
+#define VECTOR_RESCHEDULE          0xF2
+#define VECTOR_APIC_ERROR          0xFE
+#define VECTOR_APIC_SPURIOUS       0xFF
+
+// Registers saved on interrupt, handlers may change them
+typedef struct InterruptFrame {
+    u64 r15, r14, r13, r12, r11, r10, r9, r8;
+    u64 rbp, rdi, rsi, rdx, rcx, rbx, rax;
+    u64 vector;
+    u64 error_code; // 0 for vectors where the CPU doesn't push one
+    // pushed by the CPU
+    u64 rip, cs, rflags, rsp, ss;
+} InterruptFrame;
+
+typedef void (*InterruptHandler)(InterruptFrame* frame);
+
+/*
+    Loads the IDT. The GDT must be loaded, gates use kernel code selector 0x08.
+*/
+void init_interrupts();
+
+// Loads the IDT built by init_interrupts on another CPU
+void interrupt_load_idt();
+
+/*
+    Sets the handler for a vector, NULL removes it.
+    Handlers run with interrupts disabled.
+*/
+void interrupt_set_handler(u8 vector, InterruptHandler handler);
+
+/*
+    Finds a free device vector and sets its handler. Device vectors are acknowledged
+    at the local APIC after the handler returns.
+    Returns 0 if all device vectors are in use.
+*/
+u8 interrupt_alloc_vector(InterruptHandler handler);
+void interrupt_free_vector(u8 vector);
+
+// How many times a vector was raised on all CPUs
+u64 interrupt_count(u8 vector);
+
+/*
+    Prints the frame to serial and stops the CPU. For handlers that find a fault they can't fix.
+*/
+void interrupt_panic(InterruptFrame* frame);
+
+// The host tests run the allocator in user mode where cli/sti fault
+#ifdef ELOS_HOST_TEST
+static inline void interrupts_enable() { }
+static inline void interrupts_disable() { }
+static inline bool interrupts_save_disable() { return false; }
+static inline void interrupts_restore(bool enabled) { }
+#else
+static inline void interrupts_enable() {
+    asm volatile ("sti" ::: "memory");
+}
+static inline void interrupts_disable() {
+    asm volatile ("cli" ::: "memory");
+}
+// Returns whether interrupts were enabled
+static inline bool interrupts_save_disable() {
+    u64 rflags;
+    asm volatile ("pushfq\n pop %0\n cli\n" : "=r" (rflags) : : "memory");
+    return (rflags & 0x200) != 0;
+}
+static inline void interrupts_restore(bool enabled) {
+    if (enabled)
+        interrupts_enable();
+}
+#endif
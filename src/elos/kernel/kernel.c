@@ -7,11 +7,22 @@
 #include "elos/kernel/common/string.h"
 #include "elos/kernel/log/print.h"
 #include "elos/kernel/common/cpu.h"
+#include "elos/kernel/common/clock.h"
+#include "elos/kernel/common/timer.h"
+#include "elos/kernel/common/smp.h"
+#include "elos/kernel/common/scheduler.h"
+#include "elos/kernel/common/idle.h"
+#include "elos/kernel/acpi/acpi.h"
 #include "elos/kernel/driver/pata.h"
 #include "elos/kernel/driver/pci.h"
+#include "elos/kernel/driver/ahci.h"
+#include "elos/kernel/device/bcache.h"
 #include "elos/kernel/debug/debug.h"
 #include "elos/kernel/memory/phys_allocator.h"
 #include "elos/kernel/memory/paging.h"
+#include "elos/kernel/memory/demand_paging.h"
+#include "elos/kernel/interrupt/interrupt.h"
+#include "elos/kernel/interrupt/apic.h"
 #include "fs/fat.h"
 
 
@@ -42,24 +53,10 @@ typedef struct GDT_IDT_Register {
 #pragma pack(pop)
 
 static GDT_IDT_Register _gdt_register;
-static GDT_IDT_Register _idt_register;
 
 static u64 _gdt[3];
-static u64 _idt[1024];
-
-void init_gdt_idt() {
-    
-    _gdt[0] = 0;
-    _gdt[1] = (( 0b0010LLU ) << 52) | (( 0b10011010LLU ) << 40);
-    _gdt[2] = (( 0b0000LLU ) << 52) | (( 0b10010010LLU ) << 40);
-
-    // @TODO: Setup ring-3 user task system segments
-    
-    _gdt_register.size = sizeof(_gdt);
-    _gdt_register.addr = (u64)&_gdt;
-    
-    // @TODO: Interrupt descriptor table
 
+void load_gdt() {
     asm ( "lgdt %0\n" : : "m" (_gdt_register) );
 
     asm volatile (
@@ -76,10 +73,38 @@ void init_gdt_idt() {
     );
 }
 
+void init_gdt_idt() {
+    
+    _gdt[0] = 0;
+    _gdt[1] = (( 0b0010LLU ) << 52) | (( 0b10011010LLU ) << 40);
+    _gdt[2] = (( 0b0000LLU ) << 52) | (( 0b10010010LLU ) << 40);
+
+    // @TODO: Setup ring-3 user task system segments
+    
+    _gdt_register.size = sizeof(_gdt);
+    _gdt_register.addr = (u64)&_gdt;
+
+    load_gdt();
+
+    init_interrupts();
+}
+
 void kernel_entry() {
+    init_clock();
     init_paging();
 
     init_gdt_idt();
+    init_demand_paging();
+    init_acpi();
+    init_apic();
+    init_timers();
+    init_idle();
+    init_scheduler();
+    init_smp();
+    interrupts_enable();
+
+    // kernel_alloc_stress_test(100000);
+    // sched_throughput_test(256, 1000000);
 
     int width,height;
     draw_frame_info(&width,&height);
@@ -91,7 +116,8 @@ void kernel_entry() {
 
     u8 sector[512];
 
-    // init_pci();
+    init_bcache();
+    init_pci();
 
     struct {
         void* addr;
@@ -101,6 +127,9 @@ void kernel_entry() {
     asm ( "sidt %0\n" : : "m" (interrupt_table) );
 
     init_pata();
+    // pata_benchmark(0, 2048, 16, false);
+    // pata_benchmark(0, 2048, 16, true);
+    // ahci_benchmark(0, 32, 20000);
     
     // FAT32_boot_record* rec = (FAT32_boot_record*) sector;
     for (int i = 0; i < 512; i++) {
@@ -159,7 +188,8 @@ void kernel_entry() {
     //     sleep_ns(1000000000);
     // }
 
-    while(1) ;
+    // Nothing else to do, the idle threads take over
+    thread_exit();
 
     // int width,height;
     // draw_frame_info(&width,&height);
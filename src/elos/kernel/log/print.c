@@ -8,6 +8,7 @@
 #include "elos/kernel/common/string.h"
 #include "elos/kernel/common/core_data.h"
 #include "elos/kernel/frame/frame.h"
+#include "elos/kernel/common/sync.h"
 
 
 
@@ -15,6 +16,8 @@
 const int border_padding = 20;
 static int pos_x = border_padding;
 static int pos_y = border_padding;
+// Protects the cursor and keeps lines from different CPUs apart
+static Spinlock g_print_lock = LOCK_INIT("printf");
 
 void printf(char* format, ...) {
     char buffer[256];
@@ -26,6 +29,7 @@ void printf(char* format, ...) {
     va_end(va);
 
     if (!kernel__core_data->inside_uefi) {
+        bool enabled = spin_lock_irqsave(&g_print_lock);
         int start = 0;
         int head = 0;
         const int text_height = 16;
@@ -75,6 +79,7 @@ void printf(char* format, ...) {
                 }
             }
         }
+        spin_unlock_irqrestore(&g_print_lock, enabled);
     } else {
         for (int i=0;i<len+1;i++) {
             w_buffer[i] = buffer[i];
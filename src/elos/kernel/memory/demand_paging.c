@@ -0,0 +1,192 @@
+/*
+    Demand paging
+
+    Reservations are kept in an array sorted by address. There are few of them and
+    they live long so finding a gap with a linear scan is fine, the fault handler
+    finds the reservation with a binary search.
+
+    Pages that were touched are found through the page tables, not tracked here,
+    kernel_vunmap frees them when the reservation is released.
+*/
+
+#include "elos/kernel/memory/demand_paging.h"
+#include "elos/kernel/memory/paging.h"
+#include "elos/kernel/memory/phys_allocator.h"
+#include "elos/kernel/interrupt/interrupt.h"
+#include "elos/kernel/common/sync.h"
+#include "elos/kernel/debug/debug.h"
+
+#include <immintrin.h>
+
+#define MAX_RESERVATIONS 256
+
+// Error code bits for page faults
+#define PF_PRESENT  0x1 // set for protection violations, clear for not present pages
+#define PF_WRITE    0x2
+#define PF_USER     0x4
+#define PF_RESERVED 0x8
+
+#define RFLAGS_IF   0x200
+
+typedef struct Reservation {
+    u64 start;
+    u64 end;
+    u64 page_flags;
+} Reservation;
+
+static Reservation g_reservations[MAX_RESERVATIONS];
+static int g_reservation_count;
+static Spinlock g_reserve_lock = LOCK_INIT("reserve");
+
+static PageFaultStats g_fault_stats;
+
+static inline u64 read_cr2() {
+    u64 reg;
+    asm volatile ("mov %%cr2, %0\n" : "=r" (reg));
+    return reg;
+}
+
+// Index of the reservation containing address or -1, caller holds g_reserve_lock
+static int find_reservation(u64 address) {
+    int low = 0;
+    int high = g_reservation_count - 1;
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        Reservation* r = &g_reservations[mid];
+        if (address < r->start)
+            high = mid - 1;
+        else if (address >= r->end)
+            low = mid + 1;
+        else
+            return mid;
+    }
+    return -1;
+}
+
+static bool handle_demand_fault(u64 address) {
+    u64 page = address & ~(PAGE_SIZE_4K - 1);
+
+    spin_lock(&g_reserve_lock);
+    int index = find_reservation(address);
+    u64 page_flags = index >= 0 ? g_reservations[index].page_flags : 0;
+    spin_unlock(&g_reserve_lock);
+
+    if (index < 0)
+        return false;
+
+    void* physical = kernel_alloc_phys(1, ALLOC_ZERO);
+    if (!physical) {
+        serial_printf("demand: Out of memory backing %x%8x\n", (u32)(page >> 32), (u32)page);
+        return false;
+    }
+
+    if (!map_pages((void*)page, physical, PAGE_SIZE_4K, page_flags)) {
+        // another CPU faulted on the same page and mapped it first
+        kernel_free_phys_pages(physical, 1);
+        return lookup_page((void*)page, NULL, NULL);
+    }
+    return true;
+}
+
+static void page_fault_handler(InterruptFrame* frame) {
+    u64 start = __rdtsc();
+    u64 address = read_cr2();
+
+    __atomic_add_fetch(&g_fault_stats.faults, 1, __ATOMIC_RELAXED);
+
+    // CR2 is saved, allow interrupts again if the faulting code had them on.
+    // Mapping may have to wait for a TLB shootdown which needs interrupts on this CPU.
+    if (frame->rflags & RFLAGS_IF)
+        interrupts_enable();
+
+    // Only not-present faults from the kernel can be demand faults,
+    // protection violations in a reservation are bugs like any other.
+    if (frame->error_code & (PF_PRESENT | PF_USER | PF_RESERVED))
+        interrupt_panic(frame);
+
+    if (address < RESERVE_BASE || address >= RESERVE_END || !handle_demand_fault(address))
+        interrupt_panic(frame);
+
+    u64 cycles = __rdtsc() - start;
+    __atomic_add_fetch(&g_fault_stats.demand_faults, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&g_fault_stats.total_cycles, cycles, __ATOMIC_RELAXED);
+    u64 max = __atomic_load_n(&g_fault_stats.max_cycles, __ATOMIC_RELAXED);
+    while (cycles > max && !__atomic_compare_exchange_n(&g_fault_stats.max_cycles, &max, cycles, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+void init_demand_paging() {
+    interrupt_set_handler(VECTOR_PAGE_FAULT, page_fault_handler);
+}
+
+void* kernel_reserve(u64 bytes, u64 page_flags) {
+    if (bytes == 0)
+        return NULL;
+
+    u64 size = (bytes + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1);
+
+    spin_lock(&g_reserve_lock);
+
+    if (g_reservation_count == MAX_RESERVATIONS) {
+        spin_unlock(&g_reserve_lock);
+        serial_printf("demand: Too many reservations\n");
+        return NULL;
+    }
+
+    // First gap that fits, the page after each reservation is left as a guard
+    u64 candidate = RESERVE_BASE;
+    int index = 0;
+    for (; index < g_reservation_count; index++) {
+        Reservation* r = &g_reservations[index];
+        if (candidate + size + PAGE_SIZE_4K <= r->start)
+            break;
+        candidate = (r->end + PAGE_SIZE_4K + PAGE_SIZE_2M - 1) & ~(PAGE_SIZE_2M - 1);
+    }
+
+    if (candidate + size < candidate || candidate + size > RESERVE_END) {
+        spin_unlock(&g_reserve_lock);
+        serial_printf("demand: No space for a reservation of %x%8x bytes\n", (u32)(size >> 32), (u32)size);
+        return NULL;
+    }
+
+    for (int i = g_reservation_count; i > index; i--)
+        g_reservations[i] = g_reservations[i - 1];
+    g_reservations[index].start      = candidate;
+    g_reservations[index].end        = candidate + size;
+    g_reservations[index].page_flags = page_flags;
+    g_reservation_count++;
+    g_fault_stats.reserved_bytes += size;
+
+    spin_unlock(&g_reserve_lock);
+    return (void*)candidate;
+}
+
+bool kernel_unreserve(void* address) {
+    spin_lock(&g_reserve_lock);
+    int index = find_reservation((u64)address);
+    if (index < 0 || g_reservations[index].start != (u64)address) {
+        spin_unlock(&g_reserve_lock);
+        serial_printf("demand: kernel_unreserve on %x%8x which is not a reservation\n", (u32)((u64)address >> 32), (u32)(u64)address);
+        kernel_bug();
+        return false;
+    }
+    Reservation r = g_reservations[index];
+    for (int i = index; i < g_reservation_count - 1; i++)
+        g_reservations[i] = g_reservations[i + 1];
+    g_reservation_count--;
+    g_fault_stats.reserved_bytes -= r.end - r.start;
+    spin_unlock(&g_reserve_lock);
+
+    // The range is gone from the array so no new faults will map pages in it
+    return kernel_vunmap((void*)r.start, r.end - r.start);
+}
+
+void kernel_page_fault_stats(PageFaultStats* out_stats) {
+    spin_lock(&g_reserve_lock);
+    out_stats->reserved_bytes = g_fault_stats.reserved_bytes;
+    spin_unlock(&g_reserve_lock);
+    out_stats->faults        = __atomic_load_n(&g_fault_stats.faults, __ATOMIC_RELAXED);
+    out_stats->demand_faults = __atomic_load_n(&g_fault_stats.demand_faults, __ATOMIC_RELAXED);
+    out_stats->total_cycles  = __atomic_load_n(&g_fault_stats.total_cycles, __ATOMIC_RELAXED);
+    out_stats->max_cycles    = __atomic_load_n(&g_fault_stats.max_cycles, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,50 @@
+/*
+    Demand paged kernel memory
+
+    A reservation is a range of kernel virtual memory with nothing mapped behind it.
+    The first access to a page takes a page fault and the fault handler maps a zeroed
+    physical page there. Reserving a large buffer is free, memory is only used
+    for the pages that are touched.
+
+    Reserved memory must not be touched while holding the physical allocator
+    or paging locks, the fault handler takes both.
+*/
+
+#pragma once
+
+#include "elos/kernel/common/types.h"
+
+// Reservations are placed in [RESERVE_BASE, RESERVE_END)
+#define RESERVE_BASE 0xFFFFC00000000000ULL
+#define RESERVE_END  0xFFFFE00000000000ULL
+
+typedef struct PageFaultStats {
+    u64 faults;         // all page faults, also the ones we couldn't handle
+    u64 demand_faults;  // faults that mapped a page in a reservation
+    u64 total_cycles;   // time spent handling demand faults (rdtsc)
+    u64 max_cycles;
+    u64 reserved_bytes;
+} PageFaultStats;
+
+/*
+    Registers the page fault handler. Call after init_interrupts and init_paging.
+*/
+void init_demand_paging();
+
+/*
+    Reserves virtual memory that is backed by zeroed pages on first touch.
+    Reservations are 2 MiB aligned with unmapped space between them so overflowing
+    one faults instead of running into the next.
+
+    @param page_flags   PAGE_WRITE, PAGE_NO_EXECUTE...
+    Returns NULL if there is no space left.
+*/
+void* kernel_reserve(u64 bytes, u64 page_flags);
+
+/*
+    Releases a reservation and frees the pages that were touched.
+    The address must be one returned by kernel_reserve.
+*/
+bool kernel_unreserve(void* address);
+
+void kernel_page_fault_stats(PageFaultStats* out_stats);
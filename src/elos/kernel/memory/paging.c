@@ -1,297 +1,657 @@
+/*
+    Paging
 
-// @NOTTESTED this paging code hasn't been tested much. Might not work so well.
-//
+    4-level paging on the tables UEFI left in CR3. Level 4 is the PML4, level 1 holds
+    the entries for 4 KiB pages. Level 2 and 3 entries can map a 2 MiB or 1 GiB page
+    directly (the PS bit) instead of pointing to a table.
+
+    New tables come from the physical allocator. Tables are reached through the
+    direct map (see paging.h) so walking and editing them never needs a temporary
+    mapping. While the direct map is built they are reached through UEFI's identity map.
+    Tables that become empty after unmapping are kept.
+
+    Unmapping gathers the pages to invalidate and flushes once at the end. A few pages
+    are invalidated one by one with invlpg, above TLB_FLUSH_THRESHOLD the whole TLB is
+    flushed instead (CR3 reload, or CR4.PGE toggle/INVPCID when global pages are involved).
+    Adding a mapping where nothing was mapped needs no flush, the TLB never caches
+    not-present entries. Memory freed by an unmap is given back after the flush so nobody
+    can reuse it while a stale translation still points at it.
+
+    Other CPUs invalidate the same pages through smp_call_others before the memory is freed.
+    The paging lock is held meanwhile so nobody may take it with interrupts disabled.
+*/
 
 #include "elos/kernel/memory/paging.h"
 #include "elos/kernel/common/types.h"
+#include "elos/kernel/common/sync.h"
 #include "elos/kernel/memory/phys_allocator.h"
+#include "elos/kernel/debug/debug.h"
+#include "elos/kernel/common/string.h"
+#include "elos/kernel/common/intrinsics.h"
+#include "elos/kernel/common/smp.h"
+
+#include <cpuid.h>
+
+#define PTE_PRESENT 0x1ULL
+#define PTE_WRITE   0x2ULL
+#define PTE_USER    0x4ULL
+#define PTE_HUGE    0x80ULL   // PS bit in level 2 and 3 entries
+#define PTE_PAT_4K  0x80ULL   // PAT bit in level 1 entries
+#define PTE_PAT_BIG 0x1000ULL // PAT bit in huge entries
+#define PTE_GLOBAL  0x100ULL
+#define PTE_ADDRESS 0x000FFFFFFFFFF000ULL
+
+#define PAGE_FLAGS (PAGE_WRITE | PAGE_USER | PAGE_WRITE_THROUGH | PAGE_NO_CACHE | PAGE_GLOBAL | PAGE_NO_EXECUTE)
+
+#define MSR_EFER      0xC0000080
+#define EFER_NXE      (1 << 11)
+#define CR4_PGE       (1 << 7)
+#define CR4_PCIDE     (1 << 17)
+#define CR3_NO_FLUSH  (1ULL << 63)
+
+// More pages than this and we flush the whole TLB instead of one invlpg per page
+#define TLB_FLUSH_THRESHOLD 32
+#define TLB_GATHER_FREES    64
+
+#define MAX_RAM_RANGES 256
+
+
+u64 g_direct_map_offset;
+
+static Spinlock g_paging_lock = LOCK_INIT("paging");
+static bool g_has_1g_pages;
+static bool g_has_no_execute;
+static bool g_has_pcid;
+static bool g_has_invpcid;
+
+typedef struct TlbGather {
+    u64  pages[TLB_FLUSH_THRESHOLD];
+    u32  page_count;
+    bool flush_all;
+    bool global;     // a global page was invalidated
+
+    // physical memory to free after the flush
+    u64  free_start[TLB_GATHER_FREES];
+    u64  free_bytes[TLB_GATHER_FREES];
+    u32  free_count;
+} TlbGather;
+
+static TlbGather g_tlb_gather; // protected by g_paging_lock
+
+// Counters for the curious
+static u64 g_tlb_page_flushes;
+static u64 g_tlb_full_flushes;
 
 
 static inline u64 read_cr3() {
     u64 reg;
-    asm (
+    asm volatile (
         "mov %%cr3, %0\n"
         : "=r" (reg)
     );
     return reg;
 }
 static inline void write_cr3(u64 reg) {
-    asm (
+    asm volatile (
         "mov %0, %%cr3\n"
         :
         : "r" (reg)
+        : "memory"
     );
 }
 static inline void flush_tlb(void* addr) {
-    asm (
+    asm volatile (
         "invlpg (%0)\n"
         :
         : "r" (addr)
+        : "memory"
     );
 }
+static inline u64 read_cr4() {
+    u64 reg;
+    asm volatile ("mov %%cr4, %0\n" : "=r" (reg));
+    return reg;
+}
+static inline void write_cr4(u64 reg) {
+    asm volatile ("mov %0, %%cr4\n" : : "r" (reg) : "memory");
+}
+static inline void invpcid(u64 type, u64 pcid, u64 addr) {
+    struct { u64 pcid; u64 addr; } desc = { pcid, addr };
+    asm volatile ("invpcid %0, %1\n" : : "m" (desc), "r" (type) : "memory");
+}
+
+static inline u64 level_size(int level) {
+    return 1ULL << (12 + 9 * (level - 1));
+}
+static inline int table_index(u64 virt, int level) {
+    return (virt >> (12 + 9 * (level - 1))) & 0x1FF;
+}
+static inline bool is_leaf(u64 entry, int level) {
+    return level == 1 || (entry & PTE_HUGE);
+}
+// Physical address in a leaf entry, the PAT bit of huge entries is not part of it
+static inline u64 leaf_address(u64 entry, int level) {
+    return entry & PTE_ADDRESS & ~(level_size(level) - 1);
+}
+static inline u64* table_at(u64 entry) {
+    return phys_to_virt(entry & PTE_ADDRESS);
+}
+static inline u64* root_table() {
+    return phys_to_virt(read_cr3() & PTE_ADDRESS);
+}
 
-// These are already identity mapped by UEFI
-static u64 next_reserved_page_table;
-static u64 reserved_page_table_3[512];
-static u64 reserved_page_table_2[512];
-static u64 reserved_page_table_1[512];
-static u64* free_mappedPageTables[3];
-static int free_mappedPageTables_len;
 
+static void flush_tlb_all(bool global) {
+    if (global) {
+        if (g_has_invpcid) {
+            invpcid(2, 0, 0); // all contexts, global pages too
+        } else {
+            u64 cr4 = read_cr4();
+            if (cr4 & CR4_PGE) {
+                write_cr4(cr4 & ~CR4_PGE);
+                write_cr4(cr4);
+            } else {
+                write_cr3(read_cr3() & ~CR3_NO_FLUSH);
+            }
+        }
+    } else {
+        // Without the no-flush bit this drops the current PCID's non-global entries
+        write_cr3(read_cr3() & ~CR3_NO_FLUSH);
+    }
+    __atomic_add_fetch(&g_tlb_full_flushes, 1, __ATOMIC_RELAXED);
+}
 
-u64* fetch_page_table(u64* page_table, int index, bool alloc_missing_tables);
-void* alloc_page_table();
+static void tlb_gather_page(TlbGather* gather, u64 virt, u64 entry) {
+    if (entry & PTE_GLOBAL)
+        gather->global = true;
+    if (gather->page_count < TLB_FLUSH_THRESHOLD)
+        gather->pages[gather->page_count++] = virt;
+    else
+        gather->flush_all = true;
+}
 
-void init_paging() {
-    const u64 MASK_48_BIT = 0x0000FFFFFFFFFFFF;
-    const u64 MASK_ENTRY_PHYS_ADDRESS = 0x0000FFFFFFFFF000;
-
-    free_mappedPageTables[0] = reserved_page_table_1;
-    free_mappedPageTables[1] = reserved_page_table_2;
-    free_mappedPageTables[2] = reserved_page_table_3;
-    free_mappedPageTables_len = 3;
-
-    u64 base = 0x23000000;
-    int lvl4 = (base >> 39) & 0x1FF;
-    int lvl3 = (base >> 30) & 0x1FF;
-    int lvl2 = (base >> 21) & 0x1FF;
-    int lvl1 = (base >> 12) & 0x1FF;
-
-    u64* page_table_4 = (void*)read_cr3();
-
-    u64 entry;
-
-    entry = page_table_4[lvl4];
-    if ((entry & 1) == 0) {
-        // clear previous flags
-        entry = 3; // set present, read/write bit, clear user to get supervisor page (for now)
-        // Allocate Page Table
-        // Put new table into entry
-        entry |= (u64)free_mappedPageTables[free_mappedPageTables_len--] & MASK_ENTRY_PHYS_ADDRESS; // bits 12 - 48
-        // Put table entry back into page directory
-        page_table_4[lvl4] = entry;
+static void tlb_gather_invalidate(void* arg) {
+    TlbGather* gather = arg;
+    if (gather->flush_all) {
+        flush_tlb_all(gather->global);
+    } else {
+        for (u32 i = 0; i < gather->page_count; i++)
+            flush_tlb((void*)gather->pages[i]);
+        __atomic_add_fetch(&g_tlb_page_flushes, gather->page_count, __ATOMIC_RELAXED);
     }
-    u64* page_table_3 = (u64*)(entry & MASK_ENTRY_PHYS_ADDRESS);
-
-    entry = page_table_3[lvl3];
-    if ((entry & 1) == 0) {
-        // clear previous flags
-        entry = 3; // set present, read/write bit, clear user to get supervisor page (for now)
-        // Allocate Page Table
-        // Put new table into entry
-        entry |= (u64)free_mappedPageTables[free_mappedPageTables_len--] & MASK_ENTRY_PHYS_ADDRESS; // bits 12 - 48
-        // Put table entry back into page directory
-        page_table_3[lvl3] = entry;
+}
+
+static void tlb_gather_flush(TlbGather* gather) {
+    tlb_gather_invalidate(gather);
+    if (gather->page_count > 0 || gather->flush_all)
+        smp_call_others(tlb_gather_invalidate, gather);
+
+    gather->page_count = 0;
+    gather->flush_all  = false;
+    gather->global     = false;
+
+    // Nothing can reach the memory now
+    for (u32 i = 0; i < gather->free_count; i++)
+        kernel_free_phys_pages((void*)gather->free_start[i], gather->free_bytes[i] / PAGE_SIZE_4K);
+    gather->free_count = 0;
+}
+
+static void tlb_gather_free(TlbGather* gather, u64 phys, u64 bytes) {
+    if (gather->free_count > 0) {
+        // extend the previous range if it's contiguous, vmap allocates in big chunks
+        u32 last = gather->free_count - 1;
+        if (gather->free_start[last] + gather->free_bytes[last] == phys) {
+            gather->free_bytes[last] += bytes;
+            return;
+        }
     }
-    u64* page_table_2 = (u64*)(entry & MASK_ENTRY_PHYS_ADDRESS);
-
-    entry = page_table_2[lvl2];
-    if ((entry & 1) == 0) {
-        // clear previous flags
-        entry = 3; // set present, read/write bit, clear user to get supervisor page (for now)
-        // Allocate Page Table
-        // Put new table into entry
-        entry |= (u64)free_mappedPageTables[free_mappedPageTables_len--] & MASK_ENTRY_PHYS_ADDRESS; // bits 12 - 48
-        // Put table entry back into page directory
-        page_table_3[lvl2] = entry;
+    if (gather->free_count == TLB_GATHER_FREES)
+        tlb_gather_flush(gather);
+    gather->free_start[gather->free_count] = phys;
+    gather->free_bytes[gather->free_count] = bytes;
+    gather->free_count++;
+}
+
+
+typedef struct RamRange {
+    u64 start;
+    u64 end;
+} RamRange;
+
+static bool is_ram(u32 type) {
+    switch (type) {
+    case EfiLoaderCode:
+    case EfiLoaderData:
+    case EfiBootServicesCode:
+    case EfiBootServicesData:
+    case EfiRuntimeServicesCode:
+    case EfiRuntimeServicesData:
+    case EfiConventionalMemory:
+    case EfiACPIReclaimMemory:
+    case EfiACPIMemoryNVS:
+        return true;
+    default:
+        // MMIO and reserved ranges aren't mapped, they may not like cached or speculative access
+        return false;
     }
-    u64* page_table_1 = (u64*)(entry & MASK_ENTRY_PHYS_ADDRESS);
-
-    // page table can be free or whatever. It's fine.
-    
-    flush_tlb((void*)base);
-}
-
-void* alloc_page_table() {
-    u64 base = 0x23000000;
-    const u64 MASK_48_BIT = 0x0000FFFFFFFFFFFF;
-    const u64 MASK_ENTRY_PHYS_ADDRESS = 0x0000FFFFFFFFF000;
-    const int PAGE_SIZE = 0x1000;
-
-    // physical address of new page
-    // This is not the address we return.
-    // We return one from reserved_page_table
-    void* new_page_table = kerneL_alloc_phys_pages(1);
-    
-    u64* page_table_4 = (void*)read_cr3();
-
-    u64 index = next_reserved_page_table;
-    u64 virt;
-    while (1) {
-        virt = (u64)base + index * PAGE_SIZE;
-        
-        int lvl4 = (virt >> 39) & 0x1FF;
-        int lvl3 = (virt >> 30) & 0x1FF;
-        int lvl2 = (virt >> 21) & 0x1FF;
-        int lvl1 = (virt >> 12) & 0x1FF;
-
-        u64* page_table_3 = fetch_page_table(page_table_4, lvl4, false);
-        if (page_table_3) {
-            kernel_bug();
-            return NULL;
-        }
-        u64* page_table_2 = fetch_page_table(page_table_3, lvl3, false);
-        if (page_table_2) {
-            kernel_bug();
-            return NULL;
-        }
-        u64* page_table_1 = fetch_page_table(page_table_2, lvl2, false);
-        if (page_table_1) {
-            kernel_bug();
-            return NULL;
-        }
+}
 
-        u64 entry = page_table_1[lvl1];
-        if ((entry & 1) == 0) {
-            index++;
+// The firmware may keep its page tables in memory that isn't RAM in the memory map,
+// make sure every table is in the direct map anyway.
+static bool map_table_pages(u64* table, int level) {
+    for (int i = 0; i < 512; i++) {
+        u64 entry = table[i];
+        if (!(entry & PTE_PRESENT) || is_leaf(entry, level))
             continue;
-        }
+        u64 phys = entry & PTE_ADDRESS;
+        if (!map_pages((void*)(DIRECT_MAP_BASE + phys), (void*)phys, PAGE_SIZE_4K, PAGE_WRITE | PAGE_NO_EXECUTE))
+            return false;
+        if (level > 2 && !map_table_pages(table_at(entry), level - 1))
+            return false;
+    }
+    return true;
+}
 
-        if (free_mappedPageTables_len < 3) {
-            // We need to refill free mapped page tables so that we don't run out of table directories
-            // when allocating new page tables.
-            
-            void* extraTable = kerneL_alloc_phys_pages(1);
-
-            entry = 3; // set present, read/write bit, clear user to get supervisor page (for now)
-            entry |= (u64)extraTable & MASK_ENTRY_PHYS_ADDRESS;
-            page_table_1[lvl1] = entry;
-            free_mappedPageTables[free_mappedPageTables_len] = (u64*)virt;
-            index++;
+/*
+    Maps RAM from the EFI memory map at DIRECT_MAP_BASE. Neighbouring descriptors are
+    merged first so the ranges are as long as possible and get large pages.
+*/
+static void init_direct_map() {
+    static RamRange ranges[MAX_RAM_RANGES];
+    int range_count = 0;
+
+    const int desc_count = g_memory_mapper.total_size_of_descriptors/g_memory_mapper.descriptor_size;
+    for (int i = 0; i < desc_count; i++) {
+        EFI_MEMORY_DESCRIPTOR* desc = (EFI_MEMORY_DESCRIPTOR*)((char*)
+            g_memory_mapper.memory_descriptors + i*g_memory_mapper.descriptor_size);
+        if (!is_ram(desc->Type) || desc->NumberOfPages == 0)
+            continue;
+
+        RamRange range = { desc->PhysicalStart, desc->PhysicalStart + desc->NumberOfPages * PAGE_SIZE_4K };
+
+        // insertion sort, the map is short and usually sorted already
+        int at = range_count;
+        while (at > 0 && ranges[at-1].start > range.start)
+            at--;
+        if (at > 0 && ranges[at-1].end >= range.start) {
+            if (range.end > ranges[at-1].end)
+                ranges[at-1].end = range.end;
             continue;
         }
+        if (range_count == MAX_RAM_RANGES) {
+            serial_printf("paging: Too many memory ranges, some RAM is not in the direct map\n");
+            break;
+        }
+        for (int j = range_count; j > at; j--)
+            ranges[j] = ranges[j-1];
+        ranges[at] = range;
+        range_count++;
+    }
 
-        // found free entry
-        entry = 3; // set present, read/write bit, clear user to get supervisor page (for now)
-        entry |= (u64)new_page_table & MASK_ENTRY_PHYS_ADDRESS;
-        page_table_1[lvl1] = entry;
-        break;
+    // merging above only looked backwards
+    int merged = 0;
+    for (int i = 0; i < range_count; i++) {
+        if (merged > 0 && ranges[merged-1].end >= ranges[i].start) {
+            if (ranges[i].end > ranges[merged-1].end)
+                ranges[merged-1].end = ranges[i].end;
+        } else {
+            ranges[merged++] = ranges[i];
+        }
+    }
+
+    u64 total = 0;
+    for (int i = 0; i < merged; i++) {
+        u64 bytes = ranges[i].end - ranges[i].start;
+        if (!map_pages((void*)(DIRECT_MAP_BASE + ranges[i].start), (void*)ranges[i].start, bytes,
+                PAGE_WRITE | PAGE_GLOBAL | PAGE_NO_EXECUTE)) {
+            serial_printf("paging: Can't map %x - %x in the direct map\n", ranges[i].start, ranges[i].end);
+            kernel_bug();
+            return;
+        }
+        total += bytes;
     }
 
-    next_reserved_page_table = index + 1;
-    flush_tlb((void*)virt);
-    return (void*) virt;
-}
-
-// create page table if it doesn't exist
-u64* fetch_page_table(u64* page_table, int index, bool alloc_missing_tables) {
-    const u64 MASK_48_BIT = 0x0000FFFFFFFFFFFF;
-    const u64 MASK_ENTRY_PHYS_ADDRESS = 0x0000FFFFFFFFF000;
-    
-    u64 page_table_entry = page_table[index];
-
-    if ((page_table_entry & 1) == 0) {
-        // Page table is not present
-
-        if (!alloc_missing_tables)
-            return NULL;
-
-        // clear previous flags
-        page_table_entry = 3; // set present, read/write bit, clear user to get supervisor page (for now)
-                                // Clear page cache disable, page write through, Execute Disable
-        
-        // Allocate Page Table
-        void* allocated_page_table = alloc_page_table();
-        // Put new table into entry
-        page_table_entry |= (u64)allocated_page_table & MASK_ENTRY_PHYS_ADDRESS; // bits 12 - 48
-        // Put table entry back into page directory
-        page_table[index] = page_table_entry;
+    u64 root = read_cr3() & PTE_ADDRESS;
+    if (!map_pages((void*)(DIRECT_MAP_BASE + root), (void*)root, PAGE_SIZE_4K, PAGE_WRITE | PAGE_NO_EXECUTE)
+        || !map_table_pages(root_table(), 4)) {
+        serial_printf("paging: Can't map page tables in the direct map\n");
+        kernel_bug();
+        return;
     }
 
-    u64* next_page_table = (u64*)(page_table_entry & MASK_ENTRY_PHYS_ADDRESS);
-    return next_page_table;
+    // From now on page tables are reached through the direct map
+    g_direct_map_offset = DIRECT_MAP_BASE;
+    serial_printf("paging: Direct map of %d MiB in %d ranges\n", (int)(total >> 20), merged);
 }
 
-bool map_page(void* virtual_address, void* physical_address) {
-    const u64 MASK_48_BIT = 0x0000FFFFFFFFFFFF;
-    const u64 MASK_ENTRY_PHYS_ADDRESS = 0x0000FFFFFFFFF000;
+void init_paging() {
+    u32 eax, ebx, ecx, edx;
+    if (__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx)) {
+        g_has_1g_pages   = (edx >> 26) & 1;
+        g_has_no_execute = (edx >> 20) & 1;
+    }
 
-    u64 virt = (u64)virtual_address & MASK_48_BIT;
-    u64 phys = (u64)physical_address & MASK_48_BIT;
+    if (g_has_no_execute) {
+        u64 efer = read_msr(MSR_EFER);
+        if (!(efer & EFER_NXE))
+            write_msr(MSR_EFER, efer | EFER_NXE);
+    }
 
-    int lvl4 = (virt >> 39) & 0x1FF;
-    int lvl3 = (virt >> 30) & 0x1FF;
-    int lvl2 = (virt >> 21) & 0x1FF;
-    int lvl1 = (virt >> 12) & 0x1FF;
-    int page_offset = virt & 0xFFF;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        g_has_pcid = (ecx >> 17) & 1;
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        g_has_invpcid = (ebx >> 10) & 1;
 
-    int phys_page_offset = phys & 0xFFF;
+    // Global pages (the direct map) survive CR3 reloads
+    u64 cr4 = read_cr4() | CR4_PGE;
+    // PCIDE can only be turned on while we use PCID 0
+    if (g_has_pcid && (read_cr3() & 0xFFF) == 0)
+        cr4 |= CR4_PCIDE;
+    else
+        g_has_pcid = false;
+    write_cr4(cr4);
 
-    if (page_offset != phys_page_offset) {
-        kernel_bug();
-        // Bug in kernel if this happens.
-        // (only kernel calls this function)
-        // Well, actually, this would happen if we run out of physical pages.
-        return false;
-    }
+    serial_printf("paging: 1G pages: %d, NX: %d, PCID: %d, INVPCID: %d\n", (int)g_has_1g_pages,
+        (int)g_has_no_execute, (int)g_has_pcid, (int)g_has_invpcid);
 
-    // 512 entries in each map/directory/table
-    u64* page_table_4 = (void*)read_cr3();
-    u64* page_table_3 = fetch_page_table(page_table_4, lvl4, true);
-    if (!page_table_3) {
-        // Ran out of physical pages for page tables.
+    init_direct_map();
+}
+
+static u64* alloc_page_table() {
+    void* phys = kernel_alloc_phys(1, ALLOC_ZERO);
+    if (!phys)
         return NULL;
+    return phys_to_virt((u64)phys);
+}
+
+// Table the entry points to, a new empty table is added if it's not present.
+// NULL if we're out of memory.
+static u64* next_table(u64* entry, u64 flags) {
+    if (*entry & PTE_PRESENT) {
+        // Permissions are and:ed over all levels, a user page needs user tables
+        if ((flags & PAGE_USER) && !(*entry & PTE_USER))
+            *entry |= PTE_USER;
+        return table_at(*entry);
     }
-    u64* page_table_2 = fetch_page_table(page_table_3, lvl3, true);
-    if (!page_table_2) {
-        // Ran out of physical pages for page tables.
+
+    u64* table = alloc_page_table();
+    if (!table)
         return NULL;
-    }
-    u64* page_table_1 = fetch_page_table(page_table_2, lvl2, true);
-    if (!page_table_1) {
-        // Ran out of physical pages for page tables.
+    *entry = (virt_to_phys(table) & PTE_ADDRESS) | PTE_PRESENT | PTE_WRITE | (flags & PAGE_USER);
+    return table;
+}
+
+// Replaces a huge page with a table of 512 pages one level down mapping the same memory.
+static u64* split_huge_page(u64* entry, int level, u64 virt, TlbGather* gather) {
+    u64* table = alloc_page_table();
+    if (!table)
         return NULL;
-    }
 
-    u64 page_table_1_entry = page_table_1[lvl1];
-    if (page_table_1_entry & 1) {
-        u64 cur_phys = page_table_1_entry & MASK_ENTRY_PHYS_ADDRESS;
-        // page already present and mapped
-        return cur_phys == ((u64)physical_address & MASK_ENTRY_PHYS_ADDRESS);
+    const u64 old   = *entry;
+    const u64 phys  = leaf_address(old, level);
+    const u64 size  = level_size(level - 1);
+    u64 flags = old & ~PTE_ADDRESS & ~PTE_HUGE & ~PTE_PAT_BIG;
+    if (level - 1 == 1) {
+        if (old & PTE_PAT_BIG)
+            flags |= PTE_PAT_4K;
+    } else {
+        flags |= PTE_HUGE | (old & PTE_PAT_BIG);
     }
 
-    page_table_1_entry = 3; // present, read/write, supervisor
-    page_table_1_entry |= phys & MASK_ENTRY_PHYS_ADDRESS;
+    for (int i = 0; i < 512; i++)
+        table[i] = (phys + i * size) | flags;
 
-    page_table_1[lvl1] = page_table_1_entry;
-    
-    flush_tlb(virtual_address);
-    return true;
+    *entry = (virt_to_phys(table) & PTE_ADDRESS) | (old & (PTE_PRESENT | PTE_WRITE | PTE_USER));
+    tlb_gather_page(gather, virt, old);
+    return table;
 }
 
+// Largest page we can map at virt/phys with 'bytes' left
+static u64 pick_page_size(u64 virt, u64 phys, u64 bytes) {
+    if (g_has_1g_pages && ((virt | phys) & (PAGE_SIZE_1G - 1)) == 0 && bytes >= PAGE_SIZE_1G)
+        return PAGE_SIZE_1G;
+    if (((virt | phys) & (PAGE_SIZE_2M - 1)) == 0 && bytes >= PAGE_SIZE_2M)
+        return PAGE_SIZE_2M;
+    return PAGE_SIZE_4K;
+}
 
-bool unmap_page(void* virtual_address) {
-    const u64 MASK_48_BIT = 0x0000FFFFFFFFFFFF;
-    const u64 MASK_ENTRY_PHYS_ADDRESS = 0x0000FFFFFFFFF000;
+/*
+    Maps one page of 'size' bytes. Returns number of bytes mapped, it's less than size
+    when there already is a table where the large page would go. 0 on failure.
+*/
+static u64 map_one(u64 virt, u64 phys, u64 size, u64 flags) {
+    int target = size == PAGE_SIZE_1G ? 3 : size == PAGE_SIZE_2M ? 2 : 1;
+
+    u64* table = root_table();
+    for (int level = 4; level > target; level--) {
+        u64* entry = &table[table_index(virt, level)];
+        if ((*entry & PTE_PRESENT) && is_leaf(*entry, level)) {
+            // A bigger page is already here, fine if it maps to the same place
+            u64 mapped = leaf_address(*entry, level) + (virt & (level_size(level) - 1));
+            return mapped == phys ? size : 0;
+        }
+        table = next_table(entry, flags);
+        if (!table)
+            return 0;
+    }
 
-    u64 virt = (u64)virtual_address & MASK_48_BIT;
+    u64* entry = &table[table_index(virt, target)];
+    if (*entry & PTE_PRESENT) {
+        if (is_leaf(*entry, target))
+            return leaf_address(*entry, target) == phys ? size : 0;
+
+        // Smaller pages are already mapped in here, don't throw the table away
+        return map_one(virt, phys, level_size(target - 1), flags);
+    }
 
-    int lvl4 = (virt >> 39) & 0x1FF;
-    int lvl3 = (virt >> 30) & 0x1FF;
-    int lvl2 = (virt >> 21) & 0x1FF;
-    int lvl1 = (virt >> 12) & 0x1FF;
+    *entry = phys | PTE_PRESENT | (flags & PAGE_FLAGS) | (target > 1 ? PTE_HUGE : 0);
+    if (!g_has_no_execute)
+        *entry &= ~PAGE_NO_EXECUTE;
+    return size;
+}
 
-    // 512 entries in each map/directory/table
-    u64* page_table_4 = (void*)read_cr3();
-    u64* page_table_3 = fetch_page_table(page_table_4, lvl4, false);
-    if(!page_table_3)
+bool map_pages(void* virtual_address, void* physical_address, u64 bytes, u64 flags) {
+    u64 virt = (u64)virtual_address;
+    u64 phys = (u64)physical_address;
+    if ((virt | phys | bytes) & (PAGE_SIZE_4K - 1)) {
+        kernel_bug();
         return false;
-    u64* page_table_2 = fetch_page_table(page_table_3, lvl3, false);
-    if(!page_table_2)
+    }
+
+    spin_lock(&g_paging_lock);
+    while (bytes > 0) {
+        u64 mapped = map_one(virt, phys, pick_page_size(virt, phys, bytes), flags);
+        if (mapped == 0) {
+            spin_unlock(&g_paging_lock);
+            return false;
+        }
+        virt  += mapped;
+        phys  += mapped;
+        bytes -= mapped;
+    }
+    spin_unlock(&g_paging_lock);
+    return true;
+}
+
+static bool unmap_range(u64 virt, u64 bytes, bool free_memory) {
+    if ((virt | bytes) & (PAGE_SIZE_4K - 1)) {
+        kernel_bug();
         return false;
-    u64* page_table_1 = fetch_page_table(page_table_2, lvl2, false);
-    if(!page_table_1)
+    }
+
+    TlbGather* gather = &g_tlb_gather;
+    bool success = true;
+
+    spin_lock(&g_paging_lock);
+    while (bytes > 0) {
+        u64* table = root_table();
+        u64 step = 0;
+
+        for (int level = 4; level >= 1; level--) {
+            u64* entry = &table[table_index(virt, level)];
+            u64 size   = level_size(level);
+            u64 offset = virt & (size - 1);
+
+            if (!(*entry & PTE_PRESENT)) {
+                // nothing mapped up to the end of this entry
+                step = size - offset;
+                break;
+            }
+            if (!is_leaf(*entry, level)) {
+                table = table_at(*entry);
+                continue;
+            }
+
+            if (offset == 0 && bytes >= size) {
+                u64 old = *entry;
+                *entry = 0;
+                tlb_gather_page(gather, virt, old);
+                if (free_memory)
+                    tlb_gather_free(gather, leaf_address(old, level), size);
+                step = size;
+                break;
+            }
+
+            // Only part of a large page goes away
+            table = split_huge_page(entry, level, virt, gather);
+            if (!table) {
+                success = false;
+                break;
+            }
+        }
+        if (!success)
+            break;
+
+        if (step > bytes)
+            step = bytes;
+        virt  += step;
+        bytes -= step;
+    }
+    tlb_gather_flush(gather);
+    spin_unlock(&g_paging_lock);
+    return success;
+}
+
+bool unmap_pages(void* virtual_address, u64 bytes) {
+    return unmap_range((u64)virtual_address, bytes, false);
+}
+
+bool lookup_page(void* virtual_address, void** out_physical_address, u64* out_page_size) {
+    u64 virt = (u64)virtual_address;
+    u64* table = root_table();
+    for (int level = 4; level >= 1; level--) {
+        u64 entry = table[table_index(virt, level)];
+        if (!(entry & PTE_PRESENT))
+            return false;
+        if (is_leaf(entry, level)) {
+            u64 size = level_size(level);
+            if (out_physical_address)
+                *out_physical_address = (void*)(leaf_address(entry, level) + (virt & (size - 1)));
+            if (out_page_size)
+                *out_page_size = size;
+            return true;
+        }
+        table = table_at(entry);
+    }
+    return false;
+}
+
+bool map_page(void* virtual_address, void* physical_address) {
+    u64 virt = (u64)virtual_address;
+    u64 phys = (u64)physical_address;
+
+    if ((virt & 0xFFF) != (phys & 0xFFF)) {
+        // Bug in kernel if this happens.
+        // (only kernel calls this function)
+        kernel_bug();
         return false;
+    }
 
-    u64 page_table_1_entry = page_table_1[lvl1];
-    if ((page_table_1_entry & 1) == 0) {
+    return map_pages((void*)(virt & ~0xFFFULL), (void*)(phys & ~0xFFFULL), PAGE_SIZE_4K, PAGE_WRITE);
+}
+
+bool unmap_page(void* virtual_address) {
+    void* page = (void*)((u64)virtual_address & ~0xFFFULL);
+    if (!lookup_page(page, NULL, NULL)) {
         // page wasn't mapped
         return false;
     }
+    return unmap_pages(page, PAGE_SIZE_4K);
+}
+
+
+
+bool kernel_vmap(void* requested_virtual_addr, u64 bytes, u64 page_flags, u32 alloc_flags) {
+    u64 virt = (u64)requested_virtual_addr;
+    if ((virt | bytes) & (PAGE_SIZE_4K - 1)) {
+        kernel_bug();
+        return false;
+    }
 
-    page_table_1[lvl1] = 0; // clear page
-    
-    flush_tlb(virtual_address);
+    u64 done = 0;
+    while (done < bytes) {
+        // Back aligned 2 MiB stretches with 2 MiB of contiguous memory so they get a large page
+        u64 chunk = PAGE_SIZE_4K;
+        void* phys = NULL;
+        if (((virt + done) & (PAGE_SIZE_2M - 1)) == 0 && bytes - done >= PAGE_SIZE_2M) {
+            phys = kernel_alloc_phys_contiguous(PAGE_SIZE_2M / PAGE_SIZE_4K, PAGE_SIZE_2M, 0, alloc_flags & ALLOC_ZERO);
+            if (phys)
+                chunk = PAGE_SIZE_2M;
+        }
+        if (!phys)
+            phys = kernel_alloc_phys(1, alloc_flags & ALLOC_ZERO);
+        if (!phys)
+            break;
+
+        if (alloc_flags & ALLOC_DEBUG_FILL)
+            memset(phys_to_virt((u64)phys), 0x9D, chunk);
+
+        if (!map_pages((void*)(virt + done), phys, chunk, page_flags)) {
+            // It may have mapped a part before failing. Take back only the pages that point
+            // at our memory, whatever else is in the range was there before us.
+            for (u64 offset = 0; offset < chunk; offset += PAGE_SIZE_4K) {
+                void* mapped;
+                if (lookup_page((void*)(virt + done + offset), &mapped, NULL) && (u64)mapped == (u64)phys + offset)
+                    unmap_pages((void*)(virt + done + offset), PAGE_SIZE_4K);
+            }
+            kernel_free_phys_pages(phys, chunk / PAGE_SIZE_4K);
+            break;
+        }
+        done += chunk;
+    }
+
+    if (done < bytes) {
+        unmap_range(virt, done, true);
+        return false;
+    }
     return true;
 }
 
+bool kernel_vunmap(void* requested_virtual_addr, u64 bytes) {
+    return unmap_range((u64)requested_virtual_addr, bytes, true);
+}
+
+void* map_mmio(u64 physical_address, u64 bytes) {
+    u64 start = physical_address & ~(PAGE_SIZE_4K - 1);
+    u64 end = (physical_address + bytes + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1);
+    // MMIO is never RAM so it can't clash with the direct map of RAM
+    u64 flags = PAGE_WRITE | PAGE_NO_CACHE | PAGE_WRITE_THROUGH | PAGE_NO_EXECUTE;
+    if (!map_pages(phys_to_virt(start), (void*)start, end - start, flags))
+        return NULL;
+    return phys_to_virt(physical_address);
+}
+
+void switch_address_space(u64 root_table_physical, u16 pcid, bool flush) {
+    u64 cr3 = root_table_physical & PTE_ADDRESS;
+    if (g_has_pcid) {
+        cr3 |= pcid & 0xFFF;
+        if (!flush)
+            cr3 |= CR3_NO_FLUSH;
+    }
+    write_cr3(cr3);
+}
+
+void kernel_tlb_stats(u64* out_page_flushes, u64* out_full_flushes) {
+    *out_page_flushes = g_tlb_page_flushes;
+    *out_full_flushes = g_tlb_full_flushes;
+}
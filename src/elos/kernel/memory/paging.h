@@ -2,19 +2,71 @@
 
 #include "elos/kernel/common/types.h"
 
+#define PAGE_SIZE_4K 0x1000ULL
+#define PAGE_SIZE_2M 0x200000ULL
+#define PAGE_SIZE_1G 0x40000000ULL
+
+// Flags for map_pages, same bits as in the page table entries
+#define PAGE_WRITE         0x2ULL
+#define PAGE_USER          0x4ULL
+#define PAGE_WRITE_THROUGH 0x8ULL
+#define PAGE_NO_CACHE      0x10ULL
+#define PAGE_GLOBAL        0x100ULL
+#define PAGE_NO_EXECUTE    0x8000000000000000ULL
+
+/*
+    All RAM in the EFI memory map is mapped at DIRECT_MAP_BASE + physical address.
+    g_direct_map_offset is 0 until init_paging has built the direct map, physical memory
+    is reached through UEFI's identity map until then.
+*/
+#define DIRECT_MAP_BASE 0xFFFF800000000000ULL
+
+extern u64 g_direct_map_offset;
+
+static inline void* phys_to_virt(u64 physical_address) {
+    return (void*)(physical_address + g_direct_map_offset);
+}
+// Only for addresses in the direct map
+static inline u64 virt_to_phys(void* virtual_address) {
+    return (u64)virtual_address - g_direct_map_offset;
+}
+
 /*
-    Sets up backup page tables in case we run out of them when mapping pages.
-    At the moment the backup pages is static data in kernel identity mapped by UEFI
-    so we always have access to them. If we need new tables then we can easily map up
-    new ones.
+    Checks for 1 GiB page and no-execute support and builds the direct map.
+    Page tables are allocated from the physical allocator, call after kernel_init_memory_mapper.
 */
 void init_paging();
 
+/*
+    Maps a range with the largest pages that fit. 1 GiB and 2 MiB pages are used
+    where virtual and physical address are both aligned to it and enough of the range is left.
+    Parts of the range that already have a smaller page table keep using it.
+
+    Addresses and bytes must be page-aligned.
+    Mapping over an existing mapping to the same physical memory is fine, mapping over one
+    to somewhere else fails. Parts mapped before a failure stay mapped.
+*/
+bool map_pages(void* virtual_address, void* physical_address, u64 bytes, u64 flags);
+
+/*
+    Unmaps a range. Large pages only partly in the range are split into smaller pages first.
+    Unmapped holes in the range are skipped.
+    Returns false if we ran out of memory for page tables while splitting.
+*/
+bool unmap_pages(void* virtual_address, u64 bytes);
+
+/*
+    Finds the physical address a virtual address maps to and the size of the page it's in.
+    Returns false if it's not mapped. Out parameters can be NULL.
+*/
+bool lookup_page(void* virtual_address, void** out_physical_address, u64* out_page_size);
+
 /*
     The lower 12 bits of virtual and physical address should be the exact same.
     (it is the page offset into the pages we map)
 
-    Fails if page is already mapped.
+    Maps one 4 KiB page, read/write and supervisor only.
+    Fails if page is already mapped somewhere else.
 */
 bool map_page(void* virtual_address, void* physical_address);
 /*
@@ -25,3 +77,36 @@ bool map_page(void* virtual_address, void* physical_address);
     have already "reclaimed" that physical page (which is done in phys_allocator).
 */
 bool unmap_page(void* virtual_address);
+
+/*
+    Allocates physical memory and maps it at a virtual range. Aligned 2 MiB parts
+    get 2 MiB pages when contiguous memory is available.
+
+    @param page_flags   PAGE_WRITE, PAGE_NO_EXECUTE...
+    @param alloc_flags  ALLOC_ZERO or ALLOC_DEBUG_FILL (0x9D), memory is uninitialized otherwise
+    Address and bytes must be page-aligned. Nothing stays mapped if it fails.
+*/
+bool kernel_vmap(void* requested_virtual_addr, u64 bytes, u64 page_flags, u32 alloc_flags);
+
+/*
+    Unmaps a range and frees the physical memory behind it, for memory from kernel_vmap.
+    The TLB is flushed once for the whole range.
+    Address and bytes must be page-aligned
+*/
+bool kernel_vunmap(void* requested_virtual_addr, u64 bytes);
+
+/*
+    Maps device registers uncached at their place in the direct map and returns the
+    virtual address of physical_address. Needs no alignment.
+    Returns NULL if the range can't be mapped.
+*/
+void* map_mmio(u64 physical_address, u64 bytes);
+
+/*
+    Loads another top level page table. With PCID each address space keeps its TLB entries
+    across switches, pass flush if the tables changed since this pcid was last loaded.
+    Without PCID support the pcid is ignored and the TLB is always flushed.
+*/
+void switch_address_space(u64 root_table_physical, u16 pcid, bool flush);
+
+void kernel_tlb_stats(u64* out_page_flushes, u64* out_full_flushes);
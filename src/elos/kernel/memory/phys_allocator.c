@@ -1,25 +1,73 @@
 /*
-    This is a simple slow implementation
-
     Physical memory allocator
 
-    TODO: Implementation assumes we won't reach MAX_REGIONS
-      which we must fix.
-
-    At the moment a "Region" is the same as an "Allocation"
+    Binary buddy allocator over the conventional memory in the EFI memory map.
+
+    Every physical page has a PageFrame in g_page_frames (indexed by page frame number).
+    Free blocks are 2^order pages, naturally aligned, and linked into the free lists of their zone
+    through the PageFrame of their first page. The free pages themselves are never touched
+    by the allocator.
+
+    Allocating pops the smallest block that fits and splits it down. Freeing merges the block
+    with its buddy (pfn ^ (1 << order)) as long as the buddy is a free block of the same order.
+    Both are O(log n) where n is the number of pages.
+
+    Allocations of a non power-of-two page count are trimmed, the tail is given back
+    as smaller blocks so we don't waste up to half of the block.
+
+    Each order has two free lists, one for blocks known to be zero and one for dirty blocks.
+    Freed memory is dirty. A merged block is only zero if both halves were.
+    kernel_zero_free_pages, run when the kernel is idle, zeroes dirty blocks and moves them
+    to the zero lists so allocations that need zeroed memory usually don't have to clear it.
+    Memory is never handed out with leftover data from someone else, kernel_alloc scrubs
+    blocks that aren't known to be zero.
+
+    Memory is split in zones so memory that only some devices can reach isn't
+    used up by allocations that could live anywhere:
+        ZONE_DMA     below 16 MiB (ISA DMA, AP trampolines)
+        ZONE_DMA32   below 4 GiB  (32-bit bus masters)
+        ZONE_NORMAL  the rest
+    Each zone has its own free lists and blocks never merge across zones. Normal allocations
+    take from the highest zone that has memory. kernel_alloc_phys_contiguous allocates with
+    an alignment and an address limit. Alignment comes for free since blocks are naturally
+    aligned, we just allocate a big enough order. A limit at a zone boundary is only a choice
+    of zones, only the zone the limit falls inside has its free lists searched for a low block.
+
+    Single pages from kerneL_alloc_phys_pages go through a small per-CPU cache
+    which is refilled from and drained to the buddy allocator in batches.
+    Only the batch operations take g_phys_lock. Interrupts are off while a cache is used.
+
+    At the moment a "Region" is the same as an "Allocation" made by kernel_alloc.
+    Regions are found by their virtual page in a hash table so free and resize are O(1).
 */
 
 #include "elos/kernel/memory/phys_allocator.h"
 #include "elos/kernel/memory/paging.h"
 #include "elos/kernel/common/string.h"
 #include "elos/kernel/common/core_data.h"
+#include "elos/kernel/common/cpu.h"
+#include "elos/kernel/common/sync.h"
+#include "elos/kernel/interrupt/interrupt.h"
 #include "elos/kernel/debug/debug.h"
 
+#include <immintrin.h>
+
 #undef PAGE_SIZE
 #define PAGE_SIZE 4096
 
+// Largest block is 2^(BUDDY_ORDERS-1) pages (1 GiB)
+#define BUDDY_ORDERS 19
+
+#define FRAME_NIL 0xFFFFFFFF
+
+// Per-CPU page cache size and how many pages move to/from the buddy allocator at once
+#define PAGE_CACHE_MAX   64
+#define PAGE_CACHE_BATCH 32
 
-#define MAX_REGIONS 1000
+#define FRAME_FREE     0x1 // first page of a free block, order is valid
+#define FRAME_RESERVED 0x2 // not managed by allocator (firmware, MMIO, allocator metadata)
+#define FRAME_ZEROED   0x4 // free block is known to be all zeroes
+#define FRAME_CACHED   0x8 // free single page sitting in a per-CPU cache
 
 #define FLAG_FREE 0x1
 #define FLAG_USED 0x2
@@ -33,90 +81,527 @@
 
 MemoryMapper g_memory_mapper;
 
+typedef struct PageFrame {
+    u32 next;  // free list links, FRAME_NIL if none
+    u32 prev;
+    u8  order; // valid if FRAME_FREE is set
+    u8  flags;
+    u16 _reserved0;
+    u32 _reserved1;
+    void* owner; // set by users of allocated pages, slab allocator stores its slab here
+} PageFrame;
+
 typedef struct Region {
-    u64 physicalStart;
-    u64 virtualStart; // unused at the moment (same as physical)
+    u64 physicalStart; // in pages
+    u64 virtualStart;  // in pages, same as physical at the moment
     u64 pageCount;
     u32 flags; // READ,WRITE,EXECUTABLE,MEMORY MAPPED, whether virtualStart is valid
 } Region;
 
 
-u32 g_num_free_regions; // the upper bound, regions beyond this point are all "empty" (without FLAG_FREE,FLAG_USED)
-u32 g_num_used_regions;
-Region* g_free_regions;
-Region* g_used_regions;
+static PageFrame* g_page_frames;
+static u64        g_page_frame_count; // highest managed pfn + 1
+
+// Protects free lists, page frames and the allocation table
+static Spinlock g_phys_lock = LOCK_INIT("phys");
+
+#define ZONE_DMA    0
+#define ZONE_DMA32  1
+#define ZONE_NORMAL 2
+#define ZONE_COUNT  3
+
+// first pfn after each zone
+static const u64 g_zone_end[ZONE_COUNT] = {
+    (16 * 1024 * 1024) / PAGE_SIZE,
+    ((u64)4 * 1024 * 1024 * 1024) / PAGE_SIZE,
+    (u64)FRAME_NIL + 1,
+};
+static const char* g_zone_names[ZONE_COUNT] = { "DMA", "DMA32", "Normal" };
 
+typedef struct Zone {
+    u32 free_lists[BUDDY_ORDERS]; // dirty blocks
+    u32 zero_lists[BUDDY_ORDERS]; // zeroed blocks
+    u64 free_pages;
+} Zone;
 
+static Zone g_zones[ZONE_COUNT];
+static u64 g_free_pages; // not counting pages in per-CPU caches
+static u64 g_managed_pages; // conventional memory given to the buddy allocator
+static u64 g_zero_pages; // part of g_free_pages
 
-static void* find_free_descriptor(int size) {
-    const int requested_pages = (size + PAGE_SIZE-1) / PAGE_SIZE;
+typedef struct PageCache {
+    u32 count;
+    u32 pfns[PAGE_CACHE_MAX];
+} PageCache;
+
+typedef struct CpuPageCaches {
+    PageCache dirty;
+    PageCache zeroed;
+} __attribute__((aligned(64))) CpuPageCaches;
+
+static CpuPageCaches g_page_caches[MAX_CPUS];
+
+// Live allocations made by kernel_alloc, hash table indexed by virtual page.
+static Region* g_used_regions;
+static u32     g_num_used_regions;
+static u32     g_max_used_regions; // table size, power of two
+static u64     g_peak_metadata_bytes; // page frames + allocation table(s) while growing
+
+
+// Finds room for allocator metadata in conventional memory. The memory map is left as is,
+// kernel_init_memory_mapper keeps the pages out of the free lists.
+static void* find_free_descriptor(u64 size) {
+    const u64 requested_pages = (size + PAGE_SIZE-1) / PAGE_SIZE;
     const int desc_count = g_memory_mapper.total_size_of_descriptors/g_memory_mapper.descriptor_size;
     for (int i = 0; i < desc_count; i++) {
         EFI_MEMORY_DESCRIPTOR* desc = (EFI_MEMORY_DESCRIPTOR*)((char*)
             g_memory_mapper.memory_descriptors + i*g_memory_mapper.descriptor_size);
-        
+
         if (desc->Type != EfiConventionalMemory)
             continue;
 
         if (desc->NumberOfPages < requested_pages)
             continue;
-        
-        desc->NumberOfPages -= requested_pages;
-        desc->PhysicalStart += requested_pages;
 
-        // YOO! We might need to memory map this?
-        return (char*)desc->PhysicalStart;
+        // Don't hand out the zero page, NULL means failure
+        if (desc->PhysicalStart == 0)
+            continue;
+
+        // UEFI identity maps conventional memory so we can use it right away
+        return (void*)desc->PhysicalStart;
     }
     return NULL;
 }
 
-bool kernel_init_memory_mapper() {
-    g_free_regions = find_free_descriptor(MAX_REGIONS*sizeof(Region));
-    if (!g_free_regions) {
-        serial_printf("phys: Can't allocate free regions\n");
-        return false;
+
+
+static inline int order_for_pages(u64 pages) {
+    int order = 0;
+    while (((u64)1 << order) < pages)
+        order++;
+    return order;
+}
+
+static inline int zone_of(u64 pfn) {
+    if (pfn < g_zone_end[ZONE_DMA])
+        return ZONE_DMA;
+    if (pfn < g_zone_end[ZONE_DMA32])
+        return ZONE_DMA32;
+    return ZONE_NORMAL;
+}
+
+static inline u32* free_list(int zone, int order, bool zeroed) {
+    return zeroed ? &g_zones[zone].zero_lists[order] : &g_zones[zone].free_lists[order];
+}
+
+static void free_list_push(int order, u32 pfn, bool zeroed) {
+    const int zone = zone_of(pfn);
+    u32* list = free_list(zone, order, zeroed);
+    PageFrame* frame = &g_page_frames[pfn];
+    frame->flags |= FRAME_FREE;
+    if (zeroed)
+        frame->flags |= FRAME_ZEROED;
+    frame->order  = order;
+    frame->prev   = FRAME_NIL;
+    frame->next   = *list;
+    if (frame->next != FRAME_NIL)
+        g_page_frames[frame->next].prev = pfn;
+    *list = pfn;
+
+    g_zones[zone].free_pages += (u64)1 << order;
+    if (zeroed)
+        g_zero_pages += (u64)1 << order;
+}
+
+static void free_list_remove(int order, u32 pfn) {
+    const int zone = zone_of(pfn);
+    PageFrame* frame = &g_page_frames[pfn];
+    bool zeroed = (frame->flags & FRAME_ZEROED) != 0;
+    if (frame->prev != FRAME_NIL)
+        g_page_frames[frame->prev].next = frame->next;
+    else
+        *free_list(zone, order, zeroed) = frame->next;
+    if (frame->next != FRAME_NIL)
+        g_page_frames[frame->next].prev = frame->prev;
+    frame->flags &= ~(FRAME_FREE | FRAME_ZEROED);
+    frame->next = FRAME_NIL;
+    frame->prev = FRAME_NIL;
+
+    g_zones[zone].free_pages -= (u64)1 << order;
+    if (zeroed)
+        g_zero_pages -= (u64)1 << order;
+}
+
+/*
+    Takes a block of at least 'order' from the zero or dirty lists of a zone and
+    splits it down to 'order'. The block must end at or below limit_pfn.
+    Returns FRAME_NIL if there is none.
+
+    If the whole zone is below the limit any block will do and this is O(log n).
+    Otherwise the lists are searched for a low enough block, that only happens
+    for the one zone a limit falls inside.
+*/
+static u32 zone_alloc(int zone, int order, bool zeroed, u64 limit_pfn) {
+    const u64 size = (u64)1 << order;
+    const bool any = g_zone_end[zone] <= limit_pfn;
+
+    for (int found = order; found < BUDDY_ORDERS; found++) {
+        u32 pfn = *free_list(zone, found, zeroed);
+        if (!any) {
+            // we keep the lowest part of the block, that's what must be below the limit
+            while (pfn != FRAME_NIL && pfn + size > limit_pfn)
+                pfn = g_page_frames[pfn].next;
+        }
+        if (pfn == FRAME_NIL)
+            continue;
+
+        free_list_remove(found, pfn);
+
+        // split, upper half goes back to free lists
+        while (found > order) {
+            found--;
+            free_list_push(found, pfn + (1 << found), zeroed);
+        }
+
+        g_free_pages -= size;
+        return pfn;
     }
-    serial_printf("phys: Allocated free regions ptr: %x, size: %d\n", g_free_regions, MAX_REGIONS*sizeof(Region));
-    
-    g_used_regions = find_free_descriptor(MAX_REGIONS*sizeof(Region));
-    if (!g_used_regions) {
-        serial_printf("phys: Can't allocate used regions\n");
-        return false;
+    return FRAME_NIL;
+}
+
+/*
+    Allocates a block from the highest zone that has one and which starts below limit_pfn.
+
+    @param want_zero  Prefer blocks known to be zero, otherwise prefer dirty blocks
+                      so zeroed ones are left for those who need them.
+    @param out_zeroed Whether the returned block is known to be zero.
+*/
+static u32 buddy_alloc_below(int order, u64 limit_pfn, bool want_zero, bool* out_zeroed) {
+    for (int zone = ZONE_COUNT-1; zone >= 0; zone--) {
+        if (zone > 0 && g_zone_end[zone-1] >= limit_pfn)
+            continue; // zone starts at or above the limit
+
+        if (g_zones[zone].free_pages < ((u64)1 << order))
+            continue;
+
+        bool zeroed = want_zero;
+        u32 pfn = zone_alloc(zone, order, zeroed, limit_pfn);
+        if (pfn == FRAME_NIL) {
+            zeroed = !zeroed;
+            pfn = zone_alloc(zone, order, zeroed, limit_pfn);
+        }
+        if (pfn != FRAME_NIL) {
+            if (out_zeroed)
+                *out_zeroed = zeroed;
+            return pfn;
+        }
+    }
+    return FRAME_NIL;
+}
+
+static inline u32 buddy_alloc(int order, bool want_zero, bool* out_zeroed) {
+    return buddy_alloc_below(order, (u64)FRAME_NIL + 1, want_zero, out_zeroed);
+}
+
+static void buddy_free(u32 pfn, int order, bool zeroed) {
+    if (g_page_frames[pfn].flags & (FRAME_FREE | FRAME_RESERVED | FRAME_CACHED)) {
+        // double free or freeing memory we don't own
+        kernel_bug();
+        return;
+    }
+    g_free_pages += (u64)1 << order;
+
+    const int zone = zone_of(pfn);
+    while (order < BUDDY_ORDERS-1) {
+        u64 buddy = pfn ^ ((u64)1 << order);
+        if (buddy >= g_page_frame_count)
+            break;
+        if (zone_of(buddy) != zone)
+            break;
+        PageFrame* frame = &g_page_frames[buddy];
+        if ((frame->flags & FRAME_FREE) == 0 || frame->order != order)
+            break;
+
+        // A zeroed block doesn't merge with a dirty buddy, we would lose track of
+        // the zeroes and the idle zeroing would never make progress. It merges once
+        // the buddy is zeroed too. Dirty blocks merge with anything.
+        if (zeroed && (frame->flags & FRAME_ZEROED) == 0)
+            break;
+
+        free_list_remove(order, buddy);
+        if (buddy < pfn)
+            pfn = buddy;
+        order++;
     }
-    serial_printf("phys: Allocated used regions ptr: %x, size: %d\n", g_used_regions, MAX_REGIONS*sizeof(Region));
 
-    memset(g_free_regions, 0x9D, MAX_REGIONS * sizeof(Region));
-    memset(g_used_regions, 0x9D, MAX_REGIONS * sizeof(Region));
+    free_list_push(order, pfn, zeroed);
+}
 
+// Free an arbitrary page range as the largest naturally aligned blocks
+static void buddy_free_range(u64 pfn, u64 count, bool zeroed) {
+    while (count > 0) {
+        int order = 0;
+        while (order < BUDDY_ORDERS-1
+            && (pfn & ((u64)1 << order)) == 0
+            && ((u64)2 << order) <= count
+            && zone_of(pfn) == zone_of(pfn + ((u64)2 << order) - 1))
+            order++;
+
+        buddy_free(pfn, order, zeroed);
+        pfn   += (u64)1 << order;
+        count -= (u64)1 << order;
+    }
+}
+
+/*
+    Allocates exactly 'count' contiguous pages aligned to 2^align_order pages
+    which end at or below limit_pfn. Returns first pfn or FRAME_NIL.
+*/
+static u32 buddy_alloc_range(u64 count, int align_order, u64 limit_pfn, bool want_zero, bool* out_zeroed) {
+    int order = order_for_pages(count);
+    if (order < align_order)
+        order = align_order;
+    if (order >= BUDDY_ORDERS)
+        return FRAME_NIL;
+
+    bool zeroed;
+    u32 pfn = buddy_alloc_below(order, limit_pfn, want_zero, &zeroed);
+    if (pfn == FRAME_NIL)
+        return FRAME_NIL;
+
+    u64 block = (u64)1 << order;
+    if (block > count)
+        buddy_free_range(pfn + count, block - count, zeroed);
+
+    if (out_zeroed)
+        *out_zeroed = zeroed;
+    return pfn;
+}
+
+static inline u32 buddy_alloc_pages(u64 count, bool want_zero, bool* out_zeroed) {
+    return buddy_alloc_range(count, 0, (u64)FRAME_NIL + 1, want_zero, out_zeroed);
+}
+
+static void scrub_pages(u64 pfn, u64 count) {
+    void* ptr = (void*)(pfn * PAGE_SIZE);
+    u64 qwords = count * PAGE_SIZE / 8;
+    asm volatile (
+        "rep stosq\n"
+        : "+D" (ptr), "+c" (qwords)
+        : "a" (0)
+        : "memory"
+    );
+}
+
+
+
+bool kernel_init_memory_mapper() {
     const int desc_count = g_memory_mapper.total_size_of_descriptors/g_memory_mapper.descriptor_size;
+
+    u64 max_pfn = 0;
     for (int i = 0; i < desc_count; i++) {
         EFI_MEMORY_DESCRIPTOR* desc = (EFI_MEMORY_DESCRIPTOR*)((char*)
             g_memory_mapper.memory_descriptors + i*g_memory_mapper.descriptor_size);
-        
+
+        if (desc->Type != EfiConventionalMemory)
+            continue;
+
+        u64 end_pfn = desc->PhysicalStart / PAGE_SIZE + desc->NumberOfPages;
+        if (end_pfn > max_pfn)
+            max_pfn = end_pfn;
+    }
+
+    if (max_pfn >= FRAME_NIL) {
+        serial_printf("phys: Too much physical memory, limiting to %d pages\n", (int)(FRAME_NIL-1));
+        max_pfn = FRAME_NIL-1;
+    }
+
+    g_page_frame_count = max_pfn;
+    g_page_frames = find_free_descriptor(g_page_frame_count * sizeof(PageFrame));
+    if (!g_page_frames) {
+        serial_printf("phys: Can't allocate page frames\n");
+        return false;
+    }
+    serial_printf("phys: Allocated page frames ptr: %x, count: %d\n", g_page_frames, (int)g_page_frame_count);
+
+    for (u64 i = 0; i < g_page_frame_count; i++) {
+        PageFrame* frame = &g_page_frames[i];
+        frame->next  = FRAME_NIL;
+        frame->prev  = FRAME_NIL;
+        frame->order = 0;
+        frame->flags = FRAME_RESERVED;
+        frame->owner = NULL;
+    }
+    for (int zone = 0; zone < ZONE_COUNT; zone++) {
+        for (int i = 0; i < BUDDY_ORDERS; i++) {
+            g_zones[zone].free_lists[i] = FRAME_NIL;
+            g_zones[zone].zero_lists[i] = FRAME_NIL;
+        }
+        g_zones[zone].free_pages = 0;
+    }
+
+    for (int i = 0; i < desc_count; i++) {
+        EFI_MEMORY_DESCRIPTOR* desc = (EFI_MEMORY_DESCRIPTOR*)((char*)
+            g_memory_mapper.memory_descriptors + i*g_memory_mapper.descriptor_size);
+
         if (desc->Type != EfiConventionalMemory)
             continue;
 
         // TODO: Do something with attributes?
 
-        if(g_num_free_regions >= MAX_REGIONS)
-            break;
+        u64 pfn   = desc->PhysicalStart / PAGE_SIZE;
+        u64 count = desc->NumberOfPages;
+
+        // Page zero stays reserved, NULL means failure
+        if (pfn == 0 && count > 0) {
+            pfn++;
+            count--;
+        }
+        // Page frames are at the start of a descriptor
+        u64 frames_pfn   = (u64)g_page_frames / PAGE_SIZE;
+        u64 frames_pages = (g_page_frame_count * sizeof(PageFrame) + PAGE_SIZE-1) / PAGE_SIZE;
+        if (pfn == frames_pfn) {
+            pfn   += frames_pages;
+            count -= frames_pages;
+        }
+        if (pfn >= g_page_frame_count)
+            continue;
+        if (pfn + count > g_page_frame_count)
+            count = g_page_frame_count - pfn;
 
-        Region* alloc = &g_free_regions[g_num_free_regions];
-        g_num_free_regions++;
+        for (u64 p = pfn; p < pfn + count; p++)
+            g_page_frames[p].flags = 0;
 
-        alloc->flags = FLAG_FREE;
-        alloc->pageCount = desc->NumberOfPages;
-        alloc->physicalStart = desc->PhysicalStart;
-        alloc->virtualStart = 0;
+        // The UEFI spec doesn't promise conventional memory is cleared (and OVMF doesn't),
+        // it may hold data from the firmware or boot loader so it starts out dirty.
+        buddy_free_range(pfn, count, false);
+        g_managed_pages += count;
     }
+    g_peak_metadata_bytes = g_page_frame_count * sizeof(PageFrame);
+
+    serial_printf("phys: Free pages: %d\n", (int)g_free_pages);
+    for (int zone = 0; zone < ZONE_COUNT; zone++)
+        serial_printf("phys:   %s: %d\n", g_zone_names[zone], (int)g_zones[zone].free_pages);
     return true;
 }
 
 
 
-void* kernel_alloc(const u64 size, void* const ptr) {
-    const int requested_pages = (size + PAGE_SIZE-1) / PAGE_SIZE;
-    const int requested_aligned_size = ((size + PAGE_SIZE-1) / PAGE_SIZE) * PAGE_SIZE;
+/*
+    Allocation table
+
+    Open addressed hash table (linear probing) of live kernel_alloc allocations
+    keyed by virtual page number. A slot is empty when flags is 0.
+    Removal shifts following entries back so we never need tombstones.
+    The table doubles when it's 3/4 full.
+*/
+
+static inline u64 hash_page(u64 virtual_page) {
+    // Fibonacci hashing, consecutive pages spread over the table
+    return (virtual_page * 0x9E3779B97F4A7C15) >> 32;
+}
+
+static Region* find_used_region(u64 virtual_page) {
+    if (!g_used_regions)
+        return NULL;
+    const u32 mask = g_max_used_regions - 1;
+    u32 index = hash_page(virtual_page) & mask;
+    while (1) {
+        Region* alloc = &g_used_regions[index];
+        if (alloc->flags == 0)
+            return NULL;
+        if (alloc->virtualStart == virtual_page)
+            return alloc;
+        index = (index + 1) & mask;
+    }
+}
+
+static Region* insert_used_region(Region* table, u32 max, u64 virtual_page) {
+    const u32 mask = max - 1;
+    u32 index = hash_page(virtual_page) & mask;
+    while (table[index].flags != 0)
+        index = (index + 1) & mask;
+    table[index].virtualStart = virtual_page;
+    return &table[index];
+}
+
+static Region* add_used_region(u64 virtual_page) {
+    if ((g_num_used_regions + 1) * 4 > g_max_used_regions * 3) {
+        u64 new_max   = g_max_used_regions ? g_max_used_regions * 2 : PAGE_SIZE / sizeof(Region);
+        u64 new_pages = (new_max * sizeof(Region) + PAGE_SIZE-1) / PAGE_SIZE;
+        bool zeroed;
+        u32 pfn = buddy_alloc_pages(new_pages, true, &zeroed);
+        if (pfn == FRAME_NIL)
+            return NULL;
+
+        Region* new_regions = (Region*)((u64)pfn * PAGE_SIZE);
+        if (!zeroed)
+            scrub_pages(pfn, new_pages);
+
+        if (g_used_regions) {
+            for (u32 i = 0; i < g_max_used_regions; i++) {
+                Region* alloc = &g_used_regions[i];
+                if (alloc->flags == 0)
+                    continue;
+                *insert_used_region(new_regions, new_max, alloc->virtualStart) = *alloc;
+            }
+            u64 old_pages = (g_max_used_regions * sizeof(Region) + PAGE_SIZE-1) / PAGE_SIZE;
+            buddy_free_range((u64)g_used_regions / PAGE_SIZE, old_pages, false);
+        }
+        u64 metadata = g_page_frame_count * sizeof(PageFrame)
+            + (new_max + g_max_used_regions) * sizeof(Region);
+        if (metadata > g_peak_metadata_bytes)
+            g_peak_metadata_bytes = metadata;
+
+        g_used_regions     = new_regions;
+        g_max_used_regions = new_max;
+    }
+    g_num_used_regions++;
+    return insert_used_region(g_used_regions, g_max_used_regions, virtual_page);
+}
+
+static void remove_used_region(Region* region) {
+    const u32 mask = g_max_used_regions - 1;
+    u32 hole  = region - g_used_regions;
+    u32 index = hole;
+
+    g_used_regions[hole].flags = 0;
+    g_num_used_regions--;
+
+    // Move back entries that probed past the hole
+    while (1) {
+        index = (index + 1) & mask;
+        Region* alloc = &g_used_regions[index];
+        if (alloc->flags == 0)
+            break;
+
+        u32 home = hash_page(alloc->virtualStart) & mask;
+        // entry can move if its home slot is not in (hole, index]
+        bool movable = hole <= index
+            ? (home <= hole || home > index)
+            : (home <= hole && home > index);
+        if (!movable)
+            continue;
+
+        g_used_regions[hole] = *alloc;
+        alloc->flags = 0;
+        hole = index;
+    }
+}
+
+
+
+// Initializes pages that aren't known to be zero, see ALLOC_DEBUG_FILL
+static void init_pages(u64 pfn, u64 count, bool zeroed, u32 flags) {
+    if (flags & ALLOC_DEBUG_FILL) {
+        memset((void*)(pfn * PAGE_SIZE), 0x9D, count * PAGE_SIZE);
+    } else if (!zeroed) {
+        scrub_pages(pfn, count);
+    }
+}
+
+void* kerneL_alloc_pages(const u64 size, void* const ptr, u32 flags) {
+    const u64 requested_pages = (size + PAGE_SIZE-1) / PAGE_SIZE;
     // in pages, same as Region.virtualStart
     const u64 old_virtual_address = (u64)ptr / PAGE_SIZE;
     void* const old_aligned_ptr   = (void*)(((u64)ptr / PAGE_SIZE) * PAGE_SIZE);
@@ -142,154 +627,106 @@ void* kernel_alloc(const u64 size, void* const ptr) {
 
     if (old_virtual_address && size) {
         // RESIZE MEMORY
-        
-        int found_used_index = -1;
-        for (int i = 0; i < g_num_used_regions; i++) {
-            Region* alloc = &g_used_regions[i];
-            if ((alloc->flags & FLAG_USED) == 0)
-                continue;
-            if (alloc->virtualStart != old_virtual_address)
-                continue;
-
-            found_used_index = i;
-            break;
+
+        spin_lock(&g_phys_lock);
+
+        Region* used_alloc = find_used_region(old_virtual_address);
+        if (!used_alloc) {
+            spin_unlock(&g_phys_lock);
+            return NULL;
+        }
+
+        if (requested_pages <= used_alloc->pageCount) {
+            // shrink in place, give the tail back
+            buddy_free_range(used_alloc->physicalStart + requested_pages, used_alloc->pageCount - requested_pages, false);
+            used_alloc->pageCount = requested_pages;
+            spin_unlock(&g_phys_lock);
+            return old_aligned_ptr;
         }
 
-        if (found_used_index == -1) {
+        // Grow by moving to a new block. Copy the fields first, the table
+        // may be reorganized when we remove and insert.
+        const u64 old_physical_start = used_alloc->physicalStart;
+        const u64 old_page_count     = used_alloc->pageCount;
+        const u32 old_flags          = used_alloc->flags;
+
+        // Most of the block is overwritten by the copy, don't use up zeroed pages
+        bool zeroed;
+        u32 pfn = buddy_alloc_pages(requested_pages, false, &zeroed);
+        if (pfn == FRAME_NIL) {
+            spin_unlock(&g_phys_lock);
             return NULL;
         }
 
-        Region* used_alloc = &g_used_regions[found_used_index];
-        const u64 old_aligned_size = used_alloc->pageCount * PAGE_SIZE;
+        // Removing first means the insert can't grow the table (and fail)
+        remove_used_region(used_alloc);
+        Region* new_alloc = add_used_region(pfn);
+        new_alloc->physicalStart = pfn;
+        new_alloc->pageCount     = requested_pages;
+        new_alloc->flags         = old_flags;
 
-        void* new_ptr = kernel_alloc(requested_aligned_size, NULL);
-        memcpy(new_ptr, old_aligned_ptr, old_aligned_size);
-        // TODO: We are doing a loop over used regions once above and then
-        //   once below when freeing old allocation. OPTIMIZE.
-        //   We'll want to use a different memory allocation implementation
-        //   so no point in improving this now.
-        kernel_alloc(0, old_aligned_ptr);
+        spin_unlock(&g_phys_lock);
+
+        // Old pages are still ours until we free them below, copy without the lock
+        void* const new_ptr = (void*)((u64)pfn * PAGE_SIZE);
+        memcpy(new_ptr, old_aligned_ptr, old_page_count * PAGE_SIZE);
+        init_pages(pfn + old_page_count, requested_pages - old_page_count, zeroed, flags);
+
+        spin_lock(&g_phys_lock);
+        buddy_free_range(old_physical_start, old_page_count, false);
+        spin_unlock(&g_phys_lock);
 
         return new_ptr;
 
     } else if (old_virtual_address) {
         // FREE MEMORY
-        
-        // TODO: If the ptr you passed is valid then this function should always succeed.
-        //   If g_free_regions is full then we will fail however. Memory is too scattered.
-        //   Also, we can't indicate whether we succeded or not. return (void*)1 to indicate
-        //   free succeded seems like a bad idea. But as I said, as long as ptr is valid free
-        //   always succeeds. We'll revise and improve this implementation in the future.
-        
-        int found_used_index = -1;
-        for (int i = 0; i < g_num_used_regions; i++) {
-            Region* alloc = &g_used_regions[i];
-            if ((alloc->flags & FLAG_USED) == 0)
-                continue;
-            if (alloc->virtualStart != old_virtual_address)
-                continue;
-
-            found_used_index = i;
-            break;
-        }
 
-        if (found_used_index == -1) {
-            return NULL;
-        }
+        // Freeing can't fail if ptr is valid, neighbouring free blocks are merged right away.
 
-        int found_free_index = -1;
-        for (int i = 0; i < g_num_free_regions + 1; i++) {
-            Region* alloc = &g_free_regions[i];
-            if ((alloc->flags & FLAG_FREE) != 0)
-                continue;
-
-            found_free_index = i;
-            break;
-        }
+        spin_lock(&g_phys_lock);
 
-        if (found_free_index == -1) {
+        Region* used_alloc = find_used_region(old_virtual_address);
+        if (!used_alloc) {
+            spin_unlock(&g_phys_lock);
             return NULL;
         }
 
-        Region* free_alloc = &g_free_regions[found_free_index];
-        Region* used_alloc = &g_used_regions[found_used_index];
-
-        free_alloc->physicalStart = used_alloc->physicalStart;
-        free_alloc->virtualStart  = used_alloc->virtualStart;
-        free_alloc->pageCount     = used_alloc->pageCount;
-        free_alloc->flags         = FLAG_FREE;
-
-        used_alloc->flags = 0; // clear region
-
-        if (found_free_index >= g_num_free_regions) {
-            g_num_free_regions = found_free_index + 1;
-        }
+        // Memory from kernel_alloc is reached through UEFI's identity map so
+        // there is nothing to unmap.
+        // The pages are dirty, they are scrubbed before anyone else gets them.
+        buddy_free_range(used_alloc->physicalStart, used_alloc->pageCount, false);
+        remove_used_region(used_alloc);
 
-        for (int i = 0; i < requested_pages; i++) {
-            void* addr = (char*)old_virtual_address + used_alloc->pageCount * PAGE_SIZE;
-            bool yes = unmap_page(addr);
-            if (!yes) {
-                // Bug in kernel if this doesn't work
-                return NULL;
-            }
-        }
+        spin_unlock(&g_phys_lock);
 
         return NULL; // we return NULL on success when freeing
 
     } else /* if (size) */ {
         // ALLOCATE MEMORY
 
-        int found_free_index = -1;
-        for (int i = 0; i < g_num_free_regions; i++) {
-            Region* alloc = &g_free_regions[i];
-            if ((alloc->flags & FLAG_FREE) == 0)
-                continue;
+        spin_lock(&g_phys_lock);
 
-            if (requested_pages >= alloc->pageCount)
-                continue;
-            
-            found_free_index = i;
-            break;
-        }
-
-        if (found_free_index == -1) {
+        bool zeroed;
+        u32 pfn = buddy_alloc_pages(requested_pages, !(flags & ALLOC_DEBUG_FILL), &zeroed);
+        if (pfn == FRAME_NIL) {
+            spin_unlock(&g_phys_lock);
             return NULL;
         }
 
-        int found_used_index = -1;
-        for (int i = 0; i < g_num_used_regions + 1; i++) {
-            Region* alloc = &g_used_regions[i];
-            if ((alloc->flags & FLAG_USED) != 0)
-                continue;
-
-            found_used_index = i;
-            break;
-        }
-
-        if (found_used_index == -1) {
+        Region* used_alloc = add_used_region(pfn);
+        if (!used_alloc) {
+            buddy_free_range(pfn, requested_pages, zeroed);
+            spin_unlock(&g_phys_lock);
             return NULL;
         }
 
-        Region* free_alloc = &g_free_regions[found_free_index];
-        Region* used_alloc = &g_used_regions[found_used_index];
-
-        used_alloc->physicalStart = free_alloc->physicalStart;
-        used_alloc->virtualStart  = free_alloc->physicalStart;
+        used_alloc->physicalStart = pfn;
         used_alloc->pageCount     = requested_pages;
         used_alloc->flags         = FLAG_USED | FLAG_VIRTUALLY_MAPPED;
 
-        free_alloc->pageCount     -= requested_pages;
-        free_alloc->physicalStart += requested_pages;
-        if (free_alloc->pageCount == 0) {
-            free_alloc->flags = 0; // clear region
-        }
+        spin_unlock(&g_phys_lock);
 
-        if (found_used_index >= g_num_used_regions) {
-            g_num_used_regions = found_used_index + 1;
-        }
-
-        void* const new_ptr    = (void*)(used_alloc->virtualStart * PAGE_SIZE);
-        const u64 aligned_size = ((size + PAGE_SIZE-1) / PAGE_SIZE) * PAGE_SIZE;
+        void* const new_ptr = (void*)((u64)pfn * PAGE_SIZE);
 
         // Safe to assume regions/pages from UEFI is mapped mostly?
         // Otherwise we need this:
@@ -303,159 +740,418 @@ void* kernel_alloc(const u64 size, void* const ptr) {
         // }
 
         // Always initialize memory. Malicious program should not be able to read freed memory from other programs.
-        memset(new_ptr, 0x9D, aligned_size);
+        // Usually the block was zeroed while the kernel was idle and there is nothing to do.
+        init_pages(pfn, requested_pages, zeroed, flags);
 
         return new_ptr;
     }
 }
 
+void* kernel_alloc(const u64 size, void* const ptr) {
+    return kerneL_alloc_pages(size, ptr, 0);
+}
+
 
 
-static int filter_empty_regions(Region* regions, int count) {
-    int begin = 0;
-    int end = count-1;
-    while (begin <= end) {
-        Region* b = &regions[begin];
-        Region* e = &regions[end];
+static void page_cache_refill(PageCache* cache, bool zeroed) {
+    u32 dirty_count = 0;
+    u32 dirty[PAGE_CACHE_BATCH];
 
-        if (b->flags != 0) {
-            begin++;
-            continue;
-        }
-        if (e->flags == 0) {
-            end--;
-            continue;
+    spin_lock(&g_phys_lock);
+    while (cache->count + dirty_count < PAGE_CACHE_BATCH) {
+        bool page_zeroed;
+        u32 pfn = buddy_alloc(0, zeroed, &page_zeroed);
+        if (pfn == FRAME_NIL)
+            break;
+        g_page_frames[pfn].flags |= FRAME_CACHED;
+        if (zeroed && !page_zeroed)
+            dirty[dirty_count++] = pfn;
+        else
+            cache->pfns[cache->count++] = pfn;
+    }
+    spin_unlock(&g_phys_lock);
+
+    // Ran out of zeroed pages, clear them here without the lock
+    for (u32 i = 0; i < dirty_count; i++) {
+        scrub_pages(dirty[i], 1);
+        cache->pfns[cache->count++] = dirty[i];
+    }
+}
+
+static void page_cache_drain(PageCache* cache, u32 keep, bool zeroed) {
+    spin_lock(&g_phys_lock);
+    while (cache->count > keep) {
+        u32 pfn = cache->pfns[--cache->count];
+        g_page_frames[pfn].flags &= ~FRAME_CACHED;
+        buddy_free(pfn, 0, zeroed);
+    }
+    spin_unlock(&g_phys_lock);
+}
+
+void* kernel_alloc_phys(u64 requested_pages, u32 flags) {
+    if (requested_pages <= 0)
+        return NULL;
+
+    const bool want_zero = (flags & ALLOC_ZERO) != 0;
+
+    if (requested_pages == 1) {
+        // Interrupts are off so a handler on this CPU can't use the cache while we are
+        bool enabled = interrupts_save_disable();
+        CpuPageCaches* caches = &g_page_caches[cpu_index()];
+        PageCache* cache = want_zero ? &caches->zeroed : &caches->dirty;
+        if (cache->count == 0)
+            page_cache_refill(cache, want_zero);
+        if (cache->count == 0) {
+            interrupts_restore(enabled);
+            return NULL;
         }
+        u32 pfn = cache->pfns[--cache->count];
+        g_page_frames[pfn].flags &= ~FRAME_CACHED;
+        interrupts_restore(enabled);
+        return (void*)((u64)pfn * PAGE_SIZE);
+    }
 
-        *b = *e;
-        begin++;
-        end--;
+    bool zeroed;
+    spin_lock(&g_phys_lock);
+    u32 pfn = buddy_alloc_pages(requested_pages, want_zero, &zeroed);
+    spin_unlock(&g_phys_lock);
+
+    if (pfn == FRAME_NIL) {
+        return NULL;
     }
-    return begin + (regions[begin].flags != 0 ? 1 : 0);
+
+    if (want_zero && !zeroed)
+        scrub_pages(pfn, requested_pages);
+
+    void* new_ptr = (void*)((u64)pfn * PAGE_SIZE);
+    return new_ptr;
 }
 
+void* kernel_alloc_phys_contiguous(u64 requested_pages, u64 alignment, u64 address_limit, u32 flags) {
+    if (requested_pages == 0)
+        return NULL;
+    if (alignment & (alignment - 1)) {
+        kernel_bug();
+        return NULL;
+    }
+
+    int align_order = 0;
+    while (((u64)PAGE_SIZE << align_order) < alignment)
+        align_order++;
+
+    u64 limit_pfn = (u64)FRAME_NIL + 1;
+    if (address_limit && address_limit / PAGE_SIZE < limit_pfn)
+        limit_pfn = address_limit / PAGE_SIZE;
+
+    const bool want_zero = (flags & ALLOC_ZERO) != 0;
 
+    bool zeroed;
+    spin_lock(&g_phys_lock);
+    u32 pfn = buddy_alloc_range(requested_pages, align_order, limit_pfn, want_zero, &zeroed);
+    spin_unlock(&g_phys_lock);
+
+    if (pfn == FRAME_NIL)
+        return NULL;
+
+    if (want_zero && !zeroed)
+        scrub_pages(pfn, requested_pages);
+
+    return (void*)((u64)pfn * PAGE_SIZE);
+}
+
+void* kerneL_alloc_phys_pages(u64 requested_pages) {
+    return kernel_alloc_phys(requested_pages, 0);
+}
 
-static void sort_regions(Region* regions, int left, int right) {
-    // quick sort (ChatGPT)
-    if (left >= right)
+void kernel_free_phys_pages(void* physical_address, u64 pages) {
+    u64 pfn = (u64)physical_address / PAGE_SIZE;
+    if (pages == 0)
         return;
-    
-    u64 pivot = regions[(left + right) / 2].physicalStart;
-    int i = left;
-    int j = right;
-
-    while (i <= j) {
-        while (regions[i].physicalStart < pivot)
-            i++;
-        while (regions[j].physicalStart > pivot)
-            j--;
-        
-        if (i <= j) {
-            // maybe some VPXOR x64 AVX2 instruction to speed up swap?
-            // It assumes Region is 32 bytes. And not all computers support AVX2.
-            Region tmp = regions[i];
-            regions[i] = regions[j];
-            regions[j] = tmp;
-            i++;
-            j--;
+    if ((u64)physical_address % PAGE_SIZE != 0 || pfn + pages > g_page_frame_count) {
+        kernel_bug();
+        return;
+    }
+
+    if (pages == 1) {
+        // Same check as buddy_free, the page would otherwise sit in the cache twice
+        // and be handed out to two owners
+        if (g_page_frames[pfn].flags & (FRAME_FREE | FRAME_RESERVED | FRAME_CACHED)) {
+            kernel_bug();
+            return;
         }
+        bool enabled = interrupts_save_disable();
+        PageCache* cache = &g_page_caches[cpu_index()].dirty;
+        if (cache->count == PAGE_CACHE_MAX)
+            page_cache_drain(cache, PAGE_CACHE_MAX - PAGE_CACHE_BATCH, false);
+        g_page_frames[pfn].flags |= FRAME_CACHED;
+        cache->pfns[cache->count++] = pfn;
+        interrupts_restore(enabled);
+        return;
     }
-    if (left < j)
-        sort_regions(regions, left, j);
-    if (i < right)
-        sort_regions(regions, i, right);
+
+    spin_lock(&g_phys_lock);
+    buddy_free_range(pfn, pages, false);
+    spin_unlock(&g_phys_lock);
 }
 
+u64 kernel_zero_free_pages(u64 max_pages) {
+    u64 zeroed_pages = 0;
+    while (zeroed_pages < max_pages) {
+        // Largest block within budget, bigger dirty blocks are split
+        int order = 0;
+        while (order < BUDDY_ORDERS-1 && ((u64)2 << order) <= max_pages - zeroed_pages)
+            order++;
+
+        spin_lock(&g_phys_lock);
+        u32 pfn = FRAME_NIL;
+        for (; order >= 0; order--) {
+            for (int zone = ZONE_COUNT-1; zone >= 0 && pfn == FRAME_NIL; zone--)
+                pfn = zone_alloc(zone, order, false, (u64)FRAME_NIL + 1);
+            if (pfn != FRAME_NIL)
+                break;
+        }
+        spin_unlock(&g_phys_lock);
 
+        if (pfn == FRAME_NIL)
+            break; // no dirty memory left
 
-static void merge_neighbour_regions(Region* regions, int count) {
-    int index = 0;
-    int read_index = 1;
-    while (index < count && read_index < count) {
-        Region* b = &regions[index];
-        Region* e = &regions[read_index];
-        
-        if (b->physicalStart + b->pageCount != e->physicalStart) {
-            index = read_index;
-            read_index++;
-            continue;
-        }
+        scrub_pages(pfn, (u64)1 << order);
 
-        b->pageCount += e->pageCount;
-        e->flags = 0;
-        read_index++;
+        spin_lock(&g_phys_lock);
+        buddy_free(pfn, order, true);
+        spin_unlock(&g_phys_lock);
+
+        zeroed_pages += (u64)1 << order;
     }
+    return zeroed_pages;
 }
 
+u64 kernel_zeroed_page_count() {
+    return g_zero_pages;
+}
 
+void kernel_set_page_owner(void* physical_address, u64 pages, void* owner) {
+    u64 pfn = (u64)physical_address / PAGE_SIZE;
+    if (pfn + pages > g_page_frame_count) {
+        kernel_bug();
+        return;
+    }
+    for (u64 i = 0; i < pages; i++)
+        g_page_frames[pfn + i].owner = owner;
+}
 
-void kernel_compress_regions() {
-    // THIS FUNCTION HAS NOT BEEN TESTED
-    g_num_free_regions = filter_empty_regions(g_free_regions, g_num_free_regions);
-
-    sort_regions(g_free_regions, 0, g_num_free_regions-1);
+void* kernel_get_page_owner(void* physical_address) {
+    u64 pfn = (u64)physical_address / PAGE_SIZE;
+    if (pfn >= g_page_frame_count)
+        return NULL;
+    return g_page_frames[pfn].owner;
+}
 
-    merge_neighbour_regions(g_free_regions, g_num_free_regions);
+void kernel_drain_page_cache() {
+    bool enabled = interrupts_save_disable();
+    CpuPageCaches* caches = &g_page_caches[cpu_index()];
+    page_cache_drain(&caches->dirty, 0, false);
+    page_cache_drain(&caches->zeroed, 0, true);
+    interrupts_restore(enabled);
 }
 
+u64 kernel_free_page_count() {
+    return g_free_pages;
+}
 
+void kernel_phys_get_stats(PhysAllocStats* out_stats) {
+    memset(out_stats, 0, sizeof(*out_stats));
+
+    spin_lock(&g_phys_lock);
+    out_stats->total_pages  = g_managed_pages;
+    out_stats->free_pages   = g_free_pages;
+    out_stats->zeroed_pages = g_zero_pages;
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++)
+        out_stats->cached_pages += g_page_caches[cpu].dirty.count + g_page_caches[cpu].zeroed.count;
+
+    for (int zone = 0; zone < ZONE_COUNT; zone++) {
+        for (int order = 0; order < BUDDY_ORDERS; order++) {
+            for (int zeroed = 0; zeroed < 2; zeroed++) {
+                u32 pfn = *free_list(zone, order, zeroed);
+                if (pfn != FRAME_NIL && ((u64)1 << order) > out_stats->largest_free_block)
+                    out_stats->largest_free_block = (u64)1 << order;
+                for (; pfn != FRAME_NIL; pfn = g_page_frames[pfn].next)
+                    out_stats->free_blocks++;
+            }
+        }
+    }
 
+    out_stats->allocations         = g_num_used_regions;
+    out_stats->metadata_bytes      = g_page_frame_count * sizeof(PageFrame) + g_max_used_regions * sizeof(Region);
+    out_stats->peak_metadata_bytes = g_peak_metadata_bytes;
+    spin_unlock(&g_phys_lock);
+}
 
-void* kerneL_alloc_phys_pages(u64 requested_pages) {
-    if (requested_pages <= 0)
-        return NULL;
+#define VERIFY_MAX_REPORTS 16
 
-    int found_free_index = -1;
-    for (int i = 0; i < g_num_free_regions; i++) {
-        Region* alloc = &g_free_regions[i];
-        if ((alloc->flags & FLAG_FREE) == 0)
-            continue;
+static u64 verify_report(u64 problems, const char* what, u64 pfn, int order) {
+    if (problems < VERIFY_MAX_REPORTS)
+        serial_printf("phys: verify: %s, pfn %x order %d\n", what, (u32)pfn, order);
+    return problems + 1;
+}
 
-        if (requested_pages < alloc->pageCount)
-            continue;
-        
-        found_free_index = i;
-        break;
+u64 kernel_phys_verify() {
+    u64 problems = 0;
+    u64 zone_pages[ZONE_COUNT] = { 0 };
+    u64 zero_pages = 0;
+
+    spin_lock(&g_phys_lock);
+
+    for (int zone = 0; zone < ZONE_COUNT; zone++) {
+        for (int order = 0; order < BUDDY_ORDERS; order++) {
+            for (int zeroed = 0; zeroed < 2; zeroed++) {
+                const u64 size = (u64)1 << order;
+                u32 prev = FRAME_NIL;
+                u64 steps = 0;
+                for (u32 pfn = *free_list(zone, order, zeroed); pfn != FRAME_NIL; pfn = g_page_frames[pfn].next) {
+                    if (pfn + size > g_page_frame_count || ++steps > g_page_frame_count) {
+                        problems = verify_report(problems, "broken free list", pfn, order);
+                        break;
+                    }
+                    PageFrame* frame = &g_page_frames[pfn];
+                    if (frame->prev != prev)
+                        problems = verify_report(problems, "bad prev link", pfn, order);
+                    prev = pfn;
+
+                    if ((frame->flags & (FRAME_FREE | FRAME_RESERVED)) != FRAME_FREE || frame->order != order)
+                        problems = verify_report(problems, "bad flags or order", pfn, order);
+                    if (((frame->flags & FRAME_ZEROED) != 0) != zeroed)
+                        problems = verify_report(problems, "block in wrong zero list", pfn, order);
+                    if (pfn & (size - 1))
+                        problems = verify_report(problems, "misaligned block", pfn, order);
+                    if (zone_of(pfn) != zone || zone_of(pfn + size - 1) != zone)
+                        problems = verify_report(problems, "block outside its zone", pfn, order);
+
+                    // Another free block starting inside this one means they overlap
+                    for (u64 p = pfn + 1; p < pfn + size; p++) {
+                        if (g_page_frames[p].flags & (FRAME_FREE | FRAME_RESERVED)) {
+                            problems = verify_report(problems, "free block overlaps a free block or reserved page", p, order);
+                            break;
+                        }
+                    }
+
+                    // Buddies in the same state should have been merged. A zeroed block
+                    // next to a dirty one is fine, see buddy_free.
+                    u64 buddy = pfn ^ size;
+                    if (order < BUDDY_ORDERS-1 && buddy + size <= g_page_frame_count && zone_of(buddy) == zone) {
+                        PageFrame* other = &g_page_frames[buddy];
+                        if ((other->flags & FRAME_FREE) && other->order == order
+                            && ((other->flags & FRAME_ZEROED) != 0) == zeroed)
+                            problems = verify_report(problems, "unmerged buddies", pfn, order);
+                    }
+
+                    zone_pages[zone] += size;
+                    if (zeroed)
+                        zero_pages += size;
+                }
+            }
+        }
     }
 
-    if (found_free_index == -1) {
-        return NULL;
+    u64 free_pages = 0;
+    for (int zone = 0; zone < ZONE_COUNT; zone++) {
+        if (zone_pages[zone] != g_zones[zone].free_pages)
+            problems = verify_report(problems, "zone free count is off", zone_pages[zone], zone);
+        free_pages += zone_pages[zone];
+    }
+    if (free_pages != g_free_pages)
+        problems = verify_report(problems, "free page count is off", free_pages, 0);
+    if (zero_pages != g_zero_pages)
+        problems = verify_report(problems, "zeroed page count is off", zero_pages, 0);
+
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        PageCache* caches[2] = { &g_page_caches[cpu].dirty, &g_page_caches[cpu].zeroed };
+        for (int c = 0; c < 2; c++) {
+            for (u32 i = 0; i < caches[c]->count; i++) {
+                u32 pfn = caches[c]->pfns[i];
+                if (pfn >= g_page_frame_count || (g_page_frames[pfn].flags & (FRAME_FREE | FRAME_RESERVED | FRAME_CACHED)) != FRAME_CACHED)
+                    problems = verify_report(problems, "bad page in per-CPU cache", pfn, 0);
+            }
+        }
     }
 
-    int found_used_index = -1;
-    for (int i = 0; i < g_num_used_regions + 1; i++) {
+    u32 used = 0;
+    for (u32 i = 0; i < g_max_used_regions; i++) {
         Region* alloc = &g_used_regions[i];
-        if ((alloc->flags & FLAG_USED) != 0)
+        if (alloc->flags == 0)
             continue;
-
-        found_used_index = i;
-        break;
+        used++;
+        if (alloc->physicalStart + alloc->pageCount > g_page_frame_count) {
+            problems = verify_report(problems, "allocation out of range", alloc->physicalStart, 0);
+            continue;
+        }
+        if (g_page_frames[alloc->physicalStart].flags & (FRAME_FREE | FRAME_RESERVED))
+            problems = verify_report(problems, "allocation starts in free memory", alloc->physicalStart, 0);
+        if (find_used_region(alloc->virtualStart) != alloc)
+            problems = verify_report(problems, "allocation can't be found", alloc->virtualStart, 0);
     }
+    if (used != g_num_used_regions)
+        problems = verify_report(problems, "allocation count is off", used, 0);
 
-    if (found_used_index == -1) {
-        return NULL;
-    }
+    spin_unlock(&g_phys_lock);
 
-    Region* free_alloc = &g_free_regions[found_free_index];
-    Region* used_alloc = &g_used_regions[found_used_index];
+    if (problems > VERIFY_MAX_REPORTS)
+        serial_printf("phys: verify: %d problems in total\n", (int)problems);
+    return problems;
+}
 
-    // TODO: Describe that this region isn't memory mapped
-    used_alloc->physicalStart = free_alloc->physicalStart;
-    used_alloc->virtualStart  = 0;
-    used_alloc->pageCount     = requested_pages;
-    used_alloc->flags         = FLAG_USED;
 
-    free_alloc->pageCount     -= requested_pages;
-    free_alloc->physicalStart += requested_pages;
-    if (free_alloc->pageCount == 0) {
-        free_alloc->flags = 0; // clear region
-    }
 
-    if (found_used_index >= g_num_used_regions) {
-        g_num_used_regions = found_used_index + 1;
+/*
+    Times 'pairs' free+alloc pairs while a set of allocations is kept alive
+    and prints cycles per operation to serial.
+*/
+void kernel_alloc_stress_test(int pairs) {
+    const int LIVE = 1024;
+    u32 random = 2463534242;
+
+    void** live = kernel_alloc(LIVE * sizeof(void*), NULL);
+    if (!live) {
+        serial_printf("alloc test: Out of memory\n");
+        return;
+    }
+    for (int i = 0; i < LIVE; i++)
+        live[i] = kernel_alloc(PAGE_SIZE, NULL);
+
+    u64 alloc_total = 0, alloc_max = 0;
+    u64 free_total  = 0, free_max  = 0;
+    int failed = 0;
+
+    for (int n = 0; n < pairs; n++) {
+        random ^= random << 13;
+        random ^= random >> 17;
+        random ^= random << 5;
+
+        int index = random % LIVE;
+        u64 size  = (1 + (random >> 16) % 8) * PAGE_SIZE;
+
+        u64 t0 = _rdtsc();
+        kernel_alloc(0, live[index]);
+        u64 t1 = _rdtsc();
+        live[index] = kernel_alloc(size, NULL);
+        u64 t2 = _rdtsc();
+
+        if (!live[index])
+            failed++;
+
+        free_total  += t1 - t0;
+        alloc_total += t2 - t1;
+        if (t1 - t0 > free_max)  free_max  = t1 - t0;
+        if (t2 - t1 > alloc_max) alloc_max = t2 - t1;
     }
 
-    void* new_ptr = (void*)(used_alloc->physicalStart * PAGE_SIZE);
-    return new_ptr;
+    for (int i = 0; i < LIVE; i++)
+        kernel_alloc(0, live[i]);
+    kernel_alloc(0, live);
+
+    if (pairs <= 0)
+        return;
+    serial_printf("alloc test: %d pairs, %d live, %d failed\n", pairs, LIVE, failed);
+    serial_printf("alloc test: alloc avg %d cycles, max %d\n", (int)(alloc_total / pairs), (int)alloc_max);
+    serial_printf("alloc test: free  avg %d cycles, max %d\n", (int)(free_total / pairs), (int)free_max);
 }
@@ -23,41 +23,128 @@ extern MemoryMapper g_memory_mapper;
 
 
 
+/*
+    Sets up the buddy allocator from the EFI memory map.
+    Call once after ExitBootServices.
+*/
 bool kernel_init_memory_mapper();
 
-void kernel_compress_regions();
+/*
+    Allocate:  kernel_alloc(bytes, NULL)
+    Resize:    kernel_alloc(bytes, ptr)
+    Free:      kernel_alloc(0, ptr)    (returns NULL)
 
+    Memory is page granular and zero initialized.
+*/
 void* kernel_alloc(u64 bytes, void* ptr);
 
-/*
-    Flags specify write/read/execute access and other flags (zero initialized or 0x9D initialized)
-    Address and bytes must be page-aligned
-*/
-bool kernel_vmap(void* requested_virtual_addr, u64 bytes, int flags);
+// kernel_vmap and kernel_vunmap are in paging.h
 
-/*
-    Address and bytes must be page-aligned
-*/
-bool kernel_vunmap(void* requested_virtual_addr, u64 bytes);
 
+// Flags for kerneL_alloc_pages and kernel_alloc_phys
+
+// kernel_alloc_phys: Memory is zero initialized (kernel_alloc memory always is)
+#define ALLOC_ZERO       0x1
+// kerneL_alloc_pages: Fill with 0x9D instead of zero, helps finding reads of uninitialized memory
+#define ALLOC_DEBUG_FILL 0x2
 
 /*
-    TODO: Allocates contiguous pages with some optional flags
-    
-        Option to choose how memory is initialized. Zero initialized or some specific byte like 0xCD
-        (allocated pages are always initialized, we don't want to leave leftover data which a malicious program read)
+    Same as kernel_alloc but with flags.
+
+    Allocated pages are always initialized, we don't want to leave leftover data which a malicious program read.
+    Pages are zeroed unless ALLOC_DEBUG_FILL is set. Pages zeroed ahead of time by kernel_zero_free_pages
+    are used first so usually no clearing is done when allocating.
+
+    TODO:
         DEBUG boundaries. Allocating 2 extra pages at start and end where page is filled with 0xCD. If they were modified
         we'll know and can notify the user. (user might call kernel_allocated_pages_wrote_to_debug_page() to check it)
         READ,WRITE,EXECUTE permissions. Well, you would maybe start with READ,WRITE,EXEC but then using kernel_set_flags
         turn off write permissions or something.
-
-
 */
 void* kerneL_alloc_pages(u64 size, void* ptr, u32 flags);
 
 
 /*
     Does no memory mapping
-    Memory is uninitialized
+    Memory is uninitialized unless flags has ALLOC_ZERO. Uninitialized pages may contain
+    data from earlier allocations, don't give them to user programs.
+    Single pages come from a per-CPU cache and don't take the allocator lock
+    unless the cache has to be refilled.
+*/
+void* kernel_alloc_phys(u64 requested_pages, u32 flags);
+
+/*
+    Physically contiguous pages for DMA buffers, rings and command tables.
+    Every allocation from the phys allocator is contiguous, this one also takes
+    placement constraints.
+
+    @param alignment      in bytes, power of two. 0 or anything up to PAGE_SIZE means page aligned.
+    @param address_limit  the whole buffer lies below this address, 0 for no limit.
+                          PHYS_LIMIT_4G for 32-bit bus masters, PHYS_LIMIT_16M for ISA DMA.
+    @param flags          ALLOC_ZERO
+    Returns NULL if no free block satisfies the constraints.
+    Free with kernel_free_phys_pages.
 */
+void* kernel_alloc_phys_contiguous(u64 requested_pages, u64 alignment, u64 address_limit, u32 flags);
+
+#define PHYS_LIMIT_16M 0x1000000ULL
+#define PHYS_LIMIT_4G  0x100000000ULL
+
+// Same as kernel_alloc_phys(requested_pages, 0)
 void* kerneL_alloc_phys_pages(u64 requested_pages);
+
+/*
+    Gives back pages from kerneL_alloc_phys_pages. Any page range may be freed,
+    it doesn't have to match the original allocation.
+*/
+void kernel_free_phys_pages(void* physical_address, u64 pages);
+
+/*
+    Attach a pointer to allocated pages, like the slab that lives in them.
+    The owner must be cleared before the pages are freed.
+*/
+void  kernel_set_page_owner(void* physical_address, u64 pages, void* owner);
+void* kernel_get_page_owner(void* physical_address);
+
+/*
+    Gives the pages in this CPU's page cache back to the buddy allocator.
+*/
+void kernel_drain_page_cache();
+
+/*
+    Zeroes up to max_pages of dirty free memory so later allocations don't have to.
+    Call when there is nothing else to do. Returns number of pages zeroed, 0 when
+    all free memory is zeroed.
+*/
+u64 kernel_zero_free_pages(u64 max_pages);
+
+u64 kernel_free_page_count();
+u64 kernel_zeroed_page_count();
+
+typedef struct PhysAllocStats {
+    u64 total_pages;         // conventional memory managed by the allocator
+    u64 free_pages;          // in the buddy free lists
+    u64 zeroed_pages;        // part of free_pages
+    u64 cached_pages;        // free but sitting in per-CPU caches
+    u64 free_blocks;
+    u64 largest_free_block;  // in pages
+    u64 allocations;         // live kernel_alloc allocations
+    u64 metadata_bytes;      // page frames and allocation table
+    u64 peak_metadata_bytes;
+} PhysAllocStats;
+
+void kernel_phys_get_stats(PhysAllocStats* out_stats);
+
+/*
+    Walks all free lists and the allocation table and checks that blocks are aligned,
+    don't overlap, are in the right zone and list, buddies that should have merged did,
+    and that the counters add up. Problems are printed to serial.
+    Slow, meant for debugging and tests/phys_allocator.c.
+    Returns number of problems found.
+*/
+u64 kernel_phys_verify();
+
+/*
+    Runs alloc/free pairs through kernel_alloc and prints cycles per operation to serial.
+*/
+void kernel_alloc_stress_test(int pairs);
@@ -0,0 +1,337 @@
+/*
+    Slab allocator
+
+    Slab layout (slab_pages pages, from kerneL_alloc_phys_pages):
+
+        | KmemSlab header | free_next[objects_per_slab] | padding | object 0 | object 1 | ... |
+
+    The free list is a list of object indices kept next to the header instead of
+    inside the objects so constructed objects are never overwritten by the allocator.
+    Every page of a slab has the slab as its page owner which is how kfree finds the cache.
+*/
+
+#include "elos/kernel/memory/slab.h"
+#include "elos/kernel/memory/phys_allocator.h"
+#include "elos/kernel/common/string.h"
+#include "elos/kernel/debug/debug.h"
+
+#undef PAGE_SIZE
+#define PAGE_SIZE 4096
+
+#define SLAB_NIL 0xFFFF
+#define SLAB_MAX_PAGES 8
+#define CACHE_LINE 64
+
+struct KmemSlab {
+    KmemSlab*  next;
+    KmemSlab*  prev;
+    KmemCache* cache;
+    u16 free_head;
+    u16 inuse;
+    u32 _reserved;
+    u16 free_next[];
+};
+
+#define KMALLOC_CLASSES 8 // 16, 32, ..., 2048
+
+static KmemCache g_cache_cache; // caches made by kmem_cache_create
+static KmemCache g_kmalloc_caches[KMALLOC_CLASSES];
+static const char* g_kmalloc_names[KMALLOC_CLASSES] = {
+    "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+    "kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048",
+};
+static Spinlock g_init_lock = LOCK_INIT("slab init");
+static volatile bool g_initialized;
+
+
+
+static inline u32 align_up(u32 value, u32 align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+static void cache_init(KmemCache* cache, const char* name, u32 size, u32 align, KmemConstructor ctor) {
+    if (align == 0) {
+        // natural alignment, objects up to a cache line never straddle two lines
+        align = 8;
+        while (align < size && align < CACHE_LINE)
+            align *= 2;
+    }
+
+    memset(cache, 0, sizeof(*cache));
+    cache->name        = name;
+    cache->align       = align;
+    cache->object_size = align_up(size < 8 ? 8 : size, align);
+    cache->ctor        = ctor;
+#ifdef ELOS_LOCK_STATS
+    cache->lock.stats.name = name;
+#endif
+
+    // Pick the smallest slab where we waste at most 1/8
+    u32 pages = 1;
+    while (1) {
+        u32 bytes = pages * PAGE_SIZE;
+        u32 count = (bytes - sizeof(KmemSlab)) / (cache->object_size + sizeof(u16));
+        while (count > 0 && align_up(sizeof(KmemSlab) + count * sizeof(u16), align) + count * cache->object_size > bytes)
+            count--;
+        if (count >= SLAB_NIL)
+            count = SLAB_NIL - 1;
+
+        cache->slab_pages       = pages;
+        cache->objects_per_slab = count;
+        cache->first_object     = align_up(sizeof(KmemSlab) + count * sizeof(u16), align);
+
+        u32 waste = bytes - count * cache->object_size;
+        if (count > 0 && waste * 8 <= bytes)
+            break;
+        if (pages >= SLAB_MAX_PAGES)
+            break;
+        pages *= 2;
+    }
+}
+
+static void init_caches() {
+    spin_lock(&g_init_lock);
+    if (!g_initialized) {
+        cache_init(&g_cache_cache, "kmem_cache", sizeof(KmemCache), 0, NULL);
+        for (int i = 0; i < KMALLOC_CLASSES; i++)
+            cache_init(&g_kmalloc_caches[i], g_kmalloc_names[i], KMEM_MIN_SIZE << i, 0, NULL);
+        g_initialized = true;
+    }
+    spin_unlock(&g_init_lock);
+}
+
+
+
+static void slab_list_push(KmemSlab** list, KmemSlab* slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (slab->next)
+        slab->next->prev = slab;
+    *list = slab;
+}
+
+static void slab_list_remove(KmemSlab** list, KmemSlab* slab) {
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        *list = slab->next;
+    if (slab->next)
+        slab->next->prev = slab->prev;
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+static inline void* slab_object(KmemCache* cache, KmemSlab* slab, u32 index) {
+    return (char*)slab + cache->first_object + index * cache->object_size;
+}
+
+static KmemSlab* slab_create(KmemCache* cache) {
+    KmemSlab* slab = kerneL_alloc_phys_pages(cache->slab_pages);
+    if (!slab)
+        return NULL;
+
+    slab->next      = NULL;
+    slab->prev      = NULL;
+    slab->cache     = cache;
+    slab->inuse     = 0;
+    slab->free_head = 0;
+    for (u32 i = 0; i < cache->objects_per_slab; i++)
+        slab->free_next[i] = i + 1 < cache->objects_per_slab ? i + 1 : SLAB_NIL;
+
+    if (cache->ctor) {
+        for (u32 i = 0; i < cache->objects_per_slab; i++)
+            cache->ctor(slab_object(cache, slab, i));
+    }
+
+    kernel_set_page_owner(slab, cache->slab_pages, slab);
+    return slab;
+}
+
+static void slab_destroy(KmemCache* cache, KmemSlab* slab) {
+    cache->stats.slabs--;
+    cache->stats.pages         -= cache->slab_pages;
+    cache->stats.total_objects -= cache->objects_per_slab;
+
+    kernel_set_page_owner(slab, cache->slab_pages, NULL);
+    kernel_free_phys_pages(slab, cache->slab_pages);
+}
+
+
+
+KmemCache* kmem_cache_create(const char* name, u32 size, u32 align, KmemConstructor ctor) {
+    if (!g_initialized)
+        init_caches();
+
+    if (size == 0 || size > KMEM_MAX_SIZE)
+        return NULL;
+    if (align & (align - 1))
+        return NULL;
+
+    KmemCache* cache = kmem_cache_alloc(&g_cache_cache);
+    if (!cache)
+        return NULL;
+
+    cache_init(cache, name, size, align, ctor);
+    if (cache->objects_per_slab == 0) {
+        kmem_cache_free(&g_cache_cache, cache);
+        return NULL;
+    }
+    return cache;
+}
+
+void kmem_cache_destroy(KmemCache* cache) {
+    kmem_cache_shrink(cache);
+    if (cache->partial || cache->full) {
+        // objects still in use
+        kernel_bug();
+        return;
+    }
+    kmem_cache_free(&g_cache_cache, cache);
+}
+
+void* kmem_cache_alloc(KmemCache* cache) {
+    spin_lock(&cache->lock);
+
+    KmemSlab* slab = cache->partial;
+    if (!slab) {
+        slab = cache->empty;
+        if (slab) {
+            cache->empty = NULL;
+        } else {
+            // Creating a slab may run constructors, don't hold the lock meanwhile
+            spin_unlock(&cache->lock);
+            KmemSlab* new_slab = slab_create(cache);
+            spin_lock(&cache->lock);
+            if (!new_slab) {
+                spin_unlock(&cache->lock);
+                return NULL;
+            }
+            cache->stats.slabs++;
+            cache->stats.pages         += cache->slab_pages;
+            cache->stats.total_objects += cache->objects_per_slab;
+            slab = new_slab;
+        }
+        slab_list_push(&cache->partial, slab);
+    }
+
+    u32 index = slab->free_head;
+    slab->free_head = slab->free_next[index];
+    slab->inuse++;
+
+    if (slab->free_head == SLAB_NIL) {
+        slab_list_remove(&cache->partial, slab);
+        slab_list_push(&cache->full, slab);
+    }
+
+    cache->stats.allocs++;
+    cache->stats.active_objects++;
+
+    spin_unlock(&cache->lock);
+    return slab_object(cache, slab, index);
+}
+
+void kmem_cache_free(KmemCache* cache, void* object) {
+    if (!object)
+        return;
+
+    KmemSlab* slab = kernel_get_page_owner(object);
+    if (!slab || slab->cache != cache) {
+        // not an object from this cache
+        kernel_bug();
+        return;
+    }
+
+    u32 index = ((char*)object - (char*)slab - cache->first_object) / cache->object_size;
+
+    KmemSlab* destroy = NULL;
+
+    spin_lock(&cache->lock);
+
+    if (slab->free_head == SLAB_NIL) {
+        slab_list_remove(&cache->full, slab);
+        slab_list_push(&cache->partial, slab);
+    }
+
+    slab->free_next[index] = slab->free_head;
+    slab->free_head = index;
+    slab->inuse--;
+
+    if (slab->inuse == 0) {
+        slab_list_remove(&cache->partial, slab);
+        // keep one empty slab so alloc/free around the boundary doesn't hit the page allocator
+        if (cache->empty)
+            destroy = slab;
+        else
+            cache->empty = slab;
+    }
+
+    cache->stats.frees++;
+    cache->stats.active_objects--;
+
+    if (destroy)
+        slab_destroy(cache, destroy);
+
+    spin_unlock(&cache->lock);
+}
+
+void kmem_cache_shrink(KmemCache* cache) {
+    spin_lock(&cache->lock);
+    if (cache->empty) {
+        slab_destroy(cache, cache->empty);
+        cache->empty = NULL;
+    }
+    spin_unlock(&cache->lock);
+}
+
+void kmem_cache_get_stats(KmemCache* cache, KmemCacheStats* out_stats) {
+    spin_lock(&cache->lock);
+    *out_stats = cache->stats;
+    spin_unlock(&cache->lock);
+}
+
+
+
+static inline int kmalloc_class(u64 size) {
+    int index = 0;
+    while (((u64)KMEM_MIN_SIZE << index) < size)
+        index++;
+    return index;
+}
+
+void* kmalloc(u64 size) {
+    if (size == 0)
+        return NULL;
+    if (size > KMEM_MAX_SIZE)
+        return kernel_alloc(size, NULL);
+
+    if (!g_initialized)
+        init_caches();
+
+    return kmem_cache_alloc(&g_kmalloc_caches[kmalloc_class(size)]);
+}
+
+void kfree(void* ptr) {
+    if (!ptr)
+        return;
+
+    KmemSlab* slab = kernel_get_page_owner(ptr);
+    if (!slab) {
+        // page allocation
+        kernel_alloc(0, ptr);
+        return;
+    }
+    kmem_cache_free(slab->cache, ptr);
+}
+
+void kmem_print_stats() {
+    if (!g_initialized)
+        init_caches();
+
+    for (int i = 0; i < KMALLOC_CLASSES; i++) {
+        KmemCacheStats stats;
+        kmem_cache_get_stats(&g_kmalloc_caches[i], &stats);
+        serial_printf("slab: %s active %d/%d objects, %d slabs, %d pages, %d allocs, %d frees\n",
+            g_kmalloc_names[i], (int)stats.active_objects, (int)stats.total_objects,
+            (int)stats.slabs, (int)stats.pages, (int)stats.allocs, (int)stats.frees);
+    }
+}
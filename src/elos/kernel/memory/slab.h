@@ -0,0 +1,85 @@
+/*
+    Slab allocator for small kernel objects
+
+    A cache hands out objects of one size. Objects live in slabs, a slab is one or
+    a few pages from the page allocator with a header and a free list.
+    kmalloc picks a cache from power-of-two size classes (16 B to 2 KiB) and falls back
+    to kernel_alloc for larger sizes.
+*/
+
+#pragma once
+
+#include "elos/kernel/common/types.h"
+#include "elos/kernel/common/sync.h"
+
+#define KMEM_MIN_SIZE 16
+#define KMEM_MAX_SIZE 2048
+
+/*
+    Called once for each object when a new slab is created, not on every allocation.
+    Objects should be given back to the cache in their constructed state.
+*/
+typedef void (*KmemConstructor)(void* object);
+
+typedef struct KmemSlab KmemSlab;
+
+typedef struct KmemCacheStats {
+    u64 allocs;
+    u64 frees;
+    u64 active_objects;
+    u64 total_objects; // active + free objects in slabs
+    u64 slabs;
+    u64 pages;
+} KmemCacheStats;
+
+typedef struct KmemCache {
+    const char* name;
+    u32 object_size;     // rounded up to alignment
+    u32 align;
+    u32 slab_pages;
+    u32 objects_per_slab;
+    u32 first_object;    // offset of first object in slab
+    KmemConstructor ctor;
+
+    Spinlock lock;
+    KmemSlab* partial;   // some objects free
+    KmemSlab* full;      // no objects free
+    KmemSlab* empty;     // all objects free, we keep at most one around
+
+    KmemCacheStats stats;
+} KmemCache;
+
+/*
+    @param align   0 picks the natural alignment of the object (power of two up to a cache line)
+    @param ctor    can be NULL
+*/
+KmemCache* kmem_cache_create(const char* name, u32 size, u32 align, KmemConstructor ctor);
+
+/*
+    All objects must have been freed.
+*/
+void kmem_cache_destroy(KmemCache* cache);
+
+void* kmem_cache_alloc(KmemCache* cache);
+
+void kmem_cache_free(KmemCache* cache, void* object);
+
+/*
+    Gives empty slabs back to the page allocator.
+*/
+void kmem_cache_shrink(KmemCache* cache);
+
+void kmem_cache_get_stats(KmemCache* cache, KmemCacheStats* out_stats);
+
+/*
+    Memory is uninitialized.
+    Sizes above KMEM_MAX_SIZE are page allocations from kernel_alloc.
+*/
+void* kmalloc(u64 size);
+
+void kfree(void* ptr);
+
+/*
+    Prints stats for the kmalloc size classes to serial.
+*/
+void kmem_print_stats();
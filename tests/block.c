@@ -0,0 +1,193 @@
+/*
+    Host test of the block layer's request merging (block_list.h)
+
+    A few fixed cases for back and front merges and the things that prevent them,
+    then requests that cut a range into pieces are inserted in random order. Every
+    request must end up in exactly one command, each command must be contiguous on
+    disk and in memory and within the size limit.
+
+    Usage: block.exe [rounds]
+*/
+
+#include "elos/kernel/device/block_list.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_REQUESTS 64
+#define MAX_SECTORS  64
+
+static u8 g_memory[MAX_REQUESTS * MAX_SECTORS * 512];
+static int g_failures;
+
+static void check(bool condition, const char* what) {
+    if (!condition) {
+        printf("FAIL: %s\n", what);
+        g_failures++;
+    }
+}
+
+// What block_prepare does
+static void init_request(BlockRequest* request, u64 lba, u32 sectors, u64 buffer_sector) {
+    memset(request, 0, sizeof(BlockRequest));
+    request->device          = 1;
+    request->lba             = lba;
+    request->sectors         = sectors;
+    request->buffer          = g_memory + buffer_sector * 512;
+    request->merged_tail     = request;
+    request->command_sectors = sectors;
+}
+
+static u32 list_length(BlockRequest* head) {
+    u32 count = 0;
+    for (; head; head = head->next)
+        count++;
+    return count;
+}
+
+static void test_fixed() {
+    BlockRequest a, b, c, d;
+    BlockRequest* head = NULL;
+    BlockRequest* tail = NULL;
+
+    // back merge
+    init_request(&a, 0, 8, 0);
+    init_request(&b, 8, 8, 8);
+    check(!block_insert(&head, &tail, &a, MAX_SECTORS), "first request merged with nothing");
+    check(block_insert(&head, &tail, &b, MAX_SECTORS), "back merge");
+    check(head == &a && tail == &a && a.command_sectors == 16, "back merge command");
+    check(a.merged_next == &b && a.merged_tail == &b, "back merge chain");
+
+    // front merge of the last command updates the tail
+    head = tail = NULL;
+    init_request(&a, 0, 8, 0);
+    init_request(&b, 8, 8, 8);
+    init_request(&c, 100, 8, 100);
+    block_insert(&head, &tail, &c, MAX_SECTORS);
+    block_insert(&head, &tail, &b, MAX_SECTORS);
+    check(block_insert(&head, &tail, &a, MAX_SECTORS), "front merge");
+    check(head == &c && c.next == &a && tail == &a && a.next == NULL, "front merge takes the place of the command");
+    check(a.command_sectors == 16 && a.merged_next == &b && a.merged_tail == &b, "front merge chain");
+
+    // front merge in the middle of the list
+    head = tail = NULL;
+    init_request(&a, 0, 8, 0);
+    init_request(&b, 8, 8, 8);
+    init_request(&c, 100, 8, 100);
+    init_request(&d, 200, 8, 200);
+    block_insert(&head, &tail, &c, MAX_SECTORS);
+    block_insert(&head, &tail, &b, MAX_SECTORS);
+    block_insert(&head, &tail, &d, MAX_SECTORS);
+    check(block_insert(&head, &tail, &a, MAX_SECTORS), "front merge in the middle");
+    check(head == &c && c.next == &a && a.next == &d && tail == &d, "front merge in the middle keeps the order");
+
+    // adjacent on disk but not in memory
+    head = tail = NULL;
+    init_request(&a, 0, 8, 0);
+    init_request(&b, 8, 8, 16);
+    block_insert(&head, &tail, &a, MAX_SECTORS);
+    check(!block_insert(&head, &tail, &b, MAX_SECTORS), "buffers not adjacent");
+    check(list_length(head) == 2 && tail == &b, "unmerged request appended");
+
+    // reads don't merge with writes, devices don't mix
+    head = tail = NULL;
+    init_request(&a, 0, 8, 0);
+    init_request(&b, 8, 8, 8);
+    init_request(&c, 16, 8, 16);
+    b.write = true;
+    c.device = 2;
+    block_insert(&head, &tail, &a, MAX_SECTORS);
+    check(!block_insert(&head, &tail, &b, MAX_SECTORS), "read merged with a write");
+    check(!block_insert(&head, &tail, &c, MAX_SECTORS), "merged across devices");
+
+    // size limit
+    head = tail = NULL;
+    init_request(&a, 0, 8, 0);
+    init_request(&b, 8, 8, 8);
+    block_insert(&head, &tail, &a, 15);
+    check(!block_insert(&head, &tail, &b, 15), "merged past max_sectors");
+}
+
+static u32 g_random = 2463534242u;
+
+static u32 random_u32() {
+    g_random ^= g_random << 13;
+    g_random ^= g_random >> 17;
+    g_random ^= g_random << 5;
+    return g_random;
+}
+
+static void test_random(u32 rounds) {
+    static BlockRequest requests[MAX_REQUESTS];
+    u32 order[MAX_REQUESTS];
+    for (u32 round = 0; round < rounds; round++) {
+        // cut sectors 0..total into pieces, each with its part of one buffer
+        u32 count = 1 + random_u32() % MAX_REQUESTS;
+        u32 max_sectors = 1 + random_u32() % (MAX_SECTORS * 4);
+        u64 lba = 0;
+        for (u32 i = 0; i < count; i++) {
+            u32 sectors = 1 + random_u32() % 16;
+            if (sectors > max_sectors)
+                sectors = max_sectors;
+            init_request(&requests[i], lba, sectors, lba);
+            // sometimes a gap in memory so not everything can merge
+            if (random_u32() % 8 == 0)
+                requests[i].buffer = g_memory + (lba + 1) * 512;
+            lba += sectors;
+            order[i] = i;
+        }
+        for (u32 i = count - 1; i > 0; i--) {
+            u32 j = random_u32() % (i + 1);
+            u32 swap = order[i];
+            order[i] = order[j];
+            order[j] = swap;
+        }
+
+        BlockRequest* head = NULL;
+        BlockRequest* tail = NULL;
+        for (u32 i = 0; i < count; i++)
+            block_insert(&head, &tail, &requests[order[i]], max_sectors);
+
+        u32 seen[MAX_REQUESTS] = { 0 };
+        BlockRequest* last = NULL;
+        for (BlockRequest* command = head; command; command = command->next) {
+            last = command;
+            u32 sectors = 0;
+            BlockRequest* previous = NULL;
+            for (BlockRequest* request = command; request; request = request->merged_next) {
+                seen[request - requests]++;
+                if (previous) {
+                    check(previous->lba + previous->sectors == request->lba, "command not contiguous on disk");
+                    check((u8*)previous->buffer + previous->sectors * 512 == request->buffer, "command not contiguous in memory");
+                }
+                sectors += request->sectors;
+                previous = request;
+            }
+            check(command->merged_tail == previous, "merged_tail isn't the last request");
+            check(command->command_sectors == sectors, "command_sectors is off");
+            check(sectors <= max_sectors, "command bigger than max_sectors");
+        }
+        check(tail == last, "tail isn't the last command");
+        for (u32 i = 0; i < count; i++)
+            check(seen[i] == 1, "request lost or in two commands");
+        if (g_failures) {
+            printf("round %u, %u requests, max %u sectors\n", round, count, max_sectors);
+            return;
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    u32 rounds = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000;
+
+    test_fixed();
+    test_random(rounds);
+
+    if (g_failures) {
+        printf("%d failures\n", g_failures);
+        return 1;
+    }
+    printf("SUCCESS\n");
+    return 0;
+}
@@ -0,0 +1,105 @@
+/*
+    Host test of the Chase-Lev deque (Linux only)
+
+    The main thread is the owner and pushes numbered items, popping some of them
+    itself, while thief threads steal. Every item must be taken exactly once.
+
+    Usage: deque.exe [items] [thieves]
+*/
+
+#include "elos/kernel/common/deque.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#define CAPACITY 256
+
+static Deque g_deque;
+static void* g_buffer[CAPACITY];
+static volatile u8* g_taken;
+static volatile int g_done;
+static u64 g_duplicates;
+
+static void take(void* item) {
+    u64 index = (u64)item - 1;
+    if (__atomic_fetch_add(&g_taken[index], 1, __ATOMIC_RELAXED) != 0)
+        __atomic_add_fetch(&g_duplicates, 1, __ATOMIC_RELAXED);
+}
+
+static void* thief(void* arg) {
+    u64* stolen = arg;
+    while (1) {
+        void* item = deque_steal(&g_deque);
+        if (item) {
+            take(item);
+            (*stolen)++;
+        } else if (__atomic_load_n(&g_done, __ATOMIC_ACQUIRE) && deque_size(&g_deque) == 0) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char** argv) {
+    u64 items = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+    int thieves = argc > 2 ? atoi(argv[2]) : 3;
+
+    g_taken = calloc(items, 1);
+    deque_init(&g_deque, g_buffer, CAPACITY);
+
+    pthread_t threads[thieves];
+    u64 stolen[thieves];
+    for (int i = 0; i < thieves; i++) {
+        stolen[i] = 0;
+        pthread_create(&threads[i], NULL, thief, &stolen[i]);
+    }
+
+    u64 popped = 0;
+    u32 rng = 2463534242;
+    for (u64 i = 0; i < items; i++) {
+        // a full deque is fine, the owner works it off
+        while (!deque_push(&g_deque, (void*)(i + 1))) {
+            void* item = deque_pop(&g_deque);
+            if (item) {
+                take(item);
+                popped++;
+            }
+        }
+        rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5;
+        if (rng % 64 == 0) {
+            void* item = deque_pop(&g_deque);
+            if (item) {
+                take(item);
+                popped++;
+            }
+        }
+    }
+    void* item;
+    while ((item = deque_pop(&g_deque))) {
+        take(item);
+        popped++;
+    }
+    __atomic_store_n(&g_done, 1, __ATOMIC_RELEASE);
+
+    u64 total_stolen = 0;
+    for (int i = 0; i < thieves; i++) {
+        pthread_join(threads[i], NULL);
+        total_stolen += stolen[i];
+    }
+
+    u64 missing = 0;
+    for (u64 i = 0; i < items; i++) {
+        if (!g_taken[i])
+            missing++;
+    }
+
+    printf("items %llu, popped %llu, stolen %llu, missing %llu, duplicates %llu\n", items, popped,
+        total_stolen, missing, g_duplicates);
+    if (missing || g_duplicates) {
+        printf("FAILED\n");
+        return 1;
+    }
+    printf("SUCCESS\n");
+    return 0;
+}
@@ -0,0 +1,381 @@
+/*
+    Host build of the physical allocator (Linux only)
+
+    phys_allocator.c is compiled as is and given a fake EFI memory map. The "physical"
+    memory is mapped at the same addresses in this process since the allocator
+    expects physical == virtual like UEFI's identity map.
+
+    Runs a randomized trace of kernel_alloc allocations, frees and resizes mixed with
+    kernel_alloc_phys and DMA allocations, then prints throughput and fragmentation.
+    Every page of a live allocation holds a tag which is checked when it's freed so
+    overlapping allocations are caught. kernel_phys_verify checks the free lists
+    along the way and at the end all memory must be free and merged again.
+
+    Usage: phys_allocator.exe [operations] [seed]
+*/
+
+#include "elos/kernel/memory/phys_allocator.h"
+#include "elos/kernel/common/core_data.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#undef PAGE_SIZE
+#define PAGE_SIZE 4096
+
+#define MAX_LIVE 1024
+
+// Stubs for what phys_allocator.c links against in the kernel
+
+EFI_SYSTEM_TABLE* ST;
+
+static int g_bugs;
+
+void kernel_bug() {
+    g_bugs++;
+    printf("kernel_bug called\n");
+}
+
+void serial_printf(const char* format, ...) {
+    va_list va;
+    va_start(va, format);
+    vprintf(format, va);
+    va_end(va);
+}
+
+bool map_page(void* virtual_address, void* physical_address) {
+    return true;
+}
+
+bool unmap_page(void* virtual_address) {
+    return true;
+}
+
+
+
+// Fake machine: low memory split by the 16 MiB DMA boundary and a bigger chunk at 1 GiB.
+// Memory used by "firmware" is mapped too but not conventional.
+static EFI_MEMORY_DESCRIPTOR g_descriptors[] = {
+    { EfiConventionalMemory,   0, 0x00100000, 0, 0x0600, 0 }, // 1 MiB - 7 MiB
+    { EfiLoaderCode,           0, 0x00700000, 0, 0x0100, 0 },
+    { EfiConventionalMemory,   0, 0x00800000, 0, 0x1000, 0 }, // 8 MiB - 24 MiB
+    { EfiBootServicesData,     0, 0x01800000, 0, 0x0013, 0 },
+    { EfiConventionalMemory,   0, 0x01813000, 0, 0x07ED, 0 }, // up to 32 MiB
+    { EfiConventionalMemory,   0, 0x40000000, 0, 0x9000, 0 }, // 1 GiB - 1 GiB + 144 MiB
+    { EfiRuntimeServicesData,  0, 0x49000000, 0, 0x0020, 0 },
+    { EfiConventionalMemory,   0, 0x49020000, 0, 0x2FE0, 0 }, // up to 1 GiB + 192 MiB
+};
+
+static void map_fixed(u64 address, u64 bytes) {
+    void* ptr = mmap((void*)address, bytes, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE | MAP_NORESERVE, -1, 0);
+    if (ptr != (void*)address) {
+        printf("Can't map fake memory at %llx\n", address);
+        exit(1);
+    }
+}
+
+static void setup_machine() {
+    map_fixed((u64)kernel__core_data, PAGE_SIZE);
+
+    int count = sizeof(g_descriptors) / sizeof(*g_descriptors);
+    for (int i = 0; i < count; i++)
+        map_fixed(g_descriptors[i].PhysicalStart, g_descriptors[i].NumberOfPages * PAGE_SIZE);
+
+    g_memory_mapper.memory_descriptors        = g_descriptors;
+    g_memory_mapper.descriptor_size           = sizeof(EFI_MEMORY_DESCRIPTOR);
+    g_memory_mapper.total_size_of_descriptors = sizeof(g_descriptors);
+}
+
+
+
+typedef enum AllocKind {
+    KIND_NONE,
+    KIND_ALLOC, // kernel_alloc
+    KIND_PHYS,  // kernel_alloc_phys
+    KIND_DMA,   // kernel_alloc_phys_contiguous
+} AllocKind;
+
+typedef struct Live {
+    char* ptr;
+    u64   pages;
+    u64   tag;
+    AllocKind kind;
+} Live;
+
+typedef struct OpStats {
+    const char* name;
+    u64 count;
+    u64 failed;
+    u64 nanoseconds;
+} OpStats;
+
+enum { OP_ALLOC, OP_FREE, OP_GROW, OP_SHRINK, OP_PHYS, OP_PHYS_FREE, OP_DMA, OP_COUNT };
+
+static OpStats g_ops[OP_COUNT] = {
+    { "alloc" }, { "free" }, { "grow" }, { "shrink" },
+    { "phys alloc" }, { "phys free" }, { "dma alloc" },
+};
+
+static Live g_live[MAX_LIVE];
+static int  g_failures;
+static u64  g_random;
+
+static u64 random_u64() {
+    g_random ^= g_random << 13;
+    g_random ^= g_random >> 7;
+    g_random ^= g_random << 17;
+    return g_random;
+}
+
+static u64 now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void fail(const char* what, Live* live) {
+    if (g_failures < 20)
+        printf("FAIL: %s (ptr %p, %llu pages)\n", what, live->ptr, live->pages);
+    g_failures++;
+}
+
+// Mostly small allocations with the occasional big one
+static u64 random_pages() {
+    u64 r = random_u64() % 100;
+    if (r < 70) return 1 + random_u64() % 4;
+    if (r < 95) return 1 + random_u64() % 32;
+    return 1 + random_u64() % 1024;
+}
+
+static void write_tags(Live* live, u64 first_page) {
+    for (u64 i = first_page; i < live->pages; i++)
+        *(u64*)(live->ptr + i * PAGE_SIZE) = live->tag + i;
+}
+
+static void check_tags(Live* live, u64 pages) {
+    for (u64 i = 0; i < pages; i++) {
+        if (*(u64*)(live->ptr + i * PAGE_SIZE) != live->tag + i) {
+            fail("allocation was overwritten", live);
+            return;
+        }
+    }
+}
+
+static void check_zero(Live* live, u64 first_page) {
+    for (u64 i = first_page; i < live->pages; i++) {
+        u64* page = (u64*)(live->ptr + i * PAGE_SIZE);
+        if (page[0] != 0 || page[PAGE_SIZE/16] != 0 || page[PAGE_SIZE/8 - 1] != 0) {
+            fail("memory is not zeroed", live);
+            return;
+        }
+    }
+}
+
+static void check_placement(Live* live, u64 alignment, u64 limit) {
+    if ((u64)live->ptr % alignment != 0)
+        fail("misaligned DMA allocation", live);
+    if (limit && (u64)live->ptr + live->pages * PAGE_SIZE > limit)
+        fail("DMA allocation above limit", live);
+}
+
+static void release(Live* live) {
+    check_tags(live, live->pages);
+    if (live->kind == KIND_ALLOC)
+        kernel_alloc(0, live->ptr);
+    else
+        kernel_free_phys_pages(live->ptr, live->pages);
+    live->kind = KIND_NONE;
+}
+
+static void run_trace(u64 operations) {
+    u64 next_tag = 1;
+
+    for (u64 n = 0; n < operations; n++) {
+        Live* live = &g_live[random_u64() % MAX_LIVE];
+        u64 r = random_u64() % 100;
+        int op;
+        u64 t0 = now_ns();
+
+        if (live->kind == KIND_NONE) {
+            next_tag += 1 << 20;
+            live->tag = next_tag;
+
+            if (r < 70) {
+                op = OP_ALLOC;
+                live->pages = random_pages();
+                live->ptr = kernel_alloc(live->pages * PAGE_SIZE - random_u64() % PAGE_SIZE, NULL);
+                live->kind = KIND_ALLOC;
+            } else if (r < 95) {
+                op = OP_PHYS;
+                live->pages = r < 90 ? 1 : 1 + random_u64() % 16;
+                live->ptr = kernel_alloc_phys(live->pages, r & 1 ? ALLOC_ZERO : 0);
+                live->kind = KIND_PHYS;
+            } else {
+                op = OP_DMA;
+                static const u64 alignments[] = { 0, 64 * 1024, 2 * 1024 * 1024 };
+                static const u64 limits[]     = { 0, PHYS_LIMIT_4G, PHYS_LIMIT_16M };
+                u64 alignment = alignments[random_u64() % 3];
+                u64 limit     = limits[random_u64() % 3];
+                live->pages = 1 + random_u64() % 32;
+                live->ptr = kernel_alloc_phys_contiguous(live->pages, alignment, limit, ALLOC_ZERO);
+                live->kind = KIND_DMA;
+                if (live->ptr)
+                    check_placement(live, alignment ? alignment : PAGE_SIZE, limit);
+            }
+            g_ops[op].nanoseconds += now_ns() - t0;
+
+            if (!live->ptr) {
+                g_ops[op].failed++;
+                live->kind = KIND_NONE;
+            } else {
+                if (live->kind != KIND_PHYS || (r & 1))
+                    check_zero(live, 0);
+                write_tags(live, 0);
+            }
+        } else if (live->kind == KIND_ALLOC && r < 30) {
+            u64 old_pages = live->pages;
+            u64 new_pages = random_pages();
+            op = new_pages > old_pages ? OP_GROW : OP_SHRINK;
+
+            char* ptr = kernel_alloc(new_pages * PAGE_SIZE, live->ptr);
+            g_ops[op].nanoseconds += now_ns() - t0;
+
+            if (!ptr) {
+                // old allocation is still valid
+                g_ops[op].failed++;
+            } else {
+                live->ptr   = ptr;
+                live->pages = new_pages;
+                check_tags(live, old_pages < new_pages ? old_pages : new_pages);
+                if (new_pages > old_pages) {
+                    check_zero(live, old_pages);
+                    write_tags(live, old_pages);
+                }
+            }
+        } else {
+            op = live->kind == KIND_ALLOC ? OP_FREE : OP_PHYS_FREE;
+            // tags are checked before timing
+            check_tags(live, live->pages);
+            t0 = now_ns();
+            if (live->kind == KIND_ALLOC)
+                kernel_alloc(0, live->ptr);
+            else
+                kernel_free_phys_pages(live->ptr, live->pages);
+            g_ops[op].nanoseconds += now_ns() - t0;
+            live->kind = KIND_NONE;
+        }
+        g_ops[op].count++;
+
+        // pretend the kernel was idle now and then
+        if (n % 1024 == 0)
+            kernel_zero_free_pages(64);
+
+        if (n % 50000 == 0 && kernel_phys_verify() != 0)
+            g_failures++;
+    }
+}
+
+static void print_stats(const char* when, PhysAllocStats* stats) {
+    u64 free = stats->free_pages;
+    printf("%s: %llu/%llu pages free, %llu zeroed, %llu cached, %llu blocks, largest %llu pages, %llu allocations\n",
+        when, free, stats->total_pages, stats->zeroed_pages, stats->cached_pages,
+        stats->free_blocks, stats->largest_free_block, stats->allocations);
+    if (free)
+        printf("%s: fragmentation %.1f%% (free memory outside the largest block)\n",
+            when, 100.0 * (free - stats->largest_free_block) / free);
+    printf("%s: metadata %llu KiB, peak %llu KiB\n",
+        when, stats->metadata_bytes / 1024, stats->peak_metadata_bytes / 1024);
+}
+
+int main(int argc, char** argv) {
+    u64 operations = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+    g_random       = argc > 2 ? strtoull(argv[2], NULL, 10) : 88172645463325252ULL;
+    if (g_random == 0)
+        g_random = 1;
+
+    setup_machine();
+    if (!kernel_init_memory_mapper()) {
+        printf("FAIL: kernel_init_memory_mapper\n");
+        return 1;
+    }
+
+    PhysAllocStats initial;
+    kernel_phys_get_stats(&initial);
+    print_stats("start", &initial);
+
+    u64 t0 = now_ns();
+    run_trace(operations);
+    u64 elapsed = now_ns() - t0;
+
+    PhysAllocStats stats;
+    kernel_phys_get_stats(&stats);
+    print_stats("trace", &stats);
+
+    printf("%llu operations in %.2f s\n", operations, elapsed / 1e9);
+    for (int i = 0; i < OP_COUNT; i++) {
+        OpStats* op = &g_ops[i];
+        if (op->count == 0)
+            continue;
+        printf("  %-10s %9llu ops, %6llu failed, %7.1f ns/op, %6.2f M ops/s\n",
+            op->name, op->count, op->failed, (double)op->nanoseconds / op->count,
+            op->nanoseconds ? op->count * 1e3 / op->nanoseconds : 0.0);
+    }
+
+    // Give everything back. After zeroing all free memory every buddy pair is in
+    // the same state so kernel_phys_verify complains about any pair that didn't merge.
+    for (int i = 0; i < MAX_LIVE; i++) {
+        if (g_live[i].kind != KIND_NONE)
+            release(&g_live[i]);
+    }
+
+    // A single page freed twice must be caught before it sits in the per-CPU cache twice
+    void* page = kernel_alloc_phys(1, 0);
+    kernel_free_phys_pages(page, 1);
+    int bugs = g_bugs;
+    kernel_free_phys_pages(page, 1);
+    if (g_bugs != bugs + 1) {
+        printf("FAIL: double free of a cached page went unnoticed\n");
+        g_failures++;
+    }
+    g_bugs = bugs;
+
+    kernel_drain_page_cache();
+    while (kernel_zero_free_pages(4096) != 0)
+        ;
+
+    kernel_phys_get_stats(&stats);
+    print_stats("end", &stats);
+
+    if (kernel_phys_verify() != 0)
+        g_failures++;
+    // The allocation table keeps its size
+    u64 table_pages = (stats.metadata_bytes - initial.metadata_bytes) / PAGE_SIZE;
+    if (stats.free_pages + table_pages != initial.free_pages) {
+        printf("FAIL: lost %lld pages\n", (long long)(initial.free_pages - stats.free_pages - table_pages));
+        g_failures++;
+    }
+    if (stats.zeroed_pages != stats.free_pages) {
+        printf("FAIL: free memory was not all zeroed\n");
+        g_failures++;
+    }
+    if (stats.allocations != 0) {
+        printf("FAIL: %llu allocations left\n", stats.allocations);
+        g_failures++;
+    }
+    if (g_bugs) {
+        printf("FAIL: kernel_bug was called %d times\n", g_bugs);
+        g_failures++;
+    }
+
+    if (g_failures) {
+        printf("%d failures\n", g_failures);
+        return 1;
+    }
+    printf("SUCCESS\n");
+    return 0;
+}
@@ -20,6 +20,42 @@ def test_font_reader():
 
     cmd(f"{EXE}")
 
+def test_phys_allocator():
+    # Uses mmap to put fake physical memory at fixed addresses
+    if platform.system() != "Linux":
+        return
+    EXE = TEST_INT + "/phys_allocator.exe"
+    SRC = " ".join([
+        "tests/phys_allocator.c",
+        "src/elos/kernel/memory/phys_allocator.c"
+    ])
+    FLAGS = "-Iinclude -Isrc -Iextern/efi -Iextern/efi/x86_64 -Iextern/efi/protocol -Isrc/elos/efi"
+    FLAGS += " -g -O2 -ffreestanding -fshort-wchar -DELOS_HOST_TEST"
+    FLAGS += " -Werror=implicit-function-declaration"
+    cmd(f"gcc -o {EXE} {SRC} {FLAGS}")
+
+    cmd(f"{EXE} 200000")
+
+def test_deque():
+    # Needs pthreads
+    if platform.system() != "Linux":
+        return
+    EXE = TEST_INT + "/deque.exe"
+    SRC = "tests/deque.c"
+    FLAGS = "-Isrc -g -O2 -pthread"
+    FLAGS += " -Werror=implicit-function-declaration"
+    cmd(f"gcc -o {EXE} {SRC} {FLAGS}")
+
+    cmd(f"{EXE} 2000000 3")
+
+def test_block():
+    EXE = TEST_INT + "/block.exe"
+    SRC = "tests/block.c"
+    FLAGS = "-Isrc -g -O2"
+    FLAGS += " -Werror=implicit-function-declaration"
+    cmd(f"gcc -o {EXE} {SRC} {FLAGS}")
+
+    cmd(f"{EXE} 20000")
 
 def cmd(c):
     if platform.system() == "Windows":
@@ -41,8 +77,21 @@ def cmd(c):
             print("ERR",c)
         exit(1)
 
+TESTS = {
+    "font_reader":    test_font_reader,
+    "phys_allocator": test_phys_allocator,
+    "deque":          test_deque,
+    "block":          test_block,
+}
+
 def main():
-    test_font_reader();
+    # run.py [test names...], runs all tests by default
+    names = sys.argv[1:] or list(TESTS)
+    for name in names:
+        if name not in TESTS:
+            print(f"Unknown test '{name}'")
+            exit(1)
+        TESTS[name]()
 
 if __name__ == "__main__":
     main()
\ No newline at end of file